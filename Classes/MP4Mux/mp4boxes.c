@@ -0,0 +1,1488 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include "mp4boxes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static unsigned int get_u32(const unsigned char *p)
+{
+    return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) | ((unsigned int) p[2] << 8) | p[3];
+}
+
+static unsigned long long get_u64(const unsigned char *p)
+{
+    return ((unsigned long long) get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static void put_u32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static void put_u64(unsigned char *p, unsigned long long v)
+{
+    put_u32(p, (unsigned int) (v >> 32));
+    put_u32(p + 4, (unsigned int) v);
+}
+
+int mp4box_read(FILE *fp, unsigned long long offset, unsigned long long end, mp4box *box)
+{
+    unsigned char h[16];
+
+    if (offset + 8 > end || fseeko(fp, (off_t) offset, SEEK_SET) || fread(h, 1, 8, fp) != 8) return -1;
+
+    box->offset = offset;
+    box->type = get_u32(h + 4);
+    box->size = get_u32(h);
+    box->header = 8;
+
+    if (box->size == 1) {
+        if (offset + 16 > end || fread(h + 8, 1, 8, fp) != 8) return -1;
+        box->size = get_u64(h + 8);
+        box->header = 16;
+    } else if (!box->size) {
+        /* last box of the file */
+        box->size = end - offset;
+    }
+
+    return (box->size < box->header || offset + box->size > end) ? -1 : 0;
+}
+
+int mp4box_find(FILE *fp, const mp4box *parent, unsigned int type, mp4box *box)
+{
+    unsigned long long offset = parent->offset + parent->header;
+    unsigned long long end = parent->offset + parent->size;
+
+    while (!mp4box_read(fp, offset, end, box)) {
+        if (box->type == type) return 0;
+        offset += box->size;
+    }
+    return -1;
+}
+
+int mp4box_find_top(FILE *fp, unsigned int type, mp4box *box)
+{
+    mp4box file;
+
+    if (fseeko(fp, 0, SEEK_END)) return -1;
+    file.offset = 0;
+    file.size = (unsigned long long) ftello(fp);
+    file.header = 0;
+    file.type = 0;
+    return mp4box_find(fp, &file, type, box);
+}
+
+/*
+ Read the content of a box following its header, NULL if it is shorter than min_len
+ */
+static unsigned char *read_payload(FILE *fp, const mp4box *box, unsigned long long min_len, unsigned long long *len)
+{
+    unsigned char *data;
+
+    *len = box->size - box->header;
+    if (*len < min_len || *len > (size_t) -1) return NULL;
+
+    data = (unsigned char *) malloc((size_t) *len + 1);
+    if (!data) return NULL;
+
+    if (fseeko(fp, (off_t) (box->offset + box->header), SEEK_SET) || fread(data, 1, (size_t) *len, fp) != *len) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/*
+ Path of nested boxes, types separated, 0 terminated
+ */
+static int find_path(FILE *fp, const mp4box *parent, const unsigned int *types, mp4box *box)
+{
+    mp4box current = *parent;
+
+    for (; *types; types++) {
+        if (mp4box_find(fp, &current, *types, box)) return -1;
+        current = *box;
+    }
+    return 0;
+}
+
+static int load_sizes(FILE *fp, const mp4box *stbl, mp4box_track *track)
+{
+    static const unsigned int stsz[] = {MP4BOX_TYPE('s','t','s','z'), 0};
+    static const unsigned int stz2[] = {MP4BOX_TYPE('s','t','z','2'), 0};
+    mp4box box;
+    unsigned char *data;
+    unsigned long long len;
+    unsigned int i, field_size = 32, sample_size = 0;
+    int rc = -1;
+
+    if (!find_path(fp, stbl, stsz, &box)) {
+        data = read_payload(fp, &box, 12, &len);
+        if (!data) return -1;
+        sample_size = get_u32(data + 4);
+        track->sample_count = get_u32(data + 8);
+    } else if (!find_path(fp, stbl, stz2, &box)) {
+        /* compact sample sizes */
+        data = read_payload(fp, &box, 12, &len);
+        if (!data) return -1;
+        field_size = data[7];
+        track->sample_count = get_u32(data + 8);
+        if (field_size != 4 && field_size != 8 && field_size != 16) goto exit;
+    } else {
+        return -1;
+    }
+
+    if (!sample_size && 12 + ((unsigned long long) track->sample_count * field_size + 7) / 8 > len) goto exit;
+
+    track->sizes = (unsigned int *) malloc(sizeof(unsigned int) * (track->sample_count + 1));
+    if (!track->sizes) goto exit;
+
+    for (i = 0; i < track->sample_count; i++) {
+        const unsigned char *p = data + 12;
+        if (sample_size) track->sizes[i] = sample_size;
+        else if (field_size == 32) track->sizes[i] = get_u32(p + 4 * i);
+        else if (field_size == 16) track->sizes[i] = (p[2 * i] << 8) | p[2 * i + 1];
+        else if (field_size == 8) track->sizes[i] = p[i];
+        else track->sizes[i] = (i & 1) ? (p[i / 2] & 0x0f) : (p[i / 2] >> 4);
+    }
+    rc = 0;
+
+exit:
+    free(data);
+    return rc;
+}
+
+static int load_offsets(FILE *fp, const mp4box *stbl, mp4box_track *track)
+{
+    static const unsigned int stco[] = {MP4BOX_TYPE('s','t','c','o'), 0};
+    static const unsigned int co64[] = {MP4BOX_TYPE('c','o','6','4'), 0};
+    static const unsigned int stsc[] = {MP4BOX_TYPE('s','t','s','c'), 0};
+    mp4box box;
+    unsigned char *chunks = NULL, *runs = NULL;
+    unsigned long long len, runs_len;
+    unsigned int i, chunk, run, run_count, used, sample = 0, large = 0;
+    int rc = -1;
+
+    if (!find_path(fp, stbl, stco, &box)) {
+        chunks = read_payload(fp, &box, 8, &len);
+    } else if (!find_path(fp, stbl, co64, &box)) {
+        chunks = read_payload(fp, &box, 8, &len);
+        large = 1;
+    }
+    if (!chunks || find_path(fp, stbl, stsc, &box)) goto exit;
+    runs = read_payload(fp, &box, 8, &runs_len);
+    if (!runs) goto exit;
+
+    track->chunk_count = get_u32(chunks + 4);
+    run_count = get_u32(runs + 4);
+    if (8 + (unsigned long long) track->chunk_count * (large ? 8 : 4) > len || 8 + (unsigned long long) run_count * 12 > runs_len) goto exit;
+
+    track->offsets = (unsigned long long *) malloc(sizeof(unsigned long long) * (track->sample_count + 1));
+    track->chunks = (unsigned int *) malloc(sizeof(unsigned int) * (track->chunk_count + 1));
+    if (!track->offsets || !track->chunks) goto exit;
+
+    for (chunk = 1, run = 0, used = 0; chunk <= track->chunk_count && sample < track->sample_count; chunk++) {
+        unsigned long long offset = large ? get_u64(chunks + 8 + 8 * (chunk - 1)) : get_u32(chunks + 8 + 4 * (chunk - 1));
+        unsigned int samples_per_chunk;
+
+        while (run + 1 < run_count && get_u32(runs + 8 + 12 * (run + 1)) <= chunk) run++;
+        samples_per_chunk = run_count ? get_u32(runs + 8 + 12 * run + 4) : 0;
+        if (samples_per_chunk) track->chunks[used++] = sample;
+
+        for (i = 0; i < samples_per_chunk && sample < track->sample_count; i++, sample++) {
+            track->offsets[sample] = offset;
+            offset += track->sizes[sample];
+        }
+    }
+    /* only the chunks holding samples are counted */
+    track->chunk_count = used;
+    if (sample == track->sample_count) rc = 0;
+
+exit:
+    free(chunks);
+    free(runs);
+    return rc;
+}
+
+static int load_times(FILE *fp, const mp4box *stbl, mp4box_track *track)
+{
+    static const unsigned int stts[] = {MP4BOX_TYPE('s','t','t','s'), 0};
+    static const unsigned int stss[] = {MP4BOX_TYPE('s','t','s','s'), 0};
+    static const unsigned int ctts[] = {MP4BOX_TYPE('c','t','t','s'), 0};
+    mp4box box;
+    unsigned char *data;
+    unsigned long long len, dts = 0;
+    unsigned int i, j, count, sample = 0;
+
+    if (find_path(fp, stbl, stts, &box)) return -1;
+    data = read_payload(fp, &box, 8, &len);
+    if (!data) return -1;
+
+    track->dts = (unsigned long long *) malloc(sizeof(unsigned long long) * (track->sample_count + 1));
+    count = get_u32(data + 4);
+    if (!track->dts || 8 + (unsigned long long) count * 8 > len) {
+        free(data);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        unsigned int samples = get_u32(data + 8 + 8 * i), delta = get_u32(data + 12 + 8 * i);
+        for (j = 0; j < samples && sample < track->sample_count; j++, sample++) {
+            track->dts[sample] = dts;
+            dts += delta;
+        }
+    }
+    for (; sample < track->sample_count; sample++) track->dts[sample] = dts;
+    free(data);
+
+    if (!find_path(fp, stbl, ctts, &box)) {
+        data = read_payload(fp, &box, 8, &len);
+        if (!data) return -1;
+
+        track->cts_offsets = (long long *) calloc(track->sample_count + 1, sizeof(long long));
+        count = get_u32(data + 4);
+        if (!track->cts_offsets || 8 + (unsigned long long) count * 8 > len) {
+            free(data);
+            return -1;
+        }
+        for (i = 0, sample = 0; i < count; i++) {
+            unsigned int samples = get_u32(data + 8 + 8 * i), offset = get_u32(data + 12 + 8 * i);
+            for (j = 0; j < samples && sample < track->sample_count; j++, sample++) {
+                /* signed in version 1 */
+                track->cts_offsets[sample] = data[0] ? (long long) (int) offset : (long long) offset;
+            }
+        }
+        free(data);
+    }
+
+    /* without a sync sample box every sample is a random access point */
+    if (find_path(fp, stbl, stss, &box)) return 0;
+    data = read_payload(fp, &box, 8, &len);
+    if (!data) return -1;
+
+    track->sync = (unsigned char *) calloc(track->sample_count + 1, 1);
+    count = get_u32(data + 4);
+    if (!track->sync || 8 + (unsigned long long) count * 4 > len) {
+        free(data);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        unsigned int n = get_u32(data + 8 + 4 * i);
+        if (n && n <= track->sample_count) track->sync[n - 1] = 1;
+    }
+    free(data);
+    return 0;
+}
+
+/*
+ The delay of an edit list starting with an empty edit, and the duration of the edits after it
+ */
+static int load_edits(FILE *fp, const mp4box *trak, mp4box_track *track)
+{
+    static const unsigned int elst[] = {MP4BOX_TYPE('e','d','t','s'), MP4BOX_TYPE('e','l','s','t'), 0};
+    mp4box box;
+    unsigned char *data;
+    unsigned long long len;
+    unsigned int i, count, entry;
+
+    if (find_path(fp, trak, elst, &box)) return 0;
+    data = read_payload(fp, &box, 8, &len);
+    if (!data) return -1;
+
+    entry = data[0] ? 20 : 12;
+    count = get_u32(data + 4);
+    if (8 + (unsigned long long) count * entry > len) {
+        free(data);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        const unsigned char *p = data + 8 + entry * i;
+        unsigned long long duration = data[0] ? get_u64(p) : get_u32(p);
+        long long media_time = data[0] ? (long long) get_u64(p + 8) : (long long) (int) get_u32(p + 4);
+
+        if (!i && media_time == -1) track->delay = duration;
+        else track->edit_duration += duration;
+    }
+    free(data);
+    return 0;
+}
+
+static int load_track(FILE *fp, const mp4box *trak, mp4box_track *track)
+{
+    static const unsigned int tkhd[] = {MP4BOX_TYPE('t','k','h','d'), 0};
+    static const unsigned int mdhd[] = {MP4BOX_TYPE('m','d','i','a'), MP4BOX_TYPE('m','d','h','d'), 0};
+    static const unsigned int hdlr[] = {MP4BOX_TYPE('m','d','i','a'), MP4BOX_TYPE('h','d','l','r'), 0};
+    static const unsigned int stbl[] = {MP4BOX_TYPE('m','d','i','a'), MP4BOX_TYPE('m','i','n','f'), MP4BOX_TYPE('s','t','b','l'), 0};
+    mp4box box, stbl_box;
+    unsigned char *data;
+    unsigned long long len;
+
+    memset(track, 0, sizeof(mp4box_track));
+
+    if (find_path(fp, trak, tkhd, &box) || !(data = read_payload(fp, &box, 16, &len))) return -1;
+    track->id = (data[0] && len >= 24) ? get_u32(data + 20) : get_u32(data + 12);
+    free(data);
+
+    if (find_path(fp, trak, mdhd, &box) || !(data = read_payload(fp, &box, 24, &len))) return -1;
+    track->timescale = (data[0] && len >= 36) ? get_u32(data + 20) : get_u32(data + 12);
+    track->duration = (data[0] && len >= 36) ? get_u64(data + 24) : get_u32(data + 16);
+    free(data);
+
+    if (load_edits(fp, trak, track)) return -1;
+
+    if (find_path(fp, trak, hdlr, &box) || !(data = read_payload(fp, &box, 12, &len))) return -1;
+    track->handler = get_u32(data + 8);
+    free(data);
+
+    if (find_path(fp, trak, stbl, &stbl_box)) return -1;
+    if (load_sizes(fp, &stbl_box, track) || load_offsets(fp, &stbl_box, track) || load_times(fp, &stbl_box, track)) return -1;
+
+    return 0;
+}
+
+int mp4box_load(const char *path, mp4box_file *file)
+{
+    FILE *fp;
+    mp4box trak;
+    unsigned char *data;
+    unsigned long long offset, len;
+    int rc = -1;
+
+    memset(file, 0, sizeof(mp4box_file));
+
+    fp = fopen(path, "rb");
+    if (!fp) return -1;
+
+    if (fseeko(fp, 0, SEEK_END)) goto exit;
+    file->file_size = (unsigned long long) ftello(fp);
+
+    if (mp4box_find_top(fp, MP4BOX_TYPE('m','o','o','v'), &file->moov)) goto exit;
+    if (mp4box_find_top(fp, MP4BOX_TYPE('m','d','a','t'), &file->mdat)) memset(&file->mdat, 0, sizeof(mp4box));
+    if (mp4box_find_top(fp, MP4BOX_TYPE('s','i','d','x'), &file->sidx)) memset(&file->sidx, 0, sizeof(mp4box));
+    if (mp4box_find(fp, &file->moov, MP4BOX_TYPE('m','v','h','d'), &trak) || !(data = read_payload(fp, &trak, 20, &len))) goto exit;
+    file->timescale = (data[0] && len >= 28) ? get_u32(data + 20) : get_u32(data + 12);
+    free(data);
+
+    for (offset = file->moov.offset + file->moov.header; !mp4box_read(fp, offset, file->moov.offset + file->moov.size, &trak); offset += trak.size) {
+        mp4box_track *tracks;
+
+        if (trak.type != MP4BOX_TYPE('t','r','a','k')) continue;
+
+        tracks = (mp4box_track *) realloc(file->tracks, sizeof(mp4box_track) * (file->track_count + 1));
+        if (!tracks) goto exit;
+        file->tracks = tracks;
+        if (load_track(fp, &trak, &file->tracks[file->track_count++])) goto exit;
+    }
+    rc = 0;
+
+exit:
+    fclose(fp);
+    if (rc) mp4box_free(file);
+    return rc;
+}
+
+void mp4box_free(mp4box_file *file)
+{
+    unsigned int i;
+
+    for (i = 0; i < file->track_count; i++) {
+        free(file->tracks[i].offsets);
+        free(file->tracks[i].sizes);
+        free(file->tracks[i].dts);
+        free(file->tracks[i].cts_offsets);
+        free(file->tracks[i].sync);
+        free(file->tracks[i].chunks);
+    }
+    free(file->tracks);
+    memset(file, 0, sizeof(mp4box_file));
+}
+
+int mp4box_read_sidx(FILE *fp, const mp4box *box, mp4box_sidx *sidx)
+{
+    unsigned char *data, *p;
+    unsigned long long len;
+    unsigned int i;
+
+    memset(sidx, 0, sizeof(mp4box_sidx));
+
+    data = read_payload(fp, box, 24, &len);
+    if (!data) return -1;
+
+    sidx->reference_id = get_u32(data + 4);
+    sidx->timescale = get_u32(data + 8);
+    if (data[0]) {
+        if (len < 32) goto error;
+        sidx->earliest_time = get_u64(data + 12);
+        sidx->first_offset = get_u64(data + 20);
+        p = data + 28;
+    } else {
+        sidx->earliest_time = get_u32(data + 12);
+        sidx->first_offset = get_u32(data + 16);
+        p = data + 20;
+    }
+    sidx->reference_count = (p[2] << 8) | p[3];
+    p += 4;
+    if ((unsigned long long) (p - data) + 12ULL * sidx->reference_count > len) goto error;
+
+    sidx->sizes = (unsigned int *) malloc(sizeof(unsigned int) * (sidx->reference_count + 1));
+    sidx->durations = (unsigned int *) malloc(sizeof(unsigned int) * (sidx->reference_count + 1));
+    sidx->starts_with_sap = (unsigned char *) malloc(sidx->reference_count + 1);
+    if (!sidx->sizes || !sidx->durations || !sidx->starts_with_sap) goto error;
+
+    for (i = 0; i < sidx->reference_count; i++, p += 12) {
+        /* a set reference type bit points to another index, only media ranges are written */
+        if (p[0] & 0x80) goto error;
+        sidx->sizes[i] = get_u32(p) & 0x7fffffff;
+        sidx->durations[i] = get_u32(p + 4);
+        sidx->starts_with_sap[i] = p[8] >> 7;
+    }
+    free(data);
+    return 0;
+
+error:
+    free(data);
+    mp4box_free_sidx(sidx);
+    return -1;
+}
+
+void mp4box_free_sidx(mp4box_sidx *sidx)
+{
+    free(sidx->sizes);
+    free(sidx->durations);
+    free(sidx->starts_with_sap);
+    memset(sidx, 0, sizeof(mp4box_sidx));
+}
+
+/*
+ Add delta to the chunk offsets of the stco and co64 boxes nested in the content of a box
+ */
+static int move_chunk_offsets(unsigned char *data, unsigned long long len, long long delta)
+{
+    unsigned long long pos = 0;
+
+    while (pos + 8 <= len) {
+        unsigned long long size = get_u32(data + pos);
+        unsigned int type = get_u32(data + pos + 4), header = 8;
+        unsigned char *p;
+        unsigned int i, count;
+
+        if (size == 1) {
+            if (pos + 16 > len) return 1;
+            size = get_u64(data + pos + 8);
+            header = 16;
+        } else if (!size) {
+            size = len - pos;
+        }
+        if (size < header || pos + size > len) return 1;
+        p = data + pos + header;
+
+        if (type == MP4BOX_TYPE('t','r','a','k') || type == MP4BOX_TYPE('m','d','i','a') ||
+            type == MP4BOX_TYPE('m','i','n','f') || type == MP4BOX_TYPE('s','t','b','l')) {
+            if (move_chunk_offsets(p, size - header, delta)) return 1;
+        } else if (type == MP4BOX_TYPE('s','t','c','o') || type == MP4BOX_TYPE('c','o','6','4')) {
+            unsigned int entry = (type == MP4BOX_TYPE('c','o','6','4')) ? 8 : 4;
+            if (size - header < 8) return 1;
+            count = get_u32(p + 4);
+            if (8 + (unsigned long long) count * entry > size - header) return 1;
+            for (i = 0; i < count; i++) {
+                unsigned char *e = p + 8 + entry * i;
+                long long offset = (long long) (entry == 8 ? get_u64(e) : get_u32(e)) + delta;
+                if (offset < 0 || (entry == 4 && offset > 0xffffffffLL)) return 1;
+                if (entry == 8) put_u64(e, (unsigned long long) offset);
+                else put_u32(e, (unsigned int) offset);
+            }
+        }
+        pos += size;
+    }
+    return 0;
+}
+
+static long long presentation_time(const mp4box_track *track, unsigned int i)
+{
+    return (long long) track->dts[i] + (track->cts_offsets ? track->cts_offsets[i] : 0);
+}
+
+/*
+ Build the segment index box of a file, whose first range starts at its media data box
+ */
+static unsigned char *build_sidx(const mp4box_file *file, unsigned long long *sidx_size)
+{
+    const mp4box_track *track = NULL;
+    unsigned int i, t, count = 0, *starts;
+    unsigned long long end = file->mdat.offset + file->mdat.size, previous;
+    long long earliest, end_time, last_delta;
+    unsigned char *sidx, *p;
+    unsigned int version;
+
+    for (t = 0; t < file->track_count && !track; t++) {
+        if (file->tracks[t].handler == MP4BOX_TYPE('v','i','d','e') && file->tracks[t].sample_count) track = &file->tracks[t];
+    }
+    for (t = 0; t < file->track_count && !track; t++) {
+        if (file->tracks[t].sample_count) track = &file->tracks[t];
+    }
+    if (!track || !file->mdat.size || !track->timescale) return NULL;
+
+    for (t = 0; t < file->track_count; t++) {
+        for (i = 0; i < file->tracks[t].sample_count; i++) {
+            if (file->tracks[t].offsets[i] + file->tracks[t].sizes[i] > end) end = file->tracks[t].offsets[i] + file->tracks[t].sizes[i];
+        }
+    }
+
+    starts = (unsigned int *) malloc(sizeof(unsigned int) * (track->sample_count + 1));
+    if (!starts) return NULL;
+
+    /* first sample of each range */
+    earliest = end_time = presentation_time(track, 0);
+    starts[count++] = 0;
+    previous = file->mdat.offset;
+    for (i = 0; i < track->sample_count; i++) {
+        long long time = presentation_time(track, i);
+        if (time < earliest) earliest = time;
+        if (time > end_time) end_time = time;
+        if (!i) continue;
+
+        if (track->sync ? !track->sync[i] : (time < presentation_time(track, starts[count - 1]) + track->timescale)) continue;
+        /* the chunks of the track must be stored in order for its ranges to be consecutive */
+        if (track->offsets[i] <= previous) continue;
+        starts[count++] = i;
+        previous = track->offsets[i];
+    }
+    last_delta = (track->sample_count > 1) ? (long long) (track->dts[track->sample_count - 1] - track->dts[track->sample_count - 2]) : 0;
+    end_time += last_delta;
+
+    if (count > 0xffff || earliest < 0) {
+        free(starts);
+        return NULL;
+    }
+
+    version = ((unsigned long long) earliest > 0xffffffffULL) ? 1 : 0;
+    *sidx_size = 12 + 8 + (version ? 16 : 8) + 4 + 12ULL * count;
+    sidx = (unsigned char *) calloc((size_t) *sidx_size, 1);
+    if (!sidx) {
+        free(starts);
+        return NULL;
+    }
+
+    put_u32(sidx, (unsigned int) *sidx_size);
+    put_u32(sidx + 4, MP4BOX_TYPE('s','i','d','x'));
+    sidx[8] = (unsigned char) version;
+    put_u32(sidx + 12, track->id);
+    put_u32(sidx + 16, track->timescale);
+    p = sidx + 20;
+    if (version) {
+        put_u64(p, (unsigned long long) earliest);
+        p += 16;
+    } else {
+        put_u32(p, (unsigned int) earliest);
+        p += 8;
+    }
+    /* first_offset is 0: the first range starts right after the index, with the media data box */
+    p[2] = (unsigned char) (count >> 8);
+    p[3] = (unsigned char) count;
+    p += 4;
+
+    for (i = 0; i < count; i++, p += 12) {
+        unsigned long long start = i ? track->offsets[starts[i]] : file->mdat.offset;
+        unsigned long long next = (i + 1 < count) ? track->offsets[starts[i + 1]] : end;
+        long long start_time = i ? presentation_time(track, starts[i]) : earliest;
+        long long next_time = (i + 1 < count) ? presentation_time(track, starts[i + 1]) : end_time;
+
+        if (next - start > 0x7fffffffULL || next_time < start_time || next_time - start_time > 0xffffffffLL) {
+            free(starts);
+            free(sidx);
+            return NULL;
+        }
+        put_u32(p, (unsigned int) (next - start));
+        put_u32(p + 4, (unsigned int) (next_time - start_time));
+        /* SAP of type 1 at the start of the range */
+        if (!track->sync || track->sync[starts[i]]) p[8] = 0x90;
+    }
+
+    free(starts);
+    return sidx;
+}
+
+/*
+ Set the distance between the end of an index built by build_sidx and its first range. Return 0 on success
+ */
+static int set_first_offset(unsigned char *sidx, unsigned long long first_offset)
+{
+    if (sidx[8]) {
+        put_u64(sidx + 28, first_offset);
+    } else if (first_offset > 0xffffffffULL) {
+        return -1;
+    } else {
+        put_u32(sidx + 24, (unsigned int) first_offset);
+    }
+    return 0;
+}
+
+static int copy_range(FILE *in, FILE *out, unsigned long long offset, unsigned long long size)
+{
+    static const size_t buffer_size = 1 << 20;
+    unsigned char *buffer = (unsigned char *) malloc(buffer_size);
+    int rc = 0;
+
+    if (!buffer || fseeko(in, (off_t) offset, SEEK_SET)) rc = -1;
+    while (!rc && size) {
+        size_t len = (size_t) (size < buffer_size ? size : buffer_size);
+        if (fread(buffer, 1, len, in) != len || fwrite(buffer, 1, len, out) != len) rc = -1;
+        size -= len;
+    }
+    free(buffer);
+    return rc;
+}
+
+/* free space before the media data, left by an index or a movie box moved by an append */
+static int is_free_box(unsigned int type)
+{
+    return type == MP4BOX_TYPE('f','r','e','e') || type == MP4BOX_TYPE('s','k','i','p');
+}
+
+static int write_at(FILE *fp, unsigned long long offset, const void *data, unsigned long long size)
+{
+    return (fseeko(fp, (off_t) offset, SEEK_SET) || fwrite(data, 1, (size_t) size, fp) != size) ? -1 : 0;
+}
+
+/* header of a box of the given size, in header bytes: 8, or 16 with a 64 bits size */
+static int write_box_header(FILE *fp, unsigned long long offset, unsigned int type, unsigned long long size, unsigned int header)
+{
+    unsigned char h[16];
+
+    put_u32(h + 4, type);
+    if (header == 16) {
+        put_u32(h, 1);
+        put_u64(h + 8, size);
+    } else {
+        put_u32(h, (unsigned int) size);
+    }
+    return write_at(fp, offset, h, header);
+}
+
+/* a free box of at least 8 bytes */
+static int write_free(FILE *fp, unsigned long long offset, unsigned long long size)
+{
+    return write_box_header(fp, offset, MP4BOX_TYPE('f','r','e','e'), size, (size > 0xffffffffULL) ? 16 : 8);
+}
+
+int mp4box_add_sidx(const char *path, const char *output_path, int reserve)
+{
+    mp4box_file file;
+    mp4box box;
+    FILE *in = NULL, *out = NULL;
+    unsigned char *sidx = NULL, *moov = NULL;
+    unsigned long long sidx_size = 0, reserved = 0, removed = 0, offset, len;
+    long long delta;
+    int rc = -1;
+
+    if (mp4box_load(path, &file)) return -1;
+
+    sidx = build_sidx(&file, &sidx_size);
+    if (reserve) reserved = (sidx_size < 8) ? 8 : sidx_size;
+    if (!sidx || set_first_offset(sidx, reserved)) {
+        rc = 1;
+        goto exit;
+    }
+
+    in = fopen(path, "rb");
+    if (!in) goto exit;
+
+    /* the media data moves by the size of the new index and its free space minus the size of the indexes and free space before it */
+    for (offset = 0; offset < file.mdat.offset && !mp4box_read(in, offset, file.file_size, &box); offset += box.size) {
+        if (box.type == MP4BOX_TYPE('s','i','d','x') || is_free_box(box.type)) removed += box.size;
+    }
+    delta = (long long) (sidx_size + reserved) - (long long) removed;
+
+    out = fopen(output_path, "wb");
+    if (!out) goto exit;
+
+    for (offset = 0; offset < file.file_size; offset += box.size) {
+        if (mp4box_read(in, offset, file.file_size, &box)) goto exit;
+
+        if (box.type == MP4BOX_TYPE('s','i','d','x') || (box.offset < file.mdat.offset && is_free_box(box.type))) continue;
+
+        if (box.offset == file.mdat.offset) {
+            if (fwrite(sidx, 1, (size_t) sidx_size, out) != sidx_size) goto exit;
+            /* room for the index to grow when the file is appended to, the first range starting after it */
+            if (reserved && (write_free(out, (unsigned long long) ftello(out), reserved) || fseeko(out, (off_t) reserved - 8, SEEK_CUR))) goto exit;
+        }
+
+        if (box.type == MP4BOX_TYPE('m','o','o','v')) {
+            moov = read_payload(in, &box, 0, &len);
+            if (!moov) goto exit;
+            if (move_chunk_offsets(moov, len, delta)) {
+                rc = 1;
+                goto exit;
+            }
+            if (copy_range(in, out, box.offset, box.header) || fwrite(moov, 1, (size_t) len, out) != len) goto exit;
+            free(moov);
+            moov = NULL;
+        } else if (copy_range(in, out, box.offset, box.size)) {
+            goto exit;
+        }
+    }
+    rc = 0;
+
+exit:
+    if (in) fclose(in);
+    if (out && fclose(out)) rc = -1;
+    if (rc && out) remove(output_path);
+    free(moov);
+    free(sidx);
+    mp4box_free(&file);
+    return rc;
+}
+
+/*
+ Boxes of a movie box being written
+ */
+typedef struct {
+    unsigned char *data;
+    size_t len, capacity;
+    int failed;
+} box_buffer;
+
+static unsigned char *buffer_grow(box_buffer *b, size_t len)
+{
+    unsigned char *p;
+
+    if (b->failed) return NULL;
+    if (b->len + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->len + len) capacity *= 2;
+        p = (unsigned char *) realloc(b->data, capacity);
+        if (!p) {
+            b->failed = 1;
+            return NULL;
+        }
+        b->data = p;
+        b->capacity = capacity;
+    }
+    p = b->data + b->len;
+    b->len += len;
+    return p;
+}
+
+static void buffer_put(box_buffer *b, const void *data, size_t len)
+{
+    unsigned char *p = buffer_grow(b, len);
+    if (p) memcpy(p, data, len);
+}
+
+static void buffer_u32(box_buffer *b, unsigned int v)
+{
+    unsigned char *p = buffer_grow(b, 4);
+    if (p) put_u32(p, v);
+}
+
+static void buffer_u64(box_buffer *b, unsigned long long v)
+{
+    unsigned char *p = buffer_grow(b, 8);
+    if (p) put_u64(p, v);
+}
+
+/* start a box, closed with its start once its content is written */
+static size_t box_open(box_buffer *b, unsigned int type)
+{
+    size_t start = b->len;
+    buffer_u32(b, 0);
+    buffer_u32(b, type);
+    return start;
+}
+
+static void box_close(box_buffer *b, size_t start)
+{
+    if (!b->failed) put_u32(b->data + start, (unsigned int) (b->len - start));
+}
+
+/* set a 32 bits field written earlier, the entry count of a table */
+static void buffer_set_u32(box_buffer *b, size_t pos, unsigned int v)
+{
+    if (!b->failed) put_u32(b->data + pos, v);
+}
+
+static void copy_box(box_buffer *b, const unsigned char *data, const mp4box *box)
+{
+    buffer_put(b, data + box->offset, (size_t) box->size);
+}
+
+/* read the header of the box at offset of a buffer, which must end before end. Return 0 on success */
+static int parse_box(const unsigned char *data, unsigned long long offset, unsigned long long end, mp4box *box)
+{
+    if (offset + 8 > end) return -1;
+
+    box->offset = offset;
+    box->type = get_u32(data + offset + 4);
+    box->size = get_u32(data + offset);
+    box->header = 8;
+
+    if (box->size == 1) {
+        if (offset + 16 > end) return -1;
+        box->size = get_u64(data + offset + 8);
+        box->header = 16;
+    } else if (!box->size) {
+        box->size = end - offset;
+    }
+    return (box->size < box->header || offset + box->size > end) ? -1 : 0;
+}
+
+/* duration in the movie timescale of the media of a track */
+static unsigned long long movie_duration(const mp4box_track *track, unsigned int movie_timescale)
+{
+    return track->timescale ? track->duration * movie_timescale / track->timescale : 0;
+}
+
+/*
+ Copy a movie, track or media header box with a new duration, in version 1 when it does not fit on 32 bits.
+ ids is the size of the fields between the modification time and the duration
+ */
+static int put_header(box_buffer *b, const unsigned char *data, const mp4box *box, unsigned int ids, unsigned long long duration)
+{
+    const unsigned char *p = data + box->offset + box->header;
+    unsigned long long len = box->size - box->header;
+    unsigned int times = p[0] ? 16 : 8;
+    unsigned long long fields = 4 + times + ids + (p[0] ? 8 : 4);
+    unsigned char version[4];
+    size_t start;
+
+    if (len < fields) return -1;
+
+    version[0] = (p[0] || duration > 0xffffffffULL) ? 1 : 0;
+    memcpy(version + 1, p + 1, 3);
+
+    start = box_open(b, box->type);
+    buffer_put(b, version, 4);
+    if (version[0] == p[0]) {
+        buffer_put(b, p + 4, times + ids);
+    } else {
+        buffer_u64(b, get_u32(p + 4));
+        buffer_u64(b, get_u32(p + 8));
+        buffer_put(b, p + 12, ids);
+    }
+    if (version[0]) buffer_u64(b, duration);
+    else buffer_u32(b, (unsigned int) duration);
+    buffer_put(b, p + fields, (size_t) (len - fields));
+    box_close(b, start);
+    return 0;
+}
+
+/*
+ Run length tables: stts, ctts and stsc
+ */
+typedef struct {
+    unsigned int count;
+    unsigned int value;
+    unsigned int entries;
+} table_run;
+
+static void run_flush(box_buffer *b, table_run *run)
+{
+    if (!run->count) return;
+    buffer_u32(b, run->count);
+    buffer_u32(b, run->value);
+    run->entries++;
+    run->count = 0;
+}
+
+static void run_add(box_buffer *b, table_run *run, unsigned int value)
+{
+    if (run->count && value == run->value) {
+        run->count++;
+        return;
+    }
+    run_flush(b, run);
+    run->count = 1;
+    run->value = value;
+}
+
+/*
+ Sample tables of a track, the sizes on 16 bits (stz2) when compact is set and they all fit.
+ Every chunk uses the first sample description
+ */
+static void put_sample_tables(box_buffer *b, const mp4box_track *track, int compact)
+{
+    table_run run;
+    size_t start, count_pos;
+    unsigned int i, max_size = 0, constant = 1, chunk, entries, previous = 0;
+    int shifted = 0, negative = 0, large = 0;
+
+    start = box_open(b, MP4BOX_TYPE('s','t','t','s'));
+    buffer_u32(b, 0);
+    count_pos = b->len;
+    buffer_u32(b, 0);
+    memset(&run, 0, sizeof(run));
+    for (i = 0; i < track->sample_count; i++) {
+        /* the last sample lasts until the end of the media */
+        unsigned long long next = (i + 1 < track->sample_count) ? track->dts[i + 1] : track->duration;
+        run_add(b, &run, (unsigned int) ((next > track->dts[i]) ? next - track->dts[i] : 0));
+    }
+    run_flush(b, &run);
+    buffer_set_u32(b, count_pos, run.entries);
+    box_close(b, start);
+
+    for (i = 0; track->cts_offsets && i < track->sample_count; i++) {
+        if (track->cts_offsets[i]) shifted = 1;
+        if (track->cts_offsets[i] < 0) negative = 1;
+    }
+    if (shifted) {
+        start = box_open(b, MP4BOX_TYPE('c','t','t','s'));
+        /* signed offsets in version 1 */
+        buffer_u32(b, negative ? 0x01000000 : 0);
+        count_pos = b->len;
+        buffer_u32(b, 0);
+        memset(&run, 0, sizeof(run));
+        for (i = 0; i < track->sample_count; i++) run_add(b, &run, (unsigned int) track->cts_offsets[i]);
+        run_flush(b, &run);
+        buffer_set_u32(b, count_pos, run.entries);
+        box_close(b, start);
+    }
+
+    if (track->sync) {
+        unsigned int count = 0;
+        start = box_open(b, MP4BOX_TYPE('s','t','s','s'));
+        buffer_u32(b, 0);
+        count_pos = b->len;
+        buffer_u32(b, 0);
+        for (i = 0; i < track->sample_count; i++) {
+            if (!track->sync[i]) continue;
+            buffer_u32(b, i + 1);
+            count++;
+        }
+        buffer_set_u32(b, count_pos, count);
+        box_close(b, start);
+    }
+
+    for (i = 0; i < track->sample_count; i++) {
+        if (track->sizes[i] != track->sizes[0]) constant = 0;
+        if (track->sizes[i] > max_size) max_size = track->sizes[i];
+    }
+    if (!constant && compact && max_size <= 0xffff) {
+        start = box_open(b, MP4BOX_TYPE('s','t','z','2'));
+        buffer_u32(b, 0);
+        /* field size in the low byte */
+        buffer_u32(b, 16);
+        buffer_u32(b, track->sample_count);
+        for (i = 0; i < track->sample_count; i++) {
+            unsigned char *p = buffer_grow(b, 2);
+            if (!p) break;
+            p[0] = (unsigned char) (track->sizes[i] >> 8);
+            p[1] = (unsigned char) track->sizes[i];
+        }
+    } else {
+        start = box_open(b, MP4BOX_TYPE('s','t','s','z'));
+        buffer_u32(b, 0);
+        buffer_u32(b, (constant && track->sample_count) ? track->sizes[0] : 0);
+        buffer_u32(b, track->sample_count);
+        for (i = 0; !constant && i < track->sample_count; i++) buffer_u32(b, track->sizes[i]);
+    }
+    box_close(b, start);
+
+    start = box_open(b, MP4BOX_TYPE('s','t','s','c'));
+    buffer_u32(b, 0);
+    count_pos = b->len;
+    buffer_u32(b, 0);
+    for (chunk = 0, entries = 0; chunk < track->chunk_count; chunk++) {
+        unsigned int samples = ((chunk + 1 < track->chunk_count) ? track->chunks[chunk + 1] : track->sample_count) - track->chunks[chunk];
+        if (chunk && samples == previous) continue;
+        /* first chunk of the run, its samples per chunk and sample description */
+        buffer_u32(b, chunk + 1);
+        buffer_u32(b, samples);
+        buffer_u32(b, 1);
+        entries++;
+        previous = samples;
+    }
+    buffer_set_u32(b, count_pos, entries);
+    box_close(b, start);
+
+    for (chunk = 0; chunk < track->chunk_count; chunk++) {
+        if (track->offsets[track->chunks[chunk]] > 0xffffffffULL) large = 1;
+    }
+    start = box_open(b, large ? MP4BOX_TYPE('c','o','6','4') : MP4BOX_TYPE('s','t','c','o'));
+    buffer_u32(b, 0);
+    buffer_u32(b, track->chunk_count);
+    for (chunk = 0; chunk < track->chunk_count; chunk++) {
+        unsigned long long offset = track->offsets[track->chunks[chunk]];
+        if (large) buffer_u64(b, offset);
+        else buffer_u32(b, (unsigned int) offset);
+    }
+    box_close(b, start);
+}
+
+/*
+ Sample table box of an extended track: the sample description is copied, the tables are written again,
+ the per sample tables that would no longer match the samples (dependencies, groups, subsamples) are left out.
+ Return 1 when the track has several sample descriptions
+ */
+static int put_stbl(box_buffer *b, const unsigned char *data, const mp4box *stbl, const mp4box_track *track)
+{
+    mp4box box;
+    unsigned long long offset, end = stbl->offset + stbl->size;
+    size_t start;
+    int compact = 0, described = 0;
+
+    for (offset = stbl->offset + stbl->header; !parse_box(data, offset, end, &box); offset += box.size) {
+        if (box.type == MP4BOX_TYPE('s','t','z','2')) compact = 1;
+    }
+
+    start = box_open(b, stbl->type);
+    for (offset = stbl->offset + stbl->header; !parse_box(data, offset, end, &box); offset += box.size) {
+        switch (box.type) {
+        case MP4BOX_TYPE('s','t','s','d'):
+            /* the appended samples use the first description */
+            if (box.size < box.header + 8 || get_u32(data + box.offset + box.header + 4) != 1) return 1;
+            copy_box(b, data, &box);
+            put_sample_tables(b, track, compact);
+            described = 1;
+            break;
+        case MP4BOX_TYPE('s','t','t','s'):
+        case MP4BOX_TYPE('c','t','t','s'):
+        case MP4BOX_TYPE('s','t','s','s'):
+        case MP4BOX_TYPE('s','t','s','z'):
+        case MP4BOX_TYPE('s','t','z','2'):
+        case MP4BOX_TYPE('s','t','s','c'):
+        case MP4BOX_TYPE('s','t','c','o'):
+        case MP4BOX_TYPE('c','o','6','4'):
+        case MP4BOX_TYPE('c','s','l','g'):
+        case MP4BOX_TYPE('s','t','s','h'):
+        case MP4BOX_TYPE('s','t','d','p'):
+        case MP4BOX_TYPE('p','a','d','b'):
+        case MP4BOX_TYPE('s','d','t','p'):
+        case MP4BOX_TYPE('s','b','g','p'):
+        case MP4BOX_TYPE('s','g','p','d'):
+        case MP4BOX_TYPE('s','u','b','s'):
+            break;
+        default:
+            copy_box(b, data, &box);
+            break;
+        }
+    }
+    box_close(b, start);
+    return described ? 0 : 1;
+}
+
+/* copy a container box, writing its child of the given type with put */
+static int put_container(box_buffer *b, const unsigned char *data, const mp4box *parent, unsigned int type,
+                         int (*put)(box_buffer *, const unsigned char *, const mp4box *, const mp4box_track *), const mp4box_track *track)
+{
+    mp4box box;
+    unsigned long long offset, end = parent->offset + parent->size;
+    size_t start = box_open(b, parent->type);
+    int rc = 0;
+
+    for (offset = parent->offset + parent->header; !rc && !parse_box(data, offset, end, &box); offset += box.size) {
+        if (box.type == type) rc = put(b, data, &box, track);
+        else copy_box(b, data, &box);
+    }
+    box_close(b, start);
+    return rc;
+}
+
+static int put_minf(box_buffer *b, const unsigned char *data, const mp4box *minf, const mp4box_track *track)
+{
+    return put_container(b, data, minf, MP4BOX_TYPE('s','t','b','l'), put_stbl, track);
+}
+
+static int put_mdia(box_buffer *b, const unsigned char *data, const mp4box *mdia, const mp4box_track *track)
+{
+    mp4box box;
+    unsigned long long offset, end = mdia->offset + mdia->size;
+    size_t start = box_open(b, mdia->type);
+    int rc = 0;
+
+    for (offset = mdia->offset + mdia->header; !rc && !parse_box(data, offset, end, &box); offset += box.size) {
+        if (box.type == MP4BOX_TYPE('m','d','h','d')) rc = put_header(b, data, &box, 4, track->duration);
+        else if (box.type == MP4BOX_TYPE('m','i','n','f')) rc = put_minf(b, data, &box, track);
+        else copy_box(b, data, &box);
+    }
+    box_close(b, start);
+    return rc;
+}
+
+/*
+ Track box of an extended track: its edit list keeps the delay of an initial empty edit and spans the whole media,
+ the other edit lists are dropped
+ */
+static int put_trak(box_buffer *b, const unsigned char *data, const mp4box *trak, const mp4box_track *track, unsigned int movie_timescale)
+{
+    mp4box box;
+    unsigned long long offset, end = trak->offset + trak->size;
+    unsigned long long media = movie_duration(track, movie_timescale);
+    size_t start = box_open(b, trak->type);
+    int rc = 0;
+
+    for (offset = trak->offset + trak->header; !rc && !parse_box(data, offset, end, &box); offset += box.size) {
+        if (box.type == MP4BOX_TYPE('t','k','h','d')) {
+            rc = put_header(b, data, &box, 8, track->delay + media);
+        } else if (box.type == MP4BOX_TYPE('e','d','t','s')) {
+            int large = (track->delay > 0xffffffffULL || media > 0xffffffffULL);
+            size_t edts, elst;
+
+            if (!track->delay) continue;
+            edts = box_open(b, MP4BOX_TYPE('e','d','t','s'));
+            elst = box_open(b, MP4BOX_TYPE('e','l','s','t'));
+            buffer_u32(b, large ? 0x01000000 : 0);
+            buffer_u32(b, 2);
+            /* empty edit, then the media from its start at normal rate */
+            if (large) {
+                buffer_u64(b, track->delay);
+                buffer_u64(b, 0xffffffffffffffffULL);
+                buffer_u32(b, 0x00010000);
+                buffer_u64(b, media);
+                buffer_u64(b, 0);
+            } else {
+                buffer_u32(b, (unsigned int) track->delay);
+                buffer_u32(b, 0xffffffff);
+                buffer_u32(b, 0x00010000);
+                buffer_u32(b, (unsigned int) media);
+                buffer_u32(b, 0);
+            }
+            buffer_u32(b, 0x00010000);
+            box_close(b, elst);
+            box_close(b, edts);
+        } else if (box.type == MP4BOX_TYPE('m','d','i','a')) {
+            rc = put_mdia(b, data, &box, track);
+        } else {
+            copy_box(b, data, &box);
+        }
+    }
+    box_close(b, start);
+    return rc;
+}
+
+/*
+ Movie box with the tracks of merged, those marked in extended are written again and the others copied.
+ Return 1 for a fragmented file
+ */
+static int put_moov(box_buffer *b, const unsigned char *data, const mp4box *moov, const mp4box_file *merged, const unsigned char *extended)
+{
+    mp4box box;
+    unsigned long long offset, end = moov->offset + moov->size, duration = 0;
+    unsigned int t = 0;
+    size_t start;
+    int rc = 0;
+
+    if (!parse_box(data, moov->offset + moov->header, end, &box) && box.type == MP4BOX_TYPE('m','v','h','d') && box.size >= box.header + 28) {
+        const unsigned char *p = data + box.offset + box.header;
+        duration = p[0] ? get_u64(p + 24) : get_u32(p + 16);
+    }
+    for (t = 0; t < merged->track_count; t++) {
+        const mp4box_track *track = &merged->tracks[t];
+        if (extended[t] && track->delay + movie_duration(track, merged->timescale) > duration) duration = track->delay + movie_duration(track, merged->timescale);
+    }
+
+    start = box_open(b, moov->type);
+    for (offset = moov->offset + moov->header, t = 0; !rc && !parse_box(data, offset, end, &box); offset += box.size) {
+        if (box.type == MP4BOX_TYPE('m','v','h','d')) {
+            rc = put_header(b, data, &box, 4, duration);
+        } else if (box.type == MP4BOX_TYPE('m','v','e','x')) {
+            rc = 1;
+        } else if (box.type == MP4BOX_TYPE('t','r','a','k')) {
+            if (t >= merged->track_count) rc = -1;
+            else if (extended[t]) rc = put_trak(b, data, &box, &merged->tracks[t], merged->timescale);
+            else copy_box(b, data, &box);
+            t++;
+        } else {
+            copy_box(b, data, &box);
+        }
+    }
+    box_close(b, start);
+    return rc;
+}
+
+/*
+ Samples of a track followed by the samples appended to it, whose times are relative to its end
+ */
+static int merge_track(const mp4box_track *track, const mp4box_track *samples, mp4box_track *merged)
+{
+    unsigned int n = track->sample_count, i;
+
+    memset(merged, 0, sizeof(mp4box_track));
+    merged->id = track->id;
+    merged->handler = track->handler;
+    merged->timescale = track->timescale;
+    merged->delay = track->delay;
+    merged->edit_duration = track->edit_duration;
+    merged->sample_count = n + samples->sample_count;
+    merged->chunk_count = track->chunk_count + samples->chunk_count;
+    merged->duration = track->duration + samples->duration;
+
+    merged->offsets = (unsigned long long *) malloc(sizeof(unsigned long long) * (merged->sample_count + 1));
+    merged->sizes = (unsigned int *) malloc(sizeof(unsigned int) * (merged->sample_count + 1));
+    merged->dts = (unsigned long long *) malloc(sizeof(unsigned long long) * (merged->sample_count + 1));
+    merged->chunks = (unsigned int *) malloc(sizeof(unsigned int) * (merged->chunk_count + 1));
+    if (track->cts_offsets || samples->cts_offsets) merged->cts_offsets = (long long *) calloc(merged->sample_count + 1, sizeof(long long));
+    if (track->sync || samples->sync) merged->sync = (unsigned char *) malloc(merged->sample_count + 1);
+    if (!merged->offsets || !merged->sizes || !merged->dts || !merged->chunks ||
+        ((track->cts_offsets || samples->cts_offsets) && !merged->cts_offsets) || ((track->sync || samples->sync) && !merged->sync)) return -1;
+
+    for (i = 0; i < merged->sample_count; i++) {
+        const mp4box_track *from = (i < n) ? track : samples;
+        unsigned int j = (i < n) ? i : i - n;
+
+        merged->offsets[i] = from->offsets[j];
+        merged->sizes[i] = from->sizes[j];
+        merged->dts[i] = from->dts[j] + ((i < n) ? 0 : track->duration);
+        if (merged->cts_offsets && from->cts_offsets) merged->cts_offsets[i] = from->cts_offsets[j];
+        if (merged->sync) merged->sync[i] = from->sync ? from->sync[j] : 1;
+    }
+    for (i = 0; i < merged->chunk_count; i++) {
+        merged->chunks[i] = (i < track->chunk_count) ? track->chunks[i] : samples->chunks[i - track->chunk_count] + n;
+    }
+    return 0;
+}
+
+static void release_appender(mp4box_appender *appender)
+{
+    if (appender->fp) fclose(appender->fp);
+    free(appender->old_moov);
+    free(appender->moov);
+    mp4box_free(&appender->file);
+    mp4box_free(&appender->merged);
+    memset(appender, 0, sizeof(mp4box_appender));
+}
+
+int mp4box_append_begin(mp4box_appender *appender, const char *path, mp4box_track *samples, unsigned int count)
+{
+    mp4box_file *file = &appender->file;
+    mp4box_file *merged = &appender->merged;
+    mp4box moof, moov;
+    box_buffer buffer;
+    unsigned char *extended = NULL;
+    unsigned long long end;
+    unsigned int i, t;
+    int rc = -1;
+
+    memset(appender, 0, sizeof(mp4box_appender));
+    memset(&buffer, 0, sizeof(buffer));
+
+    /* the movie box of an unreadable or fragmented file cannot be extended */
+    if (mp4box_load(path, file)) return 1;
+    appender->fp = fopen(path, "r+b");
+    if (!appender->fp) goto exit;
+    if (!mp4box_find_top(appender->fp, MP4BOX_TYPE('m','o','o','f'), &moof)) {
+        rc = 1;
+        goto exit;
+    }
+
+    if (file->moov.size > (size_t) -1 || !(appender->old_moov = (unsigned char *) malloc((size_t) file->moov.size))) goto exit;
+    if (fseeko(appender->fp, (off_t) file->moov.offset, SEEK_SET) || fread(appender->old_moov, 1, (size_t) file->moov.size, appender->fp) != file->moov.size) goto exit;
+
+    extended = (unsigned char *) calloc(file->track_count + 1, 1);
+    if (!extended) goto exit;
+    for (i = 0; i < count; i++) {
+        for (t = 0; t < file->track_count && file->tracks[t].id != samples[i].id; t++);
+        if (t == file->track_count || extended[t]) {
+            rc = 1;
+            goto exit;
+        }
+        extended[t] = 1;
+        if (samples[i].sample_count && samples[i].offsets[samples[i].sample_count - 1] + samples[i].sizes[samples[i].sample_count - 1] > appender->data_size) {
+            appender->data_size = samples[i].offsets[samples[i].sample_count - 1] + samples[i].sizes[samples[i].sample_count - 1];
+        }
+    }
+
+    /*
+     The new media data box replaces the movie box at the end of the file, at least as large as it.
+     Elsewhere it follows the file and the old movie box becomes free space
+     */
+    appender->reclaim = (file->moov.offset + file->moov.size == file->file_size);
+    appender->mdat_header = (appender->data_size + 16 + (appender->reclaim ? file->moov.size : 0) > 0xffffffffULL) ? 16 : 8;
+    appender->mdat_offset = appender->reclaim ? file->moov.offset : file->file_size;
+    appender->mdat_size = appender->mdat_header + appender->data_size;
+    if (appender->reclaim && appender->mdat_size < file->moov.size) appender->mdat_size = file->moov.size;
+    else if (appender->reclaim && appender->mdat_size > file->moov.size && appender->mdat_size < file->moov.size + 8) appender->mdat_size = file->moov.size + 8;
+
+    for (i = 0; i < count; i++) {
+        unsigned int s;
+        for (s = 0; s < samples[i].sample_count; s++) samples[i].offsets[s] += appender->mdat_offset + appender->mdat_header;
+    }
+
+    merged->tracks = (mp4box_track *) calloc(file->track_count + 1, sizeof(mp4box_track));
+    if (!merged->tracks) goto exit;
+    merged->timescale = file->timescale;
+    merged->moov = file->moov;
+    merged->mdat = file->mdat;
+    if (!merged->mdat.size) {
+        merged->mdat.type = MP4BOX_TYPE('m','d','a','t');
+        merged->mdat.offset = appender->mdat_offset;
+        merged->mdat.size = appender->mdat_size;
+        merged->mdat.header = appender->mdat_header;
+    }
+    for (t = 0; t < file->track_count; t++) {
+        mp4box_track none;
+        const mp4box_track *appended = &none;
+
+        memset(&none, 0, sizeof(none));
+        for (i = 0; i < count; i++) {
+            if (samples[i].id == file->tracks[t].id) appended = &samples[i];
+        }
+        merged->track_count++;
+        if (merge_track(&file->tracks[t], appended, &merged->tracks[t])) goto exit;
+    }
+
+    moov = file->moov;
+    moov.offset = 0;
+    rc = put_moov(&buffer, appender->old_moov, &moov, merged, extended);
+    if (!rc && buffer.failed) rc = -1;
+    if (rc) goto exit;
+    appender->moov = buffer.data;
+    appender->moov_size = buffer.len;
+    buffer.data = NULL;
+    rc = -1;
+
+    if (appender->reclaim) {
+        /*
+         Until the new media data box replaces it, the old movie box is followed by free space up to the end of the new movie box,
+         then by a copy of itself, the movie box of the file once the media data box header is written
+         */
+        end = appender->mdat_offset + appender->mdat_size;
+        if (appender->mdat_size > file->moov.size && write_free(appender->fp, file->file_size, appender->mdat_size - file->moov.size)) goto undo;
+        if (write_free(appender->fp, end, appender->moov_size) || write_at(appender->fp, end + appender->moov_size, appender->old_moov, file->moov.size) || fflush(appender->fp)) goto undo;
+        if (write_box_header(appender->fp, appender->mdat_offset, MP4BOX_TYPE('m','d','a','t'), appender->mdat_size, appender->mdat_header) || fflush(appender->fp)) goto undo;
+        appender->switched = 1;
+    } else if (write_box_header(appender->fp, appender->mdat_offset, MP4BOX_TYPE('f','r','e','e'), 0, 8) || fflush(appender->fp)) {
+        /* the appended data is free space up to the end of the file until its media data box header is written */
+        goto undo;
+    }
+    if (fseeko(appender->fp, (off_t) (appender->mdat_offset + appender->mdat_header), SEEK_SET)) goto undo;
+
+    free(extended);
+    return 0;
+
+undo:
+    free(extended);
+    mp4box_append_abort(appender);
+    return -1;
+
+exit:
+    free(extended);
+    free(buffer.data);
+    release_appender(appender);
+    return rc;
+}
+
+int mp4box_append_write(mp4box_appender *appender, const void *data, unsigned long long size)
+{
+    if (!appender->fp || appender->written + size > appender->data_size || fwrite(data, 1, (size_t) size, appender->fp) != size) return -1;
+    appender->written += size;
+    return 0;
+}
+
+/*
+ Write the index of the merged tracks over the largest run of free boxes before the media data. Return 0 on success
+ */
+static int place_sidx(mp4box_appender *appender)
+{
+    FILE *fp = appender->fp;
+    mp4box box;
+    unsigned long long offset, start = 0, end = 0, run = 0, sidx_size, limit = appender->merged.mdat.offset;
+    unsigned char *sidx;
+    int rc = -1;
+
+    for (offset = 0; offset < limit && !mp4box_read(fp, offset, limit, &box); offset += box.size) {
+        if (!is_free_box(box.type)) {
+            run = offset + box.size;
+        } else if (offset + box.size - run > end - start) {
+            start = run;
+            end = offset + box.size;
+        }
+    }
+
+    sidx = build_sidx(&appender->merged, &sidx_size);
+    if (!sidx) return 1;
+
+    /* the rest of the run stays free, the index is written last over the free box it replaces */
+    if ((sidx_size == end - start || sidx_size + 8 <= end - start) && !set_first_offset(sidx, limit - start - sidx_size)) {
+        rc = 0;
+        if (end - start > sidx_size && write_free(fp, start + sidx_size, end - start - sidx_size)) rc = -1;
+        if (!rc && (write_at(fp, start + 8, sidx + 8, sidx_size - 8) || fflush(fp) || write_at(fp, start, sidx, 8) || fflush(fp))) rc = -1;
+    }
+    free(sidx);
+    return rc;
+}
+
+int mp4box_append_end(mp4box_appender *appender, int index)
+{
+    FILE *fp = appender->fp;
+    mp4box box;
+    unsigned long long offset, size, moov_offset = appender->mdat_offset + appender->mdat_size;
+    static const unsigned char free_type[4] = {'f','r','e','e'};
+    int rc = 0;
+
+    if (!fp || appender->written != appender->data_size) goto fail;
+    if (!appender->reclaim && write_box_header(fp, appender->mdat_offset, MP4BOX_TYPE('m','d','a','t'), appender->mdat_size, appender->mdat_header)) goto fail;
+
+    /* the new movie box is read once its header is written, before the old one or its copy */
+    if (write_at(fp, moov_offset + 8, appender->moov + 8, appender->moov_size - 8) || fflush(fp) ||
+        write_at(fp, moov_offset, appender->moov, 8) || fflush(fp)) goto fail;
+    if (appender->reclaim && ftruncate(fileno(fp), (off_t) (moov_offset + appender->moov_size))) goto fail;
+
+    /* the old movie box and the indexes are left as free space */
+    size = moov_offset + appender->moov_size;
+    for (offset = 0; offset < size && !mp4box_read(fp, offset, size, &box); offset += box.size) {
+        if ((box.type == MP4BOX_TYPE('m','o','o','v') && offset != moov_offset) || box.type == MP4BOX_TYPE('s','i','d','x')) {
+            if (write_at(fp, offset + 4, free_type, 4)) rc = 1;
+        }
+    }
+    if (fflush(fp)) rc = 1;
+
+    if (!rc && (index || appender->file.sidx.size)) rc = place_sidx(appender) ? 1 : 0;
+
+    fp = appender->fp;
+    appender->fp = NULL;
+    if (fclose(fp)) rc = 1;
+    release_appender(appender);
+    return rc;
+
+fail:
+    mp4box_append_abort(appender);
+    return -1;
+}
+
+void mp4box_append_abort(mp4box_appender *appender)
+{
+    FILE *fp = appender->fp;
+
+    if (fp) {
+        /* the old movie box is written back, its header last over the media data box header that replaced it */
+        if (appender->switched) {
+            unsigned int header = appender->mdat_header;
+            if (!write_at(fp, appender->file.moov.offset + header, appender->old_moov + header, appender->file.moov.size - header) && !fflush(fp)) {
+                write_at(fp, appender->file.moov.offset, appender->old_moov, header);
+            }
+        }
+        fflush(fp);
+        if (ftruncate(fileno(fp), (off_t) appender->file.file_size)) {}
+    }
+    release_appender(appender);
+}
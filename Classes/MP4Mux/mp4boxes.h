@@ -0,0 +1,173 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef MP4BOXES_H_INCLUDED
+#define MP4BOXES_H_INCLUDED
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    /*
+     Minimal reader of the boxes of an ISO media file, independent of GPAC,
+     to inspect the layout of the files written by mp4mux
+     */
+    #define MP4BOX_TYPE(a, b, c, d) (((unsigned int) (a) << 24) | ((unsigned int) (b) << 16) | ((unsigned int) (c) << 8) | (unsigned int) (d))
+
+    typedef struct
+    {
+        unsigned int type;                  /* four character code */
+        unsigned long long offset;          /* of the box header in the file */
+        unsigned long long size;            /* of the whole box, header included */
+        unsigned int header;                /* size of the header, 8 or 16 bytes */
+    } mp4box;
+
+    typedef struct
+    {
+        unsigned int id;                    /* track ID */
+        unsigned int handler;               /* 'vide', 'soun', ... */
+        unsigned int timescale;             /* of the media */
+        unsigned int sample_count;
+        unsigned long long *offsets;        /* file offset of each sample */
+        unsigned int *sizes;
+        unsigned long long *dts;            /* decoding time of each sample in timescale units */
+        long long *cts_offsets;             /* composition time minus decoding time of each sample, NULL when they are equal */
+        unsigned char *sync;                /* non-zero for random access samples, NULL when every sample is one */
+        unsigned int chunk_count;
+        unsigned int *chunks;               /* first sample of each chunk */
+        unsigned long long duration;        /* of the media in timescale units, the duration of the last sample included */
+        unsigned long long delay;           /* empty edit before the media in the movie timescale, 0 if there is none */
+        unsigned long long edit_duration;   /* of the edits following the delay in the movie timescale, 0 without edit list */
+    } mp4box_track;
+
+    typedef struct
+    {
+        mp4box moov;
+        mp4box mdat;                        /* the first media data box */
+        mp4box sidx;                        /* the first segment index box, of size 0 if there is none */
+        unsigned long long file_size;
+        unsigned int timescale;             /* of the movie */
+        unsigned int track_count;
+        mp4box_track *tracks;
+    } mp4box_file;
+
+    /*
+     Segment index: consecutive byte ranges, the first one starting first_offset bytes after the end of the box,
+     each one holding the samples of a time range of the reference track
+     */
+    typedef struct
+    {
+        unsigned int reference_id;          /* track ID */
+        unsigned int timescale;
+        unsigned long long earliest_time;   /* presentation time of the first range */
+        unsigned long long first_offset;
+        unsigned int reference_count;
+        unsigned int *sizes;                /* size in bytes of each range */
+        unsigned int *durations;            /* duration of each range in timescale units */
+        unsigned char *starts_with_sap;     /* non-zero when a range starts with a random access sample */
+    } mp4box_sidx;
+
+    /* read the header of the box at offset, which must end before end. Return 0 on success */
+    int mp4box_read(FILE *fp, unsigned long long offset, unsigned long long end, mp4box *box);
+    /* find the first child of parent of the given type. Return 0 on success */
+    int mp4box_find(FILE *fp, const mp4box *parent, unsigned int type, mp4box *box);
+    /* find the first top level box of the given type. Return 0 on success */
+    int mp4box_find_top(FILE *fp, unsigned int type, mp4box *box);
+
+    /* read the top level boxes and the sample tables of every track. Return 0 on success */
+    int mp4box_load(const char *path, mp4box_file *file);
+    void mp4box_free(mp4box_file *file);
+
+    /* read a segment index box. Return 0 on success */
+    int mp4box_read_sidx(FILE *fp, const mp4box *box, mp4box_sidx *sidx);
+    void mp4box_free_sidx(mp4box_sidx *sidx);
+
+    /*
+     Copy an ISO media file, replacing its segment index by one inserted before its media data box,
+     whose ranges start on the sync samples of the first video track (of the first track if there is none),
+     every second when all its samples are sync samples. The chunk offsets are moved after the index.
+     The ranges also hold the samples of the other tracks stored between those of the reference track.
+     return value:
+     0 - success
+     1 - the file cannot be indexed: no media data box or samples, a range larger than 2 GB, a 32 bits chunk offset overflow
+     -1 - cannot read path or write output_path
+     With reserve set, free space as large as the index is left after it, for the index of a file appended to to grow in place.
+     */
+    int mp4box_add_sidx(const char *path, const char *output_path, int reserve);
+
+    /*
+     Samples added to the end of the tracks of an ISO media file without rewriting it:
+     mp4box_append_begin takes the tables of the samples added to each track, mp4box_append_write stores their data in the order
+     of their offsets, then mp4box_append_end writes the new movie box after them.
+     The file remains readable with its previous samples until the new movie box is complete. The new media data replaces
+     the old movie box when it is the last box of the file, otherwise the old one is left as a free box, where the segment index goes.
+     */
+    typedef struct
+    {
+        FILE *fp;
+        mp4box_file file;                   /* as it was before the append */
+        mp4box_file merged;                 /* its tracks followed by the appended samples */
+        unsigned char *old_moov;            /* the whole movie box replaced */
+        unsigned char *moov;                /* the whole new movie box */
+        unsigned long long moov_size;
+        unsigned long long mdat_offset;     /* of the media data box of the appended samples */
+        unsigned long long mdat_size;
+        unsigned int mdat_header;
+        unsigned long long data_size;       /* of the appended samples */
+        unsigned long long written;
+        int reclaim;                        /* the new media data box replaces the old movie box */
+        int switched;                       /* the old movie box is replaced by its copy after the new movie box */
+    } mp4box_appender;
+
+    /*
+     Prepare the append of the samples of count tracks. Each one is added after the last sample of the track of the same ID,
+     its offsets are relative to the start of the appended data and are made absolute, its decoding times are relative
+     to the end of the track and its duration and times are in the media timescale of the track.
+     return value:
+     0 - success
+     1 - the file cannot be appended to in place: fragmented, several sample descriptions in a track, unknown track ID. It is left unchanged
+     -1 - cannot read or write path, the file is left unchanged
+     */
+    int mp4box_append_begin(mp4box_appender *appender, const char *path, mp4box_track *samples, unsigned int count);
+    /* write the data of the next appended bytes. Return 0 on success */
+    int mp4box_append_write(mp4box_appender *appender, const void *data, unsigned long long size);
+    /*
+     Write the movie box once every appended byte is written, and the segment index when index is set or the file has one
+     return value:
+     0 - success
+     1 - success, but the segment index did not fit in place or could not be built: the file is left without index, see mp4box_add_sidx
+     -1 - cannot write path, the file is restored
+     */
+    int mp4box_append_end(mp4box_appender *appender, int index);
+    /* give up the append, the file is restored */
+    void mp4box_append_abort(mp4box_appender *appender);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MP4BOXES_H_INCLUDED
@@ -1,316 +1,1540 @@
-/*
- *			GPAC - Multimedia Framework C SDK
- *
- *			Authors: Jean Le Feuvre
- *          Modified by: Gailliez Jonathan
- *                       Damien Leroy
- *			Copyright (c) Telecom ParisTech 2000-2012
- *					All rights reserved
- *
- *  This file is part of GPAC / mp4box application
- *
- *  GPAC is free software; you can redistribute it and/or modify
- *  it under the terms of the GNU Lesser General Public License as published by
- *  the Free Software Foundation; either version 2, or (at your option)
- *  any later version.
- *
- *  GPAC is distributed in the hope that it will be useful,
- *  but WITHOUT ANY WARRANTY; without even the implied warranty of
- *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- *  GNU Lesser General Public License for more details.
- *
- *  You should have received a copy of the GNU Lesser General Public
- *  License along with this library; see the file COPYING.  If not, write to
- *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
- *
- */
-
-
-#include "mp4mux.h"
-
-#include <gpac/download.h>
-#include <gpac/network.h>
-
-#include <gpac/fileimport.h>
-
-#ifndef GPAC_DISABLE_SMGR
-    #include <gpac/scene_manager.h>
-#endif
-
-#ifdef GPAC_DISABLE_ISOM
-    #error "Cannot compile MP4Box if GPAC is not built with ISO File Format support"
-#else
-    #if defined(WIN32) && !defined(_WIN32_WCE)
-    #include <io.h>
-    #include <fcntl.h>
-    #endif
-
-    #include <gpac/media_tools.h>
-
-    /*RTP packetizer flags*/
-    #ifndef GPAC_DISABLE_STREAMING
-        #include <gpac/ietf.h>
-    #endif
-
-    #ifndef GPAC_DISABLE_MCRYPT
-    #include <gpac/ismacryp.h>
-    #endif
-
-    #include <gpac/constants.h>
-    #include <gpac/internal/mpd.h>
-    #include <time.h>
-    #define BUFFSIZE	8192
-#endif
-
-Bool keep_sys_tracks = (Bool)0;
-u32 swf_flags = 0;
-Float swf_flatten_angle = 0;
-
-void scene_coding_log(void *cbk, u32 log_level, u32 log_tool, const char *fmt, va_list vlist)
-{
-	FILE *logs = (FILE *)cbk;
-	if (log_tool != GF_LOG_CODING) return;
-    vfprintf(logs, fmt, vlist);
-	fflush(logs);
-}
-
-/*return value:
-	0: not supported
-	1: ISO media
-	2: input bt file (.bt, .wrl)
-	3: input XML file (.xmt)
-	4: input SVG file (.svg)
-	5: input SWF file (.swf)
-	6: input LASeR file (.lsr or .saf)
-*/
-u32 get_file_type_by_ext(char *inName)
-{
-	u32 type = 0;
-	char *ext = strrchr(inName, '.');
-	if (ext) {
-		char *sep;
-		if (!strcmp(ext, ".gz")) ext = strrchr(ext-1, '.');
-		ext+=1;
-		sep = strchr(ext, '.');
-		if (sep) sep[0] = 0;
-
-		if (!stricmp(ext, "mp4") || !stricmp(ext, "3gp") || !stricmp(ext, "mov") || !stricmp(ext, "3g2") || !stricmp(ext, "3gs")) type = 1;
-		else if (!stricmp(ext, "bt") || !stricmp(ext, "wrl") || !stricmp(ext, "x3dv")) type = 2;
-		else if (!stricmp(ext, "xmt") || !stricmp(ext, "x3d")) type = 3;
-		else if (!stricmp(ext, "lsr") || !stricmp(ext, "saf")) type = 6;
-		else if (!stricmp(ext, "svg")) type = 4;
-		else if (!stricmp(ext, "xsr")) type = 4;
-		else if (!stricmp(ext, "xml")) type = 4;
-		else if (!stricmp(ext, "swf")) type = 5;
-		else if (!stricmp(ext, "jp2")) {
-			if (sep) sep[0] = '.';
-			return 0;
-		}
-		else type = 0;
-
-		if (sep) sep[0] = '.';
-	}
-
-
-	/*try open file in read mode*/
-	if (!type && gf_isom_probe_file(inName)) type = 1;
-	return type;
-}
-
-
-
-static void check_media_profile(GF_ISOFile *file, u32 track)
-{
-	u8 PL;
-	GF_M4ADecSpecInfo dsi;
-	GF_ESD *esd = gf_isom_get_esd(file, track, 1);
-	if (!esd) return;
-
-	switch (esd->decoderConfig->streamType) {
-	case 0x04:
-		PL = gf_isom_get_pl_indication(file, GF_ISOM_PL_VISUAL);
-		if (esd->decoderConfig->objectTypeIndication==GPAC_OTI_VIDEO_MPEG4_PART2) {
-			GF_M4VDecSpecInfo dsi;
-			gf_m4v_get_config(esd->decoderConfig->decoderSpecificInfo->data, esd->decoderConfig->decoderSpecificInfo->dataLength, &dsi);
-			if (dsi.VideoPL > PL) gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, dsi.VideoPL);
-		} else if ((esd->decoderConfig->objectTypeIndication==GPAC_OTI_VIDEO_AVC) || (esd->decoderConfig->objectTypeIndication==GPAC_OTI_VIDEO_SVC)) {
-			gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0x15);
-		} else if (!PL) {
-			gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0xFE);
-		}
-		break;
-	case 0x05:
-		PL = gf_isom_get_pl_indication(file, GF_ISOM_PL_AUDIO);
-		switch (esd->decoderConfig->objectTypeIndication) {
-		case GPAC_OTI_AUDIO_AAC_MPEG2_MP:
-		case GPAC_OTI_AUDIO_AAC_MPEG2_LCP:
-		case GPAC_OTI_AUDIO_AAC_MPEG2_SSRP:
-		case GPAC_OTI_AUDIO_AAC_MPEG4:
-			gf_m4a_get_config(esd->decoderConfig->decoderSpecificInfo->data, esd->decoderConfig->decoderSpecificInfo->dataLength, &dsi);
-			if (dsi.audioPL > PL) gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, dsi.audioPL);
-			break;
-		default:
-			if (!PL) gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, 0xFE);
-		}
-		break;
-	}
-	gf_odf_desc_del((GF_Descriptor *) esd);
-}
-
-void remove_systems_tracks(GF_ISOFile *file)
-{
-	u32 i, count;
-
-	count = gf_isom_get_track_count(file);
-	if (count==1) return;
-
-	/*force PL rewrite*/
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0);
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, 0);
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_OD, 1);	/*the lib always remove IOD when no profiles are specified..*/
-
-	for (i=0; i<gf_isom_get_track_count(file); i++) {
-		switch (gf_isom_get_media_type(file, i+1)) {
-		case GF_ISOM_MEDIA_VISUAL:
-		case GF_ISOM_MEDIA_AUDIO:
-		case GF_ISOM_MEDIA_TEXT:
-		case GF_ISOM_MEDIA_SUBT:
-			gf_isom_remove_track_from_root_od(file, i+1);
-			check_media_profile(file, i+1);
-			break;
-		/*only remove real systems tracks (eg, delaing with scene description & presentation)
-		but keep meta & all unknown tracks*/
-		case GF_ISOM_MEDIA_SCENE:
-			switch (gf_isom_get_media_subtype(file, i+1, 1)) {
-			case GF_ISOM_MEDIA_DIMS:
-				gf_isom_remove_track_from_root_od(file, i+1);
-				continue;
-			default:
-				break;
-			}
-		case GF_ISOM_MEDIA_OD:
-		case GF_ISOM_MEDIA_OCR:
-		case GF_ISOM_MEDIA_MPEGJ:
-			gf_isom_remove_track(file, i+1);
-			i--;
-			break;
-		default:
-			break;
-		}
-	}
-	/*none required*/
-	if (!gf_isom_get_pl_indication(file, GF_ISOM_PL_AUDIO)) gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, 0xFF);
-	if (!gf_isom_get_pl_indication(file, GF_ISOM_PL_VISUAL)) gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0xFF);
-
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_OD, 0xFF);
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_SCENE, 0xFF);
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_GRAPHICS, 0xFF);
-	gf_isom_set_pl_indication(file, GF_ISOM_PL_INLINE, 0);
-}
-
-int assemble_elementary_streams(char *left_stream, char *right_stream, char *output_file, double import_fps) {
-    u32 level = GF_LOG_DEBUG;
-
-    gf_log_set_tool_level(GF_LOG_CONTAINER, level);
-    gf_log_set_tool_level(GF_LOG_SCENE, level);
-    gf_log_set_tool_level(GF_LOG_PARSER, level);
-    gf_log_set_tool_level(GF_LOG_AUTHOR, level);
-    gf_log_set_tool_level(GF_LOG_CODING, level);
-
-    /*
-    1 - cannot open destination file
-    2 - cannot import stream
-    3 - cannot write file
-    */
-
-    int force_new = 1;
-    int do_flat = 0;
-    char *inName = output_file;
-    char *outName = NULL;
-    char *tmpdir = NULL;
-
-    GF_ISOFile *file;
-    GF_Err e;
-    GF_Err error_left_stream;
-    GF_Err error_right_stream;
-    u32 import_flags = 0;
-
-    u32 agg_samples = 0;
-    u32 old_interleave = 0;
-    Double interleaving_time = 0.0;
-
-    u8 open_mode = GF_ISOM_OPEN_EDIT;
-    if (force_new) {
-        open_mode = (do_flat) ? GF_ISOM_OPEN_WRITE : GF_ISOM_WRITE_EDIT;
-    } else {
-        FILE *test = gf_f64_open(inName, "rb");
-        if (!test) {
-            open_mode = (do_flat) ? GF_ISOM_OPEN_WRITE : GF_ISOM_WRITE_EDIT;
-            if (!outName) outName = inName;
-        } else {
-            fclose(test);
-            if (! gf_isom_probe_file(inName) ) {
-                open_mode = (do_flat) ? GF_ISOM_OPEN_WRITE : GF_ISOM_WRITE_EDIT;
-                if (!outName) outName = inName;
-            }
-        }
-    }
-
-    file = gf_isom_open(inName, open_mode, tmpdir);
-    if (!file) {
-#ifdef VERBOSE
-        fprintf(stderr, "Cannot open destination file %s: %s\n", inName, gf_error_to_string(gf_isom_last_error(NULL)) );
-#endif
-        return 1;
-    }
-
-    /*
-    FOR elementary streams
-    */
-    error_left_stream = import_file(file, left_stream, import_flags, import_fps, agg_samples);
-    error_right_stream = import_file(file, right_stream, import_flags, import_fps, agg_samples);
-    
-    if (error_left_stream && error_right_stream) {
-#ifdef VERBOSE
-        fprintf(stderr, "Cannot import video AND audio streams %s: %s\n", inName, gf_error_to_string(gf_isom_last_error(NULL)) );
-#endif
-        return 2;
-    }
-
-    /*
-    FOR transport streams (ts files)
-    e = cat_isomedia_file(file, left_stream, import_flags, import_fps, agg_samples, tmpdir, 1, 1, GF_TRUE);
-    e = cat_isomedia_file(file, right_stream, import_flags, import_fps, agg_samples, tmpdir, 1, 1, GF_TRUE);
-    */
-
-    /*unless explicitly asked, remove all systems tracks*/
-    if (!keep_sys_tracks) {
-        remove_systems_tracks(file);
-    }
-
-
-    e = gf_isom_make_interleave(file, interleaving_time);
-    if (!e && !old_interleave) e = gf_isom_set_storage_mode(file, GF_ISOM_STORE_DRIFT_INTERLEAVED);
-
-
-    if (outName) {
-#ifdef VERBOSE
-        fprintf(stderr, "Saving to %s: ", output_file);
-#endif
-        gf_isom_set_final_name(file, output_file);
-    } else {
-#ifdef VERBOSE
-        fprintf(stderr, "Saving %s: ", inName);
-#endif
-    }
-
-    e = gf_isom_close(file);
-    if (e) {
-#ifdef VERBOSE
-        fprintf(stderr, "Cannot import right stream %s: %s\n", inName, gf_error_to_string(gf_isom_last_error(NULL)) );
-#endif
-        return 3;
-    }
-
-	return 0;
-}
+/*
+ *			GPAC - Multimedia Framework C SDK
+ *
+ *			Authors: Jean Le Feuvre
+ *          Modified by: Gailliez Jonathan
+ *                       Damien Leroy
+ *			Copyright (c) Telecom ParisTech 2000-2012
+ *					All rights reserved
+ *
+ *  This file is part of GPAC / mp4box application
+ *
+ *  GPAC is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  GPAC is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include "mp4mux.h"
+#include "mp4boxes.h"
+#include "kmtrace.h"
+#include "kmlog.h"
+#include "kmmem.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <gpac/download.h>
+#include <gpac/network.h>
+
+#ifndef GPAC_DISABLE_SMGR
+    #include <gpac/scene_manager.h>
+#endif
+
+#ifdef GPAC_DISABLE_ISOM
+    #error "Cannot compile MP4Box if GPAC is not built with ISO File Format support"
+#else
+    #if defined(WIN32) && !defined(_WIN32_WCE)
+    #include <io.h>
+    #include <fcntl.h>
+    #endif
+
+    #include <gpac/media_tools.h>
+
+    /*RTP packetizer flags*/
+    #ifndef GPAC_DISABLE_STREAMING
+        #include <gpac/ietf.h>
+    #endif
+
+    #ifndef GPAC_DISABLE_MCRYPT
+    #include <gpac/ismacryp.h>
+    #endif
+
+    #include <gpac/constants.h>
+    #include <gpac/internal/mpd.h>
+    #include <time.h>
+    #include <sys/stat.h>
+    #define BUFFSIZE	8192
+#endif
+
+Bool keep_sys_tracks = (Bool)0;
+u32 swf_flags = 0;
+Float swf_flatten_angle = 0;
+
+void scene_coding_log(void *cbk, u32 log_level, u32 log_tool, const char *fmt, va_list vlist)
+{
+	FILE *logs = (FILE *)cbk;
+	if (log_tool != GF_LOG_CODING) return;
+    vfprintf(logs, fmt, vlist);
+	fflush(logs);
+}
+
+/*return value:
+	0: not supported
+	1: ISO media
+	2: input bt file (.bt, .wrl)
+	3: input XML file (.xmt)
+	4: input SVG file (.svg)
+	5: input SWF file (.swf)
+	6: input LASeR file (.lsr or .saf)
+*/
+u32 get_file_type_by_ext(char *inName)
+{
+	u32 type = 0;
+	char *ext = strrchr(inName, '.');
+	if (ext) {
+		char *sep;
+		if (!strcmp(ext, ".gz")) ext = strrchr(ext-1, '.');
+		ext+=1;
+		sep = strchr(ext, '.');
+		if (sep) sep[0] = 0;
+
+		if (!stricmp(ext, "mp4") || !stricmp(ext, "3gp") || !stricmp(ext, "mov") || !stricmp(ext, "3g2") || !stricmp(ext, "3gs")) type = 1;
+		else if (!stricmp(ext, "bt") || !stricmp(ext, "wrl") || !stricmp(ext, "x3dv")) type = 2;
+		else if (!stricmp(ext, "xmt") || !stricmp(ext, "x3d")) type = 3;
+		else if (!stricmp(ext, "lsr") || !stricmp(ext, "saf")) type = 6;
+		else if (!stricmp(ext, "svg")) type = 4;
+		else if (!stricmp(ext, "xsr")) type = 4;
+		else if (!stricmp(ext, "xml")) type = 4;
+		else if (!stricmp(ext, "swf")) type = 5;
+		else if (!stricmp(ext, "jp2")) {
+			if (sep) sep[0] = '.';
+			return 0;
+		}
+		else type = 0;
+
+		if (sep) sep[0] = '.';
+	}
+
+
+	/*try open file in read mode*/
+	if (!type && gf_isom_probe_file(inName)) type = 1;
+	return type;
+}
+
+
+
+static void check_media_profile(GF_ISOFile *file, u32 track)
+{
+	u8 PL;
+	GF_M4ADecSpecInfo dsi;
+	GF_ESD *esd = gf_isom_get_esd(file, track, 1);
+	if (!esd) return;
+
+	switch (esd->decoderConfig->streamType) {
+	case 0x04:
+		PL = gf_isom_get_pl_indication(file, GF_ISOM_PL_VISUAL);
+		if (esd->decoderConfig->objectTypeIndication==GPAC_OTI_VIDEO_MPEG4_PART2) {
+			GF_M4VDecSpecInfo dsi;
+			gf_m4v_get_config(esd->decoderConfig->decoderSpecificInfo->data, esd->decoderConfig->decoderSpecificInfo->dataLength, &dsi);
+			if (dsi.VideoPL > PL) gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, dsi.VideoPL);
+		} else if ((esd->decoderConfig->objectTypeIndication==GPAC_OTI_VIDEO_AVC) || (esd->decoderConfig->objectTypeIndication==GPAC_OTI_VIDEO_SVC)) {
+			gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0x15);
+		} else if (!PL) {
+			gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0xFE);
+		}
+		break;
+	case 0x05:
+		PL = gf_isom_get_pl_indication(file, GF_ISOM_PL_AUDIO);
+		switch (esd->decoderConfig->objectTypeIndication) {
+		case GPAC_OTI_AUDIO_AAC_MPEG2_MP:
+		case GPAC_OTI_AUDIO_AAC_MPEG2_LCP:
+		case GPAC_OTI_AUDIO_AAC_MPEG2_SSRP:
+		case GPAC_OTI_AUDIO_AAC_MPEG4:
+			gf_m4a_get_config(esd->decoderConfig->decoderSpecificInfo->data, esd->decoderConfig->decoderSpecificInfo->dataLength, &dsi);
+			if (dsi.audioPL > PL) gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, dsi.audioPL);
+			break;
+		default:
+			if (!PL) gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, 0xFE);
+		}
+		break;
+	}
+	gf_odf_desc_del((GF_Descriptor *) esd);
+}
+
+void remove_systems_tracks(GF_ISOFile *file)
+{
+	u32 i, count;
+
+	count = gf_isom_get_track_count(file);
+	if (count==1) return;
+
+	/*force PL rewrite*/
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0);
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, 0);
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_OD, 1);	/*the lib always remove IOD when no profiles are specified..*/
+
+	for (i=0; i<gf_isom_get_track_count(file); i++) {
+		switch (gf_isom_get_media_type(file, i+1)) {
+		case GF_ISOM_MEDIA_VISUAL:
+		case GF_ISOM_MEDIA_AUDIO:
+		case GF_ISOM_MEDIA_TEXT:
+		case GF_ISOM_MEDIA_SUBT:
+			gf_isom_remove_track_from_root_od(file, i+1);
+			check_media_profile(file, i+1);
+			break;
+		/*only remove real systems tracks (eg, delaing with scene description & presentation)
+		but keep meta & all unknown tracks*/
+		case GF_ISOM_MEDIA_SCENE:
+			switch (gf_isom_get_media_subtype(file, i+1, 1)) {
+			case GF_ISOM_MEDIA_DIMS:
+				gf_isom_remove_track_from_root_od(file, i+1);
+				continue;
+			default:
+				break;
+			}
+		case GF_ISOM_MEDIA_OD:
+		case GF_ISOM_MEDIA_OCR:
+		case GF_ISOM_MEDIA_MPEGJ:
+			gf_isom_remove_track(file, i+1);
+			i--;
+			break;
+		default:
+			break;
+		}
+	}
+	/*none required*/
+	if (!gf_isom_get_pl_indication(file, GF_ISOM_PL_AUDIO)) gf_isom_set_pl_indication(file, GF_ISOM_PL_AUDIO, 0xFF);
+	if (!gf_isom_get_pl_indication(file, GF_ISOM_PL_VISUAL)) gf_isom_set_pl_indication(file, GF_ISOM_PL_VISUAL, 0xFF);
+
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_OD, 0xFF);
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_SCENE, 0xFF);
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_GRAPHICS, 0xFF);
+	gf_isom_set_pl_indication(file, GF_ISOM_PL_INLINE, 0);
+}
+
+/*
+ Delay the presentation of a track with an empty edit
+ */
+static void set_track_delay(GF_ISOFile *file, u32 track, Double delay)
+{
+    u64 duration = gf_isom_get_track_duration(file, track);
+    u32 timescale = gf_isom_get_timescale(file);
+
+    gf_isom_remove_edit_segments(file, track);
+    gf_isom_append_edit_segment(file, track, (u64) (delay * timescale), 0, GF_ISOM_EDIT_EMPTY);
+    gf_isom_append_edit_segment(file, track, duration, 0, GF_ISOM_EDIT_NORMAL);
+}
+
+/*
+ Stretch the edit list of an appended track over its new duration, keeping its initial delay
+ */
+static void extend_track_edits(GF_ISOFile *file, u32 track)
+{
+    u64 edit_time, duration, media_time;
+    u8 mode;
+    Double delay = 0;
+
+    if (!gf_isom_get_edit_segment_count(file, track)) return;
+
+    if (!gf_isom_get_edit_segment(file, track, 1, &edit_time, &duration, &media_time, &mode) && (mode == GF_ISOM_EDIT_EMPTY)) {
+        delay = (Double) duration / gf_isom_get_timescale(file);
+    }
+    /*the track duration is the one of its edits while it has some*/
+    gf_isom_remove_edit_segments(file, track);
+    if (delay > 0) set_track_delay(file, track, delay);
+}
+
+/*
+ Whether the samples of a track can follow the samples of another one: same media and same decoder configuration (avcC, esds)
+ */
+static Bool same_decoder_config(GF_ISOFile *file, u32 track, GF_ISOFile *other, u32 other_track)
+{
+    GF_ESD *esd, *other_esd;
+    Bool same;
+
+    if (gf_isom_get_media_type(file, track) != gf_isom_get_media_type(other, other_track)) return GF_FALSE;
+    if (gf_isom_get_media_subtype(file, track, 1) != gf_isom_get_media_subtype(other, other_track, 1)) return GF_FALSE;
+
+    esd = gf_isom_get_esd(file, track, 1);
+    other_esd = gf_isom_get_esd(other, other_track, 1);
+    if (!esd || !other_esd) {
+        same = (!esd && !other_esd);
+    } else if (!esd->decoderConfig->decoderSpecificInfo || !other_esd->decoderConfig->decoderSpecificInfo) {
+        same = (!esd->decoderConfig->decoderSpecificInfo && !other_esd->decoderConfig->decoderSpecificInfo);
+    } else {
+        same = (esd->decoderConfig->decoderSpecificInfo->dataLength == other_esd->decoderConfig->decoderSpecificInfo->dataLength)
+            && !memcmp(esd->decoderConfig->decoderSpecificInfo->data, other_esd->decoderConfig->decoderSpecificInfo->data, esd->decoderConfig->decoderSpecificInfo->dataLength);
+    }
+    if (esd) gf_odf_desc_del((GF_Descriptor *) esd);
+    if (other_esd) gf_odf_desc_del((GF_Descriptor *) other_esd);
+    return same;
+}
+
+/*
+ Decoding and presentation times of the samples of a track, in 90kHz ticks
+ */
+typedef struct {
+    u64 *dts;
+    u64 *pts;
+    u32 count;
+} mp4mux_timing;
+
+static void free_timing(mp4mux_timing *timing)
+{
+    if (timing->dts) gf_free(timing->dts);
+    if (timing->pts) gf_free(timing->pts);
+    memset(timing, 0, sizeof(mp4mux_timing));
+}
+
+/*
+ Read a timing file, see mp4mux_track. The timing is left empty if the file is unusable
+ */
+static void load_timing(const char *path, mp4mux_timing *timing)
+{
+    char line[128];
+    u32 capacity = 0;
+    s64 offset = 0;
+    FILE *fp;
+
+    memset(timing, 0, sizeof(mp4mux_timing));
+    fp = gf_f64_open(path, "rt");
+    if (!fp) return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        u64 dts, pts;
+        long long n;
+
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "offset %lld", &n) == 1) {
+            offset = n;
+            continue;
+        }
+        if (sscanf(line, "%llu %llu", &dts, &pts) != 2) break;
+        dts += offset;
+        pts += offset;
+
+        /*samples must be in decoding order and presented after being decoded*/
+        if (pts < dts || (timing->count && dts <= timing->dts[timing->count - 1])) break;
+
+        if (timing->count == capacity) {
+            u64 *d, *p;
+            capacity = capacity ? capacity * 2 : 4096;
+            d = (u64 *) gf_realloc(timing->dts, sizeof(u64) * capacity);
+            if (d) timing->dts = d;
+            p = (u64 *) gf_realloc(timing->pts, sizeof(u64) * capacity);
+            if (p) timing->pts = p;
+            if (!d || !p) break;
+        }
+        timing->dts[timing->count] = dts;
+        timing->pts[timing->count] = pts;
+        timing->count++;
+    }
+
+    if (!feof(fp)) {
+        KMLOG(KMLOG_MUX, KMLOG_WARNING, "Invalid timing file %s", path);
+        free_timing(timing);
+    }
+    fclose(fp);
+}
+
+/*
+ Progress of the mux running on the calling thread, GPAC only has a process wide progress callback
+ */
+typedef struct {
+    const mp4mux_options *options;
+    Double base;            /*fraction of the mux done before the current stage*/
+    Double scale;           /*fraction of the mux taken by the current stage*/
+    Double reported;
+    Bool cancelled;
+    kmmem_span memory;      /*stage whose memory is sampled as GPAC reports progress*/
+    GF_MediaImporter *importer;     /*import running on the thread, aborted once the mux is cancelled*/
+} mp4mux_progress;
+
+static __thread mp4mux_progress *current_progress = NULL;
+
+static Bool report_progress(mp4mux_progress *progress, Double done)
+{
+    if (!progress) return GF_FALSE;
+
+    progress->reported = done;
+    kmmem_sample(&progress->memory);
+    if (!progress->options->progress) return GF_FALSE;
+    if (progress->options->progress(progress->options->progress_ctx, done)) progress->cancelled = GF_TRUE;
+    return progress->cancelled;
+}
+
+static void on_gpac_progress(const void *cbck, const char *title, u64 done, u64 total)
+{
+    mp4mux_progress *progress = current_progress;
+    Double fraction;
+
+    if (!progress || !total) return;
+
+    /*GPAC reports every sample, only forward every half percent*/
+    fraction = progress->base + progress->scale * done / total;
+    if (fraction - progress->reported >= 0.005 || done >= total) report_progress(progress, fraction);
+
+    /*the importers check their abort flag at each sample*/
+    if (progress->cancelled && progress->importer) progress->importer->flags |= GF_IMPORT_DO_ABORT;
+}
+
+/*
+ Import the first track of a media file, as import_file does for an elementary stream.
+ The importer is driven here so that a cancellation reported through the GPAC progress can abort it
+ */
+static GF_Err import_stream(GF_ISOFile *dest, const char *path, u32 import_flags, Double fps, u32 agg_samples)
+{
+    mp4mux_progress *progress = current_progress;
+    GF_MediaImporter import;
+    GF_Err e;
+
+    memset(&import, 0, sizeof(GF_MediaImporter));
+    import.dest = dest;
+    import.in_name = (char *) path;
+    import.flags = import_flags;
+    import.video_fps = fps;
+    import.frames_per_sample = agg_samples;
+
+    if (progress) progress->importer = &import;
+    e = gf_media_import(&import);
+    if (progress) progress->importer = NULL;
+    return e;
+}
+
+/*samples copied between two checks of a cancellation*/
+#define CANCEL_POLL_SAMPLES 256
+
+/*
+ Add the samples of a track of src to a track of file, either after offset with their own times
+ or at the times of a timing holding one entry per sample. Stops early once the mux is cancelled
+ */
+static GF_Err copy_samples(GF_ISOFile *file, u32 track, GF_ISOFile *src, u32 src_track, u64 offset, const mp4mux_timing *timing)
+{
+    u32 timescale = gf_isom_get_media_timescale(file, track);
+    u32 src_timescale = gf_isom_get_media_timescale(src, src_track);
+    u32 s, sample_count = gf_isom_get_sample_count(src, src_track);
+    GF_Err e = GF_OK;
+
+    /*tick of the TS clock in the media timescale, the jitter of the timestamps*/
+    u64 jitter = timescale / 90000 + 1;
+    u64 last_dts = 0, last_delta = 0;
+    u32 last_cts_offset = 0;
+
+    for (s = 1; s <= sample_count && !e; s++) {
+        u32 di;
+        GF_ISOSample *sample;
+
+        /*adding samples reports no progress, the cancellation is polled at the last reported fraction*/
+        if (current_progress && !(s % CANCEL_POLL_SAMPLES) && report_progress(current_progress, current_progress->reported)) break;
+
+        sample = gf_isom_get_sample(src, src_track, s, &di);
+        if (!sample) {
+            e = gf_isom_last_error(src);
+            if (!e) e = GF_IO_ERR;
+            break;
+        }
+        if (timing) {
+            u64 cts = (timing->pts[s - 1] - timing->dts[0]) * timescale / 90000;
+            sample->DTS = (timing->dts[s - 1] - timing->dts[0]) * timescale / 90000;
+            /*a time within the jitter of the previous duration or composition offset keeps it,
+              so rounded timestamps do not break the runs of the stts and ctts tables*/
+            if (s > 2 && sample->DTS + jitter >= last_dts + last_delta && sample->DTS <= last_dts + last_delta + jitter) {
+                sample->DTS = last_dts + last_delta;
+            }
+            if (s > 1) last_delta = sample->DTS - last_dts;
+            last_dts = sample->DTS;
+            sample->CTS_Offset = (cts > sample->DTS) ? (u32) (cts - sample->DTS) : 0;
+            if (s > 1 && sample->CTS_Offset + jitter >= last_cts_offset && sample->CTS_Offset <= last_cts_offset + jitter) {
+                sample->CTS_Offset = last_cts_offset;
+            }
+            last_cts_offset = sample->CTS_Offset;
+        } else if (timescale != src_timescale) {
+            sample->DTS = sample->DTS * timescale / src_timescale;
+            sample->CTS_Offset = (u32) ((u64) sample->CTS_Offset * timescale / src_timescale);
+        }
+        sample->DTS += offset;
+        e = gf_isom_add_sample(file, track, 1, sample);
+        gf_isom_sample_del(&sample);
+    }
+    return e;
+}
+
+/*
+ Store the sample sizes of the tracks on 16 or fewer bits (stz2) when they are not all equal and all fit,
+ GPAC already writes a single size for tracks of constant size, and run-length stts, ctts and stsc tables
+ */
+static void compact_sample_sizes(GF_ISOFile *file)
+{
+    u32 t, s;
+
+    for (t = 1; t <= gf_isom_get_track_count(file); t++) {
+        u32 count = gf_isom_get_sample_count(file, t);
+        u32 first = count ? gf_isom_get_sample_size(file, t, 1) : 0;
+        u32 max_size = first;
+        Bool constant = GF_TRUE;
+
+        for (s = 2; s <= count && max_size <= 0xFFFF; s++) {
+            u32 size = gf_isom_get_sample_size(file, t, s);
+            if (size != first) constant = GF_FALSE;
+            if (size > max_size) max_size = size;
+        }
+        if (count && !constant && max_size <= 0xFFFF) gf_isom_use_compact_size(file, t, GF_TRUE);
+    }
+}
+
+/*
+ Import an elementary stream into a new scratch file, loading its timing when it has one
+ */
+static GF_Err import_scratch(const mp4mux_track *track, u32 import_flags, u32 agg_samples, const char *scratch_name, char *tmpdir, GF_ISOFile **scratch, mp4mux_timing *timing)
+{
+    GF_Err e;
+
+    memset(timing, 0, sizeof(mp4mux_timing));
+    *scratch = gf_isom_open((char *) scratch_name, GF_ISOM_WRITE_EDIT, tmpdir);
+    if (!*scratch) return gf_isom_last_error(NULL);
+
+    e = import_stream(*scratch, track->path, import_flags, track->fps, agg_samples);
+    if (!e && track->timing && track->timing[0]) load_timing(track->timing, timing);
+    return e;
+}
+
+/*
+ Clone the tracks of a scratch file into file with their samples,
+ at the times of the timing when it holds one entry per sample
+ */
+static GF_Err merge_scratch(GF_ISOFile *file, const mp4mux_track *track, GF_ISOFile *scratch, const mp4mux_timing *timing)
+{
+    u32 t, new_track;
+    GF_Err e = GF_OK;
+
+    for (t = 1; t <= gf_isom_get_track_count(scratch) && !e; t++) {
+        Bool timed = (timing->count && timing->count == gf_isom_get_sample_count(scratch, t));
+        if (!timed && track->timing && track->timing[0]) KMLOG(KMLOG_MUX, KMLOG_WARNING, "Timing of %s ignored: %d entries for %d samples", track->path, timing->count, gf_isom_get_sample_count(scratch, t));
+        e = gf_isom_clone_track(scratch, t, file, GF_FALSE, &new_track);
+        if (!e) e = copy_samples(file, new_track, scratch, t, 0, timed ? timing : NULL);
+    }
+    return e;
+}
+
+/*
+ Import an elementary stream and set the times of its samples from a timing file,
+ the importers only know a constant frame rate. The stream is imported into a scratch file
+ whose samples are copied with their times into a clone of its track.
+ Samples keep the importer times when the timing does not hold one entry per sample.
+ */
+static GF_Err import_timed_file(GF_ISOFile *file, const mp4mux_track *track, u32 import_flags, u32 agg_samples, const char *output_file, char *tmpdir)
+{
+    char scratchName[GF_MAX_PATH];
+    GF_ISOFile *scratch;
+    mp4mux_timing timing;
+    GF_Err e;
+
+    snprintf(scratchName, sizeof(scratchName), "%s.timing~", output_file);
+    e = import_scratch(track, import_flags, agg_samples, scratchName, tmpdir, &scratch, &timing);
+    if (!e) e = merge_scratch(file, track, scratch, &timing);
+    free_timing(&timing);
+
+    /*nothing was written, the scratch file only lives in memory and in GPAC temporary files*/
+    if (scratch) gf_isom_delete(scratch);
+    return e;
+}
+
+/*
+ Match every track of src with the first unused track of file with the same media type, in matches[track of src - 1].
+ Every track is matched before any sample is added, file is left unchanged when a track has no compatible match.
+ */
+static GF_Err match_tracks(GF_ISOFile *file, GF_ISOFile *src, u32 *matches)
+{
+    u32 i, j, count = gf_isom_get_track_count(src), file_count = gf_isom_get_track_count(file);
+    Bool *used;
+    GF_Err e = GF_OK;
+
+    used = (Bool *) gf_malloc(sizeof(Bool) * (file_count + 1));
+    if (!used) return GF_OUT_OF_MEM;
+    memset(used, 0, sizeof(Bool) * (file_count + 1));
+
+    for (i = 1; i <= count; i++) {
+        matches[i - 1] = 0;
+        for (j = 1; j <= file_count; j++) {
+            if (used[j] || gf_isom_get_media_type(file, j) != gf_isom_get_media_type(src, i)) continue;
+            if (same_decoder_config(file, j, src, i)) {
+                matches[i - 1] = j;
+                used[j] = GF_TRUE;
+            }
+            /*only the first unused track of this media type is a candidate*/
+            break;
+        }
+        if (!matches[i - 1]) {
+            KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot append track %d: no compatible track", i);
+            e = GF_NOT_SUPPORTED;
+        }
+    }
+
+    gf_free(used);
+    return e;
+}
+
+/*
+ Append every track of src after the last sample of its matching track of file
+ */
+static GF_Err append_samples(GF_ISOFile *file, GF_ISOFile *src, const u32 *matches)
+{
+    u32 i, count = gf_isom_get_track_count(src);
+    GF_Err e = GF_OK;
+
+    for (i = 1; i <= count && !e; i++) {
+        u32 track = matches[i - 1];
+        /*the media duration includes the duration of the last sample, the appended samples start right after it*/
+        e = copy_samples(file, track, src, i, gf_isom_get_media_duration(file, track), NULL);
+        if (!e) extend_track_edits(file, track);
+    }
+    return e;
+}
+
+/*the memory of the stage is sampled until the next stage begins*/
+static void set_memory_stage(mp4mux_progress *progress, const mp4mux_options *options, kmmem_stage stage)
+{
+    if (!progress) return;
+    kmmem_end(&progress->memory);
+    kmmem_begin(&progress->memory, options ? options->memory : NULL, stage);
+}
+
+static void set_progress_stage(mp4mux_progress *progress, Double base, Double scale)
+{
+    if (!progress) return;
+    progress->base = base;
+    progress->scale = scale;
+}
+
+static u64 file_size(const char *path)
+{
+    struct stat st;
+    return (path && path[0] && !stat(path, &st)) ? (u64) st.st_size : 0;
+}
+
+/*share of the mux spent writing the file in gf_isom_close, the rest is spent importing*/
+#define WRITE_PROGRESS_SHARE 0.2
+
+/*
+ Import of one track into its own scratch file, on its own thread: the importers of the tracks are independent
+ but a GPAC file cannot be shared between threads. The thread then retimes the samples into a file of their own,
+ written as they are added, whose tracks are merged in the order of the tracks.
+ */
+typedef struct {
+    const mp4mux_track *track;
+    char scratch_name[GF_MAX_PATH];
+    char written_name[GF_MAX_PATH];
+    Bool written;                   /*the retimed track is in the file of written_name*/
+    char *tmpdir;
+    u32 import_flags, agg_samples;
+    GF_ISOFile *scratch;
+    mp4mux_timing timing;
+    GF_Err e;
+    u64 size;                       /*of the elementary stream file*/
+    mp4mux_options options;         /*forwards the GPAC progress of the thread into done*/
+    mp4mux_progress progress;
+    Bool reports;                   /*GPAC reports the progress of the import*/
+    volatile Double done;           /*fraction of the stream imported*/
+    volatile Bool *cancelled;       /*of the mux, aborts the import at its next progress report*/
+    volatile Bool finished;
+    Bool started;
+    pthread_t thread;
+} mp4mux_import;
+
+/*time between two progress reports of the threads importing the tracks*/
+#define IMPORT_POLL_US 10000
+
+static int on_import_progress(void *ctx, Double done)
+{
+    mp4mux_import *import = (mp4mux_import *) ctx;
+
+    import->done = done;
+    return (import->cancelled && *import->cancelled) ? 1 : 0;
+}
+
+/*
+ Retime the samples of the scratch file of an import into its written file, on the thread of the import
+ */
+static GF_Err write_scratch(mp4mux_import *import)
+{
+    mp4mux_progress *progress = current_progress;
+    GF_ISOFile *written = gf_isom_open(import->written_name, GF_ISOM_OPEN_WRITE, import->tmpdir);
+    GF_Err e;
+
+    if (!written) return gf_isom_last_error(NULL);
+    e = merge_scratch(written, import->track, import->scratch, &import->timing);
+    if (e) {
+        gf_isom_delete(written);
+        gf_delete_file(import->written_name);
+        return e;
+    }
+
+    /*the samples are already written, only the moov box is left, it is not part of the progress of the import*/
+    current_progress = NULL;
+    e = gf_isom_close(written);
+    current_progress = progress;
+    if (e) gf_delete_file(import->written_name);
+    else import->written = GF_TRUE;
+    return e;
+}
+
+/*
+ Run on its own thread, or inline when the thread cannot be created:
+ the progress of the calling thread is then restored once the import is done
+ */
+static void *import_thread(void *arg)
+{
+    mp4mux_import *import = (mp4mux_import *) arg;
+    mp4mux_progress *caller_progress = current_progress;
+    kmtrace_span span;
+
+    if (import->reports) current_progress = &import->progress;
+
+    kmtrace_begin(&span, "import_file");
+    import->e = import_scratch(import->track, import->import_flags, import->agg_samples, import->scratch_name, import->tmpdir, &import->scratch, &import->timing);
+    if (!import->e) import->e = write_scratch(import);
+    if (import->scratch) gf_isom_delete(import->scratch);
+    import->scratch = NULL;
+    free_timing(&import->timing);
+    if (span.start) {
+        kmtrace_arg(&span, "file", import->track->path);
+        kmtrace_arg_int(&span, "error", import->e);
+        kmtrace_end(&span);
+    }
+
+    current_progress = caller_progress;
+    import->done = 1;
+    __sync_synchronize();
+    import->finished = GF_TRUE;
+    return NULL;
+}
+
+/*
+ Import every track into a scratch file concurrently, the mux then takes the time of the longest import.
+ The progress of the imports is reported as a share of the total size of the streams, and a cancellation
+ noticed while waiting for them aborts every import at its next progress report
+ */
+static void import_concurrently(mp4mux_import *imports, const mp4mux_track *tracks, u32 track_count, const char *output_file, char *tmpdir,
+                                u32 import_flags, u32 agg_samples, mp4mux_progress *progress, u64 total_size)
+{
+    u32 i;
+    Bool running = GF_TRUE;
+
+    for (i = 0; i < track_count; i++) {
+        mp4mux_import *import = &imports[i];
+        if (!tracks[i].path || !tracks[i].path[0]) continue;
+
+        import->track = &tracks[i];
+        snprintf(import->scratch_name, sizeof(import->scratch_name), "%s.track%u~", output_file, i);
+        snprintf(import->written_name, sizeof(import->written_name), "%s.track%u.mp4~", output_file, i);
+        import->tmpdir = tmpdir;
+        import->import_flags = import_flags;
+        import->agg_samples = agg_samples;
+        import->size = file_size(tracks[i].path);
+        import->options.progress = on_import_progress;
+        import->options.progress_ctx = import;
+        import->progress.options = &import->options;
+        import->progress.scale = 1;
+        import->reports = (progress != NULL);
+        import->cancelled = progress ? &progress->cancelled : NULL;
+
+        import->started = !pthread_create(&import->thread, NULL, import_thread, import);
+        if (!import->started) import_thread(import);
+    }
+
+    while (running) {
+        u64 done = 0;
+
+        running = GF_FALSE;
+        for (i = 0; i < track_count; i++) {
+            if (!imports[i].track) continue;
+            if (!imports[i].finished) running = GF_TRUE;
+            done += (u64) (imports[i].size * imports[i].done);
+        }
+
+        if (progress && total_size && (1 - WRITE_PROGRESS_SHARE) * done / total_size - progress->reported >= 0.005) {
+            report_progress(progress, (1 - WRITE_PROGRESS_SHARE) * done / total_size);
+        }
+        if (running) usleep(IMPORT_POLL_US);
+    }
+
+    for (i = 0; i < track_count; i++) {
+        if (imports[i].started) pthread_join(imports[i].thread, NULL);
+    }
+}
+
+/*
+ Add the track written by an import to dest. The written file of the first track of dest becomes dest, opened in edit mode:
+ GPAC reads its samples from there when dest is written, only the samples of the next tracks are added again.
+ file follows dest when they are the same
+ */
+static GF_Err merge_written(GF_ISOFile **file, GF_ISOFile **dest, mp4mux_import *import, char *tmpdir)
+{
+    GF_ISOFile *written;
+    u32 t, new_track;
+    GF_Err e = GF_OK;
+
+    written = gf_isom_open(import->written_name, gf_isom_get_track_count(*dest) ? GF_ISOM_OPEN_READ : GF_ISOM_OPEN_EDIT, tmpdir);
+    /*the file map keeps the written file open, nothing else refers to its name*/
+    gf_delete_file(import->written_name);
+    import->written = GF_FALSE;
+    if (!written) return gf_isom_last_error(NULL);
+
+    if (!gf_isom_get_track_count(*dest)) {
+        if (*file == *dest) *file = written;
+        gf_isom_delete(*dest);
+        *dest = written;
+        return GF_OK;
+    }
+
+    for (t = 1; t <= gf_isom_get_track_count(written) && !e; t++) {
+        e = gf_isom_clone_track(written, t, *dest, GF_FALSE, &new_track);
+        if (!e) e = copy_samples(*dest, new_track, written, t, 0, NULL);
+    }
+    gf_isom_delete(written);
+    return e;
+}
+
+/*release the scratch and written files the merge did not consume*/
+static void free_imports(mp4mux_import *imports, u32 track_count)
+{
+    u32 i;
+
+    for (i = 0; i < track_count; i++) {
+        if (imports[i].scratch) gf_isom_delete(imports[i].scratch);
+        if (imports[i].written) gf_delete_file(imports[i].written_name);
+        free_timing(&imports[i].timing);
+    }
+    gf_free(imports);
+}
+
+/*
+ Index a written file again, through a copy replacing it. Return the mp4box_add_sidx result
+ */
+static int add_segment_index(const char *output_file, int reserve)
+{
+    char scratchName[GF_MAX_PATH];
+    kmtrace_span span;
+    int rc;
+
+    kmtrace_begin(&span, "add_sidx");
+    snprintf(scratchName, sizeof(scratchName), "%s.sidx~", output_file);
+    rc = mp4box_add_sidx(output_file, scratchName, reserve);
+    if (!rc && rename(scratchName, output_file)) {
+        gf_delete_file(scratchName);
+        rc = -1;
+    }
+    kmtrace_end(&span);
+    if (rc > 0) KMLOG(KMLOG_MUX, KMLOG_WARNING, "%s cannot be indexed", output_file);
+    return rc;
+}
+
+/*chunk duration of the samples appended in place without interleaving time, the default of gf_isom_make_interleave*/
+#define APPEND_INTERLEAVE_TIME 0.5
+
+static void free_append_tables(mp4box_track *samples, u32 count)
+{
+    u32 i;
+
+    for (i = 0; i < count; i++) {
+        free(samples[i].offsets);
+        free(samples[i].sizes);
+        free(samples[i].dts);
+        free(samples[i].cts_offsets);
+        free(samples[i].sync);
+        free(samples[i].chunks);
+    }
+    free(samples);
+}
+
+/*
+ Sample tables of the tracks of src in the media timescales of the tracks of file they extend, see mp4box_append_begin.
+ The chunks hold interleave_time of each track in turn, order receives the track and sample index of each sample in the order they are stored.
+ Return GF_NOT_SUPPORTED for a sample of another description than the first one
+ */
+static GF_Err build_append_tables(GF_ISOFile *file, GF_ISOFile *src, const u32 *matches, Double interleave_time, u32 max_chunk_size,
+                                  mp4box_track *samples, u32 *order)
+{
+    u32 i, s, di, n = 0, total = 0, count = gf_isom_get_track_count(src);
+    u32 *next;
+    u64 offset = 0, data_offset;
+    Double window;
+
+    for (i = 0; i < count; i++) {
+        mp4box_track *track = &samples[i];
+        u32 src_timescale = gf_isom_get_media_timescale(src, i + 1);
+        Bool all_sync = GF_TRUE, no_offset = GF_TRUE;
+
+        track->id = gf_isom_get_track_id(file, matches[i]);
+        track->timescale = gf_isom_get_media_timescale(file, matches[i]);
+        track->sample_count = gf_isom_get_sample_count(src, i + 1);
+        track->offsets = (unsigned long long *) calloc(track->sample_count + 1, sizeof(unsigned long long));
+        track->sizes = (unsigned int *) calloc(track->sample_count + 1, sizeof(unsigned int));
+        track->dts = (unsigned long long *) calloc(track->sample_count + 1, sizeof(unsigned long long));
+        track->cts_offsets = (long long *) calloc(track->sample_count + 1, sizeof(long long));
+        track->sync = (unsigned char *) calloc(track->sample_count + 1, 1);
+        track->chunks = (unsigned int *) calloc(track->sample_count + 1, sizeof(unsigned int));
+        if (!track->offsets || !track->sizes || !track->dts || !track->cts_offsets || !track->sync || !track->chunks || !src_timescale) return GF_OUT_OF_MEM;
+
+        for (s = 0; s < track->sample_count; s++) {
+            GF_ISOSample *sample = gf_isom_get_sample_info(src, i + 1, s + 1, &di, &data_offset);
+            if (!sample) return GF_IO_ERR;
+            track->sizes[s] = sample->dataLength;
+            track->dts[s] = sample->DTS * track->timescale / src_timescale;
+            track->cts_offsets[s] = (long long) ((u64) sample->CTS_Offset * track->timescale / src_timescale);
+            track->sync[s] = sample->IsRAP ? 1 : 0;
+            gf_isom_sample_del(&sample);
+            /*the appended samples use the sample description of the track they extend*/
+            if (di != 1) return GF_NOT_SUPPORTED;
+            if (!track->sync[s]) all_sync = GF_FALSE;
+            if (track->cts_offsets[s]) no_offset = GF_FALSE;
+        }
+        track->duration = gf_isom_get_media_duration(src, i + 1) * track->timescale / src_timescale;
+        if (track->sample_count && track->duration <= track->dts[track->sample_count - 1]) track->duration = track->dts[track->sample_count - 1] + 1;
+        total += track->sample_count;
+
+        if (all_sync) {
+            free(track->sync);
+            track->sync = NULL;
+        }
+        if (no_offset) {
+            free(track->cts_offsets);
+            track->cts_offsets = NULL;
+        }
+    }
+
+    next = (u32 *) gf_malloc(sizeof(u32) * (count + 1));
+    if (!next) return GF_OUT_OF_MEM;
+    memset(next, 0, sizeof(u32) * (count + 1));
+
+    /*each track in turn stores its samples decoded before the end of the window, in chunks of at most max_chunk_size bytes*/
+    for (window = interleave_time; n < total; window += interleave_time) {
+        for (i = 0; i < count; i++) {
+            mp4box_track *track = &samples[i];
+            u64 chunk_size = 0;
+            Bool in_chunk = GF_FALSE;
+
+            for (s = next[i]; s < track->sample_count && (Double) track->dts[s] / track->timescale < window; s++) {
+                if (!in_chunk || (max_chunk_size && chunk_size + track->sizes[s] > max_chunk_size)) {
+                    track->chunks[track->chunk_count++] = s;
+                    chunk_size = 0;
+                    in_chunk = GF_TRUE;
+                }
+                track->offsets[s] = offset;
+                chunk_size += track->sizes[s];
+                offset += track->sizes[s];
+                order[2 * n] = i;
+                order[2 * n + 1] = s;
+                n++;
+            }
+            next[i] = s;
+        }
+    }
+    gf_free(next);
+    return GF_OK;
+}
+
+/*
+ Append the samples of every track of src to the tracks of output_file they match without rewriting it:
+ their data is written in a new media data box after the samples of the file, followed by a new moov box.
+ The file keeps its storage and interleaving, the appended samples are interleaved by interleave_time.
+ Return 0 on success, 1 when the file cannot be appended to in place and is left unchanged, 3 on write error,
+ 4 when cancelled, the file then being left as it was
+ */
+static int append_in_place(GF_ISOFile *file, GF_ISOFile *src, const u32 *matches, const char *output_file,
+                           const mp4mux_options *options, mp4mux_progress *progress, int segment_index)
+{
+    u32 i, di, total = 0, count = gf_isom_get_track_count(src);
+    Double interleave_time = (options && options->interleave_time > 0) ? options->interleave_time : APPEND_INTERLEAVE_TIME;
+    mp4box_track *samples;
+    mp4box_appender appender;
+    u32 *order;
+    GF_Err e;
+    int rc;
+
+    for (i = 1; i <= count; i++) total += gf_isom_get_sample_count(src, i);
+    samples = (mp4box_track *) calloc(count + 1, sizeof(mp4box_track));
+    order = (u32 *) gf_malloc(sizeof(u32) * 2 * (total + 1));
+    if (!samples || !order) {
+        if (samples) free(samples);
+        if (order) gf_free(order);
+        return 3;
+    }
+
+    e = build_append_tables(file, src, matches, interleave_time, options ? options->max_chunk_size : 0, samples, order);
+    if (e) {
+        free_append_tables(samples, count);
+        gf_free(order);
+        return (e == GF_NOT_SUPPORTED) ? 1 : 3;
+    }
+
+    rc = mp4box_append_begin(&appender, output_file, samples, count);
+    if (rc) {
+        free_append_tables(samples, count);
+        gf_free(order);
+        return (rc > 0) ? 1 : 3;
+    }
+
+    set_memory_stage(progress, options, KMMEM_CLOSE);
+    for (i = 0; i < total && !rc; i++) {
+        GF_ISOSample *sample = gf_isom_get_sample(src, order[2 * i] + 1, order[2 * i + 1] + 1, &di);
+        if (!sample || mp4box_append_write(&appender, sample->data, sample->dataLength)) rc = 3;
+        if (sample) gf_isom_sample_del(&sample);
+
+        if (progress && (i + 1 == total || progress->base + progress->scale * (i + 1) / total - progress->reported >= 0.005)) {
+            if (report_progress(progress, progress->base + progress->scale * (i + 1) / total)) rc = 4;
+        }
+    }
+    free_append_tables(samples, count);
+    gf_free(order);
+
+    if (rc) {
+        mp4box_append_abort(&appender);
+        return rc;
+    }
+
+    rc = mp4box_append_end(&appender, segment_index);
+    if (rc < 0) return 3;
+    /*the index outgrew the free space left for it*/
+    if (rc > 0 && add_segment_index(output_file, 1) < 0) return 3;
+    return 0;
+}
+
+/*GPAC storage mode of each mp4mux_storage*/
+static const u8 storage_modes[] = {
+    GF_ISOM_STORE_DRIFT_INTERLEAVED,
+    GF_ISOM_STORE_FLAT,
+    GF_ISOM_STORE_STREAMABLE,
+    GF_ISOM_STORE_INTERLEAVED,
+    GF_ISOM_STORE_TIGHT
+};
+
+/*GPAC messages go to the KMLOG_GPAC component, GF_LOG_QUIET to GF_LOG_DEBUG matching KMLOG_QUIET to KMLOG_DEBUG*/
+static void gpac_log(void *cbk, u32 log_level, u32 log_tool, const char *fmt, va_list vlist)
+{
+    char message[1024];
+    if ((int) log_level > kmlog_levels[KMLOG_GPAC]) return;
+    vsnprintf(message, sizeof(message), fmt, vlist);
+    kmlog_write(KMLOG_GPAC, (kmlog_level) log_level, "%s", message);
+}
+
+/*GPAC only formats the messages of the tools at the level of KMLOG_GPAC or below, errors by default*/
+static void set_gpac_log(void)
+{
+    u32 level = (u32) kmlog_levels[KMLOG_GPAC];
+
+    gf_log_set_callback(NULL, gpac_log);
+    gf_log_set_tool_level(GF_LOG_CONTAINER, level);
+    gf_log_set_tool_level(GF_LOG_SCENE, level);
+    gf_log_set_tool_level(GF_LOG_PARSER, level);
+    gf_log_set_tool_level(GF_LOG_AUTHOR, level);
+    gf_log_set_tool_level(GF_LOG_CODING, level);
+}
+
+/*the moov box is downloaded and parsed before the first frame is shown*/
+static void log_moov_size(const char *output_file, kmtrace_span *mux_span)
+{
+    FILE *written = fopen(output_file, "rb");
+    mp4box moov;
+
+    if (written && !mp4box_find_top(written, MP4BOX_TYPE('m','o','o','v'), &moov)) {
+        KMLOG(KMLOG_MUX, KMLOG_INFO, "%s: moov box of %llu bytes", output_file, moov.size);
+        kmtrace_arg_int(mux_span, "moov_size", (long long) moov.size);
+    }
+    if (written) fclose(written);
+}
+
+static int assemble(const mp4mux_track *tracks, unsigned int track_count, const char *output_file, const mp4mux_options *options, mp4mux_progress *progress) {
+    set_gpac_log();
+
+    int force_new = !(options && options->append);
+    int segment_index = (options && options->segment_index);
+    int do_flat = 0;
+    char *inName = (char *) output_file;
+    char *outName = NULL;
+    char *tmpdir = NULL;
+    char scratchName[GF_MAX_PATH];
+
+    GF_ISOFile *file, *dest;
+    GF_Err e;
+    u32 import_flags = 0;
+    u32 i, track, first_track, imported = 0, streams = 0;
+    mp4mux_import *imports = NULL;
+
+    u32 agg_samples = 0;
+    u32 old_interleave = 0;
+    Double interleaving_time = 0.0;
+    u8 storage_mode = storage_modes[(options && (unsigned int) options->storage_mode <= MP4MUX_STORAGE_TIGHT) ? options->storage_mode : MP4MUX_STORAGE_DEFAULT];
+
+    u64 total_size = 0, imported_size = 0;
+
+    kmtrace_span mux_span, span;
+    kmtrace_begin(&mux_span, "assemble_tracks");
+    kmtrace_arg(&mux_span, "output", output_file);
+
+    u8 open_mode = GF_ISOM_OPEN_EDIT;
+    if (force_new) {
+        open_mode = (do_flat) ? GF_ISOM_OPEN_WRITE : GF_ISOM_WRITE_EDIT;
+    } else {
+        FILE *test = gf_f64_open(inName, "rb");
+        if (!test) {
+            open_mode = (do_flat) ? GF_ISOM_OPEN_WRITE : GF_ISOM_WRITE_EDIT;
+            if (!outName) outName = inName;
+        } else {
+            mp4box index;
+            /*the index of an extended file would no longer match its samples*/
+            if (!mp4box_find_top(test, MP4BOX_TYPE('s','i','d','x'), &index)) segment_index = 1;
+            fclose(test);
+            if (! gf_isom_probe_file(inName) ) {
+                open_mode = (do_flat) ? GF_ISOM_OPEN_WRITE : GF_ISOM_WRITE_EDIT;
+                if (!outName) outName = inName;
+            }
+        }
+    }
+
+    file = gf_isom_open(inName, open_mode, tmpdir);
+    if (!file) {
+        KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot open destination file %s: %s", inName, gf_error_to_string(gf_isom_last_error(NULL)));
+        kmtrace_arg_int(&mux_span, "rc", 1);
+        kmtrace_end(&mux_span);
+        return 1;
+    }
+
+    /*
+    When appending to an existing file, the streams are imported into a scratch file
+    whose samples are then added after the samples of the existing tracks
+    */
+    dest = file;
+    if (open_mode == GF_ISOM_OPEN_EDIT) {
+        snprintf(scratchName, sizeof(scratchName), "%s.import~", output_file);
+        dest = gf_isom_open(scratchName, GF_ISOM_WRITE_EDIT, tmpdir);
+        if (!dest) {
+            gf_isom_delete(file);
+            kmtrace_arg_int(&mux_span, "rc", 1);
+            kmtrace_end(&mux_span);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < track_count; i++) total_size += file_size(tracks[i].path);
+
+    set_memory_stage(progress, options, KMMEM_GPAC_IMPORT);
+
+    /*
+    FOR elementary streams
+    several streams are imported and retimed concurrently into files of their own, then merged in order
+    */
+    for (i = 0; i < track_count; i++) {
+        if (tracks[i].path && tracks[i].path[0]) streams++;
+    }
+    if (streams > 1) {
+        imports = (mp4mux_import *) gf_malloc(sizeof(mp4mux_import) * track_count);
+        if (imports) {
+            memset(imports, 0, sizeof(mp4mux_import) * track_count);
+            import_concurrently(imports, tracks, track_count, output_file, tmpdir, import_flags, agg_samples, progress, total_size);
+        }
+    }
+
+    for (i = 0; i < track_count; i++) {
+        if (!tracks[i].path || !tracks[i].path[0]) continue;
+        /*the remaining streams are neither imported nor merged*/
+        if (progress && progress->cancelled) break;
+
+        if (!imports && total_size) {
+            u64 size = file_size(tracks[i].path);
+            set_progress_stage(progress, (1 - WRITE_PROGRESS_SHARE) * imported_size / total_size, (1 - WRITE_PROGRESS_SHARE) * size / total_size);
+            imported_size += size;
+        }
+
+        first_track = gf_isom_get_track_count(dest) + 1;
+        if (imports) {
+            kmtrace_begin(&span, "merge_track");
+            e = imports[i].e;
+            if (!e) e = merge_written(&file, &dest, &imports[i], tmpdir);
+        } else {
+            kmtrace_begin(&span, "import_file");
+            if (tracks[i].timing && tracks[i].timing[0]) {
+                e = import_timed_file(dest, &tracks[i], import_flags, agg_samples, output_file, tmpdir);
+            } else {
+                e = import_stream(dest, tracks[i].path, import_flags, tracks[i].fps, agg_samples);
+            }
+        }
+        if (span.start) {
+            kmtrace_arg(&span, "file", tracks[i].path);
+            kmtrace_arg_int(&span, "track", first_track);
+            kmtrace_arg_int(&span, "samples", e ? 0 : gf_isom_get_sample_count(dest, first_track));
+            kmtrace_arg_int(&span, "error", e);
+            kmtrace_end(&span);
+        }
+        if (e) {
+            KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot import stream %s: %s", tracks[i].path, gf_error_to_string(e));
+            continue;
+        }
+        imported++;
+
+        /*appended tracks keep the language and delay of the tracks they extend*/
+        for (track = first_track; dest == file && track <= gf_isom_get_track_count(file); track++) {
+            if (tracks[i].language[0]) gf_isom_set_media_language(file, track, (char *) tracks[i].language);
+            if (tracks[i].delay > 0) set_track_delay(file, track, tracks[i].delay);
+        }
+    }
+    if (imports) free_imports(imports, track_count);
+
+    if (progress && progress->cancelled) {
+        if (dest != file) gf_isom_delete(dest);
+        gf_isom_delete(file);
+        kmtrace_arg_int(&mux_span, "rc", 4);
+        kmtrace_end(&mux_span);
+        return 4;
+    }
+
+    if (!imported) {
+        KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot import any stream %s", inName);
+        if (dest != file) gf_isom_delete(dest);
+        gf_isom_delete(file);
+        kmtrace_arg_int(&mux_span, "rc", 2);
+        kmtrace_end(&mux_span);
+        return 2;
+    }
+
+    /*
+    FOR transport streams (ts files)
+    e = cat_isomedia_file(file, left_stream, import_flags, import_fps, agg_samples, tmpdir, 1, 1, GF_TRUE);
+    e = cat_isomedia_file(file, right_stream, import_flags, import_fps, agg_samples, tmpdir, 1, 1, GF_TRUE);
+    */
+
+    if (dest != file) {
+        u32 *matches = (u32 *) gf_malloc(sizeof(u32) * (gf_isom_get_track_count(dest) + 1));
+        int rc = 1;
+
+        kmtrace_begin(&span, "append_samples");
+        e = matches ? match_tracks(file, dest, matches) : GF_OUT_OF_MEM;
+        /*
+        The appended samples are written after the file with a new moov box,
+        GPAC only rewrites the whole file when it cannot be extended in place
+        */
+        if (!e) {
+            set_progress_stage(progress, 1 - WRITE_PROGRESS_SHARE, WRITE_PROGRESS_SHARE);
+            rc = append_in_place(file, dest, matches, output_file, options, progress, segment_index);
+            kmtrace_arg_int(&span, "in_place", rc != 1);
+            if (rc == 1) e = append_samples(file, dest, matches);
+        }
+        kmtrace_arg_int(&span, "error", e);
+        kmtrace_end(&span);
+        if (matches) gf_free(matches);
+        /*nothing was written, the scratch file only lives in memory and in GPAC temporary files*/
+        gf_isom_delete(dest);
+        if (e) {
+            KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot append to %s: %s", inName, gf_error_to_string(e));
+            gf_isom_delete(file);
+            kmtrace_arg_int(&mux_span, "rc", (e == GF_NOT_SUPPORTED) ? 5 : 3);
+            kmtrace_end(&mux_span);
+            return (e == GF_NOT_SUPPORTED) ? 5 : 3;
+        }
+        if (rc != 1) {
+            /*the file was only read, its edits are left unwritten*/
+            gf_isom_delete(file);
+            if (rc == 3) KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot append to %s", inName);
+            if (!rc) log_moov_size(output_file, &mux_span);
+            kmtrace_arg_int(&mux_span, "rc", rc);
+            if (!rc) kmtrace_arg_int(&mux_span, "tracks", imported);
+            kmtrace_end(&mux_span);
+            return rc;
+        }
+    }
+
+    /*unless explicitly asked, remove all systems tracks*/
+    if (!keep_sys_tracks && dest == file) {
+        remove_systems_tracks(file);
+    }
+
+    if (options && options->major_brand) {
+        gf_isom_set_brand_info(file, options->major_brand, 0);
+        gf_isom_modify_alternate_brand(file, GF_ISOM_BRAND_ISOM, 1);
+        gf_isom_modify_alternate_brand(file, GF_ISOM_BRAND_MP42, 1);
+    }
+
+
+    set_memory_stage(progress, options, KMMEM_INTERLEAVE);
+    if (options && options->compact_sizes) {
+        kmtrace_begin(&span, "compact_sample_sizes");
+        compact_sample_sizes(file);
+        kmtrace_end(&span);
+    }
+
+    if (options) {
+        interleaving_time = options->interleave_time;
+        if (options->max_chunk_size) {
+            for (i = 0; i < gf_isom_get_track_count(file); i++) {
+                gf_isom_hint_max_chunk_size(file, i + 1, options->max_chunk_size);
+            }
+        }
+    }
+
+    kmtrace_begin(&span, "make_interleave");
+    kmtrace_arg_int(&span, "storage", storage_mode);
+    if (storage_mode == GF_ISOM_STORE_FLAT || storage_mode == GF_ISOM_STORE_STREAMABLE) {
+        e = gf_isom_set_storage_mode(file, storage_mode);
+    } else {
+        /*sets the interleaving time and the drift interleaved mode, refined below*/
+        e = gf_isom_make_interleave(file, interleaving_time);
+        if (!e && !old_interleave) e = gf_isom_set_storage_mode(file, storage_mode);
+    }
+    kmtrace_end(&span);
+
+    if (report_progress(progress, 1 - WRITE_PROGRESS_SHARE)) {
+        gf_isom_delete(file);
+        kmtrace_arg_int(&mux_span, "rc", 4);
+        kmtrace_end(&mux_span);
+        return 4;
+    }
+    set_progress_stage(progress, 1 - WRITE_PROGRESS_SHARE, WRITE_PROGRESS_SHARE);
+
+
+    if (outName) {
+        KMLOG(KMLOG_MUX, KMLOG_INFO, "Saving to %s", output_file);
+        gf_isom_set_final_name(file, (char *) output_file);
+    } else {
+        KMLOG(KMLOG_MUX, KMLOG_INFO, "Saving %s", inName);
+        /*an edited file is rewritten next to the original, which is only replaced once the new one is complete*/
+        snprintf(scratchName, sizeof(scratchName), "%s.append~", output_file);
+        gf_isom_set_final_name(file, scratchName);
+    }
+
+    /*the whole file is written here*/
+    set_memory_stage(progress, options, KMMEM_CLOSE);
+    kmtrace_begin(&span, "isom_close");
+    e = gf_isom_close(file);
+    kmtrace_end(&span);
+    if (progress) kmmem_end(&progress->memory);
+    if (e) {
+        KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot write file %s: %s", inName, gf_error_to_string(gf_isom_last_error(NULL)));
+        kmtrace_arg_int(&mux_span, "rc", 3);
+        kmtrace_end(&mux_span);
+        return 3;
+    }
+    /*GPAC cannot stop writing, a cancellation reported meanwhile discards the file, an edited one is left as it was*/
+    if (progress && progress->cancelled) {
+        if (!outName) gf_delete_file(scratchName);
+        kmtrace_arg_int(&mux_span, "rc", 4);
+        kmtrace_end(&mux_span);
+        return 4;
+    }
+    if (!outName && rename(scratchName, output_file)) {
+        gf_delete_file(scratchName);
+        kmtrace_arg_int(&mux_span, "rc", 3);
+        kmtrace_end(&mux_span);
+        return 3;
+    }
+
+    /*an appended file keeps room for its index to grow in place*/
+    if (segment_index && add_segment_index(output_file, options && options->append) < 0) {
+        kmtrace_arg_int(&mux_span, "rc", 3);
+        kmtrace_end(&mux_span);
+        return 3;
+    }
+
+    log_moov_size(output_file, &mux_span);
+
+    kmtrace_arg_int(&mux_span, "tracks", imported);
+    kmtrace_end(&mux_span);
+	return 0;
+}
+
+int assemble_tracks(const mp4mux_track *tracks, unsigned int track_count, const char *output_file, const mp4mux_options *options) {
+    mp4mux_progress progress;
+    int rc;
+
+    memset(&progress, 0, sizeof(progress));
+    progress.options = options;
+
+    if (options && (options->progress || options->memory)) {
+        gf_set_progress_callback(NULL, on_gpac_progress);
+        current_progress = &progress;
+    }
+
+    rc = assemble(tracks, track_count, output_file, options, current_progress);
+    current_progress = NULL;
+    kmmem_end(&progress.memory);
+
+    /*an appended file is left as it was*/
+    if (rc == 4 && !(options && options->append)) {
+        gf_delete_file((char *) output_file);
+    } else if (!rc) {
+        report_progress(options ? &progress : NULL, 1);
+    }
+
+    return rc;
+}
+
+/*
+ Add the samples of a track of src to the current fragment, the first one decoded at decode_time
+ */
+static GF_Err add_fragment_samples(GF_ISOFile *file, u32 track_id, GF_ISOFile *src, u32 src_track, u64 decode_time)
+{
+    u32 s, sample_count = gf_isom_get_sample_count(src, src_track);
+    u32 duration = 0;
+    GF_Err e;
+
+    e = gf_isom_set_traf_base_media_decode_time(file, track_id, decode_time);
+
+    for (s = 1; s <= sample_count && !e; s++) {
+        u32 di;
+        GF_ISOSample *sample;
+
+        /*adding samples reports no progress, the cancellation is polled at the last reported fraction*/
+        if (current_progress && !(s % CANCEL_POLL_SAMPLES) && report_progress(current_progress, current_progress->reported)) break;
+
+        sample = gf_isom_get_sample(src, src_track, s, &di);
+        if (!sample) {
+            e = gf_isom_last_error(src);
+            if (!e) e = GF_IO_ERR;
+            break;
+        }
+        /*the last sample lasts as long as the previous one*/
+        if (s < sample_count) duration = (u32) (gf_isom_get_sample_dts(src, src_track, s + 1) - sample->DTS);
+        e = gf_isom_fragment_add_sample(file, track_id, sample, di, duration, 0, 0, GF_FALSE);
+        gf_isom_sample_del(&sample);
+    }
+    return e;
+}
+
+int assemble_segment(const mp4mux_track *tracks, unsigned int track_count, const char *output_file, const mp4mux_segment *segment) {
+    char scratchName[GF_MAX_PATH], headerName[GF_MAX_PATH];
+    char *tmpdir = NULL;
+    GF_ISOFile *scratch, *file;
+    GF_Err e = GF_OK;
+    u32 i, t, new_track, imported = 0;
+    u32 *first_tracks;
+
+    kmtrace_span mux_span, span;
+
+    set_gpac_log();
+    kmtrace_begin(&mux_span, "assemble_segment");
+    kmtrace_arg(&mux_span, "output", output_file);
+
+    /*the streams are imported as usual, then their samples are written as fragments*/
+    snprintf(scratchName, sizeof(scratchName), "%s.import~", output_file);
+    scratch = gf_isom_open(scratchName, GF_ISOM_WRITE_EDIT, tmpdir);
+    first_tracks = (u32 *) gf_malloc(sizeof(u32) * (track_count + 1));
+    if (!scratch || !first_tracks) {
+        if (scratch) gf_isom_delete(scratch);
+        gf_free(first_tracks);
+        kmtrace_arg_int(&mux_span, "rc", 1);
+        kmtrace_end(&mux_span);
+        return 1;
+    }
+
+    for (i = 0; i < track_count; i++) {
+        first_tracks[i] = gf_isom_get_track_count(scratch) + 1;
+        if (!tracks[i].path || !tracks[i].path[0]) continue;
+
+        kmtrace_begin(&span, "import_file");
+        kmtrace_arg(&span, "file", tracks[i].path);
+        if (tracks[i].timing && tracks[i].timing[0]) {
+            e = import_timed_file(scratch, &tracks[i], 0, 0, output_file, tmpdir);
+        } else {
+            e = import_stream(scratch, tracks[i].path, 0, tracks[i].fps, 0);
+        }
+        kmtrace_end(&span);
+        if (!e) imported++;
+    }
+    first_tracks[track_count] = gf_isom_get_track_count(scratch) + 1;
+
+    if (!imported) {
+        gf_isom_delete(scratch);
+        gf_free(first_tracks);
+        kmtrace_arg_int(&mux_span, "rc", 2);
+        kmtrace_end(&mux_span);
+        return 2;
+    }
+
+    /*
+    Every segment of a presentation builds the same header from its own tracks,
+    only the first one keeps it as the init segment
+    */
+    if (segment->init_file) snprintf(headerName, sizeof(headerName), "%s", segment->init_file);
+    else snprintf(headerName, sizeof(headerName), "%s.init~", output_file);
+
+    file = gf_isom_open(headerName, GF_ISOM_OPEN_WRITE, tmpdir);
+    if (!file) {
+        gf_isom_delete(scratch);
+        gf_free(first_tracks);
+        kmtrace_arg_int(&mux_span, "rc", 1);
+        kmtrace_end(&mux_span);
+        return 1;
+    }
+
+    gf_isom_set_brand_info(file, GF_4CC('c','m','f','c'), 0);
+    gf_isom_modify_alternate_brand(file, GF_4CC('i','s','o','6'), 1);
+    gf_isom_modify_alternate_brand(file, GF_ISOM_BRAND_ISOM, 0);
+
+    for (t = 1; t <= gf_isom_get_track_count(scratch) && !e; t++) {
+        e = gf_isom_clone_track(scratch, t, file, GF_FALSE, &new_track);
+        if (e) break;
+        /*the times of the fragments replace the edit lists*/
+        gf_isom_remove_edit_segments(file, new_track);
+        for (i = 0; i < track_count; i++) {
+            if (t >= first_tracks[i] && t < first_tracks[i + 1] && tracks[i].language[0]) gf_isom_set_media_language(file, new_track, (char *) tracks[i].language);
+        }
+        e = gf_isom_setup_track_fragment(file, gf_isom_get_track_id(file, new_track), 1, 0, 0, 0, 0, 0);
+    }
+    if (!e) e = gf_isom_finalize_for_fragment(file, 1);
+
+    /*one fragment per segment, numbered after the segment*/
+    kmtrace_begin(&span, "write_fragment");
+    if (!e) e = gf_isom_start_segment(file, (char *) output_file, GF_FALSE);
+    if (!e) e = gf_isom_set_next_moof_number(file, segment->sequence_number);
+    if (!e) e = gf_isom_start_fragment(file, GF_TRUE);
+
+    for (i = 0; i < track_count && !e; i++) {
+        for (t = first_tracks[i]; t < first_tracks[i + 1] && !e; t++) {
+            u32 timescale = gf_isom_get_media_timescale(scratch, t);
+            u32 di;
+            s64 decode_time = (s64) ((segment->base_time + (tracks[i].delay > 0 ? tracks[i].delay : 0)) * timescale + 0.5);
+            GF_ISOSample *first = gf_isom_get_sample_info(scratch, t, 1, &di, NULL);
+
+            /*the delay is the presentation time of the first sample, decoded its composition offset earlier*/
+            if (first) {
+                decode_time -= first->CTS_Offset;
+                gf_isom_sample_del(&first);
+            }
+            e = add_fragment_samples(file, gf_isom_get_track_id(file, t), scratch, t, decode_time > 0 ? (u64) decode_time : 0);
+        }
+    }
+    if (!e) e = gf_isom_close_segment(file, -1, 0, 0, 0, 0, GF_FALSE, segment->last, 0, NULL, NULL);
+    kmtrace_end(&span);
+
+    gf_isom_delete(scratch);
+    gf_free(first_tracks);
+
+    if (e) {
+        KMLOG(KMLOG_MUX, KMLOG_ERROR, "Cannot write segment %s: %s", output_file, gf_error_to_string(e));
+        gf_isom_delete(file);
+        gf_delete_file((char *) output_file);
+        if (!segment->init_file) gf_delete_file(headerName);
+        kmtrace_arg_int(&mux_span, "rc", 3);
+        kmtrace_end(&mux_span);
+        return 3;
+    }
+
+    e = gf_isom_close(file);
+    if (!segment->init_file) gf_delete_file(headerName);
+    kmtrace_arg_int(&mux_span, "rc", e ? 3 : 0);
+    kmtrace_end(&mux_span);
+    return e ? 3 : 0;
+}
+
+int assemble_elementary_streams(char *left_stream, char *right_stream, char *output_file, double import_fps) {
+    mp4mux_track tracks[2];
+
+    memset(tracks, 0, sizeof(tracks));
+    tracks[0].path = left_stream;
+    tracks[0].fps = import_fps;
+    tracks[1].path = right_stream;
+    tracks[1].fps = import_fps;
+
+    return assemble_tracks(tracks, 2, output_file, NULL);
+}
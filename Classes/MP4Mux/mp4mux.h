@@ -1,40 +1,132 @@
-/*
- *			GPAC - Multimedia Framework C SDK
- *
- *			Authors: Jean Le Feuvre
- *          Modified by: Gailliez Jonathan
- *                       Damien Leroy
- *			Copyright (c) Telecom ParisTech 2000-2012
- *					All rights reserved
- *
- *  This file is part of GPAC / mp4box application
- *
- *  GPAC is free software; you can redistribute it and/or modify
- *  it under the terms of the GNU Lesser General Public License as published by
- *  the Free Software Foundation; either version 2, or (at your option)
- *  any later version.
- *
- *  GPAC is distributed in the hope that it will be useful,
- *  but WITHOUT ANY WARRANTY; without even the implied warranty of
- *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- *  GNU Lesser General Public License for more details.
- *
- *  You should have received a copy of the GNU Lesser General Public
- *  License along with this library; see the file COPYING.  If not, write to
- *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
- *
- */
-
-
-#ifndef MP4BOX_H_INCLUDED
-#define MP4BOX_H_INCLUDED
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-    int assemble_elementary_streams(char *left_stream, char *right_stream, char *output_file, double import_fps);
-#ifdef __cplusplus
-}
-#endif
-
-#endif // MP4MUX_H_INCLUDED
+/*
+ *			GPAC - Multimedia Framework C SDK
+ *
+ *			Authors: Jean Le Feuvre
+ *          Modified by: Gailliez Jonathan
+ *                       Damien Leroy
+ *			Copyright (c) Telecom ParisTech 2000-2012
+ *					All rights reserved
+ *
+ *  This file is part of GPAC / mp4box application
+ *
+ *  GPAC is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  GPAC is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef MP4BOX_H_INCLUDED
+#define MP4BOX_H_INCLUDED
+
+#include "kmmem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    /*
+     One elementary stream to import as a track of the output file
+     */
+    typedef struct
+    {
+        const char *path;           /* elementary stream file, tracks with an empty path are skipped */
+        char language[4];           /* ISO 639-2 language code, empty if unknown */
+        double fps;                 /* frame rate of a video stream, 0 to let the importer detect it */
+        double delay;               /* time in seconds before the first sample of the track is presented */
+        const char *timing;         /* optional file of the times of the samples, NULL to use the constant frame rate of the importer.
+                                       One "<dts> <pts>" line per sample in 90kHz ticks, "offset <ticks>" lines shift the next ones.
+                                       It is ignored unless it holds as many entries as the imported track has samples */
+    } mp4mux_track;
+
+    /*
+     Layout of the samples and of the metadata in the output file
+     */
+    typedef enum
+    {
+        MP4MUX_STORAGE_DEFAULT = 0,     /* moov first, chunks of the tracks interleaved by duration, allowing some drift */
+        MP4MUX_STORAGE_FLAT,            /* each track in one run of chunks, moov last: smallest seeks for archival, not progressive */
+        MP4MUX_STORAGE_STREAMABLE,      /* each track in one run of chunks, moov first */
+        MP4MUX_STORAGE_INTERLEAVED,     /* moov first, chunks of the tracks interleaved by duration */
+        MP4MUX_STORAGE_TIGHT            /* moov first, samples interleaved one by one by decoding time */
+    } mp4mux_storage;
+    
+    /*
+     Optional behaviour of assemble_tracks
+     */
+    typedef struct
+    {
+        /* called with the fraction of the mux done (0 to 1), a non-zero return cancels it.
+           The imports stop at their next sample, GPAC cannot stop writing the file but the written file is discarded */
+        int (*progress)(void *ctx, double done);
+        void *progress_ctx;
+        /* major brand of the file as a four character code ('M4A ' for an audio-only file), 0 for the GPAC default */
+        unsigned int major_brand;
+        /* append the samples of the streams after the last sample of the tracks of an existing output file,
+           matched in order by media type, instead of overwriting it. The language and delay of the tracks are ignored.
+           The appended samples are written after the existing ones with a new moov box, the old one is left as free space,
+           so an append writes the new samples rather than the whole file. The file keeps its storage layout and major brand,
+           the new samples are interleaved by interleave_time. A fragmented file, or a track with several sample descriptions,
+           is rewritten whole */
+        int append;
+        /* layout of the output file */
+        mp4mux_storage storage_mode;
+        /* duration in seconds of the chunks of the interleaved layouts, 0 for the GPAC default */
+        double interleave_time;
+        /* size in bytes above which a chunk is split, 0 for no limit */
+        unsigned int max_chunk_size;
+        /* write a segment index (sidx) before the media data, mapping the ranges between video sync samples to byte ranges,
+           so a player can seek with one range request. Always rewritten when appending to a file holding one */
+        int segment_index;
+        /* store the sample sizes on 16 or fewer bits (stz2) when they all fit, for a smaller moov.
+           Some players and tools only read stsz, it is off unless set */
+        int compact_sizes;
+        /* when set, the heap growth of the import, interleave and close stages is recorded there, see kmmem.h */
+        kmmem_stats *memory;
+    } mp4mux_options;
+
+    /*
+     Mux the streams into a MP4 file. Several streams are imported and retimed concurrently, each on its own thread into its own scratch file,
+     the file of the first stream then becomes the output file and the tracks of the others are added to it in the order of the streams.
+     return value:
+     0 - success
+     1 - cannot open destination file
+     2 - cannot import any stream
+     3 - cannot write file
+     4 - cancelled, the destination file is removed unless appending
+     5 - cannot append, a stream does not match a track of the destination file, which is left unchanged
+     */
+    int assemble_tracks(const mp4mux_track *tracks, unsigned int track_count, const char *output_file, const mp4mux_options *options);
+
+    /*
+     One CMAF media segment of a presentation cut on video keyframes
+     */
+    typedef struct
+    {
+        const char *init_file;          /* when set, the init segment (ftyp and moov) is written there, it only depends on the stream formats */
+        double base_time;               /* time in seconds of the start of the segment in the presentation, the track delays are added to it */
+        unsigned int sequence_number;   /* of the segment in the presentation, from 1 */
+        int last;                       /* non-zero for the last segment of the presentation */
+    } mp4mux_segment;
+
+    /*
+     Write the streams as one media segment (styp, moof, mdat). Segments of a presentation can be written concurrently.
+     The delay of each track is the presentation time of its first sample relative to base_time.
+     return value: as assemble_tracks, segments cannot be cancelled
+     */
+    int assemble_segment(const mp4mux_track *tracks, unsigned int track_count, const char *output_file, const mp4mux_segment *segment);
+    int assemble_elementary_streams(char *left_stream, char *right_stream, char *output_file, double import_fps);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MP4MUX_H_INCLUDED
@@ -30,4 +30,5 @@
 #import "KMMediaAsset.h"
 #import "KMMediaFormat.h"
 #import "KMMediaAssetExportSession.h"
+#import "KMMediaConversionCache.h"
 #endif
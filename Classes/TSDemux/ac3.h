@@ -113,6 +113,18 @@ namespace ac3
             }
         }
         u_int64_t get_frame_num(void) const { return frame_num; }
+        u_int16_t get_st(void) const { return st; }
+        u_int32_t get_ctx(void) const { return ctx; }
+        u_int16_t get_skip(void) const { return skip; }
+
+        // continue counting from a saved state, see demuxer::resume
+        void restore(u_int16_t s,u_int32_t c,u_int16_t k,u_int64_t n)
+        {
+            st=s;
+            ctx=c;
+            skip=k;
+            frame_num=n;
+        }
 
         void reset(void)
         {
@@ -47,6 +47,14 @@ namespace h264
         }
 
         u_int64_t get_frame_num(void) const { return frame_num; }
+        u_int32_t get_ctx(void) const { return ctx; }
+
+        // continue counting from a saved state, see demuxer::resume
+        void restore(u_int32_t c,u_int64_t n)
+        {
+            ctx=c;
+            frame_num=n;
+        }
 
         void reset(void)
         {
@@ -0,0 +1,152 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#ifndef __PES_H
+#define __PES_H
+
+#include "common.h"
+
+namespace pes
+{
+    // a complete PES payload, in one contiguous block owned by a pool
+    class buffer
+    {
+    public:
+        char* data;
+        u_int32_t len;                          // bytes used
+        u_int32_t size;                         // bytes allocated, a power of two
+        u_int64_t pts;                          // 90kHz, after unwrapping and rebasing, 0 if the PES has none
+        u_int64_t dts;                          // equals pts when the PES has no DTS
+        u_int8_t stream_id;
+        
+        int size_class;
+        buffer* next;                           // in the free list of its size class
+        
+        buffer(void):data(0),len(0),size(0),pts(0),dts(0),stream_id(0),size_class(0),next(0) {}
+    };
+    
+    // buffers sorted by power of two size classes, recycled through a free list per class: once every class in use
+    // has been allocated, reassembling a PES costs no malloc/free, only the copies of its payload
+    class pool
+    {
+    public:
+        enum { min_shift=12, class_count=20 };  // 4KB to 2GB
+    protected:
+        buffer* free_list[class_count];
+        std::vector<buffer*> buffers;           // every buffer allocated, released with the pool
+    public:
+        u_int64_t allocated;                    // bytes allocated
+        u_int64_t acquired;                     // buffers handed out, allocated or recycled
+        u_int64_t dropped;                      // PES dropped because their buffer could not be allocated or grown
+        
+        pool(void):allocated(0),acquired(0),dropped(0) { memset(free_list,0,sizeof(free_list)); }
+        
+        ~pool(void)
+        {
+            for(size_t i=0;i<buffers.size();i++)
+            {
+                free(buffers[i]->data);
+                delete buffers[i];
+            }
+        }
+        
+        // a buffer of at least len bytes, 0 if it cannot be allocated
+        buffer* get(u_int32_t len)
+        {
+            int c=0;
+            while(c<class_count-1 && (1U<<(c+min_shift))<len)
+                c++;
+            
+            buffer* b=free_list[c];
+            
+            if(b)
+                free_list[c]=b->next;
+            else
+            {
+                char* data=(char*)malloc(1U<<(c+min_shift));
+                if(!data)
+                    return 0;
+                
+                b=new buffer;
+                b->data=data;
+                b->size=1U<<(c+min_shift);
+                b->size_class=c;
+                buffers.push_back(b);
+                allocated+=b->size;
+            }
+            
+            b->len=0;
+            b->pts=b->dts=0;
+            b->stream_id=0;
+            b->next=0;
+            acquired++;
+            
+            return b;
+        }
+        
+        void put(buffer* b)
+        {
+            b->next=free_list[b->size_class];
+            free_list[b->size_class]=b;
+        }
+        
+        // append to a buffer, moving it to the next size class when it is full. Return the buffer holding the data,
+        // 0 if it cannot grow: the PES is counted as dropped and b is returned to the pool
+        buffer* append(buffer* b,const char* p,u_int32_t l)
+        {
+            if(b->len+l>b->size)
+            {
+                buffer* n=b->size_class<class_count-1 ? get(b->len+l) : 0;
+                
+                if(!n || n->size<b->len+l)
+                {
+                    if(n)
+                        put(n);
+                    put(b);
+                    dropped++;
+                    return 0;
+                }
+                
+                memcpy(n->data,b->data,b->len);
+                n->len=b->len;
+                n->pts=b->pts;
+                n->dts=b->dts;
+                n->stream_id=b->stream_id;
+                put(b);
+                b=n;
+            }
+            
+            memcpy(b->data+b->len,p,l);
+            b->len+=l;
+            
+            return b;
+        }
+    };
+}
+
+#endif
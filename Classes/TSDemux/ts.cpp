@@ -24,7 +24,11 @@
 
 
 #include "ts.h"
+#include "kmtrace.h"
+#include "kmlog.h"
 #include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 // TODO: join TS
 
@@ -102,6 +106,9 @@ bool ts::file::open(int mode,const char* fmt,...)
         case out:
             flags=O_CREAT|O_TRUNC|O_LARGEFILE|O_BINARY|O_WRONLY;
             break;
+        case append:
+            flags=O_CREAT|O_LARGEFILE|O_BINARY|O_WRONLY;
+            break;
     }
     
     fd=::open(name,flags,0644);
@@ -112,9 +119,7 @@ bool ts::file::open(int mode,const char* fmt,...)
         len=offset=0;
         return true;
     }
-#ifdef VERBOSE
-    fprintf(stderr,"can`t open file %s %s\n",name,strerror(errno));
-#endif
+    KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"can`t open file %s %s",name,strerror(errno));
     return false;
 }
 
@@ -135,6 +140,8 @@ int ts::file::flush(void)
 {
     int l=0;
     
+    unsigned long long start=kmtrace_enabled?kmtrace_now():0;
+    
     while(l<len)
     {
         int n=::write(fd,buf+l,len-l);
@@ -143,6 +150,10 @@ int ts::file::flush(void)
         l+=n;
     }
     
+    if(start)
+        write_time+=kmtrace_now()-start;
+    
+    written+=l;
     len=0;
     
     return l;
@@ -202,64 +213,112 @@ int ts::file::read(char* p,int l)
 }
 
 
-bool ts::demuxer::validate_type(u_int8_t type)
+int ts::file::peek(char* p,int l)
+{
+    int n=len-offset;
+    
+    if(n<=0)
+    {
+        int m=::read(fd,buf,max_buf_len);
+        if(m==-1 || !m)
+            return 0;
+        len=m;
+        offset=0;
+        n=m;
+    }
+    
+    if(n>l)
+        n=l;
+    
+    memcpy(p,buf+offset,n);
+    
+    return n;
+}
+
+bool ts::file::seek(u_int64_t pos)
 {
-    if(av_only)
-        return strchr("\x01\x02\x80\x1b\xea\x81\x06\x83\x03\x04\x82\x86\x8a",type)?true:false;
+    if(lseek(fd,(off_t)pos,SEEK_SET)==(off_t)-1)
+        return false;
+    
+    len=0;
+    offset=0;
     
     return true;
 }
 
-int ts::demuxer::get_stream_type(u_int8_t type)
+bool ts::file::truncate(u_int64_t size)
 {
-    switch(type)
-    {
-        case 0x01:
-        case 0x02:
-            return stream_type::mpeg2_video;
-        case 0x80:
-            return hdmv?stream_type::lpcm_audio:stream_type::mpeg2_video;
-        case 0x1b:
-            return stream_type::h264_video;
-        case 0xea:
-            return stream_type::vc1_video;
-        case 0x81:
-        case 0x06:
-        case 0x83:
-            return stream_type::ac3_audio;
-        case 0x03:
-        case 0x04:
-            return stream_type::mpeg2_audio;
-        case 0x82:
-        case 0x86:
-        case 0x8a:
-            return stream_type::dts_audio;
-    }
-    return stream_type::data;
+    flush();
+    
+    struct stat st;
+    if(fstat(fd,&st) || (u_int64_t)st.st_size<size || ftruncate(fd,(off_t)size) || lseek(fd,(off_t)size,SEEK_SET)==(off_t)-1)
+        return false;
+    
+    written=size;
+    
+    return true;
 }
 
-bool ts::demuxer::is_video_stream_type(u_int8_t type)
+
+namespace ts
 {
-    switch(type)
+    // properties of a PMT stream_type, one byte per type
+    namespace stream_props
     {
-        case 0x01:
-        case 0x02:
-        case 0x1b:
-        case 0xea:
-            return true;
-        case 0x80:
-            return hdmv?false : true;
-        case 0x81:
-        case 0x06:
-        case 0x83:
-        case 0x03:
-        case 0x04:
-        case 0x82:
-        case 0x86:
-        case 0x8a:
-        default:
-            return false;
+        enum
+        {
+            kind_mask           = 0x0f,             // stream_type:: value
+            av                  = 0x10,             // audio or video, kept with av_only
+            video               = 0x20,
+            hdmv_lpcm           = 0x40              // LPCM audio instead of MPEG2 video in M2TS
+        };
+        
+        constexpr u_int8_t of(int type)
+        {
+            return
+                type==0x01 || type==0x02 ? stream_type::mpeg2_video|av|video :
+                type==0x80 ? stream_type::mpeg2_video|av|video|hdmv_lpcm :
+                type==0x1b ? stream_type::h264_video|av|video :
+                type==0xea ? stream_type::vc1_video|av|video :
+                type==0x81 || type==0x06 || type==0x83 ? stream_type::ac3_audio|av :
+                type==0x03 || type==0x04 ? stream_type::mpeg2_audio|av :
+                type==0x82 || type==0x86 || type==0x8a ? stream_type::dts_audio|av :
+                type==0x0f || type==0x11 ? stream_type::data|av :      // AAC, its extension is the data one
+                stream_type::data;
+        }
     }
+    
+#define STREAM_PROPS4(t)    stream_props::of(t),stream_props::of(t+1),stream_props::of(t+2),stream_props::of(t+3)
+#define STREAM_PROPS16(t)   STREAM_PROPS4(t),STREAM_PROPS4(t+4),STREAM_PROPS4(t+8),STREAM_PROPS4(t+12)
+#define STREAM_PROPS64(t)   STREAM_PROPS16(t),STREAM_PROPS16(t+16),STREAM_PROPS16(t+32),STREAM_PROPS16(t+48)
+    
+    static constexpr u_int8_t stream_type_props[256]={ STREAM_PROPS64(0),STREAM_PROPS64(64),STREAM_PROPS64(128),STREAM_PROPS64(192) };
+    
+#undef STREAM_PROPS64
+#undef STREAM_PROPS16
+#undef STREAM_PROPS4
+}
+
+bool ts::demuxer::validate_type(u_int8_t type)
+{
+    return !av_only || (stream_type_props[type]&stream_props::av);
+}
+
+int ts::demuxer::get_stream_type(u_int8_t type)
+{
+    u_int8_t props=stream_type_props[type];
+    
+    if(hdmv && (props&stream_props::hdmv_lpcm))
+        return stream_type::lpcm_audio;
+    
+    return props&stream_props::kind_mask;
+}
+
+bool ts::demuxer::is_video_stream_type(u_int8_t type)
+{
+    u_int8_t props=stream_type_props[type];
+    
+    return (props&stream_props::video) && !(hdmv && (props&stream_props::hdmv_lpcm));
 }
 
 const char* ts::demuxer::get_stream_ext(u_int8_t type_id)
@@ -276,7 +335,7 @@ u_int64_t ts::demuxer::decode_pts(const char* ptr)
 {
     const unsigned char* p=(const unsigned char*)ptr;
     
-    u_int64_t pts=((p[0]&0xe)<<29);
+    u_int64_t pts=((u_int64_t)(p[0]&0xe)<<29);
     pts|=((p[1]&0xff)<<22);
     pts|=((p[2]&0xfe)<<14);
     pts|=((p[3]&0xff)<<7);
@@ -285,19 +344,102 @@ u_int64_t ts::demuxer::decode_pts(const char* ptr)
     return pts;
 }
 
+// extend a 33-bit timestamp to the 64-bit timeline, picking the value closest to ref
+u_int64_t ts::demuxer::unwrap_pts(u_int64_t pts,u_int64_t ref)
+{
+    const u_int64_t wrap=1ULL<<33;
+    
+    u_int64_t n=(ref&~(wrap-1))|pts;
+    
+    if(n+wrap/2<ref)
+        n+=wrap;
+    else if(n>ref+wrap/2 && n>=wrap)
+        n-=wrap;
+    
+    return n;
+}
+
+// the next timestamps come from a new input file, whose clock may be unrelated to the previous one
+void ts::demuxer::begin_input(void)
+{
+    timeline_end=0;
+    
+    for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+    {
+        stream& s=i->second;
+        
+        if(s.type!=0xff && s.last_pts && s.last_pts+s.frame_length>timeline_end)
+            timeline_end=s.last_pts+s.frame_length;
+        
+        s.raw_dts=0;
+    }
+    
+    input_offset_pending=true;
+}
+
+// move a timestamp of the current input file onto the output timeline
+u_int64_t ts::demuxer::rebase_pts(u_int64_t pts)
+{
+    if(input_offset_pending)
+    {
+        input_offset_pending=false;
+        
+        // a clock continuing the previous input file within a second is kept as is
+        u_int64_t n=pts+input_offset;
+        if(timeline_end && (n+90000<timeline_end || n>timeline_end+90000))
+            input_offset=timeline_end-pts;
+    }
+    
+    return pts+input_offset;
+}
+
+void ts::demuxer::write_timing(stream& s,u_int64_t dts,u_int64_t pts)
+{
+    char line[48];
+    int n=sprintf(line,"%llu %llu\n",dts,pts);
+    s.timing.write(line,n);
+}
+
 double ts::demuxer::compute_fps_from_frame_length(u_int32_t frame_length)
 {
     return 90000./(double)frame_length;
 }
 
-int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
+void ts::demuxer::open_es_file(u_int16_t pid, stream& s)
 {
-    u_int32_t timecode=0;
-    if(hdmv)
+    std::string name=prefix;
+    
+    char id[32];
+    
+    if(all_programs)
+        sprintf(id,"%u.%u.",s.channel,pid);
+    else
+        sprintf(id,"%u.",pid);
+    
+    name+=id;
+    name+=get_stream_ext(get_stream_type(s.type));
+    
+    if(dst.length())
     {
-        timecode=to_int32(ptr)&0x3fffffff;
-        ptr+=4;
+        s.file.open(file::out,"%s%c%s",dst.c_str(),os_slash,name.c_str());
+        KMLOG(KMLOG_DEMUX,KMLOG_DEBUG,"pid %u to %s%c%s",pid,dst.c_str(),os_slash,name.c_str());
     }
+    else
+        s.file.open(file::out,"%s",name.c_str());
+    
+    if(video_prologue.length() && s.file.is_opened() && is_video_stream_type(s.type))
+        s.file.write(video_prologue.c_str(),video_prologue.length());
+    
+    if(timing && s.file.is_opened() && is_video_stream_type(s.type))
+        s.timing.open(file::out,"%s.timing",s.file.filename.c_str());
+}
+
+template<int packet_len,int features>
+int ts::demuxer::demux_packet(const char* ptr, double* video_fps)
+{
+    // M2TS timecode, see trace_packet
+    if(packet_len==192)
+        ptr+=4;
     
     const char* end_ptr=ptr+188;
     
@@ -305,13 +447,16 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
         return -1;
     
     u_int16_t pid=to_int(ptr+1);
+    
+    if(!(pid_mask[(pid&0x1fff)>>5]&(1<<(pid&31))))
+        return 0;
+    
     u_int8_t flags=to_byte(ptr+3);
     
     bool transport_error=pid&0x8000;
     bool payload_unit_start_indicator=pid&0x4000;
     bool adaptation_field_exist=flags&0x20;
     bool payload_data_exist=flags&0x10;
-    u_int8_t continuity_counter=flags&0x0f;
     pid&=0x1fff;
     
     if(transport_error)
@@ -329,19 +474,6 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
         if(ptr>=end_ptr)
             return -3;
     }
-#ifdef VERBOSE
-    if(dump==1)
-        printf("%.4x: [%c%c%c%c] %u.%i\n",
-               pid,
-               transport_error?'e':'-',
-               payload_data_exist?'p':'-',
-               payload_unit_start_indicator?'s':'-',
-               adaptation_field_exist?'a':'-',
-               timecode,
-               continuity_counter
-               );
-#endif
-    
     
     stream& s=streams[pid];
     
@@ -438,11 +570,12 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                 
                 pid&=0x1fff;
                 
-                if(!demuxer::channel || demuxer::channel==channel)
+                if(all_programs || !demuxer::channel || demuxer::channel==channel)
                 {
                     stream& ss=streams[pid];
                     ss.channel=channel;
                     ss.type=0xff;
+                    set_pid_mask(pid);
                 }
             }
         }else
@@ -477,10 +610,26 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                 
                 info_len=to_int(ptr+3)&0x0fff;
                 
-                ptr+=5+info_len;
+                const char* lang=0;
+                const char* desc_end=ptr+5+info_len;
+                
+                if(desc_end>end_ptr)
+                    return -17;
+                
+                // ISO 639 language descriptor
+                for(const char* d=ptr+5;d+2<=desc_end && d+2+to_byte(d+1)<=desc_end;d+=2+to_byte(d+1))
+                {
+                    if(to_byte(d)==0x0a && to_byte(d+1)>=3)
+                    {
+                        lang=d+2;
+                        break;
+                    }
+                }
+                
+                ptr=desc_end;
                 
-                // ignore unknown streams
-                if(validate_type(type))
+                // ignore unknown and unselected streams
+                if(validate_type(type) && is_selected(pid,type))
                 {
                     stream& ss=streams[pid];
                     
@@ -490,18 +639,14 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                         ss.type=type;
                         ss.id=++s.id;
                         
-                        if(!parse_only && !ss.file.is_opened())
+                        if(lang)
                         {
-                            if(dst.length())
-                            {
-                                ss.file.open(file::out,"%s%c%s%s",dst.c_str(),os_slash,prefix.c_str(),get_stream_ext(get_stream_type(ss.type)));
-                                fprintf(stderr,"%s%c%s%s\n",dst.c_str(),os_slash,prefix.c_str(),get_stream_ext(get_stream_type(ss.type)));
-                            }
-                            
-                            
-                            else
-                                ss.file.open(file::out,"%s%s",prefix.c_str(),get_stream_ext(get_stream_type(ss.type)));
+                            memcpy(ss.lang,lang,3);
+                            ss.lang[3]=0;
                         }
+                        
+                        if(!parse_only && !ss.file.is_opened())
+                            open_es_file(pid,ss);
                     }
                 }
             }
@@ -517,6 +662,9 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
             
             if(payload_unit_start_indicator)
             {
+                if((features&feature_reassembly) && s.pes)
+                    deliver_pes(pid,s);
+                
                 s.psi.reset();
                 s.psi.len=9;
             }
@@ -553,17 +701,32 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                 
                 s.frame_num++;
                 
+                if(features&feature_reassembly)
+                {
+                    s.pes=pes_pool.get(s.pes_len);
+                    if(s.pes)
+                        s.pes->stream_id=s.stream_id;
+                    else
+                    {
+                        pes_pool.dropped++;
+                        KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"pid %u: can`t allocate %u bytes, PES dropped",pid,s.pes_len);
+                    }
+                }
+                
                 switch(flags&0xc0)
                 {
                     case 0x80:          // PTS only
                     {
-                        u_int64_t pts=decode_pts(s.psi.buf+9);
-#ifdef VERBOSE
-                        if(dump==2)
-                            printf("%.4x: %llu\n",pid,pts);
-                        else if(dump==3)
-                            printf("%.4x: track=%.4x.%.2i, type=%.2x, stream=%.2x, pts=%llums\n",pid,s.channel,s.id,s.type,s.stream_id,pts/90);
-#endif
+                        u_int64_t pts=unwrap_pts(decode_pts(s.psi.buf+9),s.raw_dts?s.raw_dts:timeline_pts);
+                        timeline_pts=s.raw_dts=pts;
+                        if(rebase)
+                            pts=rebase_pts(pts);
+                        if((features&feature_trace) && trace_rec)
+                        {
+                            trace_rec->pts=decode_pts(s.psi.buf+9);
+                            trace_rec->stream_id=s.stream_id;
+                            trace_rec->flags|=tstrace::flag_pts;
+                        }
                         if(s.dts>0 && pts>s.dts)
                         {
                             s.frame_length=(u_int32_t)(pts-s.dts);
@@ -575,6 +738,12 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                         }
                         s.dts=pts;
                         
+                        if((features&feature_reassembly) && s.pes)
+                            s.pes->pts=s.pes->dts=pts;
+                        
+                        if(s.timing.is_opened())
+                            write_timing(s,pts,pts);
+                        
                         if(pts>s.last_pts)
                             s.last_pts=pts;
                         
@@ -584,14 +753,21 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                         break;
                     case 0xc0:          // PTS,DTS
                     {
-                        u_int64_t pts=decode_pts(s.psi.buf+9);
-                        u_int64_t dts=decode_pts(s.psi.buf+14);
-#ifdef VERBOSE
-                        if(dump==2)
-                            printf("%.4x: %llu %llu\n",pid,pts,dts);
-                        else if(dump==3)
-                            printf("%.4x: track=%.4x.%.2i, type=%.2x, stream=%.2x, pts=%llums, dts=%llums\n",pid,s.channel,s.id,s.type,s.stream_id,pts/90,dts/90);
-#endif
+                        u_int64_t dts=unwrap_pts(decode_pts(s.psi.buf+14),s.raw_dts?s.raw_dts:timeline_pts);
+                        u_int64_t pts=unwrap_pts(decode_pts(s.psi.buf+9),dts);
+                        timeline_pts=s.raw_dts=dts;
+                        if(rebase)
+                        {
+                            dts=rebase_pts(dts);
+                            pts=dts+(pts-s.raw_dts);
+                        }
+                        if((features&feature_trace) && trace_rec)
+                        {
+                            trace_rec->pts=decode_pts(s.psi.buf+9);
+                            trace_rec->dts=decode_pts(s.psi.buf+14);
+                            trace_rec->stream_id=s.stream_id;
+                            trace_rec->flags|=tstrace::flag_pts|tstrace::flag_dts;
+                        }
                         if(s.dts>0 && dts>s.dts)
                         {
                             s.frame_length=(u_int32_t)(dts-s.dts);
@@ -604,16 +780,28 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                         
                         s.dts=dts;
                         
+                        if((features&feature_reassembly) && s.pes)
+                        {
+                            s.pes->pts=pts;
+                            s.pes->dts=dts;
+                        }
+                        
+                        if(s.timing.is_opened())
+                            write_timing(s,dts,pts);
+                        
                         if(pts>s.last_pts)
                             s.last_pts=pts;
                         
                         if(!s.first_dts)
                             s.first_dts=dts;
+                        
+                        if(!s.first_pts)
+                            s.first_pts=pts;
                     }
                         break;
                 }
                 
-                if(pes_output && s.file.is_opened())
+                if((features&feature_pes_output) && s.file.is_opened())
                     s.file.write(s.psi.buf,s.psi.len);
                 
                 s.psi.reset();
@@ -623,7 +811,7 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
             {
                 int len=end_ptr-ptr;
                 
-                if(es_parse)
+                if(features&feature_es_parse)
                 {
                     switch(s.type)
                     {
@@ -638,6 +826,13 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
                     }
                 }
                 
+                if((features&feature_reassembly) && s.pes && len>0)
+                {
+                    s.pes=pes_pool.append(s.pes,ptr,len);
+                    if(!s.pes)
+                        KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"pid %u: can`t grow the PES buffer, PES dropped",pid);
+                }
+                
                 if(s.file.is_opened())
                     s.file.write(ptr,len);
             }
@@ -647,6 +842,80 @@ int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
     return 0;
 }
 
+#define PACKET_PARSERS(len)  { &demuxer::demux_packet<len,0>, &demuxer::demux_packet<len,1>, &demuxer::demux_packet<len,2>, &demuxer::demux_packet<len,3>,\
+                               &demuxer::demux_packet<len,4>, &demuxer::demux_packet<len,5>, &demuxer::demux_packet<len,6>, &demuxer::demux_packet<len,7>,\
+                               &demuxer::demux_packet<len,8>, &demuxer::demux_packet<len,9>, &demuxer::demux_packet<len,10>, &demuxer::demux_packet<len,11>,\
+                               &demuxer::demux_packet<len,12>, &demuxer::demux_packet<len,13>, &demuxer::demux_packet<len,14>, &demuxer::demux_packet<len,15> }
+
+void ts::demuxer::prepare_selection(void)
+{
+    pid_mask_ready=true;
+    
+    if(!select && select_pids.empty())
+    {
+        memset(pid_mask,0xff,sizeof(pid_mask));
+        return;
+    }
+    
+    // PAT only, PMT and elementary stream PIDs are added while parsing them
+    memset(pid_mask,0,sizeof(pid_mask));
+    set_pid_mask(0);
+}
+
+bool ts::demuxer::is_selected(u_int16_t pid, u_int8_t type)
+{
+    if(!select && select_pids.empty())
+        return true;
+    
+    bool selected=false;
+    
+    if(std::find(select_pids.begin(),select_pids.end(),pid)!=select_pids.end())
+        selected=true;
+    else if(stream_type_props[type]&stream_props::av)
+    {
+        if(is_video_stream_type(type))
+        {
+            if(!first_video_pid)
+                first_video_pid=pid;
+            
+            selected=(select&select_video) || ((select&select_first_video) && first_video_pid==pid);
+        }else
+        {
+            if(!first_audio_pid)
+                first_audio_pid=pid;
+            
+            selected=(select&select_audio) || ((select&select_first_audio) && first_audio_pid==pid);
+        }
+    }
+    
+    if(selected)
+        set_pid_mask(pid);
+    
+    return selected;
+}
+
+void ts::demuxer::select_parser(int packet_len)
+{
+    if(!pid_mask_ready)
+        prepare_selection();
+    
+    static const packet_parser parsers[3][feature_count]= { PACKET_PARSERS(188), PACKET_PARSERS(192), PACKET_PARSERS(204) };
+    
+    int features=(pes_output?feature_pes_output:0)|(es_parse?feature_es_parse:0)|(pes_callback?feature_reassembly:0)|(trace?feature_trace:0);
+    
+    parser=parsers[packet_len==192?1:packet_len==204?2:0][features];
+}
+
+#undef PACKET_PARSERS
+
+int ts::demuxer::demux_ts_packet(const char* ptr, double* video_fps)
+{
+    if(!parser)
+        select_parser(hdmv?192:188);
+    
+    return (this->*parser)(ptr,video_fps);
+}
+
 void ts::demuxer::show(void)
 {
     u_int64_t beg_pts=0,end_pts=0;
@@ -696,16 +965,16 @@ void ts::demuxer::show(void)
             
             if(s.first_pts>beg_pts)
             {
-                u_int32_t n=(u_int32_t)(s.first_pts-beg_pts)/90;
+                u_int64_t n=(s.first_pts-beg_pts)/90;
                 
-                fprintf(stderr,", head=+%ums",n);
+                fprintf(stderr,", head=+%llums",n);
             }
             
             if(end<end_pts)
             {
-                u_int32_t n=(u_int32_t)(end_pts-end)/90;
+                u_int64_t n=(end_pts-end)/90;
                 
-                fprintf(stderr,", tail=-%ums",n);
+                fprintf(stderr,", tail=-%llums",n);
             }
             
             fprintf(stderr,"\n");
@@ -713,73 +982,1034 @@ void ts::demuxer::show(void)
     }
 }
 
-int ts::demuxer::demux_file(const char* name, double* video_fps)
+void ts::demuxer::set_prefix(const char* name)
+{
+    if(prefix.length()==0 && name) get_prefix_name_by_filename(name,prefix);
+    if(prefix.length() && prefix[prefix.length()-1]!='.')
+        prefix+='.';
+}
+
+int ts::demuxer::read_first_packet(ts::file& file, char* buf, const char* name)
 {
-//    prefix.clear();
+    if(file.read(buf,188)!=188)
+        return 0;
     
-    char buf[192];
+    if(buf[0]==0x47 && buf[4]!=0x47)
+    {
+        hdmv=false;
+        
+        // 204 bytes packets end with 16 bytes of Reed-Solomon parity
+        char next[17];
+        if(file.peek(next,17)==17 && next[0]!=0x47 && next[16]==0x47)
+        {
+            if(file.read(buf+188,16)!=16)
+                return 0;
+            KMLOG(KMLOG_DEMUX,KMLOG_INFO,"TS stream detected in %s (packet length=%i)",name,204);
+            select_parser(204);
+            return 204;
+        }
+        KMLOG(KMLOG_DEMUX,KMLOG_INFO,"TS stream detected in %s (packet length=%i)",name,188);
+        select_parser(188);
+        return 188;
+    }else if(buf[0]!=0x47 && buf[4]==0x47)
+    {
+        if(file.read(buf+188,4)!=4)
+            return 0;
+        KMLOG(KMLOG_DEMUX,KMLOG_INFO,"M2TS stream detected in %s (packet length=%i)",name,192);
+        hdmv=true;
+        select_parser(192);
+        return 192;
+    }
+    KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"unknown stream type in %s",name);
+    return -1;
+}
+
+int ts::demuxer::demux_file(const char* name, double* video_fps)
+{
+    return demux_file(name,video_fps,0,0);
+}
+
+int ts::demuxer::demux_file(const char* name, double* video_fps, u_int64_t begin, u_int64_t end)
+{
+    ts::file file;
     
-    int buf_len=0;
+    bool resuming=resume_pending;
+    resume_pending=false;
     
-    ts::file file;
+    if(resuming)
+    {
+        if(resume_name!=name)
+        {
+            KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"%s: the checkpoint was taken in %s",name,resume_name.c_str());
+            return -1;
+        }
+        begin=resume_offset;
+    }
     
+    // ts::file logs why it cannot be opened
     if(!file.open(file::in,"%s",name))
-    {
-#ifdef VERBOSE
-        fprintf(stderr,"can`t open file %s\n",name);
-#endif
         return -1;
+    
+    if(begin && !file.seek(begin))
+        return -1;
+    
+    kmmem_add(memory,KMMEM_DEMUX_BUFFERS,sizeof(file));
+    
+    if(trace)
+    {
+        trace_file=trace->begin_file();
+        if(trace_recorder)
+            trace_recorder->reset();
     }
     
-    if(prefix.length()==0) get_prefix_name_by_filename(name,prefix);
-    if(prefix.length())
-        prefix+='.';
+    set_prefix(name);
+    
+    // a resumed file is already on the timeline
+    if(rebase && !resuming)
+        begin_input();
+    
+    kmtrace_span span;
+    kmtrace_begin(&span,"demux_file");
+    
+    // elementary stream writes are accounted by the files themselves
+    u_int64_t written=0,write_time=0;
+    for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+        written-=i->second.file.written,write_time-=i->second.file.write_time;
+    
+    u_int64_t packets=0;
+    u_int64_t start=consumed;
+    int rc=demux_range(file,name,video_fps,begin,end,&packets);
+    
+    if(trace_recorder)
+        trace_recorder->flush();
+    
+    if(!rc)
+        inputs++;
+    
+    if(!rc && progress && progress(progress_ctx,consumed))
+        rc=-2;
+    
+    if(span.start)
+    {
+        for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+            written+=i->second.file.written,write_time+=i->second.file.write_time;
+        
+        kmtrace_arg(&span,"file",name);
+        kmtrace_arg_int(&span,"begin",begin);
+        kmtrace_arg_int(&span,"end",end);
+        kmtrace_arg_int(&span,"packets",packets);
+        kmtrace_arg_int(&span,"bytes",consumed-start);
+        kmtrace_arg_int(&span,"es_bytes",written);
+        kmtrace_arg_int(&span,"es_write_us",write_time);
+        if(pes_callback)
+        {
+            kmtrace_arg_int(&span,"pes_pool_bytes",pes_pool.allocated);
+            kmtrace_arg_int(&span,"pes_dropped",pes_pool.dropped);
+        }
+        kmtrace_arg_int(&span,"rc",rc);
+        kmtrace_end(&span);
+    }
+    
+    kmmem_add(memory,KMMEM_DEMUX_BUFFERS,-(long long)sizeof(file));
+    
+    return rc;
+}
+
+int ts::demuxer::demux_range(ts::file& file, const char* name, double* video_fps, u_int64_t begin, u_int64_t end, u_int64_t* packets)
+{
+    char buf[204];
+    
+    int buf_len=0;
+    
+    u_int64_t offset=begin;
     
-    for(u_int64_t pn=1;;pn++)
+    std::map<u_int16_t,bool> pending;                   // streams with a PES still open at the end of the range
+    bool draining=false;
+    
+    u_int64_t next_checkpoint=checkpoint_path.length() && checkpoint_interval && !end && !pes_callback?begin+checkpoint_interval:0;
+    
+    for(u_int64_t pn=1;;pn++,offset+=buf_len,consumed+=buf_len)
     {
+        if(progress && !(pn%progress_interval) && progress(progress_ctx,consumed))
+            return -2;
+        
+        // every packet before offset is demuxed
+        if(next_checkpoint && offset>=next_checkpoint)
+        {
+            save_checkpoint(name,offset,*video_fps);
+            next_checkpoint=offset+checkpoint_interval;
+        }
+        
         if(buf_len)
         {
             if(file.read(buf,buf_len)!=buf_len)
                 break;
         }else
         {
-            if(file.read(buf,188)!=188)
+            buf_len=read_first_packet(file,buf,name);
+            if(!buf_len)
                 break;
-            if(buf[0]==0x47 && buf[4]!=0x47)
-            {
-                buf_len=188;
-#ifdef VERBOSE
-                fprintf(stderr,"TS stream detected in %s (packet length=%i)\n",name,buf_len);
-#endif
-                hdmv=false;
-            }else if(buf[0]!=0x47 && buf[4]==0x47)
+            if(buf_len<0)
+                return -1;
+        }
+        
+        if(end && offset>=end)
+        {
+            if(!draining)
             {
-                if(file.read(buf+188,4)!=4)
-                    break;
-                buf_len=192;
-#ifdef VERBOSE
-                fprintf(stderr,"M2TS stream detected in %s (packet length=%i)\n",name,buf_len);
-#endif
-                hdmv=true;
-            }else
+                draining=true;
+                
+                for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+                    if(i->second.type!=0xff && i->second.frame_num)
+                        pending[i->first]=true;
+            }
+            
+            if(pending.empty())
+                break;
+            
+            u_int16_t pid=to_int(hdmv?buf+5:buf+1);
+            
+            std::map<u_int16_t,bool>::iterator i=pending.find(pid&0x1fff);
+            
+            if(i==pending.end())
+                continue;
+            
+            if(pid&0x4000)
             {
-#ifdef VERBOSE
-                fprintf(stderr,"unknown stream type in %s\n",name);
-#endif
-                return -1;
+                // next PES begins, it belongs to the next range
+                std::map<u_int16_t,stream>::iterator s=streams.find(i->first);
+                if(pes_callback && s!=streams.end() && s->second.pes)
+                    deliver_pes(i->first,s->second);
+                
+                pending.erase(i);
+                continue;
             }
         }
         
-        int n;
-        if((n=demux_ts_packet(buf, video_fps)))
+        (*packets)++;
+        
+        if(trace)
+            trace_packet(buf,offset);
+        
+        int n=(this->*parser)(buf, video_fps);
+        trace_rec=0;
+        if(n)
         {
-#ifdef VERBOSE
-            fprintf(stderr,"%s: invalid packet %llu (%i)\n",name,pn,n);
-#endif
+            KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"%s: invalid packet %llu (%i)",name,pn,n);
+            return -1;
+        }
+        
+        if(memory)
+            count_memory();
+    }
+    
+    return 0;
+}
+
+namespace ts
+{
+    enum { checkpoint_version=2 };
+    
+    static void write_hex(FILE* fp, const char* p, int len)
+    {
+        if(!len)
+            fputc('-',fp);
+        for(int i=0;i<len;i++)
+            fprintf(fp,"%.2x",(unsigned char)p[i]);
+    }
+    
+    static int read_hex(const char* hex, char* p, int max_len)
+    {
+        if(!strcmp(hex,"-"))
+            return 0;
+        
+        int len=strlen(hex)/2;
+        if(len>max_len || strlen(hex)%2)
+            return -1;
+        
+        for(int i=0;i<len;i++)
+        {
+            unsigned int c;
+            if(sscanf(hex+i*2,"%2x",&c)!=1)
+                return -1;
+            p[i]=c;
+        }
+        
+        return len;
+    }
+    
+    // a stream line of a checkpoint
+    class checkpoint_stream
+    {
+    public:
+        unsigned int pid,channel,id,type,stream_id,frame_length,pes_len,h264_ctx,ac3_st,ac3_ctx,ac3_skip,psi_len,psi_offset;
+        unsigned long long dts,raw_dts,first_dts,first_pts,last_pts,frame_num,h264_frame_num,ac3_frame_num;
+        long long file_len,timing_len;                  // -1 if not opened
+        char lang[4];
+        char psi[table::max_buf_len];
+        std::string filename;
+        
+        bool parse(const char* line)
+        {
+            char lang_hex[16],psi_hex[table::max_buf_len*2+1];
+            int pos=0;
+            
+            if(sscanf(line,"stream %u %u %u %u %u %15s %llu %llu %llu %llu %llu %u %llu %u %x %llu %u %x %u %llu %u %u %1024s %lld %lld %n",
+                      &pid,&channel,&id,&type,&stream_id,lang_hex,&dts,&raw_dts,&first_dts,&first_pts,&last_pts,&frame_length,&frame_num,
+                      &pes_len,&h264_ctx,&h264_frame_num,&ac3_st,&ac3_ctx,&ac3_skip,&ac3_frame_num,&psi_len,&psi_offset,psi_hex,
+                      &file_len,&timing_len,&pos)!=25 || !pos)
+                return false;
+            
+            int n=read_hex(lang_hex,lang,3);
+            if(n<0)
+                return false;
+            lang[n]=0;
+            
+            if(pid>0x1fff || psi_len>table::max_buf_len || read_hex(psi_hex,psi,table::max_buf_len)!=(int)psi_offset)
+                return false;
+            
+            filename=line+pos;
+            
+            // the output files must still hold what was written before the checkpoint
+            struct stat st;
+            if(file_len>=0 && (stat(filename.c_str(),&st) || st.st_size<file_len))
+                return false;
+            if(timing_len>=0 && (stat((filename+".timing").c_str(),&st) || st.st_size<timing_len))
+                return false;
+            
+            return true;
+        }
+    };
+}
+
+// the checkpoint is written beside its path then renamed over it, a kill while saving leaves the previous one
+bool ts::demuxer::save_checkpoint(const char* name, u_int64_t offset, double video_fps)
+{
+    // the output files must hold everything demuxed before offset
+    for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+    {
+        i->second.file.flush();
+        i->second.timing.flush();
+    }
+    
+    std::string tmp=checkpoint_path+"~";
+    
+    FILE* fp=fopen(tmp.c_str(),"w");
+    if(!fp)
+    {
+        KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"can`t write checkpoint %s %s",tmp.c_str(),strerror(errno));
+        return false;
+    }
+    
+    fprintf(fp,"tsdemux-checkpoint %i\n",checkpoint_version);
+    fprintf(fp,"input %u %llu %llu %.17g %s\n",inputs,(unsigned long long)offset,(unsigned long long)consumed,video_fps,name);
+    fprintf(fp,"prefix %s\n",prefix.c_str());
+    fprintf(fp,"dst %s\n",dst.c_str());
+    fprintf(fp,"timeline %llu %llu %llu %i\n",(unsigned long long)timeline_pts,(unsigned long long)input_offset,(unsigned long long)timeline_end,
+            input_offset_pending?1:0);
+    fprintf(fp,"selection %i %u %u\n",pid_mask_ready?1:0,first_video_pid,first_audio_pid);
+    
+    // every PID is demuxed without a selection
+    if(pid_mask_ready && (select || !select_pids.empty()))
+        for(int i=0;i<pid_mask_len;i++)
+            if(pid_mask[i])
+                fprintf(fp,"mask %i %x\n",i,pid_mask[i]);
+    
+    for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+    {
+        stream& s=i->second;
+        
+        fprintf(fp,"stream %u %u %u %u %u ",i->first,s.channel,s.id,s.type,s.stream_id);
+        write_hex(fp,s.lang,strlen(s.lang));
+        fprintf(fp," %llu %llu %llu %llu %llu %u %llu %u %x %llu %u %x %u %llu %u %u ",
+                (unsigned long long)s.dts,(unsigned long long)s.raw_dts,(unsigned long long)s.first_dts,(unsigned long long)s.first_pts,
+                (unsigned long long)s.last_pts,s.frame_length,(unsigned long long)s.frame_num,s.pes_len,
+                s.frame_num_h264.get_ctx(),(unsigned long long)s.frame_num_h264.get_frame_num(),
+                s.frame_num_ac3.get_st(),s.frame_num_ac3.get_ctx(),s.frame_num_ac3.get_skip(),(unsigned long long)s.frame_num_ac3.get_frame_num(),
+                s.psi.len,s.psi.offset);
+        write_hex(fp,s.psi.buf,s.psi.offset);
+        fprintf(fp," %lld %lld %s\n",s.file.is_opened()?(long long)s.file.written:-1LL,s.timing.is_opened()?(long long)s.timing.written:-1LL,
+                s.file.filename.c_str());
+    }
+    
+    fprintf(fp,"end\n");
+    
+    if(fclose(fp) || rename(tmp.c_str(),checkpoint_path.c_str()))
+    {
+        KMLOG(KMLOG_DEMUX,KMLOG_ERROR,"can`t write checkpoint %s %s",checkpoint_path.c_str(),strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    
+    KMLOG(KMLOG_DEMUX,KMLOG_DEBUG,"%s: checkpoint at %llu",name,(unsigned long long)offset);
+    
+    return true;
+}
+
+int ts::demuxer::resume(const std::vector<std::string>& names, double* video_fps)
+{
+    FILE* fp=fopen(checkpoint_path.c_str(),"r");
+    if(!fp)
+        return -1;
+    
+    std::vector<std::string> lines;
+    
+    char line[4096];
+    while(fgets(line,sizeof(line),fp))
+    {
+        size_t n=strlen(line);
+        if(n && line[n-1]=='\n')
+            line[--n]=0;
+        lines.push_back(line);
+    }
+    
+    fclose(fp);
+    
+    // check the whole checkpoint before changing anything
+    unsigned int input,mask_ready,video_pid,audio_pid,pending;
+    unsigned long long offset,bytes,pts,input_pts,end_pts;
+    double fps;
+    int version=0,pos=0;
+    
+    if(lines.size()<7 || sscanf(lines[0].c_str(),"tsdemux-checkpoint %i",&version)!=1 || version!=checkpoint_version || lines.back()!="end" ||
+       sscanf(lines[1].c_str(),"input %u %llu %llu %lg %n",&input,&offset,&bytes,&fps,&pos)!=4 || !pos ||
+       lines[2].compare(0,7,"prefix ") || lines[3].compare(0,4,"dst ") ||
+       sscanf(lines[4].c_str(),"timeline %llu %llu %llu %u",&pts,&input_pts,&end_pts,&pending)!=4 ||
+       sscanf(lines[5].c_str(),"selection %u %u %u",&mask_ready,&video_pid,&audio_pid)!=3)
+    {
+        KMLOG(KMLOG_DEMUX,KMLOG_WARNING,"invalid checkpoint %s",checkpoint_path.c_str());
+        return -1;
+    }
+    
+    if(input>=names.size() || names[input]!=lines[1].c_str()+pos)
+    {
+        KMLOG(KMLOG_DEMUX,KMLOG_WARNING,"checkpoint %s is of other input files",checkpoint_path.c_str());
+        return -1;
+    }
+    
+    u_int32_t mask[pid_mask_len];
+    memset(mask,0,sizeof(mask));
+    
+    std::vector<checkpoint_stream> saved;
+    
+    for(size_t i=6;i<lines.size()-1;i++)
+    {
+        int n;
+        unsigned int word;
+        
+        if(sscanf(lines[i].c_str(),"mask %i %x",&n,&word)==2 && n>=0 && n<pid_mask_len)
+            mask[n]=word;
+        else
+        {
+            saved.push_back(checkpoint_stream());
+            if(!saved.back().parse(lines[i].c_str()))
+            {
+                KMLOG(KMLOG_DEMUX,KMLOG_WARNING,"checkpoint %s does not match the output files",checkpoint_path.c_str());
+                return -1;
+            }
+        }
+    }
+    
+    std::string new_prefix=prefix,new_dst=dst;
+    
+    prefix=lines[2].substr(7);
+    dst=lines[3].substr(4);
+    timeline_pts=pts;
+    input_offset=input_pts;
+    timeline_end=end_pts;
+    input_offset_pending=pending?true:false;
+    pid_mask_ready=false;
+    if(mask_ready)
+    {
+        prepare_selection();
+        if(select || !select_pids.empty())
+            memcpy(pid_mask,mask,sizeof(pid_mask));
+    }
+    first_video_pid=video_pid;
+    first_audio_pid=audio_pid;
+    consumed=bytes;
+    inputs=input;
+    
+    for(std::vector<checkpoint_stream>::iterator i=saved.begin();i!=saved.end();++i)
+    {
+        stream& s=streams[i->pid];
+        
+        s.channel=i->channel;
+        s.id=i->id;
+        s.type=i->type;
+        s.stream_id=i->stream_id;
+        memcpy(s.lang,i->lang,sizeof(s.lang));
+        s.dts=i->dts;
+        s.raw_dts=i->raw_dts;
+        s.first_dts=i->first_dts;
+        s.first_pts=i->first_pts;
+        s.last_pts=i->last_pts;
+        s.frame_length=i->frame_length;
+        s.frame_num=i->frame_num;
+        s.pes_len=i->pes_len;
+        s.frame_num_h264.restore(i->h264_ctx,i->h264_frame_num);
+        s.frame_num_ac3.restore(i->ac3_st,i->ac3_ctx,i->ac3_skip,i->ac3_frame_num);
+        s.psi.len=i->psi_len;
+        s.psi.offset=i->psi_offset;
+        memcpy(s.psi.buf,i->psi,i->psi_offset);
+        
+        // the bytes written after the checkpoint are demuxed again
+        if((i->file_len>=0 && !(s.file.open(file::append,"%s",i->filename.c_str()) && s.file.truncate(i->file_len))) ||
+           (i->timing_len>=0 && !(s.timing.open(file::append,"%s.timing",i->filename.c_str()) && s.timing.truncate(i->timing_len))))
+        {
+            // back to a new demuxer
+            streams.clear();
+            prefix=new_prefix;
+            dst=new_dst;
+            timeline_pts=input_offset=timeline_end=0;
+            input_offset_pending=pid_mask_ready=false;
+            first_video_pid=first_audio_pid=0;
+            consumed=0;
+            inputs=0;
             return -1;
         }
     }
     
+    resume_pending=true;
+    resume_offset=offset;
+    resume_name=names[input];
+    
+    *video_fps=fps;
+    
+    KMLOG(KMLOG_DEMUX,KMLOG_INFO,"%s: resumed at %llu",resume_name.c_str(),offset);
+    
+    return input;
+}
+
+void ts::demuxer::trace_packet(const char* ptr, u_int64_t offset)
+{
+    if(!trace_recorder)
+    {
+        trace_recorder=new tstrace::recorder(trace);
+        kmmem_add(memory,KMMEM_DEMUX_BUFFERS,sizeof(tstrace::recorder));
+    }
+    
+    tstrace::record* r=trace_rec=trace_recorder->next();
+    
+    r->offset=offset;
+    r->file=trace_file;
+    
+    if(hdmv)
+    {
+        r->timecode=to_int32(ptr)&0x3fffffff;
+        ptr+=4;
+    }
+    
+    if(ptr[0]!=0x47)
+    {
+        r->flags=tstrace::flag_sync_error;
+        return;
+    }
+    
+    u_int16_t pid=to_int(ptr+1);
+    u_int8_t flags=to_byte(ptr+3);
+    
+    r->pid=pid&0x1fff;
+    r->cc=flags&0x0f;
+    
+    if(pid&0x8000)
+        r->flags|=tstrace::flag_error;
+    if(pid&0x4000)
+        r->flags|=tstrace::flag_pusi;
+    if(pid_mask[r->pid>>5]&(1<<(r->pid&31)))
+        r->flags|=tstrace::flag_selected;
+    
+    int len=184;
+    
+    if(flags&0x20)
+    {
+        const unsigned char* p=(const unsigned char*)ptr+4;
+        
+        r->flags|=tstrace::flag_adaptation;
+        
+        if(p[0] && p[0]<=183)
+        {
+            if(p[1]&0x80)
+                r->flags|=tstrace::flag_discontinuity;
+            if(p[1]&0x40)
+                r->flags|=tstrace::flag_random_access;
+            if((p[1]&0x10) && p[0]>=7)
+            {
+                u_int64_t base=((u_int64_t)p[2]<<25)|(p[3]<<17)|(p[4]<<9)|(p[5]<<1)|(p[6]>>7);
+                r->pcr=base*300+(((p[6]&0x01)<<8)|p[7]);
+                r->flags|=tstrace::flag_pcr;
+            }
+        }
+        
+        len-=p[0]+1;
+    }
+    
+    if(flags&0x10)
+    {
+        r->flags|=tstrace::flag_payload;
+        r->payload_len=len>0?len:0;
+    }
+    
+    trace_recorder->check(r);
+}
+
+void ts::demuxer::deliver_pes(u_int16_t pid, stream& s)
+{
+    pes::buffer* b=s.pes;
+    s.pes=0;
+    s.pes_len=b->len;
+    
+    pes_callback(pes_ctx,pid,s,*b);
+    
+    pes_pool.put(b);
+}
+
+ts::demuxer::~demuxer(void)
+{
+    if(subs)
+        fclose(subs);
+    
+    if(trace_recorder)
+    {
+        delete trace_recorder;
+        kmmem_add(memory,KMMEM_DEMUX_BUFFERS,-(long long)sizeof(tstrace::recorder));
+    }
+    
+    kmmem_add(memory,KMMEM_STREAM_BUFFERS,-counted_streams);
+    kmmem_add(memory,KMMEM_DEMUX_BUFFERS,-counted_pool);
+}
+
+// streams are never removed and the PES pool only grows, the counts follow them packet after packet
+void ts::demuxer::count_memory(void)
+{
+    // a map node holds the PID, the stream and the links of the tree
+    long long streams_len=streams.size()*(sizeof(std::map<u_int16_t,stream>::value_type)+4*sizeof(void*));
+    
+    if(streams_len!=counted_streams)
+    {
+        kmmem_add(memory,KMMEM_STREAM_BUFFERS,streams_len-counted_streams);
+        counted_streams=streams_len;
+    }
+    
+    if((long long)pes_pool.allocated!=counted_pool)
+    {
+        kmmem_add(memory,KMMEM_DEMUX_BUFFERS,pes_pool.allocated-counted_pool);
+        counted_pool=pes_pool.allocated;
+    }
+}
+
+void ts::demuxer::flush_pes(void)
+{
+    for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+        if(i->second.pes)
+            deliver_pes(i->first,i->second);
+}
+
+// keep the last PAT/PMT packets, by PID, return true if buf is one of them
+bool ts::demuxer::keep_psi(const char* buf, int packet_len, std::map<u_int16_t,std::string>& psi)
+{
+    const char* ptr=hdmv?buf+4:buf;
+    
+    u_int16_t pid=to_int(ptr+1);
+    u_int8_t flags=to_byte(ptr+3);
+    bool start=pid&0x4000;
+    pid&=0x1fff;
+    
+    std::map<u_int16_t,stream>::iterator i=streams.find(pid);
+    
+    if(i==streams.end() || !(flags&0x10))
+        return false;
+    
+    stream& s=i->second;
+    
+    if(pid && (s.channel==0xffff || s.type!=0xff))
+        return false;
+    
+    if(start)
+        psi[pid].assign(buf,packet_len);
+    else if(psi[pid].length())
+        psi[pid].append(buf,packet_len);
+    
+    return true;
+}
+
+// look for an IDR and the parameter sets in the NAL units of an access unit before its first slice,
+// true if it is a keyframe. The SPS/PPS found replace param_sets, each prefixed with a 4-byte start code, and set own_sets
+bool ts::demuxer::split_access_unit(const std::string& au, bool random_access, std::string& param_sets, bool& own_sets)
+{
+    const char* ptr=au.data();
+    const char* end_ptr=ptr+au.length();
+    
+    bool keyframe=random_access;
+    std::string sets;
+    
+    for(const char* p=ptr;p+3<end_ptr;p++)
+    {
+        if(p[0] || p[1] || p[2]!=1)
+            continue;
+        
+        u_int8_t nal=to_byte(p+3)&0x1f;
+        
+        if(nal==5)
+            keyframe=true;
+        else if(nal==7 || nal==8)
+        {
+            const char* e=p+3;
+            while(e+2<end_ptr && (e[0] || e[1] || e[2]!=1))
+                e++;
+            if(e+2>=end_ptr)
+                e=end_ptr;
+            while(e>p+3 && !e[-1])              // the zero_byte of the next start code
+                e--;
+            sets.append("\x00",1);
+            sets.append(p,e-p);
+            if(nal==7)
+                keyframe=true;
+            p=e-1;
+        }
+        
+        // the parameter sets and the IDR precede or are the first slice
+        if(nal>=1 && nal<=5)
+            break;
+    }
+    
+    own_sets=sets.length()>0;
+    if(own_sets)
+        param_sets=sets;
+    
+    return keyframe;
+}
+
+int ts::demuxer::plan_split(const char* name, u_int64_t interval, split_plan& plan)
+{
+    plan.packet_len=0;
+    plan.psi.clear();
+    plan.points.clear();
+    plan.points.push_back(split_point());
+    
+    ts::file file;
+    
+    if(!file.open(file::in,"%s",name))
+        return -1;
+    
+    parse_only=true;
+    
+    char buf[204];
+    double fps;
+    
+    std::map<u_int16_t,std::string> psi;                // last PAT/PMT seen, by PID
+    std::string param_sets;                             // last SPS/PPS seen
+    u_int16_t video_pid=0;
+    u_int64_t next_pts=0;
+    
+    // the access unit being collected, from its PUSI packet to the next one
+    std::string au;
+    u_int64_t au_offset=0,au_dts=0,last_dts=0;
+    bool au_random_access=false,au_open=false;
+    
+    for(u_int64_t offset=0,pn=1;;offset+=plan.packet_len,consumed+=plan.packet_len,pn++)
+    {
+        if(progress && !(pn%progress_interval) && progress(progress_ctx,consumed))
+            return -2;
+        
+        bool eof=false;
+        
+        if(plan.packet_len)
+        {
+            if(file.read(buf,plan.packet_len)!=plan.packet_len)
+                eof=true;
+        }else
+        {
+            plan.packet_len=read_first_packet(file,buf,name);
+            if(plan.packet_len<=0)
+                return -1;
+        }
+        
+        const char* ptr=hdmv?buf+4:buf;
+        const char* end_ptr=ptr+188;
+        u_int16_t pid=0;
+        u_int8_t flags=0;
+        bool start=false;
+        
+        if(!eof)
+        {
+            if(demux_ts_packet(buf,&fps))
+                return -1;
+            
+            pid=to_int(ptr+1);
+            flags=to_byte(ptr+3);
+            start=pid&0x4000;
+            pid&=0x1fff;
+            
+            if(keep_psi(buf,plan.packet_len,psi))
+                continue;
+        }
+        
+        std::map<u_int16_t,stream>::iterator i=streams.find(pid);
+        bool video=!eof && i!=streams.end() && (flags&0x10) && i->second.type==0x1b && (!video_pid || video_pid==pid);
+        
+        // the access unit ends with the next one or the file
+        if(au_open && (eof || (video && start)))
+        {
+            au_open=false;
+            
+            bool own_sets;
+            
+            if(split_access_unit(au,au_random_access,param_sets,own_sets))
+            {
+                if(!next_pts)
+                {
+                    plan.points[0].dts=au_dts;
+                    next_pts=au_dts+interval;
+                }else if(au_dts>=next_pts)
+                {
+                    split_point sp;
+                    sp.offset=au_offset;
+                    sp.dts=au_dts;
+                    if(!own_sets)
+                        sp.param_sets=param_sets;
+                    plan.points.push_back(sp);
+                    
+                    next_pts=au_dts+interval;
+                }
+            }
+        }
+        
+        if(eof)
+            break;
+        
+        if(!video || (!start && !au_open))
+            continue;
+        
+        video_pid=pid;
+        
+        ptr+=4;
+        
+        if(start)
+        {
+            au_random_access=false;
+            au.clear();
+        }
+        
+        if(flags&0x20)
+        {
+            if(start)
+                au_random_access=to_byte(ptr) && (to_byte(ptr+1)&0x40);
+            ptr+=to_byte(ptr)+1;
+        }
+        
+        if(start)
+        {
+            if(end_ptr-ptr<9 || memcmp(ptr,"\x00\x00\x01",3))
+                continue;
+            
+            ptr+=9+to_byte(ptr+8);
+            
+            au_open=true;
+            au_offset=offset;
+            au_dts=last_dts=i->second.dts;
+        }
+        
+        if(ptr<end_ptr)
+            au.append(ptr,end_ptr-ptr);
+    }
+    
+    if(plan.points.size()<2 && (!next_pts || last_dts>=next_pts))
+        KMLOG(KMLOG_DEMUX,KMLOG_WARNING,"%s: no H.264 keyframe to split at, the file is a single chunk",name);
+    
+    for(std::map<u_int16_t,std::string>::const_iterator i=psi.begin();i!=psi.end();++i)
+        plan.psi+=i->second;
+    
+    return 0;
+}
+
+int ts::demuxer::plan_ranges(const char* name, int count, split_plan& plan)
+{
+    plan.packet_len=0;
+    plan.psi.clear();
+    plan.points.clear();
+    
+    struct stat st;
+    ts::file file;
+    
+    if(stat(name,&st) || !file.open(file::in,"%s",name))
+        return -1;
+    
+    parse_only=true;
+    
+    char buf[204];
+    double fps;
+    
+    plan.packet_len=read_first_packet(file,buf,name);
+    if(plan.packet_len<=0)
+        return -1;
+    
+    std::map<u_int16_t,std::string> psi;
+    
+    for(u_int64_t offset=0;offset<probe_head_len;offset+=plan.packet_len)
+    {
+        if(offset && file.read(buf,plan.packet_len)!=plan.packet_len)
+            break;
+        
+        if(demux_ts_packet(buf,&fps))
+            return -1;
+        
+        keep_psi(buf,plan.packet_len,psi);
+    }
+    
+    for(std::map<u_int16_t,std::string>::const_iterator i=psi.begin();i!=psi.end();++i)
+        plan.psi+=i->second;
+    
+    u_int64_t size=st.st_size;
+    
+    if((u_int64_t)count>size/range_min_len)
+        count=size/range_min_len;
+    if(count<1)
+        count=1;
+    
+    for(int i=0;i<count;i++)
+    {
+        split_point sp;
+        sp.offset=size*i/count;
+        sp.offset-=sp.offset%plan.packet_len;
+        plan.points.push_back(sp);
+    }
+    
+    return 0;
+}
+
+int ts::demuxer::probe_file(const char* name, probe_result& result)
+{
+    result=probe_result();
+    
+    struct stat st;
+    ts::file file;
+    
+    if(stat(name,&st) || !file.open(file::in,"%s",name))
+        return -1;
+    
+    result.size=st.st_size;
+    
+    parse_only=true;
+    
+    char buf[204];
+    double fps=0;
+    
+    result.packet_len=read_first_packet(file,buf,name);
+    if(result.packet_len<=0)
+        return -1;
+    
+    // head: every packet must parse, which rejects the files that only happen to start with a sync byte
+    u_int64_t offset=0;
+    for(;offset<probe_head_len;offset+=result.packet_len)
+    {
+        if(offset && file.read(buf,result.packet_len)!=result.packet_len)
+            break;
+        if((this->*parser)(buf,&fps))
+            return -1;
+    }
+    
+    // timestamps spanned by the head window, its bitrate estimates the duration when the tail does not continue the head clock
+    u_int64_t head_beg_pts=0,head_end_pts=0;
+    
+    for(std::map<u_int16_t,stream>::const_iterator i=streams.begin();i!=streams.end();++i)
+    {
+        const stream& s=i->second;
+        
+        if(s.first_pts && (s.first_pts<head_beg_pts || !head_beg_pts))
+            head_beg_pts=s.first_pts;
+        if(s.last_pts && s.last_pts+s.frame_length>head_end_pts)
+            head_end_pts=s.last_pts+s.frame_length;
+    }
+    
+    u_int64_t tail=result.size>probe_tail_len?result.size-probe_tail_len:0;
+    tail-=tail%result.packet_len;
+    
+    if(tail>offset && file.seek(tail))
+    {
+        // the tail starts in the middle of PES packets and sections, timestamps must not be taken as frame durations
+        for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
+        {
+            i->second.psi.reset();
+            i->second.dts=0;
+        }
+        
+        // a corrupted tail only loses the end timestamps
+        while(file.read(buf,result.packet_len)==result.packet_len && !(this->*parser)(buf,&fps));
+    }
+    
+    u_int64_t beg_pts=0,end_pts=0;
+    
+    for(std::map<u_int16_t,stream>::const_iterator i=streams.begin();i!=streams.end();++i)
+    {
+        const stream& s=i->second;
+        
+        if(s.type==0xff)
+            continue;
+        
+        probe_stream ps;
+        ps.pid=i->first;
+        ps.channel=s.channel;
+        ps.type=s.type;
+        ps.codec=get_stream_ext(get_stream_type(s.type));
+        ps.video=is_video_stream_type(s.type);
+        memcpy(ps.lang,s.lang,sizeof(ps.lang));
+        ps.fps=(ps.video && s.frame_length)?compute_fps_from_frame_length(s.frame_length):0;
+        ps.first_pts=s.first_pts;
+        ps.end_pts=s.last_pts?s.last_pts+s.frame_length:0;
+        result.streams.push_back(ps);
+        
+        if(ps.first_pts && (ps.first_pts<beg_pts || !beg_pts))
+            beg_pts=ps.first_pts;
+        if(ps.end_pts>end_pts)
+            end_pts=ps.end_pts;
+    }
+    
+    // no elementary stream announced by a PMT in the head window
+    if(result.streams.empty())
+        return -1;
+    
+    if(beg_pts && end_pts>beg_pts)
+    {
+        result.duration=end_pts-beg_pts;
+        result.bitrate=result.size*8*90000/result.duration;
+    }
+    
+    // a discontinuity between the head and the tail makes the PTS span meaningless:
+    // the duration is taken from the size at the head bitrate when they disagree by more than a factor 2
+    if(head_beg_pts && head_end_pts>head_beg_pts && offset<result.size)
+    {
+        u_int64_t head_bitrate=offset*8*90000/(head_end_pts-head_beg_pts);
+        
+        if(head_bitrate)
+        {
+            u_int64_t size_duration=result.size*8*90000/head_bitrate;
+            
+            if(!result.duration || result.duration>size_duration*2 || result.duration*2<size_duration)
+            {
+                result.duration=size_duration;
+                result.bitrate=head_bitrate;
+                result.estimated=true;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+int ts::demuxer::seed(const split_plan& plan)
+{
+    double fps;
+    
+    set_prefix(0);
+    
+    hdmv=plan.packet_len==192;
+    select_parser(plan.packet_len);
+    
+    for(size_t i=0;i+plan.packet_len<=plan.psi.length();i+=plan.packet_len)
+        if(demux_ts_packet(plan.psi.c_str()+i,&fps))
+            return -1;
+    
     return 0;
 }
 
@@ -795,16 +2025,16 @@ void ts::my_strptime(const char* s,tm* t)
 #endif
 
 
-void ts::demuxer::write_timecodes(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int32_t frame_num,u_int32_t frame_len)
+void ts::demuxer::write_timecodes(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int64_t frame_num,u_int32_t frame_len)
 {
     u_int64_t len=last_pts-first_pts;
     
     double c=(double)len/(double)frame_num;
     
     double m=0;
-    u_int32_t n=0;
+    u_int64_t n=0;
     
-    for(int i=0;i<frame_num;i++)
+    for(u_int64_t i=0;i<frame_num;i++)
     {
         fprintf(fp,"%llu\n",(first_pts+n)/90);
         
@@ -818,7 +2048,7 @@ void ts::demuxer::write_timecodes(FILE* fp,u_int64_t first_pts,u_int64_t last_pt
 
 #ifndef OLD_TIMECODES
 // for audio
-void ts::demuxer::write_timecodes2(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int32_t frame_num,u_int32_t frame_len)
+void ts::demuxer::write_timecodes2(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int64_t frame_num,u_int32_t frame_len)
 {
     u_int64_t len=last_pts-first_pts;
     
@@ -829,11 +2059,11 @@ void ts::demuxer::write_timecodes2(FILE* fp,u_int64_t first_pts,u_int64_t last_p
     else
     {
         u_int32_t frame_len_ms=frame_len/90;
-        u_int32_t timecode_ms=(u_int32_t)base_pts/90;
+        u_int64_t timecode_ms=base_pts/90;
         
-        for(u_int32_t i=0;i<frame_num;i++)
+        for(u_int64_t i=0;i<frame_num;i++)
         {
-            fprintf(fp,"%u\n",timecode_ms);
+            fprintf(fp,"%llu\n",timecode_ms);
             timecode_ms+=frame_len_ms;
         }
     }
@@ -28,6 +28,9 @@
 #include "common.h"
 #include "h264.h"
 #include "ac3.h"
+#include "pes.h"
+#include "tstrace.h"
+#include "kmmem.h"
 
 namespace ts
 {
@@ -57,7 +60,7 @@ namespace ts
         
         u_int16_t offset;
         
-        table(void):offset(0),len(0) {}
+        table(void):len(0),offset(0) {}
         
         void reset(void) { offset=0; len=0; }
     };
@@ -74,17 +77,23 @@ namespace ts
         int len,offset;
     public:
         std::string filename;
+        
+        u_int64_t written;                              // bytes flushed to the file
+        u_int64_t write_time;                           // microseconds spent in write(), only counted while tracing
     public:
-        file(void):fd(-1),len(0),offset(0) {}
+        file(void):fd(-1),len(0),offset(0),written(0),write_time(0) {}
         ~file(void);
         
-        enum { in=0, out=1 };
+        enum { in=0, out=1, append=2 };
         
         bool open(int mode,const char* fmt,...);
         void close(void);
         int write(const char* p,int l);
         int flush(void);
         int read(char* p,int l);
+        bool seek(u_int64_t pos);
+        int peek(char* p,int l);                        // copy buffered bytes without consuming them
+        bool truncate(u_int64_t size);                  // cut an output file back to size and write after it, false if shorter
         
         bool is_opened(void) { return fd==-1?false:true; }
     };
@@ -139,29 +148,36 @@ namespace ts
         table psi;                              // PAT,PMT cache (only for PSI streams)
         
         u_int8_t stream_id;                     // MPEG stream id
+        char lang[4];                           // ISO 639-2 language code from the PMT, empty if not signaled
         
         ts::file file;                          // output ES file
+        ts::file timing;                        // DTS and PTS of each PES of a video stream, see demuxer::timing
         FILE* timecodes;
         
         u_int64_t dts;                          // current MPEG stream DTS (presentation time for audio, decode time for video)
+                                                // timestamps are unwrapped: they keep growing past the 33-bit PTS wrap (~26.5h)
+        u_int64_t raw_dts;                      // last DTS in the clock of the input file, before rebasing
         u_int64_t first_dts;
         u_int64_t first_pts;
         u_int64_t last_pts;
         u_int32_t frame_length;                 // frame length in ticks (90 ticks = 1 ms, 90000/frame_length=fps)
         u_int64_t frame_num;                    // frame counter
         
+        pes::buffer* pes;                       // PES being reassembled, see demuxer::pes_callback
+        u_int32_t pes_len;                      // length of the last PES, the size first asked for the next one
+        
         h264::counter frame_num_h264;           // JVT NAL (h.264) frame counter
         ac3::counter  frame_num_ac3;            // A/52B (AC3) frame counter
         
-        stream(void):channel(0xffff),id(0),type(0xff),stream_id(0),
-        dts(0),first_dts(0),first_pts(0),last_pts(0),frame_length(0),frame_num(0),timecodes(0) {}
+        stream(void):channel(0xffff),id(0),type(0xff),stream_id(0),timecodes(0),
+        dts(0),raw_dts(0),first_dts(0),first_pts(0),last_pts(0),frame_length(0),frame_num(0),pes(0),pes_len(0) { lang[0]=0; }
         
         ~stream(void);
         
         void reset(void)
         {
             psi.reset();
-            dts=first_pts=last_pts=0;
+            dts=raw_dts=first_pts=last_pts=0;
             frame_length=0;
             frame_num=0;
             frame_num_h264.reset();
@@ -180,6 +196,55 @@ namespace ts
         }
     };
     
+    class split_point
+    {
+    public:
+        u_int64_t offset;                       // offset of the TS packet opening the keyframe PES
+        u_int64_t dts;                          // keyframe decoding time, 90kHz
+        std::string param_sets;                 // SPS/PPS to prepend when the keyframe does not carry its own
+        
+        split_point(void):offset(0),dts(0) {}
+    };
+    
+    class split_plan
+    {
+    public:
+        int packet_len;                         // 188 (TS), 192 (M2TS) or 204 (TS with Reed-Solomon parity)
+        std::string psi;                        // raw PAT/PMT packets replayed into each chunk demuxer
+        std::vector<split_point> points;        // chunk boundaries, the first chunk always starts at 0
+        
+        split_plan(void):packet_len(0) {}
+    };
+    
+    class probe_stream
+    {
+    public:
+        u_int16_t pid;
+        u_int16_t channel;                      // program number
+        u_int8_t type;                          // PMT stream_type
+        const char* codec;                      // ES file extension: "264", "aac", "ac3", ...
+        bool video;
+        char lang[4];                           // ISO 639-2 language code from the PMT, empty if not signaled
+        double fps;                             // video frame rate, 0 if unknown
+        u_int64_t first_pts;                    // first PTS of the head window, 0 if none
+        u_int64_t end_pts;                      // presentation end of the last PES of the tail window
+        
+        probe_stream(void):pid(0),channel(0),type(0),codec(""),video(false),fps(0),first_pts(0),end_pts(0) { lang[0]=0; }
+    };
+    
+    class probe_result
+    {
+    public:
+        int packet_len;                         // 188 (TS), 192 (M2TS) or 204
+        u_int64_t size;                         // file size in bytes
+        u_int64_t duration;                     // 90kHz ticks from the earliest first PTS to the latest end
+        u_int64_t bitrate;                      // bits per second estimated from the size and the duration, 0 if unknown
+        bool estimated;                         // the timestamps of the tail do not continue those of the head (discontinuity):
+                                                // the duration is estimated from the size and the bitrate of the head
+        std::vector<probe_stream> streams;
+        
+        probe_result(void):packet_len(0),size(0),duration(0),bitrate(0),estimated(false) {}
+    };
     
     class demuxer
     {
@@ -188,12 +253,17 @@ namespace ts
         bool hdmv;                                      // HDMV mode, using 192 bytes packets
         bool av_only;                                   // Audio/Video streams only
         bool parse_only;                                // no demux
-        int dump;                                       // 0 - no dump, 1 - dump M2TS timecodes, 2 - dump PTS/DTS, 3 - dump tracks
         int channel;                                    // channel for demux
+        bool all_programs;                              // demux every program, ES files are named after their program
         int pes_output;                                 // demux to PES
         std::string prefix;                             // output file name prefix (autodetect)
         std::string dst;                                // output directory
         bool es_parse;
+        std::string video_prologue;                     // written at the head of the video ES file when it is opened
+        bool rebase;                                    // each input file continues the timeline where the previous one ended,
+                                                        // unless its clock already does
+        bool timing;                                    // write "<dts> <pts>" (90kHz, after rebasing) per PES of each video stream
+                                                        // into a .timing file next to its ES file
         
     public:
         u_int64_t base_pts;
@@ -202,28 +272,164 @@ namespace ts
         FILE* subs;
         u_int32_t subs_num;
         
+        u_int64_t timeline_pts;                         // last timestamp read, on the 64-bit timeline extending the 33-bit PTS
+        u_int64_t input_offset;                         // added to the timestamps of the current input file when rebasing
+        u_int64_t timeline_end;                         // end of the streams when the current input file was opened
+        bool input_offset_pending;                      // the offset is set by the first timestamp of the input file
+        
         bool validate_type(u_int8_t type);
         u_int64_t decode_pts(const char* ptr);
+        u_int64_t unwrap_pts(u_int64_t pts,u_int64_t ref);
+        void begin_input(void);
+        u_int64_t rebase_pts(u_int64_t pts);
+        void write_timing(stream& s,u_int64_t dts,u_int64_t pts);
         int get_stream_type(u_int8_t type);
         bool is_video_stream_type(u_int8_t type);
         const char* get_stream_ext(u_int8_t type_id);
         double compute_fps_from_frame_length(u_int32_t frame_length);
         
-        // take 188/192 bytes TS/M2TS packet
+        // demux_packet features, template parameters so each combination compiles to its own parser
+        enum
+        {
+            feature_pes_output  = 1,
+            feature_es_parse    = 2,
+            feature_trace       = 4,                    // with trace
+            feature_reassembly  = 8,                    // with pes_callback
+            feature_count       = 16
+        };
+        
+        typedef int (demuxer::*packet_parser)(const char* ptr, double* video_fps);
+        
+        packet_parser parser;                           // selected once per file by select_parser
+        
+        // PIDs whose packets are processed, the others are dropped after the header check
+        enum { pid_mask_len=0x2000/32 };
+        u_int32_t pid_mask[pid_mask_len];
+        bool pid_mask_ready;
+        u_int16_t first_video_pid;
+        u_int16_t first_audio_pid;
+        
+        void prepare_selection(void);
+        bool is_selected(u_int16_t pid, u_int8_t type);
+        void set_pid_mask(u_int16_t pid) { pid_mask[pid>>5]|=1<<(pid&31); }
+        
+        pes::pool pes_pool;
+        void deliver_pes(u_int16_t pid, stream& s);
+        
+        long long counted_streams;                      // bytes of the streams and of the PES pool counted in memory
+        long long counted_pool;
+        void count_memory(void);
+        
+        u_int32_t trace_file;                           // index of the input file in the trace
+        tstrace::recorder* trace_recorder;
+        tstrace::record* trace_rec;                     // record of the packet being demuxed, set by demux_range only
+        void trace_packet(const char* ptr, u_int64_t offset);
+        
+        // take 188/192/204 bytes TS/M2TS packet
+        template<int packet_len,int features>
+        int demux_packet(const char* ptr, double* video_fps);
+        
+        void select_parser(int packet_len);
         int demux_ts_packet(const char* ptr, double* video_fps);
         
-        void write_timecodes(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int32_t frame_num,u_int32_t frame_len);
+        // read the first packet of a file, detect TS/M2TS and select the parser, return packet length
+        int read_first_packet(ts::file& file, char* buf, const char* name);
+        int demux_range(ts::file& file, const char* name, double* video_fps, u_int64_t begin, u_int64_t end, u_int64_t* packets);
+        bool keep_psi(const char* buf, int packet_len, std::map<u_int16_t,std::string>& psi);
+        bool split_access_unit(const std::string& au, bool random_access, std::string& param_sets, bool& own_sets);
+        void set_prefix(const char* name);
+        void open_es_file(u_int16_t pid, stream& s);
+        
+        u_int32_t inputs;                               // input files demuxed to their end
+        bool resume_pending;                            // the next demux_file continues the input file of the checkpoint
+        u_int64_t resume_offset;
+        std::string resume_name;
+        bool save_checkpoint(const char* name, u_int64_t offset, double video_fps);
+        
+        void write_timecodes(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int64_t frame_num,u_int32_t frame_len);
 #ifndef OLD_TIMECODES
-        void write_timecodes2(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int32_t frame_num,u_int32_t frame_len);
+        void write_timecodes2(FILE* fp,u_int64_t first_pts,u_int64_t last_pts,u_int64_t frame_num,u_int32_t frame_len);
 #endif
     public:
-        demuxer(void):hdmv(false),av_only(true),parse_only(false),dump(0),channel(0),base_pts(0),pes_output(0),es_parse(false),subs(0),subs_num(0) {}
-        ~demuxer(void) { if(subs) fclose(subs); }
+        // stream selection, every elementary stream is demuxed when select is 0 and select_pids is empty
+        enum
+        {
+            select_video        = 1,                    // every video stream
+            select_audio        = 2,                    // every audio stream
+            select_first_video  = 4,                    // the first video stream found
+            select_first_audio  = 8                     // the first audio stream found
+        };
+        
+        int select;
+        std::vector<u_int16_t> select_pids;             // elementary stream PIDs demuxed whatever their type
+        
+        enum { progress_interval=1024 };                // packets between two progress callbacks
+        
+        // called with the input bytes consumed so far by this demuxer, a non-zero return cancels the demux (-2)
+        int (*progress)(void* ctx,u_int64_t bytes);
+        void* progress_ctx;
+        u_int64_t consumed;
+        
+        // when set, called with every complete PES payload of the demuxed streams, in one contiguous buffer
+        // recycled once the callback returns. A PES is complete when the next one of its stream starts,
+        // or when the range being demuxed ends: call flush_pes after the last input file
+        void (*pes_callback)(void* ctx,u_int16_t pid,const stream& s,const pes::buffer& pes);
+        void* pes_ctx;
+        
+        // when set, the bytes held by the buffers of the demuxer are counted there while it lives, see kmmem.h
+        kmmem_stats* memory;
+        
+        // when set, every packet demuxed by demux_file is recorded there, see tstrace.h
+        tstrace::writer* trace;
+        
+        // when set, demux_file saves the state of the demuxer, the input offset and the length of the output files into
+        // this sidecar file every checkpoint_interval input bytes, so a demux killed midway can resume from the last
+        // checkpoint instead of the start. Not with pes_callback or a range end
+        std::string checkpoint_path;
+        u_int64_t checkpoint_interval;
+        
+        enum { default_checkpoint_interval=64*1024*1024 };
+    public:
+        demuxer(void):hdmv(false),av_only(true),parse_only(false),channel(0),all_programs(false),pes_output(0),es_parse(false),rebase(false),timing(false),base_pts(0),subs(0),subs_num(0),timeline_pts(0),input_offset(0),timeline_end(0),input_offset_pending(false),parser(0),pid_mask_ready(false),first_video_pid(0),first_audio_pid(0),
+        counted_streams(0),counted_pool(0),trace_file(0),trace_recorder(0),trace_rec(0),inputs(0),resume_pending(false),resume_offset(0),
+        select(0),progress(0),progress_ctx(0),consumed(0),pes_callback(0),pes_ctx(0),memory(0),trace(0),checkpoint_interval(default_checkpoint_interval) {}
+        ~demuxer(void);
         
         void show(void);
         
+        // return 0 on success, -2 if cancelled by the progress callback, -1 on error
         int demux_file(const char* name, double* video_fps);
         
+        // demux [begin,end) only, PES packets still open at end are completed (end=0 - up to EOF)
+        int demux_file(const char* name, double* video_fps, u_int64_t begin, u_int64_t end);
+        
+        // restore the state saved by the last checkpoint of checkpoint_path into a new demuxer, the output files are cut
+        // back to their length then. names are the input files in the order they are demuxed: return the index of the one
+        // the checkpoint was taken in, the next demux_file call must be given it and continues it from the checkpoint.
+        // -1 if there is no checkpoint or it does not match the inputs or the output files
+        int resume(const std::vector<std::string>& names, double* video_fps);
+        
+        // locate the keyframes closest after every interval (90kHz ticks) without demuxing, -2 if cancelled
+        int plan_split(const char* name, u_int64_t interval, split_plan& plan);
+        
+        enum { range_min_len=1024*1024 };
+        
+        // cut the file into count packet-aligned byte ranges of at least range_min_len bytes, reading the PAT/PMT from its
+        // head only. Unlike plan_split, ranges do not start on keyframes: their elementary streams are meant to be concatenated
+        int plan_ranges(const char* name, int count, split_plan& plan);
+        
+        // replay the PAT/PMT of a split plan so a chunk can be demuxed from the middle of the file
+        int seed(const split_plan& plan);
+        
+        enum { probe_head_len=512*1024, probe_tail_len=256*1024 };
+        
+        // read the PAT/PMT, the first timestamps and the frame rates from the head of the file and the last timestamps
+        // from its tail, without demuxing. -1 if the file is empty, is not a TS file or announces no elementary stream
+        int probe_file(const char* name, probe_result& result);
+        
+        // deliver the PES still being reassembled
+        void flush_pes(void);
+        
         void reset(void)
         {
             for(std::map<u_int16_t,stream>::iterator i=streams.begin();i!=streams.end();++i)
@@ -0,0 +1,216 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#ifndef __TSTRACE_H
+#define __TSTRACE_H
+
+#include "common.h"
+
+namespace tstrace
+{
+    // a trace file is a header followed by fixed-size records, one per TS packet in the order they were demuxed.
+    // Once capacity records are written the file is a ring: record n is at n%capacity, the oldest ones are overwritten
+    enum { version=1 };
+    
+    struct header
+    {
+        char magic[8];                          // "TSTRACE\0"
+        u_int32_t version;
+        u_int32_t record_len;
+        u_int64_t capacity;                     // records the file can hold
+        u_int64_t count;                        // records written, more than capacity once the ring wrapped
+        u_int32_t files;                        // input files demuxed
+        u_int32_t reserved;
+    };
+    
+    enum
+    {
+        flag_pusi           = 0x0001,           // payload unit start indicator
+        flag_adaptation     = 0x0002,           // adaptation field present
+        flag_payload        = 0x0004,           // payload present
+        flag_error          = 0x0008,           // transport error indicator
+        flag_discontinuity  = 0x0010,           // discontinuity indicator of the adaptation field
+        flag_random_access  = 0x0020,           // random access indicator of the adaptation field
+        flag_pcr            = 0x0040,           // pcr is set
+        flag_pts            = 0x0080,           // pts and stream_id are set, from the PES header completed by this packet
+        flag_dts            = 0x0100,           // dts is set
+        flag_cc_error       = 0x0200,           // continuity counter does not follow the previous packet of the PID
+        flag_selected       = 0x0400,           // the PID is demuxed
+        flag_sync_error     = 0x0800            // no sync byte, the other fields are not set
+    };
+    
+    struct record
+    {
+        u_int64_t offset;                       // of the packet in its input file
+        u_int64_t pcr;                          // 27MHz
+        u_int64_t pts;                          // 90kHz, as in the stream (33 bits)
+        u_int64_t dts;
+        u_int32_t timecode;                     // M2TS arrival timecode, 0 for 188 bytes packets
+        u_int32_t file;                         // index of the input file, in the order they were demuxed
+        u_int16_t pid;
+        u_int16_t flags;
+        u_int8_t cc;                            // continuity counter
+        u_int8_t payload_len;
+        u_int8_t stream_id;
+        u_int8_t reserved;
+    };
+    
+    // the trace file, shared by the demuxers of a conversion, possibly running on several threads.
+    // Records are written by blocks, a block of a demuxer is never split by the records of another one
+    class writer
+    {
+    protected:
+        int fd;
+        header hdr;
+        
+        void write_header(void)
+        {
+#ifndef _WIN32
+            header h=hdr;
+            h.count=__sync_fetch_and_add(&hdr.count,0);
+            h.files=__sync_fetch_and_add(&hdr.files,0);
+            if(pwrite(fd,&h,sizeof(h),0)!=sizeof(h)) {}
+#endif
+        }
+    public:
+        writer(void):fd(-1) { memset(&hdr,0,sizeof(hdr)); }
+        ~writer(void) { close(); }
+        
+        bool open(const char* path, u_int64_t capacity)
+        {
+#ifndef _WIN32
+            close();
+            
+            if(!capacity)
+                return false;
+            
+            fd=::open(path,O_RDWR|O_CREAT|O_TRUNC|O_BINARY|O_LARGEFILE,0644);
+            if(fd==-1)
+                return false;
+            
+            memset(&hdr,0,sizeof(hdr));
+            memcpy(hdr.magic,"TSTRACE",8);
+            hdr.version=version;
+            hdr.record_len=sizeof(record);
+            hdr.capacity=capacity;
+            write_header();
+            return true;
+#else
+            return false;
+#endif
+        }
+        
+        void close(void)
+        {
+            if(fd==-1)
+                return;
+            
+            write_header();
+            ::close(fd);
+            fd=-1;
+        }
+        
+        bool is_opened(void) { return fd!=-1; }
+        
+        // index of the next input file
+        u_int32_t begin_file(void) { return __sync_fetch_and_add(&hdr.files,1); }
+        
+        void write(const record* r, u_int32_t n)
+        {
+#ifndef _WIN32
+            u_int64_t first=__sync_fetch_and_add(&hdr.count,(u_int64_t)n);
+            
+            while(n)
+            {
+                u_int64_t i=first%hdr.capacity;
+                u_int32_t len=hdr.capacity-i<n?(u_int32_t)(hdr.capacity-i):n;
+                
+                if(pwrite(fd,r,len*sizeof(record),sizeof(header)+i*sizeof(record))!=(ssize_t)(len*sizeof(record)))
+                    return;
+                
+                first+=len;
+                r+=len;
+                n-=len;
+            }
+#endif
+        }
+    };
+    
+    // the records of one demuxer, written to the trace file by blocks.
+    // It keeps the continuity counters on its own, the ranges of a file demuxed in parallel are checked apart
+    class recorder
+    {
+    protected:
+        enum { block_len=1024 };
+        
+        writer* trace;
+        record records[block_len];
+        u_int32_t count;
+        u_int8_t last_cc[0x2000];               // last continuity counter of each PID, 0xff before its first packet
+    public:
+        recorder(writer* w):trace(w),count(0) { reset(); }
+        ~recorder(void) { flush(); }
+        
+        // forget the continuity counters, at the start of an input file
+        void reset(void) { memset(last_cc,0xff,sizeof(last_cc)); }
+        
+        // a cleared record for the next packet
+        record* next(void)
+        {
+            if(count==block_len)
+                flush();
+            
+            record* r=&records[count++];
+            memset(r,0,sizeof(record));
+            return r;
+        }
+        
+        void flush(void)
+        {
+            if(count)
+                trace->write(records,count);
+            count=0;
+        }
+        
+        // flag a packet whose continuity counter does not follow the previous one of its PID: it increments with every
+        // packet carrying a payload, a packet may be repeated once, a discontinuity indicator resets it
+        void check(record* r)
+        {
+            u_int8_t prev=last_cc[r->pid];
+            last_cc[r->pid]=r->cc;
+            
+            if(prev==0xff || r->pid==0x1fff || (r->flags&flag_discontinuity))
+                return;
+            
+            if(r->flags&flag_payload ? (r->cc!=((prev+1)&0x0f) && r->cc!=prev) : r->cc!=prev)
+                r->flags|=flag_cc_error;
+        }
+    };
+}
+
+#endif
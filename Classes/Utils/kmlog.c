@@ -0,0 +1,88 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#include "kmlog.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+volatile int kmlog_levels[KMLOG_COMPONENT_COUNT] = { KMLOG_ERROR, KMLOG_ERROR, KMLOG_ERROR };
+
+static pthread_mutex_t kmlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static kmlog_sink kmlog_current_sink = NULL;
+static void *kmlog_current_ctx = NULL;
+
+static const char *kmlog_component_names[KMLOG_COMPONENT_COUNT] = { "demux", "mux", "gpac" };
+static const char *kmlog_level_names[] = { "", "error", "warning", "info", "debug" };
+
+void kmlog_set_level(kmlog_component component, kmlog_level level)
+{
+    if (component < KMLOG_COMPONENT_COUNT) kmlog_levels[component] = level;
+}
+
+void kmlog_set_levels(kmlog_level level)
+{
+    int i;
+    for (i = 0; i < KMLOG_COMPONENT_COUNT; i++) kmlog_levels[i] = level;
+}
+
+void kmlog_set_sink(kmlog_sink sink, void *ctx)
+{
+    pthread_mutex_lock(&kmlog_lock);
+    kmlog_current_sink = sink;
+    kmlog_current_ctx = ctx;
+    pthread_mutex_unlock(&kmlog_lock);
+}
+
+const char *kmlog_component_name(kmlog_component component)
+{
+    return component < KMLOG_COMPONENT_COUNT ? kmlog_component_names[component] : "";
+}
+
+void kmlog_write(kmlog_component component, kmlog_level level, const char *format, ...)
+{
+    char message[1024];
+    va_list args;
+    size_t len;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    /* messages are lines, GPAC ends its own with a newline */
+    len = strlen(message);
+    while (len && message[len - 1] == '\n') message[--len] = 0;
+
+    /* the sink is called under the lock so it is not released while in use */
+    pthread_mutex_lock(&kmlog_lock);
+    if (kmlog_current_sink) kmlog_current_sink(kmlog_current_ctx, component, level, message);
+    else fprintf(stderr, "[%s] %s: %s\n", kmlog_component_name(component), kmlog_level_names[level <= KMLOG_DEBUG ? level : 0], message);
+    pthread_mutex_unlock(&kmlog_lock);
+}
@@ -0,0 +1,81 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#ifndef KMLOG_H_INCLUDED
+#define KMLOG_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    /*
+     Process wide logging of the demuxer, the muxer and GPAC, with a level per component.
+     Messages above the level of their component cost a load and a compare: KMLOG does not
+     evaluate its arguments nor format them. Every component logs errors only by default.
+     */
+    typedef enum
+    {
+        KMLOG_QUIET = 0,
+        KMLOG_ERROR,
+        KMLOG_WARNING,
+        KMLOG_INFO,
+        KMLOG_DEBUG
+    } kmlog_level;
+
+    typedef enum
+    {
+        KMLOG_DEMUX = 0,            /* TS demuxer */
+        KMLOG_MUX,                  /* MP4 muxer */
+        KMLOG_GPAC,                 /* GPAC import and writing, every GPAC tool */
+        KMLOG_COMPONENT_COUNT
+    } kmlog_component;
+
+    /* called with every message logged, from the thread logging it */
+    typedef void (*kmlog_sink)(void *ctx, kmlog_component component, kmlog_level level, const char *message);
+
+    extern volatile int kmlog_levels[KMLOG_COMPONENT_COUNT];
+
+    void kmlog_set_level(kmlog_component component, kmlog_level level);
+    /* set the level of every component */
+    void kmlog_set_levels(kmlog_level level);
+    /* NULL writes the messages to stderr, the default */
+    void kmlog_set_sink(kmlog_sink sink, void *ctx);
+
+    const char *kmlog_component_name(kmlog_component component);
+
+    void kmlog_write(kmlog_component component, kmlog_level level, const char *format, ...)
+#ifdef __GNUC__
+        __attribute__((format(printf, 3, 4)))
+#endif
+        ;
+
+#define KMLOG(component, level, ...) do { if (kmlog_levels[component] >= (level)) kmlog_write((component), (level), __VA_ARGS__); } while (0)
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KMLOG_H_INCLUDED
@@ -0,0 +1,96 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#include "kmmem.h"
+
+#include <stdlib.h>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+static const char *kmmem_stage_names[KMMEM_STAGE_COUNT] = { "demuxBuffers", "streamBuffers", "gpacImport", "interleave", "close" };
+
+static void kmmem_raise_peak(kmmem_usage *usage, long long bytes)
+{
+    long long peak = usage->peak;
+    while (bytes > peak && !__sync_bool_compare_and_swap(&usage->peak, peak, bytes)) peak = usage->peak;
+}
+
+void kmmem_add(kmmem_stats *stats, kmmem_stage stage, long long bytes)
+{
+    if (!stats || stage >= KMMEM_STAGE_COUNT || !bytes) return;
+    kmmem_raise_peak(&stats->stages[stage], __sync_add_and_fetch(&stats->stages[stage].current, bytes));
+}
+
+long long kmmem_heap_in_use(void)
+{
+#if defined(__APPLE__)
+    malloc_statistics_t statistics;
+    malloc_zone_statistics(NULL, &statistics);
+    return (long long) statistics.size_in_use;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return (long long) (info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+    struct mallinfo info = mallinfo();
+    return (long long) (unsigned int) info.uordblks + (unsigned int) info.hblkhd;
+#else
+    return -1;
+#endif
+}
+
+void kmmem_begin(kmmem_span *span, kmmem_stats *stats, kmmem_stage stage)
+{
+    span->stats = (stage < KMMEM_STAGE_COUNT) ? stats : NULL;
+    span->stage = stage;
+    span->base = span->stats ? kmmem_heap_in_use() : -1;
+    if (span->base < 0) span->stats = NULL;
+}
+
+void kmmem_sample(kmmem_span *span)
+{
+    if (span && span->stats) kmmem_raise_peak(&span->stats->stages[span->stage], span->stats->stages[span->stage].current + kmmem_heap_in_use() - span->base);
+}
+
+void kmmem_end(kmmem_span *span)
+{
+    long long growth;
+
+    if (!span->stats) return;
+    growth = kmmem_heap_in_use() - span->base;
+    kmmem_raise_peak(&span->stats->stages[span->stage], __sync_add_and_fetch(&span->stats->stages[span->stage].current, growth));
+    span->stats = NULL;
+}
+
+const char *kmmem_stage_name(kmmem_stage stage)
+{
+    return stage < KMMEM_STAGE_COUNT ? kmmem_stage_names[stage] : "";
+}
@@ -0,0 +1,89 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+#ifndef KMMEM_H_INCLUDED
+#define KMMEM_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    /*
+     Opt-in accounting of the memory held by each conversion stage, to size the memory of conversion jobs.
+     The demuxer counts the bytes of its own buffers as they are allocated. GPAC allocations cannot be hooked,
+     so its stages record the growth of the process heap over its size when the stage began, sampled as GPAC
+     reports progress: work running concurrently in the process is included.
+     A kmmem_stats can be shared by conversions running on several threads, its counters are updated atomically
+     and the growth of every span of a sampled stage is added to its current value. The figures of the sampled
+     stages are only meaningful when their spans do not overlap: concurrent spans count the growth of each other.
+     */
+    typedef enum
+    {
+        KMMEM_DEMUX_BUFFERS = 0,    /* input buffer and reassembled PES buffers of the demuxers */
+        KMMEM_STREAM_BUFFERS,       /* per PID state of the demuxers, ES and timing file buffers included */
+        KMMEM_GPAC_IMPORT,          /* heap growth while GPAC imports the elementary streams, sample tables included */
+        KMMEM_INTERLEAVE,           /* heap growth while the sample tables are compacted and the chunks interleaved */
+        KMMEM_CLOSE,                /* heap growth while gf_isom_close writes the file, negative once the tables are released */
+        KMMEM_STAGE_COUNT
+    } kmmem_stage;
+
+    typedef struct
+    {
+        volatile long long current; /* bytes held now, or the sum of the growth of the ended spans of a sampled stage */
+        volatile long long peak;    /* largest current value */
+    } kmmem_usage;
+
+    typedef struct
+    {
+        kmmem_usage stages[KMMEM_STAGE_COUNT];
+    } kmmem_stats;
+
+    /* a sampled stage being measured */
+    typedef struct
+    {
+        kmmem_stats *stats;         /* NULL when not measured */
+        kmmem_stage stage;
+        long long base;             /* heap in use when the stage began */
+    } kmmem_span;
+
+    /* add bytes (negative when released) to a counted stage, nothing if stats is NULL */
+    void kmmem_add(kmmem_stats *stats, kmmem_stage stage, long long bytes);
+
+    /* bytes allocated on the process heap, -1 if the allocator cannot tell */
+    long long kmmem_heap_in_use(void);
+
+    /* sample the heap growth of a stage, nothing if stats is NULL or the heap cannot be measured */
+    void kmmem_begin(kmmem_span *span, kmmem_stats *stats, kmmem_stage stage);
+    void kmmem_sample(kmmem_span *span);
+    void kmmem_end(kmmem_span *span);
+
+    const char *kmmem_stage_name(kmmem_stage stage);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KMMEM_H_INCLUDED
@@ -0,0 +1,193 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#include "kmtrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+typedef struct
+{
+    const char *name;
+    unsigned long long ts;
+    unsigned long long dur;
+    int tid;
+    char args[256];
+} kmtrace_event;
+
+volatile int kmtrace_enabled = 0;
+
+static pthread_mutex_t kmtrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *kmtrace_path = NULL;
+static kmtrace_event *kmtrace_events = NULL;
+static size_t kmtrace_count = 0;
+static size_t kmtrace_capacity = 0;
+static int kmtrace_threads = 0;
+
+/* small per thread number, more readable in the viewer than a pthread_t */
+static __thread int kmtrace_tid = 0;
+
+unsigned long long kmtrace_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long) tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+int kmtrace_start(const char *path)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&kmtrace_lock);
+    if (!kmtrace_path && path) {
+        kmtrace_path = strdup(path);
+        kmtrace_count = 0;
+        kmtrace_enabled = 1;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&kmtrace_lock);
+
+    return rc;
+}
+
+static void kmtrace_write_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', fp);
+        if ((unsigned char) *s < 0x20) fprintf(fp, "\\u%04x", *s);
+        else fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+int kmtrace_stop(void)
+{
+    FILE *fp;
+    size_t i;
+    int rc = -1;
+
+    pthread_mutex_lock(&kmtrace_lock);
+    if (kmtrace_path) {
+        kmtrace_enabled = 0;
+
+        fp = fopen(kmtrace_path, "w");
+        if (fp) {
+            fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            for (i = 0; i < kmtrace_count; i++) {
+                kmtrace_event *ev = &kmtrace_events[i];
+                fprintf(fp, "%s{\"name\":", i ? ",\n" : "");
+                kmtrace_write_string(fp, ev->name);
+                fprintf(fp, ",\"cat\":\"ts2mp4\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%d,\"args\":{%s}}",
+                        ev->ts, ev->dur, ev->tid, ev->args);
+            }
+            fprintf(fp, "\n]}\n");
+            rc = fclose(fp) ? -1 : 0;
+        }
+
+        free(kmtrace_path);
+        kmtrace_path = NULL;
+        free(kmtrace_events);
+        kmtrace_events = NULL;
+        kmtrace_count = kmtrace_capacity = 0;
+    }
+    pthread_mutex_unlock(&kmtrace_lock);
+
+    return rc;
+}
+
+void kmtrace_begin(kmtrace_span *span, const char *name)
+{
+    span->name = name;
+    span->args[0] = 0;
+    span->start = kmtrace_enabled ? kmtrace_now() : 0;
+}
+
+void kmtrace_arg(kmtrace_span *span, const char *key, const char *value)
+{
+    size_t l;
+    char *p;
+
+    if (!span->start) return;
+
+    l = strlen(span->args);
+    p = span->args + l;
+    if (l + strlen(key) + 6 >= sizeof(span->args)) return;
+
+    p += sprintf(p, "%s\"%s\":\"", l ? "," : "", key);
+    for (; *value && p < span->args + sizeof(span->args) - 4; value++) {
+        if (*value == '"' || *value == '\\') *p++ = '\\';
+        *p++ = ((unsigned char) *value < 0x20) ? ' ' : *value;
+    }
+    *p++ = '"';
+    *p = 0;
+}
+
+void kmtrace_arg_int(kmtrace_span *span, const char *key, long long value)
+{
+    size_t l;
+
+    if (!span->start) return;
+
+    l = strlen(span->args);
+    snprintf(span->args + l, sizeof(span->args) - l, "%s\"%s\":%lld", l ? "," : "", key, value);
+}
+
+void kmtrace_end(kmtrace_span *span)
+{
+    unsigned long long end;
+
+    if (!span->start || !kmtrace_enabled) return;
+
+    end = kmtrace_now();
+
+    pthread_mutex_lock(&kmtrace_lock);
+    if (!kmtrace_tid) kmtrace_tid = ++kmtrace_threads;
+
+    if (kmtrace_count == kmtrace_capacity) {
+        size_t capacity = kmtrace_capacity ? kmtrace_capacity * 2 : 256;
+        kmtrace_event *events = (kmtrace_event *) realloc(kmtrace_events, capacity * sizeof(kmtrace_event));
+        if (events) {
+            kmtrace_events = events;
+            kmtrace_capacity = capacity;
+        }
+    }
+    if (kmtrace_count < kmtrace_capacity) {
+        kmtrace_event *ev = &kmtrace_events[kmtrace_count++];
+        ev->name = span->name;
+        ev->ts = span->start;
+        ev->dur = end - span->start;
+        ev->tid = kmtrace_tid;
+        memcpy(ev->args, span->args, sizeof(ev->args));
+    }
+    pthread_mutex_unlock(&kmtrace_lock);
+
+    span->start = 0;
+}
@@ -0,0 +1,64 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#ifndef KMTRACE_H_INCLUDED
+#define KMTRACE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    /*
+     Process wide recording of the conversion stages as spans, saved in the Chrome trace event
+     format (chrome://tracing, https://ui.perfetto.dev).
+     While no trace is started every call below returns immediately.
+     */
+    typedef struct
+    {
+        const char *name;           /* static string naming the stage */
+        unsigned long long start;   /* microseconds, 0 if the trace was off when the span began */
+        char args[256];             /* JSON members added with kmtrace_arg* */
+    } kmtrace_span;
+
+    extern volatile int kmtrace_enabled;
+
+    /* start recording, the events are written to path by kmtrace_stop. Return 0 on success, -1 if a trace is already running */
+    int kmtrace_start(const char *path);
+    /* stop recording and write the trace file. Return 0 on success */
+    int kmtrace_stop(void);
+
+    /* microseconds since an arbitrary origin */
+    unsigned long long kmtrace_now(void);
+
+    void kmtrace_begin(kmtrace_span *span, const char *name);
+    void kmtrace_arg(kmtrace_span *span, const char *key, const char *value);
+    void kmtrace_arg_int(kmtrace_span *span, const char *key, long long value);
+    void kmtrace_end(kmtrace_span *span);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KMTRACE_H_INCLUDED
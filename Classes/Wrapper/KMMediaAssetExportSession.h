@@ -29,17 +29,19 @@
 /**
  KMMediaAssetExportSession allow you to:
  - convert a single MPEG-TS file to a MP4 file;
- - concatenate multiple MPEG-TS files and convert it to a MP4 file.
+ - concatenate multiple MPEG-TS files and convert it to a MP4 file;
+ - extract only some of the streams, for instance the audio into a M4A file.
  
  In order to concatenate multiple MPEG-TS files, they MUST have the same audio format and the same resolution. If not, a MP4 file is still produced as an output but it wont be readable.
+ Their clocks and video frame rates may differ: each MPEG-TS file starts where the previous one ends, and the video samples keep their own durations.
  
  The concatenation and the conversion are done asynchronously.
  
  The conversion of a TS file into a MP4 file is done in two steps.
  
- The first step is the demuxing of the TS files. It consist of extracting the audio and the video elementary streams of the TS files and saving them into two distinct files on the disk in a temporary directory.
+ The first step is the demuxing of the TS files. It consist of extracting the audio and the video elementary streams of the TS files and saving each of them (one per PID) into a distinct file on the disk in a temporary directory.
  
- The second step is the muxing of the two elementary streams. It consist of assemble the two elementary streams into one MP4 file.
+ The second step is the muxing of the elementary streams. It consist of assemble every video and audio elementary stream, with its language, into one MP4 file.
  
  The concatenation of multiple TS files into a single MP4 file follow the same steps but the elementary streams are concatenated.
  */
@@ -47,6 +49,7 @@
 
 #import <Foundation/Foundation.h>
 #import "KMMediaAsset.h"
+#import "KMMediaConversionCache.h"
 
 /*
  Export session status
@@ -71,14 +74,233 @@ typedef NS_ENUM(NSUInteger, KMMediaAssetExportSessionErrorCode) {
     KMMediaAssetExportSessionErrorCodeInvalidOutput,
     KMMediaAssetExportSessionErrorCodeUnsupportedOperation,
     KMMediaAssetExportSessionErrorCodeDemuxOperationFailed,
+    KMMediaAssetExportSessionErrorCodeMuxOperationFailed,
 };
 
+/*
+ Keys of the description of a TS asset returned by probeAsset:error:
+ */
+static NSString *KMMediaAssetProbeDurationKey = @"duration";            /* NSNumber, seconds from the first timestamp to the end of the last one */
+static NSString *KMMediaAssetProbeBitrateKey = @"bitrate";              /* NSNumber, bits per second estimated from the file size and the duration */
+static NSString *KMMediaAssetProbeEstimatedKey = @"estimated";          /* NSNumber, boolean: the timestamps are discontinuous, the duration is
+                                                                           estimated from the file size and the bitrate of its head */
+static NSString *KMMediaAssetProbeSizeKey = @"size";                    /* NSNumber, file size in bytes */
+static NSString *KMMediaAssetProbePacketLengthKey = @"packetLength";    /* NSNumber, 188 (TS), 192 (M2TS) or 204 */
+static NSString *KMMediaAssetProbeStreamsKey = @"streams";              /* NSArray of NSDictionary, one per elementary stream: */
+static NSString *KMMediaAssetProbeStreamPIDKey = @"pid";                /*   NSNumber */
+static NSString *KMMediaAssetProbeStreamProgramKey = @"program";        /*   NSNumber, program number */
+static NSString *KMMediaAssetProbeStreamTypeKey = @"streamType";        /*   NSNumber, PMT stream_type */
+static NSString *KMMediaAssetProbeStreamCodecKey = @"codec";            /*   NSString: 264, aac, ac3, m2v, mp3, vc1, pcm, dts */
+static NSString *KMMediaAssetProbeStreamVideoKey = @"video";            /*   NSNumber, boolean */
+static NSString *KMMediaAssetProbeStreamLanguageKey = @"language";      /*   NSString, ISO 639-2 code, empty if not signaled */
+static NSString *KMMediaAssetProbeStreamFPSKey = @"fps";                /*   NSNumber, 0 if unknown or not a video stream */
+static NSString *KMMediaAssetProbeStreamStartKey = @"start";            /*   NSNumber, seconds from the start of the asset to the first timestamp of the stream */
+
+/*
+ Elementary streams extracted from the input assets, the others are skipped right after their packet header
+ */
+typedef NS_OPTIONS(NSUInteger, KMMediaAssetExportSessionStreams) {
+    KMMediaAssetExportSessionStreamsAll         = 0,
+    KMMediaAssetExportSessionStreamsVideo       = 1 << 0,   /* every video stream */
+    KMMediaAssetExportSessionStreamsAudio       = 1 << 1,   /* every audio stream */
+    KMMediaAssetExportSessionStreamsFirstVideo  = 1 << 2,   /* the first video stream found */
+    KMMediaAssetExportSessionStreamsFirstAudio  = 1 << 3,   /* the first audio stream found */
+};
+
+/*
+ Layout of the MP4 output files
+ */
+typedef NS_ENUM(NSInteger, KMMediaAssetExportSessionStorage) {
+    KMMediaAssetExportSessionStorageDefault,        /* moov first, audio and video chunks interleaved: local playback and progressive download */
+    KMMediaAssetExportSessionStorageFlat,           /* each track stored in one piece, moov last: archival, cannot be played while downloaded */
+    KMMediaAssetExportSessionStorageStreamable,     /* each track stored in one piece, moov first */
+    KMMediaAssetExportSessionStorageInterleaved,    /* moov first, chunks interleaved strictly every interleaveDuration */
+    KMMediaAssetExportSessionStorageTight,          /* moov first, samples interleaved one by one: smallest reads at the cost of a larger moov */
+};
+
+/*
+ Level of the messages logged by the demuxer, the muxer and GPAC
+ */
+typedef NS_ENUM(NSInteger, KMMediaAssetExportSessionLogLevel) {
+    KMMediaAssetExportSessionLogLevelQuiet,
+    KMMediaAssetExportSessionLogLevelError,         /* the default */
+    KMMediaAssetExportSessionLogLevelWarning,
+    KMMediaAssetExportSessionLogLevelInfo,
+    KMMediaAssetExportSessionLogLevelDebug,         /* GPAC formats a message per imported sample: for diagnosis only */
+};
+
+/* Components logging messages */
+static NSString *KMMediaAssetExportSessionLogDemux = @"demux";
+static NSString *KMMediaAssetExportSessionLogMux = @"mux";
+static NSString *KMMediaAssetExportSessionLogGPAC = @"gpac";
+
+/*
+ Conversion stages of memoryUsage
+ */
+static NSString *KMMediaAssetExportSessionMemoryDemuxBuffers = @"demuxBuffers";      /* input buffers and PES buffers of the demuxers */
+static NSString *KMMediaAssetExportSessionMemoryStreamBuffers = @"streamBuffers";    /* per PID state of the demuxers, ES file buffers included */
+static NSString *KMMediaAssetExportSessionMemoryGPACImport = @"gpacImport";          /* GPAC import of the elementary streams, sample tables included */
+static NSString *KMMediaAssetExportSessionMemoryInterleave = @"interleave";          /* interleaving of the chunks */
+static NSString *KMMediaAssetExportSessionMemoryClose = @"close";                    /* writing of the file by GPAC */
+static NSString *KMMediaAssetExportSessionMemoryPeakKey = @"peak";                   /* NSNumber, bytes */
+static NSString *KMMediaAssetExportSessionMemoryCurrentKey = @"current";             /* NSNumber, bytes still held at the end of the export,
+                                                                                         or the heap growth summed over the runs of a GPAC stage */
+
 
 @interface KMMediaAssetExportSession : NSObject
 
 /* The export session’s output assets */
  @property (nonatomic, strong) NSArray *outputAssets;
 
+/*
+ When greater than zero, the input asset is cut into chunks of about splitInterval seconds, each one starting on a keyframe.
+ The chunks are converted concurrently, each into its own MP4 file named after the output asset (movie-001.mp4, movie-002.mp4, ...).
+ Only a single input asset can be split.
+ */
+@property (nonatomic) NSTimeInterval splitInterval;
+
+/* The MP4 files produced by a split export, in playback order */
+@property (nonatomic, readonly) NSArray *splitOutputAssets;
+
+/*
+ When greater than zero, the input asset is written as CMAF segments of about segmentDuration seconds, each one starting on a keyframe,
+ instead of a single MP4 file: an init segment (movie-init.mp4), media segments (movie-001.m4s, movie-002.m4s, ...)
+ and a HLS media playlist (movie.m3u8), named after the output asset. The segments are demuxed and written concurrently.
+ Only a single input asset can be segmented, the storage and segmentIndex options do not apply.
+ */
+@property (nonatomic) NSTimeInterval segmentDuration;
+
+/* The init segment of a segmented export */
+@property (nonatomic, readonly) KMMediaAsset *segmentInitializationAsset;
+
+/* The media segments of a segmented export, in playback order */
+@property (nonatomic, readonly) NSArray *segmentOutputAssets;
+
+/* The media playlist of a segmented export */
+@property (nonatomic, readonly) NSURL *playlistURL;
+
+/*
+ When greater than one, a single input asset is cut into up to demuxRanges byte ranges of at least 1 MB, demuxed concurrently.
+ Each range is seeded with the PAT/PMT read from the head of the file, and the elementary streams of the ranges are concatenated
+ before muxing: the output is the same as with a single demuxer. Set it to the number of cores to convert large files,
+ the demux scales until the storage saturates. Only a single input asset can be demuxed by ranges, the cache takes precedence
+ and split, segmented and all-programs exports ignore it.
+ */
+@property (nonatomic) NSUInteger demuxRanges;
+
+/*
+ When YES, every program of a multi-program transport stream is extracted in a single read of the inputs
+ and muxed into its own MP4 file named after the output asset and the program number (movie-1.mp4, movie-2.mp4, ...).
+ */
+@property (nonatomic) BOOL allPrograms;
+
+/* The MP4 files produced by an all-programs export, ordered by program number */
+@property (nonatomic, readonly) NSArray *programOutputAssets;
+
+/*
+ When set, every input asset is demuxed on its own and its elementary streams are kept in this cache,
+ so the input assets already converted by a session sharing the cache are not demuxed again.
+ The input assets must each start on a PES boundary, as HLS segments do. Split and all-programs exports ignore the cache.
+ */
+@property (nonatomic, strong) KMMediaConversionCache *cache;
+
+/*
+ When set, the demux of the input assets is checkpointed into this file every checkpointInterval bytes of input: the state of the demuxer,
+ the input offset and the length of the elementary stream files, which are kept in the directory of the same name with a .streams extension.
+ An export of the same input assets started again with the same checkpointURL after the process was killed or the export cancelled
+ resumes the demux from the last checkpoint instead of the start, then muxes again. Both are removed when the export ends otherwise.
+ The cache and demuxRanges take precedence, split, segmented and all-programs exports ignore it.
+ */
+@property (nonatomic, strong) NSURL *checkpointURL;
+
+/* Input bytes between two checkpoints of the demux, 0 (the default) for 64 MB */
+@property (nonatomic) unsigned long long checkpointInterval;
+
+/*
+ When set, it is called on the export queue with each complete PES packet of the input assets, in input order:
+ the PID of its elementary stream, its payload, only valid during the call, and its presentation time in seconds
+ on the timeline of the output. The cache, demuxRanges and checkpointURL cannot be used with it,
+ split, segmented and all-programs exports ignore it.
+ */
+@property (nonatomic, copy) void (^packetHandler)(NSUInteger pid, NSData *payload, NSTimeInterval pts);
+
+/*
+ When YES and the output asset already exists, the input assets are appended at the end of its tracks instead of overwriting it,
+ so extending a recording by a new segment only converts that segment. The existing samples are copied as they are, not converted again.
+ Every audio and video stream must have the same format (codec configuration, resolution) as the matching track of the output asset,
+ otherwise the export fails and the output asset is left unchanged. Split and all-programs exports cannot append.
+ */
+@property (nonatomic) BOOL appendToOutput;
+
+/* Layout of the MP4 output files, KMMediaAssetExportSessionStorageDefault by default */
+@property (nonatomic) KMMediaAssetExportSessionStorage storage;
+
+/*
+ Duration in seconds of the chunks of the interleaved layouts, 0 (the default) to let GPAC choose.
+ Short chunks make seeks and progressive download read less data, long chunks make sequential reads and the moov smaller.
+ */
+@property (nonatomic) NSTimeInterval interleaveDuration;
+
+/* Size in bytes above which a chunk is split, 0 (the default) for no limit */
+@property (nonatomic) NSUInteger maximumChunkSize;
+
+/*
+ When YES, a segment index (sidx box) is written before the media data of the MP4 files. It maps the time ranges
+ starting on video keyframes to byte ranges, so a remote player can seek with one small range request
+ instead of downloading the sample tables first.
+ */
+@property (nonatomic) BOOL segmentIndex;
+
+/*
+ When YES, the sample sizes of the MP4 files are stored on 16 or fewer bits (stz2 box) when they all fit, for a smaller moov box.
+ NO by default: some players and tools only read the standard sample size box.
+ */
+@property (nonatomic) BOOL compactSampleSizes;
+
+/*
+ Size in bytes (NSNumber) of the moov box of each MP4 file written by the export, keyed by the file URL.
+ Players download and parse the whole moov box before showing the first frame.
+ */
+@property (nonatomic, readonly) NSDictionary *movieBoxSizes;
+
+/*
+ When set, the time spent in every conversion stage (demux of each input file, import of each track, interleaving, writing)
+ is recorded and saved into this file in the Chrome trace event format, to be opened in chrome://tracing or ui.perfetto.dev.
+ Tracing is process wide: it is ignored while another export session is being traced.
+ */
+@property (nonatomic, strong) NSURL *traceURL;
+
+/*
+ When set, every TS packet demuxed by the export is recorded into this file: its offset, PID, flags, continuity counter,
+ PCR, PTS, DTS and payload length, in fixed-size binary records (see Classes/TSDemux/tstrace.h), to diagnose broken inputs.
+ The file keeps the last 1048576 packets (48MB). Print or summarize it with Tools/tstrace.
+ */
+@property (nonatomic, strong) NSURL *packetTraceURL;
+
+/*
+ When YES, the memory held by each conversion stage is measured and reported in memoryUsage, to size the memory of conversion jobs.
+ The buffers of the demuxers are counted as they are allocated. GPAC allocations are sampled from the growth of the process heap
+ during each GPAC stage, so they include anything else the process allocates concurrently. NO by default.
+ */
+@property (nonatomic) BOOL measuresMemory;
+
+/*
+ Memory of each conversion stage of the last export measuring it, keyed by the KMMediaAssetExportSessionMemory stages.
+ Each value is a NSDictionary holding KMMediaAssetExportSessionMemoryPeakKey and KMMediaAssetExportSessionMemoryCurrentKey.
+ The peaks of the demuxers running concurrently add up. The GPAC stages are relative to the heap in use when they begin,
+ their figures are only meaningful when they do not overlap: the concurrent imports of several streams count each other's growth.
+ */
+@property (nonatomic, readonly) NSDictionary *memoryUsage;
+
+/*
+ The elementary streams to export, all of them by default.
+ A KMMediaFormatM4A output asset only holds audio: it exports every audio stream unless audio streams are selected.
+ */
+@property (nonatomic) KMMediaAssetExportSessionStreams streams;
+
+/* PIDs (NSNumber) of elementary streams exported in addition to the streams selection, whatever their type */
+@property (nonatomic, strong) NSArray *streamPIDs;
+
 /* Indicates the status of the export session */
 @property (nonatomic, readonly) KMMediaAssetExportSessionStatus status;
 
@@ -91,6 +313,32 @@ typedef NS_ENUM(NSUInteger, KMMediaAssetExportSessionErrorCode) {
  */
 @property (nonatomic, readonly) NSError *error;
 
+/**
+ Describe a TS asset without converting it: only the head of its file (PAT/PMT, first timestamps, frame rates)
+ and a small window at its end (last timestamps) are read, whatever its size
+ @param asset a KMMediaFormatTS asset
+ @param error set when the file is empty, is not a TS file or has no elementary stream
+ @return the description, see KMMediaAssetProbeDurationKey and the following keys, nil on error
+ */
++ (NSDictionary *)probeAsset:(KMMediaAsset *)asset error:(NSError **)error;
+
+/**
+ Set the log level of every component, process wide. The messages above it are neither formatted nor written
+ */
++ (void)setLogLevel:(KMMediaAssetExportSessionLogLevel)level;
+
+/**
+ Set the log level of a single component, process wide
+ @param component KMMediaAssetExportSessionLogDemux, KMMediaAssetExportSessionLogMux or KMMediaAssetExportSessionLogGPAC
+ */
++ (void)setLogLevel:(KMMediaAssetExportSessionLogLevel)level forComponent:(NSString *)component;
+
+/**
+ Receive the log messages instead of having them written to stderr
+ @param handler called from the thread logging each message, nil to write them to stderr again
+ */
++ (void)setLogHandler:(void (^)(NSString *component, KMMediaAssetExportSessionLogLevel level, NSString *message))handler;
+
 /**
  Initialize an KMMediaAssetExportSession and set the list of input assets to be exported but the list of assets which are the result of the export session's output have to be set via the outputAssets property
  @param inputAssets An array of KMMediaAsset that are intended to be exported. The order of the assets in the NSArray determine the order in which they are concatenated.
@@ -110,7 +358,7 @@ typedef NS_ENUM(NSUInteger, KMMediaAssetExportSessionErrorCode) {
 - (BOOL)isAValidExportSession;
 
 /** 
- Starts the asynchronous execution of an export session. If the output asset already exists it is overwritten by the export.
+ Starts the asynchronous execution of an export session. If the output asset already exists it is overwritten by the export, unless appendToOutput is set.
  @param handler
  If internal preparation for export fails, the handler will be invoked synchronously.
  The handler may also be called asynchronously after -exportAsynchronouslyWithCompletionHandler: returns,
@@ -121,19 +369,17 @@ typedef NS_ENUM(NSUInteger, KMMediaAssetExportSessionErrorCode) {
  */
 - (void)exportAsynchronouslyWithCompletionHandler:(void (^)(void))handler;
 
-
-/*
- TO DO
- */
-
 /* Specifies the progress of the export on a scale from 0 to 1.0.  A value of 0 means the export has not yet begun, A value of 1.0 means the export is complete.
- NOT IMPLEMENTED IN THE FIRST VERSION
- @property (nonatomic, readonly) float progress;
+ The progress is updated on a background thread, by the demuxer from the input bytes read and by the muxer from the samples imported and written.
  */
+@property (nonatomic, readonly) float progress;
 
 /*
  Cancels the execution of an export session.
-- (void)cancelExport;
+ The demux stops within a few packets, the mux at the end of the track being imported.
+ The temporary files and the outputs of the export are removed, and the status becomes KMMediaAssetExportSessionStatusCanceled
+ unless the export had already completed.
  */
+- (void)cancelExport;
 
 @end
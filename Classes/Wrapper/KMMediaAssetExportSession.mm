@@ -29,6 +29,7 @@
 
 /* MP4Mux */
 #import "mp4mux.h"
+#import "mp4boxes.h"
 
 /* TSDemux */
 #import "ts.h"
@@ -38,6 +39,13 @@
 
 /* Utils */
 #import "NSFileManager+Temporary.h"
+#import "kmtrace.h"
+#import "kmlog.h"
+#import "kmmem.h"
+
+/* System */
+#include <fcntl.h>
+#include <unistd.h>
 
 
 typedef NS_ENUM(NSUInteger, KMMediaAssetExportSessionInputType) {
@@ -51,18 +59,256 @@ typedef NS_ENUM(NSUInteger, KMMediaAssetExportSessionOutputType) {
 };
 
 static double const UndefinedFPS = -1.0;
+static u_int64_t const KMPacketTraceCapacity = 1048576;
 
 @interface KMMediaAssetExportSession ()
+{
+    kmmem_stats _memory;    /* shared by the demuxers and muxers of the export when measuresMemory is YES */
+    tstrace::writer *_packetTrace;  /* shared by the demuxers of the export when packetTraceURL is set */
+}
 @property (nonatomic, readwrite) KMMediaAssetExportSessionStatus status;
 @property (nonatomic, readwrite) float progress;
 @property (nonatomic, strong, readwrite) NSError *error;
+@property (nonatomic, strong, readwrite) NSArray *splitOutputAssets;
+@property (nonatomic, strong, readwrite) NSArray *programOutputAssets;
+@property (nonatomic, strong, readwrite) KMMediaAsset *segmentInitializationAsset;
+@property (nonatomic, strong, readwrite) NSArray *segmentOutputAssets;
+@property (nonatomic, strong, readwrite) NSURL *playlistURL;
+@property (nonatomic, strong, readwrite) NSDictionary *movieBoxSizes;
+@property (nonatomic, strong, readwrite) NSDictionary *memoryUsage;
 @property (nonatomic, strong) NSArray *inputAssets;
 @property (nonatomic) KMMediaAssetExportSessionInputType inputType;
 @property (nonatomic) KMMediaAssetExportSessionOutputType outputType;
+@property (atomic) BOOL cancelled;
 @end
 
+/*
+ Map the progress of a demuxer or of a muxer onto the progress of the export session
+ and give them a way to notice a cancellation
+ */
+struct KMProgressContext
+{
+    __unsafe_unretained KMMediaAssetExportSession *session;
+    float base;                     /* progress of the export when the operation starts */
+    float scale;                    /* share of the export taken by the operation, 0 to only check for cancellation */
+    unsigned long long total;       /* input bytes of a demuxer */
+};
+
+static int KMDemuxProgress(void *ctx, u_int64_t bytes)
+{
+    KMProgressContext *context = (KMProgressContext *)ctx;
+    if(context->scale > 0 && context->total) context->session.progress = context->base + context->scale * MIN(1., (double)bytes / context->total);
+    return context->session.cancelled;
+}
+
+static int KMMuxProgress(void *ctx, double done)
+{
+    KMProgressContext *context = (KMProgressContext *)ctx;
+    if(context->scale > 0) context->session.progress = context->base + context->scale * done;
+    return context->session.cancelled;
+}
+
+/*
+ Configure a demuxer to extract every elementary stream of its input into the given directory,
+ counting the memory of its buffers into memory and recording its packets into trace unless they are NULL
+ */
+static void KMConfigureDemuxer(ts::demuxer &cpp_demuxer, NSURL *outputDemuxDirectoryURL, kmmem_stats *memory, tstrace::writer *trace)
+{
+    cpp_demuxer.parse_only=false;
+    cpp_demuxer.es_parse=false;
+    cpp_demuxer.av_only=false;
+    cpp_demuxer.channel=0;
+    cpp_demuxer.pes_output=false;
+    cpp_demuxer.rebase=true;
+    cpp_demuxer.timing=true;
+    cpp_demuxer.prefix = [[[NSProcessInfo processInfo] globallyUniqueString] UTF8String];
+    cpp_demuxer.dst = [[outputDemuxDirectoryURL path] cStringUsingEncoding:[NSString defaultCStringEncoding]];
+    cpp_demuxer.memory = memory;
+    cpp_demuxer.trace = trace;
+}
+
+/*
+ Forward each PES reassembled by a demuxer to the packetHandler block set as its pes_ctx
+ */
+static void KMDemuxPES(void *ctx, u_int16_t pid, const ts::stream &, const pes::buffer &pes)
+{
+    void (^packetHandler)(NSUInteger, NSData *, NSTimeInterval) = (__bridge void (^)(NSUInteger, NSData *, NSTimeInterval))ctx;
+    @autoreleasepool
+    {
+        packetHandler(pid, [NSData dataWithBytesNoCopy:pes.data length:pes.len freeWhenDone:NO], pes.pts / 90000.);
+    }
+}
+
+/*
+ Keys of the track descriptions collected from a demuxer
+ */
+static NSString * const KMTrackPathKey = @"path";
+static NSString * const KMTrackLanguageKey = @"language";
+static NSString * const KMTrackProgramKey = @"program";
+static NSString * const KMTrackPIDKey = @"pid";
+static NSString * const KMTrackFirstPTSKey = @"firstPTS";
+static NSString * const KMTrackEndPTSKey = @"endPTS";       /* presentation end of the last sample */
+static NSString * const KMTrackTimingPathKey = @"timing";   /* times of each sample of a video track, optional */
+static NSString * const KMTrackFPSKey = @"fps";           /* 0 for audio tracks */
+
+/*
+ PMT stream types muxed into a MP4 file: H.264 video, AAC (ADTS or LATM) and MPEG audio.
+ Private data streams share the extension of AAC files, so the type decides
+ */
+static BOOL KMIsMuxedVideoStreamType(u_int8_t type)
+{
+    return type == 0x1b;
+}
+
+static BOOL KMIsMuxedAudioStreamType(u_int8_t type)
+{
+    return type == 0x0f || type == 0x11 || type == 0x03 || type == 0x04;
+}
+
+/*
+ Describe the elementary stream files written by a demuxer that can be muxed into a MP4 file,
+ video tracks first, each group ordered by PID
+ */
+static NSArray *KMTracksFromDemuxer(const ts::demuxer &cpp_demuxer)
+{
+    NSMutableArray *videoTracks = [NSMutableArray array];
+    NSMutableArray *audioTracks = [NSMutableArray array];
+    
+    for(std::map<u_int16_t,ts::stream>::const_iterator i=cpp_demuxer.streams.begin();i!=cpp_demuxer.streams.end();++i)
+    {
+        const ts::stream &s = i->second;
+        if(s.type == 0xff || !s.file.filename.length()) continue;
+        
+        BOOL isVideo = KMIsMuxedVideoStreamType(s.type);
+        if(!isVideo && !KMIsMuxedAudioStreamType(s.type)) continue;
+        
+        NSString *path = [NSString stringWithUTF8String:s.file.filename.c_str()];
+        
+        NSMutableDictionary *track = [@{KMTrackPathKey:path,
+                                        KMTrackLanguageKey:[NSString stringWithUTF8String:s.lang],
+                                        KMTrackProgramKey:@(s.channel),
+                                        KMTrackPIDKey:@(i->first),
+                                        KMTrackFirstPTSKey:@(s.first_pts),
+                                        KMTrackEndPTSKey:@(s.last_pts + s.frame_length),
+                                        KMTrackFPSKey:@((isVideo && s.frame_length > 0) ? 90000. / (double)s.frame_length : 0.)} mutableCopy];
+        if(s.timing.filename.length()) track[KMTrackTimingPathKey] = [NSString stringWithUTF8String:s.timing.filename.c_str()];
+        
+        if(isVideo) [videoTracks addObject:track];
+        else [audioTracks addObject:track];
+    }
+    
+    return [videoTracks arrayByAddingObjectsFromArray:audioTracks];
+}
+
 @implementation KMMediaAssetExportSession
 
+/* PTS of the track starting first */
+static unsigned long long KMTracksStartPTS(NSArray *tracks)
+{
+    return [[tracks valueForKeyPath:[@"@min." stringByAppendingString:KMTrackFirstPTSKey]] unsignedLongLongValue];
+}
+
+/* PTS of the end of the track ending last */
+static unsigned long long KMTracksEndPTS(NSArray *tracks)
+{
+    return [[tracks valueForKeyPath:[@"@max." stringByAppendingString:KMTrackEndPTSKey]] unsignedLongLongValue];
+}
+
+/*
+ Tracks to mux, each one delayed by the time between start_pts and its first sample
+ */
+static std::vector<mp4mux_track> KMMuxTracks(NSArray *tracks, double video_stream_fps, unsigned long long start_pts)
+{
+    std::vector<mp4mux_track> mux_tracks([tracks count]);
+    for(NSUInteger i = 0; i < [tracks count]; i++)
+    {
+        NSDictionary *track = tracks[i];
+        mp4mux_track &mux_track = mux_tracks[i];
+        unsigned long long first_pts = [track[KMTrackFirstPTSKey] unsignedLongLongValue];
+        
+        memset(&mux_track, 0, sizeof(mux_track));
+        mux_track.path = [track[KMTrackPathKey] UTF8String];
+        strncpy(mux_track.language, [track[KMTrackLanguageKey] UTF8String], sizeof(mux_track.language) - 1);
+        mux_track.fps = ([track[KMTrackFPSKey] doubleValue] > 0) ? video_stream_fps : 0;
+        mux_track.delay = (first_pts > start_pts) ? (first_pts - start_pts) / 90000. : 0;
+        mux_track.timing = [track[KMTrackTimingPathKey] UTF8String];
+    }
+    return mux_tracks;
+}
+
++ (NSDictionary *)probeAsset:(KMMediaAsset *)asset error:(NSError **)error
+{
+    ts::demuxer cpp_demuxer;
+    ts::probe_result result;
+    
+    if(asset.format != KMMediaFormatTS || cpp_demuxer.probe_file([[asset.url path] UTF8String], result))
+    {
+        if(error) *error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeInvalidInput userInfo:@{NSLocalizedDescriptionKey:@"The asset is not a TS file."}];
+        return nil;
+    }
+    
+    u_int64_t start_pts = 0;
+    for(size_t i = 0; i < result.streams.size(); i++)
+    {
+        if(result.streams[i].first_pts && (!start_pts || result.streams[i].first_pts < start_pts)) start_pts = result.streams[i].first_pts;
+    }
+    
+    NSMutableArray *streams = [NSMutableArray arrayWithCapacity:result.streams.size()];
+    for(size_t i = 0; i < result.streams.size(); i++)
+    {
+        const ts::probe_stream &s = result.streams[i];
+        [streams addObject:@{KMMediaAssetProbeStreamPIDKey:@(s.pid),
+                             KMMediaAssetProbeStreamProgramKey:@(s.channel),
+                             KMMediaAssetProbeStreamTypeKey:@(s.type),
+                             KMMediaAssetProbeStreamCodecKey:@(s.codec),
+                             KMMediaAssetProbeStreamVideoKey:@(s.video),
+                             KMMediaAssetProbeStreamLanguageKey:[NSString stringWithUTF8String:s.lang],
+                             KMMediaAssetProbeStreamFPSKey:@(s.fps),
+                             KMMediaAssetProbeStreamStartKey:@(s.first_pts ? (s.first_pts - start_pts) / 90000. : 0)}];
+    }
+    
+    return @{KMMediaAssetProbeDurationKey:@(result.duration / 90000.),
+             KMMediaAssetProbeBitrateKey:@(result.bitrate),
+             KMMediaAssetProbeEstimatedKey:@(result.estimated),
+             KMMediaAssetProbeSizeKey:@(result.size),
+             KMMediaAssetProbePacketLengthKey:@(result.packet_len),
+             KMMediaAssetProbeStreamsKey:streams};
+}
+
+static void (^KMLogHandler)(NSString *component, KMMediaAssetExportSessionLogLevel level, NSString *message) = nil;
+
+static void KMLogSink(void *ctx, kmlog_component component, kmlog_level level, const char *message)
+{
+    @autoreleasepool {
+        KMLogHandler([NSString stringWithUTF8String:kmlog_component_name(component)], (KMMediaAssetExportSessionLogLevel)level,
+                     [NSString stringWithUTF8String:message] ?: @"");
+    }
+}
+
++ (void)setLogLevel:(KMMediaAssetExportSessionLogLevel)level
+{
+    kmlog_set_levels((kmlog_level)level);
+}
+
++ (void)setLogLevel:(KMMediaAssetExportSessionLogLevel)level forComponent:(NSString *)component
+{
+    for(int i = 0; i < KMLOG_COMPONENT_COUNT; i++)
+    {
+        if([component isEqualToString:[NSString stringWithUTF8String:kmlog_component_name((kmlog_component)i)]]) kmlog_set_level((kmlog_component)i, (kmlog_level)level);
+    }
+}
+
++ (void)setLogHandler:(void (^)(NSString *component, KMMediaAssetExportSessionLogLevel level, NSString *message))handler
+{
+    @synchronized(self)
+    {
+        /* the sink is removed first, so the previous handler is not running while it is released */
+        kmlog_set_sink(NULL, NULL);
+        KMLogHandler = [handler copy];
+        if(KMLogHandler) kmlog_set_sink(KMLogSink, NULL);
+    }
+}
+
 - (id)initWithInputAssets:(NSArray *)inputAssets
 {
     self = [super init];
@@ -85,11 +331,61 @@ static double const UndefinedFPS = -1.0;
         return NO;
     }
     
-    /* Check output validity */
-    if([self.outputAssets count] == 1 && [[self.outputAssets filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"format=%d",KMMediaFormatMP4]] count] == 1) self.outputType = KMMediaAssetExportSessionOutputTypeMP4;
+    /* Check output validity, a M4A file is a MP4 file holding only audio */
+    if([self.outputAssets count] == 1 && [[self.outputAssets filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"format=%d OR format=%d",KMMediaFormatMP4,KMMediaFormatM4A]] count] == 1) self.outputType = KMMediaAssetExportSessionOutputTypeMP4;
     else
     {
-        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeInvalidOutput userInfo:@{NSLocalizedDescriptionKey:@"The output assets are invalid. The only valid output asset is KMMediaFormatMP4."}];
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeInvalidOutput userInfo:@{NSLocalizedDescriptionKey:@"The output assets are invalid. The only valid output assets are KMMediaFormatMP4 and KMMediaFormatM4A."}];
+        return NO;
+    }
+    
+    /* Check streams selection validity */
+    if([[self.outputAssets firstObject] format] == KMMediaFormatM4A && (self.streams & (KMMediaAssetExportSessionStreamsVideo | KMMediaAssetExportSessionStreamsFirstVideo)))
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeInvalidOutput userInfo:@{NSLocalizedDescriptionKey:@"A KMMediaFormatM4A output asset cannot hold video streams."}];
+        return NO;
+    }
+    
+    /* Check split validity */
+    if(self.splitInterval > 0 && [self.inputAssets count] != 1)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeUnsupportedOperation userInfo:@{NSLocalizedDescriptionKey:@"Only a single input asset can be split."}];
+        return NO;
+    }
+    
+    if(self.splitInterval > 0 && self.allPrograms)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeUnsupportedOperation userInfo:@{NSLocalizedDescriptionKey:@"A split export cannot extract all programs."}];
+        return NO;
+    }
+    
+    if(self.segmentDuration > 0 && ([self.inputAssets count] != 1 || self.splitInterval > 0 || self.allPrograms || self.appendToOutput))
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeUnsupportedOperation userInfo:@{NSLocalizedDescriptionKey:@"Only a single input asset can be segmented, without split, all-programs or append."}];
+        return NO;
+    }
+    
+    if(self.demuxRanges > 1 && [self.inputAssets count] != 1)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeUnsupportedOperation userInfo:@{NSLocalizedDescriptionKey:@"Only a single input asset can be demuxed by ranges."}];
+        return NO;
+    }
+    
+    if(self.packetHandler && (self.cache || self.demuxRanges > 1 || self.checkpointURL))
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeUnsupportedOperation userInfo:@{NSLocalizedDescriptionKey:@"The PES packets cannot be handled with a cache, demux ranges or a checkpoint."}];
+        return NO;
+    }
+    
+    if(self.appendToOutput && (self.splitInterval > 0 || self.allPrograms))
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeUnsupportedOperation userInfo:@{NSLocalizedDescriptionKey:@"A split or all-programs export cannot append to its output asset."}];
+        return NO;
+    }
+    
+    if(self.interleaveDuration < 0 || self.storage < KMMediaAssetExportSessionStorageDefault || self.storage > KMMediaAssetExportSessionStorageTight)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeInvalidOutput userInfo:@{NSLocalizedDescriptionKey:@"The output layout is not valid."}];
         return NO;
     }
     
@@ -119,7 +415,46 @@ static double const UndefinedFPS = -1.0;
         dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
         dispatch_async(queue, ^(void) {
             self.status = KMMediaAssetExportSessionStatusExporting;
-            if(self.inputType == KMMediaAssetExportSessionInputTypeTS && self.outputType == KMMediaAssetExportSessionOutputTypeMP4) [self convertInputAssets];
+            
+            BOOL tracing = self.traceURL && !kmtrace_start([[self.traceURL path] UTF8String]);
+            memset(&_memory, 0, sizeof(_memory));
+            if(self.packetTraceURL)
+            {
+                _packetTrace = new tstrace::writer;
+                if(!_packetTrace->open([[self.packetTraceURL path] UTF8String], KMPacketTraceCapacity))
+                {
+                    ALog(@"Cannot write the packet trace file %@", self.packetTraceURL);
+                    delete _packetTrace;
+                    _packetTrace = NULL;
+                }
+            }
+            kmtrace_span span;
+            kmtrace_begin(&span, "export");
+            
+            if(self.inputType == KMMediaAssetExportSessionInputTypeTS && self.outputType == KMMediaAssetExportSessionOutputTypeMP4)
+            {
+                if(self.splitInterval > 0) [self splitInputAsset];
+                else if(self.segmentDuration > 0) [self segmentInputAsset];
+                else if(self.allPrograms) [self convertAllPrograms];
+                else [self convertInputAssets];
+            }
+            
+            /* a cancellation arriving after the export completed is ignored */
+            if(self.cancelled && self.status != KMMediaAssetExportSessionStatusCompleted)
+            {
+                self.error = nil;
+                self.status = KMMediaAssetExportSessionStatusCanceled;
+            }
+            else if(self.status == KMMediaAssetExportSessionStatusCompleted) self.progress = 1.;
+            
+            if(self.measuresMemory) self.memoryUsage = [self memoryUsageOfStats:&_memory];
+            delete _packetTrace;
+            _packetTrace = NULL;
+            
+            kmtrace_arg_int(&span, "inputs", [self.inputAssets count]);
+            kmtrace_arg_int(&span, "status", self.status);
+            kmtrace_end(&span);
+            if(tracing && kmtrace_stop()) ALog(@"Cannot write the trace file %@", self.traceURL);
             dispatch_async(dispatch_get_main_queue(), ^(void) {
                 handler();
             });
@@ -127,22 +462,103 @@ static double const UndefinedFPS = -1.0;
     }
 }
 
+- (void)cancelExport
+{
+    self.cancelled = YES;
+}
+
+/* Statistics the demuxers and muxers of the export count their memory into, NULL unless measuresMemory is YES */
+- (kmmem_stats *)memoryStats
+{
+    return self.measuresMemory ? &_memory : NULL;
+}
+
+/* Trace file the demuxers of the export record their packets into, NULL unless packetTraceURL is set */
+- (tstrace::writer *)packetTrace
+{
+    return _packetTrace;
+}
+
+- (NSDictionary *)memoryUsageOfStats:(const kmmem_stats *)stats
+{
+    NSMutableDictionary *usage = [NSMutableDictionary dictionaryWithCapacity:KMMEM_STAGE_COUNT];
+    for(int i = 0; i < KMMEM_STAGE_COUNT; i++)
+    {
+        usage[[NSString stringWithUTF8String:kmmem_stage_name((kmmem_stage)i)]] = @{KMMediaAssetExportSessionMemoryPeakKey:@(stats->stages[i].peak),
+                                                                                    KMMediaAssetExportSessionMemoryCurrentKey:@(stats->stages[i].current)};
+    }
+    return usage;
+}
+
+/*
+ Streams selection of the demuxer, from the streams and streamPIDs properties and the output format
+ */
+- (int)demuxerStreamsSelection
+{
+    KMMediaAssetExportSessionStreams streams = self.streams;
+    if(streams == KMMediaAssetExportSessionStreamsAll && [[self.outputAssets firstObject] format] == KMMediaFormatM4A) streams = KMMediaAssetExportSessionStreamsAudio;
+    
+    int select = 0;
+    if(streams & KMMediaAssetExportSessionStreamsVideo) select |= ts::demuxer::select_video;
+    if(streams & KMMediaAssetExportSessionStreamsAudio) select |= ts::demuxer::select_audio;
+    if(streams & KMMediaAssetExportSessionStreamsFirstVideo) select |= ts::demuxer::select_first_video;
+    if(streams & KMMediaAssetExportSessionStreamsFirstAudio) select |= ts::demuxer::select_first_audio;
+    return select;
+}
+
+- (void)selectStreamsOfDemuxer:(ts::demuxer &)cpp_demuxer
+{
+    cpp_demuxer.select = [self demuxerStreamsSelection];
+    for (NSNumber *pid in self.streamPIDs)
+    {
+        cpp_demuxer.select_pids.push_back([pid unsignedShortValue]);
+    }
+}
+
+/*
+ Whether the selected streams may include video, the video FPS is only required then
+ */
+- (BOOL)exportsVideo
+{
+    int select = [self demuxerStreamsSelection];
+    return !select || [self.streamPIDs count] || (select & (ts::demuxer::select_video | ts::demuxer::select_first_video));
+}
+
+/*
+ Size in bytes of every input asset
+ */
+- (unsigned long long)inputSize
+{
+    unsigned long long size = 0;
+    for (KMMediaAsset *inputAsset in self.inputAssets)
+    {
+        size += [[[NSFileManager defaultManager] attributesOfItemAtPath:[inputAsset.url path] error:nil] fileSize];
+    }
+    return size;
+}
+
 - (void)convertInputAssets
 {
     /*
-     Create a unique temporary directory to store the elementary streams files.
+     Create a unique temporary directory to store the elementary streams files,
+     or reuse the one of the checkpoints to resume an interrupted demux.
      May be nil.
      */
-    NSURL *temporaryDirectoryURL = [[NSFileManager defaultManager] createUniqueTemporaryDirectory];
+    NSURL *temporaryDirectoryURL = [self checkpointsDemux] ? [self checkpointDirectoryURL] : [[NSFileManager defaultManager] createUniqueTemporaryDirectory];
     
     /*
      Demux the input assets into the unique temporary directory
-     Create two files into it:
-     - a file storing the audio elementary stream of the MPEG-TS files (mp3 or aac)
-     - a file storing the video elementary stream of the MPEG-TS files (h264)
+     Create one file per elementary stream into it, for instance:
+     - a file storing each audio elementary stream of the MPEG-TS files (mp3 or aac)
+     - a file storing each video elementary stream of the MPEG-TS files (h264)
      Return the video elementary stream number of frames per second of the MPEG-TS files (h264)
+     and the description of every track to mux
      */
-    double video_stream_fps = [self getVideoFPSAndDemuxFilesInTemporaryDirectory:temporaryDirectoryURL];
+    NSArray *tracks = nil;
+    double video_stream_fps;
+    if(self.cache) video_stream_fps = [self getVideoFPSAndDemuxCachedFilesInTemporaryDirectory:temporaryDirectoryURL tracks:&tracks];
+    else if(self.demuxRanges > 1) video_stream_fps = [self getVideoFPSAndDemuxRangesInTemporaryDirectory:temporaryDirectoryURL tracks:&tracks];
+    else video_stream_fps = [self getVideoFPSAndDemuxFilesInTemporaryDirectory:temporaryDirectoryURL tracks:&tracks];
     
     if(video_stream_fps != UndefinedFPS)
     {
@@ -150,13 +566,22 @@ static double const UndefinedFPS = -1.0;
          Mux the elementary stream stored in as files in the unique temporary directory
          into a MP4 file and store it in the outputAsset
          */
-        [self muxFilesFromTemporaryDirectory:temporaryDirectoryURL withVideoStreamFPS:video_stream_fps];
+        KMProgressContext muxProgress = {self, .5f, .5f, 0};
+        NSError *muxError = [self muxTracks:tracks intoOutputAsset:[self.outputAssets firstObject] withVideoStreamFPS:video_stream_fps progress:&muxProgress];
+        if(muxError)
+        {
+            self.error = muxError;
+            self.status = KMMediaAssetExportSessionStatusFailed;
+        }
+        else self.status = KMMediaAssetExportSessionStatusCompleted;
     }
-    else ALog(@"The video stream's FPS should always be retrieved");
+    else if(!self.cancelled) ALog(@"The video stream's FPS should always be retrieved");
     
     /*
-     Delete the temporary directory
+     Delete the checkpoint and the temporary directory, a cancelled export keeps its checkpoint to be resumed
      */
+    if([self checkpointsDemux] && self.cancelled && self.status != KMMediaAssetExportSessionStatusCompleted) return;
+    if([self checkpointsDemux]) [[NSFileManager defaultManager] removeItemAtURL:self.checkpointURL error:nil];
     NSError *error;
     if(![[NSFileManager defaultManager] removeItemAtPath:[temporaryDirectoryURL path]error:&error])
     {
@@ -164,8 +589,22 @@ static double const UndefinedFPS = -1.0;
     }
 }
 
+/* The demux of convertInputAssets is checkpointed */
+- (BOOL)checkpointsDemux
+{
+    return self.checkpointURL && !self.cache && self.demuxRanges <= 1;
+}
 
-- (double)getVideoFPSAndDemuxFilesInTemporaryDirectory:(NSURL *)outputDemuxDirectoryURL
+/* Directory of the elementary streams files of a checkpointed demux, it survives the export session to be resumed */
+- (NSURL *)checkpointDirectoryURL
+{
+    NSURL *directoryURL = [NSURL fileURLWithPath:[[self.checkpointURL path] stringByAppendingPathExtension:@"streams"]];
+    if(![[NSFileManager defaultManager] createDirectoryAtURL:directoryURL withIntermediateDirectories:YES attributes:nil error:nil]) return nil;
+    return directoryURL;
+}
+
+
+- (double)getVideoFPSAndDemuxFilesInTemporaryDirectory:(NSURL *)outputDemuxDirectoryURL tracks:(NSArray **)tracks
 {
     if(!outputDemuxDirectoryURL)
     {
@@ -178,92 +617,894 @@ static double const UndefinedFPS = -1.0;
      * Initialize the demuxer
      */
     ts::demuxer cpp_demuxer;
-    cpp_demuxer.parse_only=false;
-    cpp_demuxer.es_parse=false;
-    cpp_demuxer.dump=0;
-    cpp_demuxer.av_only=false;
-    cpp_demuxer.channel=0;
-    cpp_demuxer.pes_output=false;
-    cpp_demuxer.prefix = [[[NSProcessInfo processInfo] globallyUniqueString] UTF8String];
-    cpp_demuxer.dst = [[outputDemuxDirectoryURL path] cStringUsingEncoding:[NSString defaultCStringEncoding]];
+    KMConfigureDemuxer(cpp_demuxer, outputDemuxDirectoryURL, [self memoryStats], [self packetTrace]);
+    [self selectStreamsOfDemuxer:cpp_demuxer];
+    
+    KMProgressContext demuxProgress = {self, 0.f, .5f, [self inputSize]};
+    cpp_demuxer.progress = KMDemuxProgress;
+    cpp_demuxer.progress_ctx = &demuxProgress;
+    
+    void (^packetHandler)(NSUInteger, NSData *, NSTimeInterval) = self.packetHandler;
+    if(packetHandler)
+    {
+        cpp_demuxer.pes_callback = KMDemuxPES;
+        cpp_demuxer.pes_ctx = (__bridge void *)packetHandler;
+    }
     
     /*
-     * Demux each file with the same Demuxer will produce only two output files
-     * The concatenate audio elementary streams file and
-     * the concatenate video elementary streams file
+     * Continue the demux of an export killed after a checkpoint, the input assets before it are already demuxed
      */
-    double previous_video_fps = UndefinedFPS;
-    double current_video_fps = UndefinedFPS;
-    for (KMMediaAsset *inputAsset in self.inputAssets)
+    NSUInteger firstInput = 0;
+    double resumed_video_fps = UndefinedFPS;
+    if([self checkpointsDemux])
+    {
+        std::vector<std::string> names;
+        for (KMMediaAsset *inputAsset in self.inputAssets) names.push_back([[inputAsset.url path] UTF8String]);
+        cpp_demuxer.checkpoint_path = [[self.checkpointURL path] UTF8String];
+        if(self.checkpointInterval) cpp_demuxer.checkpoint_interval = self.checkpointInterval;
+        int resumed = cpp_demuxer.resume(names, &resumed_video_fps);
+        if(resumed >= 0) firstInput = resumed;
+    }
+    
+    /*
+     * Demux each file with the same Demuxer will produce one output file per stream
+     * Each of them concatenate the elementary streams of the same PID.
+     * The demuxer rebases the timestamps of each file after the end of the previous one, and the times
+     * of the video samples are muxed from its timing files: the files may have different FPS
+     */
+    double first_video_fps = UndefinedFPS;
+    for (NSUInteger i = firstInput; i < [self.inputAssets count]; i++)
     {
-        current_video_fps = UndefinedFPS;
-        cpp_demuxer.demux_file([[inputAsset.url path] UTF8String], &current_video_fps);
-        if(current_video_fps == UndefinedFPS)
+        KMMediaAsset *inputAsset = self.inputAssets[i];
+        double current_video_fps = i == firstInput ? resumed_video_fps : UndefinedFPS;
+        if(cpp_demuxer.demux_file([[inputAsset.url path] UTF8String], &current_video_fps) == -2) return UndefinedFPS;
+        if(current_video_fps == UndefinedFPS && [self exportsVideo])
         {
             self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"The FPS of the video stream couldn't be retrieved."}];
             self.status = KMMediaAssetExportSessionStatusFailed;
             return UndefinedFPS;
         }
-        if(previous_video_fps != UndefinedFPS && previous_video_fps != current_video_fps)
+        if(first_video_fps == UndefinedFPS) first_video_fps = current_video_fps;
+    }
+    /* the last PES of each stream */
+    if(packetHandler) cpp_demuxer.flush_pes();
+    *tracks = KMTracksFromDemuxer(cpp_demuxer);
+    /* audio only */
+    if(first_video_fps == UndefinedFPS) first_video_fps = 0;
+    return first_video_fps;
+}
+
+
+/*
+ A piece of a concatenated file: the file at source, or data when source is nil, written at offset in the file open as fd
+ */
+struct KMConcatenationPiece
+{
+    NSString *source;
+    NSData *data;
+    NSString *target;
+    off_t offset;
+    int fd;
+};
+
+/* write size bytes at offset of fd, return 0 or the errno of the failed write, ENOSPC on a full disk */
+static int KMWriteAt(int fd, const char *bytes, size_t size, off_t offset)
+{
+    while(size)
+    {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return written < 0 ? errno : EIO;
+        bytes += written;
+        size -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+/* write a piece into its concatenated file, return 0 or the errno of the failed read or write */
+static int KMWritePiece(const KMConcatenationPiece &piece)
+{
+    if(!piece.source) return KMWriteAt(piece.fd, (const char *)[piece.data bytes], [piece.data length], piece.offset);
+    
+    int in = open([piece.source fileSystemRepresentation], O_RDONLY);
+    if(in < 0) return errno;
+    
+    std::vector<char> buffer(1 << 20);
+    off_t offset = piece.offset;
+    int rc = 0;
+    while(!rc)
+    {
+        ssize_t n = read(in, &buffer[0], buffer.size());
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0)
+        {
+            if(n < 0) rc = errno;
+            break;
+        }
+        rc = KMWriteAt(piece.fd, &buffer[0], (size_t)n, offset);
+        offset += n;
+    }
+    close(in);
+    return rc;
+}
+
+/* add a piece at the end of its concatenated file, sizes holding the size of each concatenated file by path */
+static void KMAddPiece(std::vector<KMConcatenationPiece> &pieces, NSMutableDictionary *sizes, NSString *target, NSString *source, NSData *data)
+{
+    NSDictionary *attributes = source ? [[NSFileManager defaultManager] attributesOfItemAtPath:source error:nil] : nil;
+    if(source && !attributes) return;
+    
+    unsigned long long offset = [sizes[target] unsignedLongLongValue];
+    KMConcatenationPiece piece = {source, data, target, (off_t)offset, -1};
+    pieces.push_back(piece);
+    sizes[target] = @(offset + (source ? [attributes fileSize] : [data length]));
+}
+
+/*
+ Concatenate the elementary streams of segments demuxed into directories, each segment an array of tracks, by PID into outputDemuxDirectoryURL,
+ the first segment holding a PID giving its track description. The times of each segment are shifted by its offset.
+ Every piece is copied at its final offset, concurrently, except the first stream of each PID when its segment is movable: it is moved into place.
+ Return the concatenated tracks, nil with the error set when a file cannot be read or written, a full disk included
+ */
+- (NSArray *)concatenateSegments:(NSArray *)segments ofDirectories:(NSArray *)directories offsets:(const std::vector<long long> &)offsets movable:(NSIndexSet *)movable toDirectory:(NSURL *)outputDemuxDirectoryURL
+{
+    NSMutableArray *concatenatedTracks = [NSMutableArray array];
+    NSMutableDictionary *concatenatedTracksByPID = [NSMutableDictionary dictionary];
+    NSMutableDictionary *sizes = [NSMutableDictionary dictionary];      /* size of each concatenated file by path */
+    std::vector<KMConcatenationPiece> pieces;
+    
+    for(NSUInteger i = 0; i < [segments count]; i++)
+    {
+        for (NSDictionary *track in segments[i])
         {
-            self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"All video elementary stream are not at the same FPS."}];
+            NSString *name = [track[KMTrackPathKey] lastPathComponent];
+            NSString *source = [directories[i] stringByAppendingPathComponent:name];
+            NSMutableDictionary *concatenatedTrack = concatenatedTracksByPID[track[KMTrackPIDKey]];
+            if(!concatenatedTrack)
+            {
+                concatenatedTrack = [track mutableCopy];
+                concatenatedTrack[KMTrackPathKey] = [[outputDemuxDirectoryURL path] stringByAppendingPathComponent:name];
+                [concatenatedTrack removeObjectForKey:KMTrackTimingPathKey];
+                concatenatedTracksByPID[track[KMTrackPIDKey]] = concatenatedTrack;
+                [concatenatedTracks addObject:concatenatedTrack];
+                
+                /* the next streams of the PID follow the one moved into place */
+                NSString *target = concatenatedTrack[KMTrackPathKey];
+                if([movable containsIndex:i] && !rename([source fileSystemRepresentation], [target fileSystemRepresentation]))
+                {
+                    sizes[target] = @([[[NSFileManager defaultManager] attributesOfItemAtPath:target error:nil] fileSize]);
+                    source = nil;
+                }
+                else sizes[target] = @0;
+            }
+            if(source) KMAddPiece(pieces, sizes, concatenatedTrack[KMTrackPathKey], source, nil);
+            
+            /* the timing of the segment is shifted onto the output timeline */
+            NSString *timingName = [track[KMTrackTimingPathKey] lastPathComponent];
+            if(!concatenatedTrack[KMTrackTimingPathKey] && timingName) concatenatedTrack[KMTrackTimingPathKey] = [[outputDemuxDirectoryURL path] stringByAppendingPathComponent:timingName];
+            NSString *timing = concatenatedTrack[KMTrackTimingPathKey];
+            if(timing)
+            {
+                KMAddPiece(pieces, sizes, timing, nil, [[NSString stringWithFormat:@"offset %lld\n", offsets[i]] dataUsingEncoding:NSUTF8StringEncoding]);
+                if(timingName) KMAddPiece(pieces, sizes, timing, [directories[i] stringByAppendingPathComponent:timingName], nil);
+            }
+        }
+    }
+    
+    /* every concatenated file is sized first, its pieces are then written independently */
+    NSMutableDictionary *descriptors = [NSMutableDictionary dictionary];
+    int failure = 0;
+    for (NSString *target in sizes)
+    {
+        int fd = open([target fileSystemRepresentation], O_WRONLY | O_CREAT, 0644);
+        if(fd < 0 || ftruncate(fd, (off_t)[sizes[target] unsignedLongLongValue]))
+        {
+            if(!failure) failure = errno;
+            if(fd >= 0) close(fd);
+            continue;
+        }
+        descriptors[target] = @(fd);
+    }
+    for(size_t k = 0; k < pieces.size(); k++) pieces[k].fd = descriptors[pieces[k].target] ? [descriptors[pieces[k].target] intValue] : -1;
+    
+    if(!failure && !pieces.empty())
+    {
+        const KMConcatenationPiece *sharedPieces = &pieces[0];
+        __block int writeFailure = 0;
+        dispatch_apply(pieces.size(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(size_t k) {
+            int rc = KMWritePiece(sharedPieces[k]);
+            if(rc) @synchronized(self) { if(!writeFailure) writeFailure = rc; }
+        });
+        failure = writeFailure;
+    }
+    for (NSNumber *fd in [descriptors allValues])
+    {
+        if(close([fd intValue]) && !failure) failure = errno;
+    }
+    
+    if(failure)
+    {
+        NSError *underlyingError = [NSError errorWithDomain:NSPOSIXErrorDomain code:failure userInfo:nil];
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"The elementary streams couldn't be concatenated.", NSUnderlyingErrorKey:underlyingError}];
+        self.status = KMMediaAssetExportSessionStatusFailed;
+        return nil;
+    }
+    return concatenatedTracks;
+}
+
+
+/*
+ Cache entries info keys
+ */
+static NSString * const KMCacheTracksKey = @"tracks";
+static NSString * const KMCacheVideoFPSKey = @"videoFPS";
+
+/*
+ Same as getVideoFPSAndDemuxFilesInTemporaryDirectory:tracks: but every input asset is demuxed on its own, unless found in the cache,
+ then the elementary streams of the same PID are concatenated into the temporary directory
+ */
+- (double)getVideoFPSAndDemuxCachedFilesInTemporaryDirectory:(NSURL *)outputDemuxDirectoryURL tracks:(NSArray **)tracks
+{
+    if(!outputDemuxDirectoryURL)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Directory to store elementary streams files not set."}];
+        self.status = KMMediaAssetExportSessionStatusFailed;
+        return UndefinedFPS;
+    }
+    
+    /* every option changing the demuxed streams */
+    NSString *options = [NSString stringWithFormat:@"ts2mp4-2 streams=%d pids=%@", [self demuxerStreamsSelection], [self.streamPIDs componentsJoinedByString:@","]];
+    
+    NSMutableArray *segments = [NSMutableArray arrayWithCapacity:[self.inputAssets count]];
+    NSMutableArray *directories = [NSMutableArray arrayWithCapacity:[self.inputAssets count]];
+    NSMutableIndexSet *movable = [NSMutableIndexSet indexSet];     /* segments demuxed in the temporary directory, not cached */
+    NSMutableArray *leasedEntries = [NSMutableArray array];        /* not evicted until concatenated */
+    std::vector<long long> offsets;
+    double first_video_fps = UndefinedFPS;
+    NSUInteger index = 0;
+    
+    /* segments are rebased like the demuxer rebases its input files */
+    long long segment_offset = 0;
+    unsigned long long timeline_end = 0;
+    
+    for (KMMediaAsset *inputAsset in self.inputAssets)
+    {
+        NSString *key = [self.cache keyForFileAtURL:inputAsset.url options:options];
+        NSDictionary *info = nil;
+        NSURL *entryURL = key ? [self.cache entryURLForKey:key info:&info] : nil;
+        BOOL leased = entryURL != nil;     /* the entry is not evicted while concatenated */
+        
+        if(!entryURL)
+        {
+            NSString *segmentPath = [[outputDemuxDirectoryURL path] stringByAppendingPathComponent:[NSString stringWithFormat:@"segment-%lu", (unsigned long)index]];
+            [[NSFileManager defaultManager] createDirectoryAtPath:segmentPath withIntermediateDirectories:NO attributes:nil error:nil];
+            
+            double video_fps = UndefinedFPS;
+            NSArray *segmentTracks = nil;
+            int rc;
+            
+            /* the demuxer is scoped so its files are closed before being cached */
+            {
+                ts::demuxer cpp_demuxer;
+                KMConfigureDemuxer(cpp_demuxer, [NSURL fileURLWithPath:segmentPath], [self memoryStats], [self packetTrace]);
+                [self selectStreamsOfDemuxer:cpp_demuxer];
+                
+                KMProgressContext demuxProgress = {self, .5f * index / [self.inputAssets count], 0.f, 0};
+                cpp_demuxer.progress = KMDemuxProgress;
+                cpp_demuxer.progress_ctx = &demuxProgress;
+                
+                rc = cpp_demuxer.demux_file([[inputAsset.url path] UTF8String], &video_fps);
+                segmentTracks = KMTracksFromDemuxer(cpp_demuxer);
+            }
+            
+            if(rc == -2)
+            {
+                for (NSURL *leasedEntry in leasedEntries) [self.cache releaseEntryURL:leasedEntry];
+                return UndefinedFPS;
+            }
+            
+            /* the entry is relocatable: tracks refer to their files by name */
+            NSMutableArray *entryTracks = [NSMutableArray arrayWithCapacity:[segmentTracks count]];
+            for (NSDictionary *track in segmentTracks)
+            {
+                NSMutableDictionary *entryTrack = [track mutableCopy];
+                entryTrack[KMTrackPathKey] = [track[KMTrackPathKey] lastPathComponent];
+                if(track[KMTrackTimingPathKey]) entryTrack[KMTrackTimingPathKey] = [track[KMTrackTimingPathKey] lastPathComponent];
+                [entryTracks addObject:entryTrack];
+            }
+            info = @{KMCacheTracksKey:entryTracks, KMCacheVideoFPSKey:@(video_fps)};
+            
+            /* a segment that failed to demux is not cached */
+            entryURL = (key && !rc) ? [self.cache storeEntryWithKey:key fromDirectoryURL:[NSURL fileURLWithPath:segmentPath] info:info] : nil;
+            leased = entryURL != nil;
+            if(!entryURL)
+            {
+                entryURL = [NSURL fileURLWithPath:segmentPath];
+                [movable addIndex:index];
+            }
+        }
+        if(leased) [leasedEntries addObject:entryURL];
+        
+        double current_video_fps = [info[KMCacheVideoFPSKey] doubleValue];
+        if(current_video_fps == UndefinedFPS && [self exportsVideo])
+        {
+            for (NSURL *leasedEntry in leasedEntries) [self.cache releaseEntryURL:leasedEntry];
+            self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"The FPS of the video stream couldn't be retrieved."}];
             self.status = KMMediaAssetExportSessionStatusFailed;
             return UndefinedFPS;
         }
-        previous_video_fps = current_video_fps;
+        if(first_video_fps == UndefinedFPS) first_video_fps = current_video_fps;
+        
+        /* a clock continuing the previous segment within a second is kept as is */
+        NSArray *segmentTracks = info[KMCacheTracksKey];
+        if([segmentTracks count])
+        {
+            long long first = [[segmentTracks valueForKeyPath:[@"@min." stringByAppendingString:KMTrackFirstPTSKey]] longLongValue];
+            long long end = [[segmentTracks valueForKeyPath:[@"@max." stringByAppendingString:KMTrackEndPTSKey]] longLongValue];
+            if(timeline_end && llabs(first + segment_offset - (long long)timeline_end) > 90000) segment_offset = (long long)timeline_end - first;
+            timeline_end = MAX(timeline_end, (unsigned long long)(end + segment_offset));
+        }
+        
+        [segments addObject:segmentTracks ? segmentTracks : @[]];
+        [directories addObject:[entryURL path]];
+        offsets.push_back(segment_offset);
+        
+        self.progress = .5f * ++index / [self.inputAssets count];
+        if(self.cancelled)
+        {
+            for (NSURL *leasedEntry in leasedEntries) [self.cache releaseEntryURL:leasedEntry];
+            return UndefinedFPS;
+        }
     }
-    return current_video_fps;
+    
+    NSArray *concatenatedTracks = [self concatenateSegments:segments ofDirectories:directories offsets:offsets movable:movable toDirectory:outputDemuxDirectoryURL];
+    for (NSURL *leasedEntry in leasedEntries) [self.cache releaseEntryURL:leasedEntry];
+    if(!concatenatedTracks) return UndefinedFPS;
+    
+    /* video tracks first, as KMTracksFromDemuxer does */
+    *tracks = [concatenatedTracks sortedArrayUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:KMTrackFPSKey ascending:NO],
+                                                                [NSSortDescriptor sortDescriptorWithKey:KMTrackPIDKey ascending:YES]]];
+    return first_video_fps == UndefinedFPS ? 0 : first_video_fps;
 }
 
 
-- (void)muxFilesFromTemporaryDirectory:(NSURL *)inputMuxDirectoryURL withVideoStreamFPS:(double)video_stream_fps
+/*
+ Same as getVideoFPSAndDemuxFilesInTemporaryDirectory:tracks: but the single input asset is cut into byte ranges demuxed concurrently,
+ then the elementary streams of the same PID are concatenated into the temporary directory.
+ A range completes the PES packets still open at its end and skips those started before its beginning,
+ so the concatenation is the same as the output of a single demuxer.
+ */
+- (double)getVideoFPSAndDemuxRangesInTemporaryDirectory:(NSURL *)outputDemuxDirectoryURL tracks:(NSArray **)tracks
 {
-    NSError *error;
-    NSArray *inputMuxDirectoryContent = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[inputMuxDirectoryURL path] error:&error];
+    if(!outputDemuxDirectoryURL)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Directory to store elementary streams files not set."}];
+        self.status = KMMediaAssetExportSessionStatusFailed;
+        return UndefinedFPS;
+    }
     
-    if(!error)
+    NSString *inputPath = [[[self.inputAssets firstObject] url] path];
+    
+    /* the PAT/PMT every range demuxer is seeded with are read from the head of the file only */
+    ts::split_plan plan;
+    ts::demuxer cpp_planner;
+    cpp_planner.av_only=false;
+    if(cpp_planner.plan_ranges([inputPath UTF8String], (int)MIN(self.demuxRanges, (NSUInteger)INT_MAX), plan))
     {
-        /*
-         Retrieve audio elementary stream file
-         */
-        NSArray *audioExtensions = [NSArray arrayWithObjects:@"aac", @"mp3", nil];
-        NSArray *audioElementaryStreamFiles = [inputMuxDirectoryContent filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"pathExtension IN %@", audioExtensions]];
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"The input asset couldn't be cut into ranges."}];
+        self.status = KMMediaAssetExportSessionStatusFailed;
+        return UndefinedFPS;
+    }
+    
+    /*
+     Demux every range on its own thread.
+     The plan and the frame rates outlive dispatch_apply which only returns once every range is done.
+     */
+    size_t rangeCount = plan.points.size();
+    const ts::split_plan *sharedPlan = &plan;
+    std::vector<double> range_fps(rangeCount, UndefinedFPS);
+    double *rangeFPS = &range_fps[0];
+    NSMutableArray *rangeTracks = [NSMutableArray arrayWithCapacity:rangeCount];
+    for(size_t i = 0; i < rangeCount; i++) [rangeTracks addObject:[NSNull null]];
+    __block size_t rangesDone = 0;
+    
+    dispatch_apply(rangeCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(size_t i) {
+        if(self.cancelled) return;
         
-        NSString *audioElementaryStreamFileName = [audioElementaryStreamFiles firstObject];
+        kmtrace_span rangeSpan;
+        kmtrace_begin(&rangeSpan, "demux_range");
+        kmtrace_arg_int(&rangeSpan, "range", i + 1);
         
-        /*
-         Retrieve video elementary stream file
-         */
-        NSArray *videoExtensions = [NSArray arrayWithObjects:@"264", nil];
-        NSArray *videoElementaryStreamFiles = [inputMuxDirectoryContent filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"pathExtension IN %@", videoExtensions]];
+        NSString *rangePath = [[outputDemuxDirectoryURL path] stringByAppendingPathComponent:[NSString stringWithFormat:@"range-%lu", (unsigned long)i]];
+        [[NSFileManager defaultManager] createDirectoryAtPath:rangePath withIntermediateDirectories:NO attributes:nil error:nil];
         
-        NSString *videoElementaryStreamFileName = [videoElementaryStreamFiles firstObject];
+        /* ranges progress concurrently, only their completion is reported */
+        KMProgressContext rangeProgress = {self, 0.f, 0.f, 0};
+        NSArray *demuxedTracks = [self demuxChunk:i ofPlan:*sharedPlan inputPath:inputPath intoDirectory:[NSURL fileURLWithPath:rangePath] fps:&rangeFPS[i] progress:&rangeProgress];
         
-        /*
-         Assemble the elementary streams into a MP4 file
-         */
-        if(videoElementaryStreamFileName || audioElementaryStreamFileName)
+        kmtrace_end(&rangeSpan);
+        
+        @synchronized(self)
+        {
+            if(demuxedTracks) rangeTracks[i] = demuxedTracks;
+            self.progress = .5f * ++rangesDone / rangeCount;
+        }
+    });
+    
+    if(self.cancelled) return UndefinedFPS;
+    
+    NSUInteger failedRange = [rangeTracks indexOfObject:[NSNull null]];
+    if(failedRange != NSNotFound)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"The range %lu of the input asset couldn't be demuxed.", (unsigned long)failedRange + 1]}];
+        self.status = KMMediaAssetExportSessionStatusFailed;
+        return UndefinedFPS;
+    }
+    
+    NSMutableArray *rangeDirectories = [NSMutableArray arrayWithCapacity:rangeCount];
+    std::vector<long long> offsets(rangeCount);
+    
+    /*
+     A range starts without the timestamps before it: the 33-bit PTS wraps it missed are added back,
+     the way a single demuxer unwraps them
+     */
+    long long range_offset = 0;
+    unsigned long long timeline_end = 0;
+    
+    for(size_t i = 0; i < rangeCount; i++)
+    {
+        NSArray *demuxedTracks = rangeTracks[i];
+        [rangeDirectories addObject:[[outputDemuxDirectoryURL path] stringByAppendingPathComponent:[NSString stringWithFormat:@"range-%lu", (unsigned long)i]]];
+        
+        if([demuxedTracks count])
         {
-            KMMediaAsset *outputAsset = [self.outputAssets firstObject];
+            while(timeline_end && KMTracksStartPTS(demuxedTracks) + range_offset + (1ULL << 32) < timeline_end) range_offset += 1LL << 33;
+            timeline_end = MAX(timeline_end, KMTracksEndPTS(demuxedTracks) + range_offset);
+        }
+        offsets[i] = range_offset;
+    }
+    
+    /* the streams of the first range holding each PID are moved, the next ranges are copied after them concurrently */
+    NSArray *concatenatedTracks = [self concatenateSegments:rangeTracks ofDirectories:rangeDirectories offsets:offsets movable:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, rangeCount)] toDirectory:outputDemuxDirectoryURL];
+    for (NSString *rangePath in rangeDirectories) [[NSFileManager defaultManager] removeItemAtPath:rangePath error:nil];
+    if(!concatenatedTracks) return UndefinedFPS;
+    
+    /* video tracks first, as KMTracksFromDemuxer does */
+    *tracks = [concatenatedTracks sortedArrayUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:KMTrackFPSKey ascending:NO],
+                                                                [NSSortDescriptor sortDescriptorWithKey:KMTrackPIDKey ascending:YES]]];
+    return range_fps[0] == UndefinedFPS ? 0 : range_fps[0];
+}
+
+
+/*
+ First pass over a single input asset: locate the keyframes at which it is cut
+ and collect the PAT/PMT every chunk demuxer is seeded with
+ */
+- (BOOL)planChunksOfInputAsset:(NSString *)inputPath interval:(NSTimeInterval)interval plan:(ts::split_plan &)plan
+{
+    ts::demuxer cpp_planner;
+    cpp_planner.av_only=false;
+    KMProgressContext planProgress = {self, 0.f, .1f, [self inputSize]};
+    cpp_planner.progress = KMDemuxProgress;
+    cpp_planner.progress_ctx = &planProgress;
+    kmtrace_span span;
+    kmtrace_begin(&span, "plan_split");
+    int rc = cpp_planner.plan_split([inputPath UTF8String], (u_int64_t)(interval * 90000), plan);
+    kmtrace_arg_int(&span, "chunks", plan.points.size());
+    kmtrace_end(&span);
+    if(rc)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"The input asset couldn't be scanned for keyframes."}];
+        self.status = KMMediaAssetExportSessionStatusFailed;
+        return NO;
+    }
+    return YES;
+}
+
+/*
+ Demux the chunk i of a split plan into a directory, nil if it cannot be demuxed
+ */
+- (NSArray *)demuxChunk:(size_t)i ofPlan:(const ts::split_plan &)plan inputPath:(NSString *)inputPath intoDirectory:(NSURL *)directoryURL fps:(double *)video_fps progress:(KMProgressContext *)progress
+{
+    NSArray *tracks = nil;
+    *video_fps = UndefinedFPS;
+    
+    /* the demuxer is scoped so its files are closed before muxing */
+    {
+        ts::demuxer cpp_demuxer;
+        KMConfigureDemuxer(cpp_demuxer, directoryURL, [self memoryStats], [self packetTrace]);
+        [self selectStreamsOfDemuxer:cpp_demuxer];
+        cpp_demuxer.progress = KMDemuxProgress;
+        cpp_demuxer.progress_ctx = progress;
+        cpp_demuxer.video_prologue = plan.points[i].param_sets;
+        
+        u_int64_t end = (i + 1 < plan.points.size()) ? plan.points[i + 1].offset : 0;
+        
+        if(!cpp_demuxer.seed(plan) && !cpp_demuxer.demux_file([inputPath UTF8String], video_fps, plan.points[i].offset, end))
+            tracks = KMTracksFromDemuxer(cpp_demuxer);
+    }
+    
+    if(!tracks || (*video_fps == UndefinedFPS && [self exportsVideo])) return nil;
+    return tracks;
+}
+
+- (void)splitInputAsset
+{
+    KMMediaAsset *inputAsset = [self.inputAssets firstObject];
+    KMMediaAsset *outputAsset = [self.outputAssets firstObject];
+    NSString *inputPath = [inputAsset.url path];
+    
+    ts::split_plan plan;
+    if(![self planChunksOfInputAsset:inputPath interval:self.splitInterval plan:plan]) return;
+    
+    size_t chunkCount = plan.points.size();
+    NSString *outputBasePath = [[outputAsset.url path] stringByDeletingPathExtension];
+    NSString *outputExtension = [[outputAsset.url path] pathExtension];
+    NSMutableArray *chunkAssets = [NSMutableArray arrayWithCapacity:chunkCount];
+    for(size_t i = 0; i < chunkCount; i++)
+    {
+        NSString *chunkPath = [NSString stringWithFormat:@"%@-%03lu.%@", outputBasePath, (unsigned long)i + 1, outputExtension];
+        [chunkAssets addObject:[KMMediaAsset assetWithURL:[NSURL fileURLWithPath:chunkPath] withFormat:outputAsset.format]];
+    }
+    
+    /*
+     Second pass: demux and mux every chunk on its own thread.
+     The plan outlives dispatch_apply which only returns once every chunk is done.
+     */
+    const ts::split_plan *sharedPlan = &plan;
+    __block NSError *chunkError = nil;
+    __block size_t chunksDone = 0;
+    
+    dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(size_t i) {
+        if(self.cancelled) return;
+        
+        NSError *error = nil;
+        kmtrace_span chunkSpan;
+        kmtrace_begin(&chunkSpan, "split_chunk");
+        kmtrace_arg_int(&chunkSpan, "chunk", i + 1);
+        NSURL *temporaryDirectoryURL = [[NSFileManager defaultManager] createUniqueTemporaryDirectory];
+        
+        if(temporaryDirectoryURL)
+        {
+            double video_fps = UndefinedFPS;
             
-            NSString *outputAudioElementaryStreamFilePath = (audioElementaryStreamFileName)?[NSString stringWithFormat:@"%@/%@",[inputMuxDirectoryURL path],audioElementaryStreamFileName]:@"";
-            NSString *outputVideoElementaryStreamFilePath = (videoElementaryStreamFileName)?[NSString stringWithFormat:@"%@/%@",[inputMuxDirectoryURL path],videoElementaryStreamFileName]:@"";
+            /* chunks progress concurrently, only their completion is reported */
+            KMProgressContext chunkProgress = {self, 0.f, 0.f, 0};
             
-            assemble_elementary_streams((char *)[outputVideoElementaryStreamFilePath UTF8String], (char *)[outputAudioElementaryStreamFilePath UTF8String], (char *)[[outputAsset.url path ] UTF8String], video_stream_fps);
+            NSArray *tracks = [self demuxChunk:i ofPlan:*sharedPlan inputPath:inputPath intoDirectory:temporaryDirectoryURL fps:&video_fps progress:&chunkProgress];
+            if(!tracks)
+            {
+                error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"The chunk %lu couldn't be demuxed.", (unsigned long)i + 1]}];
+            }
+            else error = [self muxTracks:tracks intoOutputAsset:chunkAssets[i] withVideoStreamFPS:video_fps progress:&chunkProgress];
             
-            self.status = KMMediaAssetExportSessionStatusCompleted;
+            [[NSFileManager defaultManager] removeItemAtPath:[temporaryDirectoryURL path] error:nil];
         }
-        else
+        else error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Directory to store elementary streams files not set."}];
+        
+        kmtrace_end(&chunkSpan);
+        
+        @synchronized(self)
         {
-            self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Missing audio elementary stream or video elementary stream while trying to mux it."}];
-            self.status = KMMediaAssetExportSessionStatusFailed;
+            if(error && !chunkError) chunkError = error;
+            self.progress = .1f + .9f * ++chunksDone / chunkCount;
+        }
+    });
+    
+    if(self.cancelled)
+    {
+        for (KMMediaAsset *chunkAsset in chunkAssets)
+        {
+            [[NSFileManager defaultManager] removeItemAtPath:[chunkAsset.url path] error:nil];
         }
+        return;
+    }
+    
+    if(chunkError)
+    {
+        self.error = chunkError;
+        self.status = KMMediaAssetExportSessionStatusFailed;
     }
     else
     {
-        self.error =  [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:error.userInfo];
+        self.splitOutputAssets = chunkAssets;
+        self.status = KMMediaAssetExportSessionStatusCompleted;
+    }
+}
+
+
+/*
+ Write a single input asset as CMAF segments cut on keyframes, an init segment and a HLS media playlist.
+ The chunks are demuxed concurrently, then boxed concurrently once the start of the presentation is known.
+ */
+- (void)segmentInputAsset
+{
+    KMMediaAsset *inputAsset = [self.inputAssets firstObject];
+    KMMediaAsset *outputAsset = [self.outputAssets firstObject];
+    NSString *inputPath = [inputAsset.url path];
+    
+    ts::split_plan plan;
+    if(![self planChunksOfInputAsset:inputPath interval:self.segmentDuration plan:plan]) return;
+    
+    size_t segmentCount = plan.points.size();
+    NSString *outputBasePath = [[outputAsset.url path] stringByDeletingPathExtension];
+    NSString *initPath = [outputBasePath stringByAppendingString:@"-init.mp4"];
+    NSString *playlistPath = [outputBasePath stringByAppendingPathExtension:@"m3u8"];
+    NSMutableArray *segmentAssets = [NSMutableArray arrayWithCapacity:segmentCount];
+    for(size_t i = 0; i < segmentCount; i++)
+    {
+        NSString *segmentPath = [NSString stringWithFormat:@"%@-%03lu.m4s", outputBasePath, (unsigned long)i + 1];
+        [segmentAssets addObject:[KMMediaAsset assetWithURL:[NSURL fileURLWithPath:segmentPath] withFormat:outputAsset.format]];
+    }
+    
+    /*
+     Second pass: demux every chunk on its own thread.
+     The plan outlives dispatch_apply which only returns once every chunk is done.
+     */
+    const ts::split_plan *sharedPlan = &plan;
+    NSMutableArray *directories = [NSMutableArray arrayWithCapacity:segmentCount];
+    NSMutableArray *segmentTracks = [NSMutableArray arrayWithCapacity:segmentCount];
+    std::vector<double> fps(segmentCount, UndefinedFPS);
+    double *sharedFPS = &fps[0];
+    for(size_t i = 0; i < segmentCount; i++)
+    {
+        NSURL *temporaryDirectoryURL = [[NSFileManager defaultManager] createUniqueTemporaryDirectory];
+        if(!temporaryDirectoryURL) break;
+        [directories addObject:temporaryDirectoryURL];
+        [segmentTracks addObject:[NSNull null]];
+    }
+    __block NSError *segmentError = nil;
+    __block size_t segmentsDone = 0;
+    
+    if([directories count] < segmentCount)
+    {
+        segmentError = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Directory to store elementary streams files not set."}];
+    }
+    else dispatch_apply(segmentCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(size_t i) {
+        if(self.cancelled) return;
+        
+        kmtrace_span chunkSpan;
+        kmtrace_begin(&chunkSpan, "segment_demux");
+        kmtrace_arg_int(&chunkSpan, "segment", i + 1);
+        
+        KMProgressContext chunkProgress = {self, 0.f, 0.f, 0};
+        NSArray *tracks = [self demuxChunk:i ofPlan:*sharedPlan inputPath:inputPath intoDirectory:directories[i] fps:&sharedFPS[i] progress:&chunkProgress];
+        
+        kmtrace_end(&chunkSpan);
+        
+        @synchronized(self)
+        {
+            if(tracks) segmentTracks[i] = tracks;
+            else if(!segmentError) segmentError = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"The segment %lu couldn't be demuxed.", (unsigned long)i + 1]}];
+            self.progress = .1f + .5f * ++segmentsDone / segmentCount;
+        }
+    });
+    
+    /*
+     Every segment starts with its earliest track, the first one at the start of the presentation.
+     A segment demuxer starts without the timestamps before it: the 33-bit PTS wraps it missed are added back
+     up to the unwrapped DTS of its split point
+     */
+    std::vector<unsigned long long> starts(segmentCount + 1, 0);
+    std::vector<long long> offsets(segmentCount, 0);
+    if(!segmentError && !self.cancelled)
+    {
+        for(size_t i = 0; i < segmentCount; i++)
+        {
+            while(KMTracksStartPTS(segmentTracks[i]) + offsets[i] + (1ULL << 32) < plan.points[i].dts) offsets[i] += 1LL << 33;
+            starts[i] = KMTracksStartPTS(segmentTracks[i]) + offsets[i];
+        }
+        starts[segmentCount] = MAX(KMTracksEndPTS([segmentTracks lastObject]) + offsets[segmentCount - 1], starts[segmentCount - 1]);
+    }
+    unsigned long long *sharedStarts = &starts[0];
+    long long *sharedOffsets = &offsets[0];
+    
+    /*
+     Third pass: box every segment on its own thread
+     */
+    segmentsDone = 0;
+    if(!segmentError && !self.cancelled) dispatch_apply(segmentCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(size_t i) {
+        if(self.cancelled) return;
+        
+        std::vector<mp4mux_track> mux_tracks = KMMuxTracks(segmentTracks[i], sharedFPS[i], sharedStarts[i] - sharedOffsets[i]);
+        mp4mux_segment segment;
+        memset(&segment, 0, sizeof(segment));
+        segment.init_file = i ? NULL : [initPath UTF8String];
+        segment.base_time = (sharedStarts[i] - sharedStarts[0]) / 90000.;
+        segment.sequence_number = (unsigned int)i + 1;
+        segment.last = (i + 1 == segmentCount);
+        
+        int rc = assemble_segment(&mux_tracks[0], (unsigned int)mux_tracks.size(), [[[segmentAssets[i] url] path] UTF8String], &segment);
+        
+        @synchronized(self)
+        {
+            if(rc && !segmentError) segmentError = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeMuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"The segment %lu couldn't be written (%d).", (unsigned long)i + 1, rc]}];
+            self.progress = .6f + .4f * ++segmentsDone / segmentCount;
+        }
+    });
+    
+    for (NSURL *directory in directories)
+    {
+        [[NSFileManager defaultManager] removeItemAtPath:[directory path] error:nil];
+    }
+    
+    if(!segmentError && !self.cancelled)
+    {
+        double targetDuration = 0;
+        NSMutableString *segmentList = [NSMutableString string];
+        for(size_t i = 0; i < segmentCount; i++)
+        {
+            double duration = (starts[i + 1] - starts[i]) / 90000.;
+            targetDuration = MAX(targetDuration, duration);
+            [segmentList appendFormat:@"#EXTINF:%.3f,\n%@\n", duration, [[[segmentAssets[i] url] path] lastPathComponent]];
+        }
+        
+        NSString *playlist = [NSString stringWithFormat:@"#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%.0f\n#EXT-X-MEDIA-SEQUENCE:1\n#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-INDEPENDENT-SEGMENTS\n#EXT-X-MAP:URI=\"%@\"\n%@#EXT-X-ENDLIST\n",
+                              ceil(targetDuration), [initPath lastPathComponent], segmentList];
+        if(![playlist writeToFile:playlistPath atomically:YES encoding:NSUTF8StringEncoding error:nil])
+        {
+            segmentError = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeInvalidOutput userInfo:@{NSLocalizedDescriptionKey:@"The playlist couldn't be written."}];
+        }
+    }
+    
+    if(self.cancelled || segmentError)
+    {
+        for (KMMediaAsset *segmentAsset in segmentAssets)
+        {
+            [[NSFileManager defaultManager] removeItemAtPath:[segmentAsset.url path] error:nil];
+        }
+        [[NSFileManager defaultManager] removeItemAtPath:initPath error:nil];
+        if(self.cancelled) return;
+        
+        self.error = segmentError;
+        self.status = KMMediaAssetExportSessionStatusFailed;
+    }
+    else
+    {
+        self.segmentInitializationAsset = [KMMediaAsset assetWithURL:[NSURL fileURLWithPath:initPath] withFormat:outputAsset.format];
+        self.segmentOutputAssets = segmentAssets;
+        self.playlistURL = [NSURL fileURLWithPath:playlistPath];
+        self.status = KMMediaAssetExportSessionStatusCompleted;
+    }
+}
+
+- (void)convertAllPrograms
+{
+    NSURL *temporaryDirectoryURL = [[NSFileManager defaultManager] createUniqueTemporaryDirectory];
+    if(!temporaryDirectoryURL)
+    {
+        self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Directory to store elementary streams files not set."}];
         self.status = KMMediaAssetExportSessionStatusFailed;
+        return;
+    }
+    
+    /*
+     Demux every program of the inputs in one pass.
+     The demuxer is scoped so its elementary stream files are flushed and closed before muxing.
+     */
+    NSArray *tracks = nil;
+    {
+        ts::demuxer cpp_demuxer;
+        KMConfigureDemuxer(cpp_demuxer, temporaryDirectoryURL, [self memoryStats], [self packetTrace]);
+        [self selectStreamsOfDemuxer:cpp_demuxer];
+        cpp_demuxer.all_programs=true;
+        
+        KMProgressContext demuxProgress = {self, 0.f, .5f, [self inputSize]};
+        cpp_demuxer.progress = KMDemuxProgress;
+        cpp_demuxer.progress_ctx = &demuxProgress;
+        
+        for (KMMediaAsset *inputAsset in self.inputAssets)
+        {
+            double video_fps = UndefinedFPS;
+            if(cpp_demuxer.demux_file([[inputAsset.url path] UTF8String], &video_fps))
+            {
+                self.error = [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"The input asset %@ couldn't be demuxed.", [inputAsset.url lastPathComponent]]}];
+                self.status = KMMediaAssetExportSessionStatusFailed;
+                break;
+            }
+        }
+        
+        tracks = KMTracksFromDemuxer(cpp_demuxer);
+    }
+    
+    if(self.status != KMMediaAssetExportSessionStatusFailed)
+    {
+        KMMediaAsset *outputAsset = [self.outputAssets firstObject];
+        NSString *outputBasePath = [[outputAsset.url path] stringByDeletingPathExtension];
+        NSString *outputExtension = [[outputAsset.url path] pathExtension];
+        NSMutableArray *programAssets = [NSMutableArray array];
+        
+        NSArray *programs = [[[NSSet setWithArray:[tracks valueForKey:KMTrackProgramKey]] allObjects] sortedArrayUsingSelector:@selector(compare:)];
+        for (NSNumber *program in programs)
+        {
+            NSArray *programTracks = [tracks filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"%K == %@", KMTrackProgramKey, program]];
+            double video_fps = [[[programTracks firstObject] objectForKey:KMTrackFPSKey] doubleValue];
+            
+            NSString *programPath = [NSString stringWithFormat:@"%@-%@.%@", outputBasePath, program, outputExtension];
+            KMMediaAsset *programAsset = [KMMediaAsset assetWithURL:[NSURL fileURLWithPath:programPath] withFormat:outputAsset.format];
+            
+            KMProgressContext muxProgress = {self, .5f + .5f * [programAssets count] / [programs count], .5f / [programs count], 0};
+            NSError *muxError = [self muxTracks:programTracks intoOutputAsset:programAsset withVideoStreamFPS:video_fps progress:&muxProgress];
+            if(muxError)
+            {
+                self.error = muxError;
+                self.status = KMMediaAssetExportSessionStatusFailed;
+                break;
+            }
+            [programAssets addObject:programAsset];
+        }
+        
+        if(self.cancelled)
+        {
+            for (KMMediaAsset *programAsset in programAssets)
+            {
+                [[NSFileManager defaultManager] removeItemAtPath:[programAsset.url path] error:nil];
+            }
+        }
+        else if(self.status != KMMediaAssetExportSessionStatusFailed)
+        {
+            self.programOutputAssets = programAssets;
+            self.status = KMMediaAssetExportSessionStatusCompleted;
+        }
+    }
+    
+    NSError *error;
+    if(![[NSFileManager defaultManager] removeItemAtPath:[temporaryDirectoryURL path] error:&error])
+    {
+        ALog(@"Cannot delete temporary directory. Will be deleted automatically later. Error:%@", error);
+    }
+}
+
+
+- (NSError *)muxTracks:(NSArray *)tracks intoOutputAsset:(KMMediaAsset *)outputAsset withVideoStreamFPS:(double)video_stream_fps progress:(KMProgressContext *)progress
+{
+    if(![tracks count])
+    {
+        return [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeDemuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"Missing audio elementary stream or video elementary stream while trying to mux it."}];
+    }
+    
+    /*
+     Tracks are delayed relatively to the one starting first
+     */
+    std::vector<mp4mux_track> mux_tracks = KMMuxTracks(tracks, video_stream_fps, KMTracksStartPTS(tracks));
+    
+    mp4mux_options options;
+    memset(&options, 0, sizeof(options));
+    options.progress = KMMuxProgress;
+    options.progress_ctx = progress;
+    if(outputAsset.format == KMMediaFormatM4A) options.major_brand = 'M4A ';
+    options.append = self.appendToOutput;
+    options.storage_mode = (mp4mux_storage)self.storage;
+    options.interleave_time = self.interleaveDuration;
+    options.max_chunk_size = (unsigned int)MIN(self.maximumChunkSize, (NSUInteger)UINT32_MAX);
+    options.segment_index = self.segmentIndex;
+    options.compact_sizes = self.compactSampleSizes;
+    options.memory = [self memoryStats];
+    
+    int rc = assemble_tracks(&mux_tracks[0], (unsigned int)mux_tracks.size(), [[outputAsset.url path] UTF8String], &options);
+    if(rc == 5)
+    {
+        return [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeMuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:@"The elementary streams do not have the format of the tracks of the output asset they should be appended to."}];
+    }
+    else if(rc)
+    {
+        return [NSError errorWithDomain:KMMediaAssetExportSessionErrorDomain code:KMMediaAssetExportSessionErrorCodeMuxOperationFailed userInfo:@{NSLocalizedDescriptionKey:[NSString stringWithFormat:@"The elementary streams couldn't be muxed (%d).", rc]}];
+    }
+    
+    FILE *output = fopen([[outputAsset.url path] fileSystemRepresentation], "rb");
+    mp4box moov;
+    if(output && !mp4box_find_top(output, MP4BOX_TYPE('m','o','o','v'), &moov))
+    {
+        @synchronized(self)
+        {
+            NSMutableDictionary *sizes = [NSMutableDictionary dictionaryWithDictionary:self.movieBoxSizes];
+            sizes[outputAsset.url] = @(moov.size);
+            self.movieBoxSizes = sizes;
+        }
     }
+    if(output) fclose(output);
+    return nil;
 }
 
 @end
@@ -0,0 +1,92 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+/**
+ KMMediaConversionCache keeps the elementary streams demuxed from TS files on disk,
+ so export sessions sharing it only demux the input assets they have never seen.
+
+ Each entry is a directory named after a hash of the content of the TS file and of the conversion options.
+ It holds the elementary stream files and a description of them.
+ The least recently used entries are evicted once the cache is larger than its maximum size,
+ except the entries leased by a session reading them.
+
+ A cache can be shared by export sessions running concurrently, and by processes using the same directory.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface KMMediaConversionCache : NSObject
+
+/* Directory holding the entries */
+@property (nonatomic, readonly, strong) NSURL *directoryURL;
+
+/* Size in bytes above which the least recently used entries are evicted */
+@property (nonatomic) unsigned long long maximumSize;
+
+/**
+ Initialize a cache, the directory is created if needed
+ @param directoryURL the directory holding the entries
+ @param maximumSize size in bytes above which the least recently used entries are evicted
+ @return the initialized cache, nil if the directory cannot be created
+ */
+- (id)initWithDirectoryURL:(NSURL *)directoryURL maximumSize:(unsigned long long)maximumSize;
+
+/**
+ Return the key of the entry of a file converted with the given options
+ @param url the TS file
+ @param options describes every option changing the demuxed streams
+ @return the key, nil if the file cannot be read
+ */
+- (NSString *)keyForFileAtURL:(NSURL *)url options:(NSString *)options;
+
+/**
+ Look an entry up, mark it as the most recently used and lease it: it is not evicted until released
+ @param key the entry key
+ @param info set to the description stored with the entry
+ @return the directory of the entry, nil if the entry is not in the cache
+ */
+- (NSURL *)entryURLForKey:(NSString *)key info:(NSDictionary **)info;
+
+/**
+ Move the content of a directory into a new leased entry, then evict the least recently used entries
+ @param key the entry key
+ @param directoryURL the directory whose files are moved into the entry
+ @param info property list description stored with the entry
+ @return the directory of the entry, nil if it cannot be stored
+ */
+- (NSURL *)storeEntryWithKey:(NSString *)key fromDirectoryURL:(NSURL *)directoryURL info:(NSDictionary *)info;
+
+/**
+ Release the lease taken by entryURLForKey:info: or storeEntryWithKey:fromDirectoryURL:info:
+ @param entryURL the directory of the entry
+ */
+- (void)releaseEntryURL:(NSURL *)entryURL;
+
+/* Remove every entry */
+- (void)removeAllEntries;
+
+@end
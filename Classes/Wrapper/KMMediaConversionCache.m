@@ -0,0 +1,229 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+#import "KMMediaConversionCache.h"
+#import <CommonCrypto/CommonDigest.h>
+#include <sys/file.h>
+
+static NSString * const KMCacheInfoFileName = @"info.plist";
+static NSString * const KMCacheLeaseFileName = @".lease";
+
+@interface KMMediaConversionCache ()
+@property (nonatomic, strong, readwrite) NSURL *directoryURL;
+@property (nonatomic, strong) NSMutableDictionary *leases;     /* file descriptors of the lease files by entry path */
+@end
+
+
+@implementation KMMediaConversionCache
+
+- (id)initWithDirectoryURL:(NSURL *)directoryURL maximumSize:(unsigned long long)maximumSize
+{
+    self = [super init];
+    if(self)
+    {
+        if(![[NSFileManager defaultManager] createDirectoryAtPath:[directoryURL path] withIntermediateDirectories:YES attributes:nil error:nil])
+        {
+            ALog(@"Cannot create the cache directory %@", directoryURL);
+            return nil;
+        }
+        _directoryURL = directoryURL;
+        _maximumSize = maximumSize;
+        _leases = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSArray *descriptors in [_leases allValues])
+    {
+        for (NSNumber *descriptor in descriptors) close([descriptor intValue]);
+    }
+}
+
+- (NSString *)keyForFileAtURL:(NSURL *)url options:(NSString *)options
+{
+    NSData *data = [NSData dataWithContentsOfFile:[url path] options:NSDataReadingMappedIfSafe error:nil];
+    if(!data) return nil;
+
+    /*
+     The content is hashed, not the name: HLS playlists reuse names and the same segment can be stored under several names
+     */
+    CC_SHA1_CTX context;
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    NSData *optionsData = [options dataUsingEncoding:NSUTF8StringEncoding];
+
+    CC_SHA1_Init(&context);
+    CC_SHA1_Update(&context, [optionsData bytes], (CC_LONG)[optionsData length]);
+    for(NSUInteger offset = 0; offset < [data length]; offset += UINT32_MAX)
+    {
+        CC_SHA1_Update(&context, (const char *)[data bytes] + offset, (CC_LONG)MIN((NSUInteger)UINT32_MAX, [data length] - offset));
+    }
+    CC_SHA1_Final(digest, &context);
+
+    NSMutableString *key = [NSMutableString stringWithCapacity:CC_SHA1_DIGEST_LENGTH * 2];
+    for(int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++)
+    {
+        [key appendFormat:@"%02x", digest[i]];
+    }
+    return key;
+}
+
+/*
+ Take a shared lock on the lease file of an entry, held until releaseEntryURL:.
+ Eviction only removes the entries it can lock exclusively, in this process or another one
+ */
+- (BOOL)leaseEntryAtPath:(NSString *)entryPath
+{
+    int descriptor = open([[entryPath stringByAppendingPathComponent:KMCacheLeaseFileName] fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+    if(descriptor < 0) return NO;
+
+    /* the entry may have been evicted while waiting for the lock */
+    if(flock(descriptor, LOCK_SH) || ![[NSFileManager defaultManager] fileExistsAtPath:[entryPath stringByAppendingPathComponent:KMCacheInfoFileName]])
+    {
+        close(descriptor);
+        return NO;
+    }
+
+    @synchronized(self.leases)
+    {
+        NSMutableArray *descriptors = self.leases[entryPath];
+        if(!descriptors) self.leases[entryPath] = descriptors = [NSMutableArray array];
+        [descriptors addObject:@(descriptor)];
+    }
+    return YES;
+}
+
+- (void)releaseEntryURL:(NSURL *)entryURL
+{
+    NSNumber *descriptor = nil;
+    @synchronized(self.leases)
+    {
+        NSMutableArray *descriptors = self.leases[[entryURL path]];
+        descriptor = [descriptors lastObject];
+        if(descriptor) [descriptors removeLastObject];
+        if(![descriptors count]) [self.leases removeObjectForKey:[entryURL path]];
+    }
+    if(descriptor) close([descriptor intValue]);
+}
+
+- (NSURL *)entryURLForKey:(NSString *)key info:(NSDictionary **)info
+{
+    NSString *entryPath = [[self.directoryURL path] stringByAppendingPathComponent:key];
+    NSDictionary *entryInfo = [NSDictionary dictionaryWithContentsOfFile:[entryPath stringByAppendingPathComponent:KMCacheInfoFileName]];
+    if(!entryInfo || ![self leaseEntryAtPath:entryPath]) return nil;
+
+    /* the modification date of the entry directory is its last use */
+    [[NSFileManager defaultManager] setAttributes:@{NSFileModificationDate:[NSDate date]} ofItemAtPath:entryPath error:nil];
+
+    if(info) *info = entryInfo;
+    return [NSURL fileURLWithPath:entryPath];
+}
+
+- (NSURL *)storeEntryWithKey:(NSString *)key fromDirectoryURL:(NSURL *)directoryURL info:(NSDictionary *)info
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *entryPath = [[self.directoryURL path] stringByAppendingPathComponent:key];
+
+    /*
+     The entry is built in a hidden directory of the cache then renamed,
+     so a concurrent lookup never sees a partial entry
+     */
+    NSString *buildPath = [[self.directoryURL path] stringByAppendingPathComponent:[NSString stringWithFormat:@".%@-%@", key, [[NSProcessInfo processInfo] globallyUniqueString]]];
+    if(![fileManager moveItemAtPath:[directoryURL path] toPath:buildPath error:nil] ||
+       ![info writeToFile:[buildPath stringByAppendingPathComponent:KMCacheInfoFileName] atomically:NO])
+    {
+        [fileManager removeItemAtPath:buildPath error:nil];
+        return nil;
+    }
+
+    if(rename([buildPath fileSystemRepresentation], [entryPath fileSystemRepresentation]))
+    {
+        /* stored concurrently by another session */
+        [fileManager removeItemAtPath:buildPath error:nil];
+    }
+    if(![self leaseEntryAtPath:entryPath]) return nil;
+
+    [self evictEntriesExcept:key];
+
+    return [NSURL fileURLWithPath:entryPath];
+}
+
+/*
+ Evict the least recently used entries until the cache fits in its maximum size
+ */
+- (void)evictEntriesExcept:(NSString *)key
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableArray *entries = [NSMutableArray array];
+    unsigned long long size = 0;
+
+    @synchronized(self)
+    {
+        for (NSString *name in [fileManager contentsOfDirectoryAtPath:[self.directoryURL path] error:nil])
+        {
+            if([name hasPrefix:@"."]) continue;
+
+            NSString *entryPath = [[self.directoryURL path] stringByAppendingPathComponent:name];
+            NSDate *lastUse = [[fileManager attributesOfItemAtPath:entryPath error:nil] fileModificationDate];
+            unsigned long long entrySize = 0;
+            for (NSString *file in [fileManager contentsOfDirectoryAtPath:entryPath error:nil])
+            {
+                entrySize += [[fileManager attributesOfItemAtPath:[entryPath stringByAppendingPathComponent:file] error:nil] fileSize];
+            }
+
+            size += entrySize;
+            if(![name isEqualToString:key] && lastUse) [entries addObject:@{@"path":entryPath, @"lastUse":lastUse, @"size":@(entrySize)}];
+        }
+
+        [entries sortUsingDescriptors:@[[NSSortDescriptor sortDescriptorWithKey:@"lastUse" ascending:YES]]];
+
+        for (NSDictionary *entry in entries)
+        {
+            if(size <= self.maximumSize) break;
+
+            /* a leased entry is being read by a session and is skipped */
+            int descriptor = open([[entry[@"path"] stringByAppendingPathComponent:KMCacheLeaseFileName] fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+            if(descriptor < 0) continue;
+            if(!flock(descriptor, LOCK_EX | LOCK_NB) && [fileManager removeItemAtPath:entry[@"path"] error:nil]) size -= [entry[@"size"] unsignedLongLongValue];
+            close(descriptor);
+        }
+    }
+}
+
+- (void)removeAllEntries
+{
+    @synchronized(self)
+    {
+        for (NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[self.directoryURL path] error:nil])
+        {
+            [[NSFileManager defaultManager] removeItemAtPath:[[self.directoryURL path] stringByAppendingPathComponent:name] error:nil];
+        }
+    }
+}
+
+@end
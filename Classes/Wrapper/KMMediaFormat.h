@@ -37,7 +37,8 @@ typedef NS_ENUM(NSInteger, KMMediaFormat) {
     KMMediaFormatMP3,       /* Audio MP3 format */
     KMMediaFormatH264,      /* Video H264 format */
     KMMediaFormatMP4,       /* Video MP4 format */
-    KMMediaFormatTS         /* Video MPEG2-TS format */
+    KMMediaFormatTS,        /* Video MPEG2-TS format */
+    KMMediaFormatM4A        /* Audio only MP4 format */
 };
 
 #endif
@@ -80,7 +80,7 @@ static NSTimeInterval timeout = 60;
 
 
 /*
- This test produce an mp4 file displaying the TS file concatenated without artefact but with discontinuity between the TS files
+ This test produce an mp4 file displaying the TS file concatenated without artefact, each TS file starting where the previous one ends although their clocks are discontinuous
  */
 
 - (void)testConversionMultipleDiscontinuousTStoMP4
@@ -30,6 +30,7 @@
 #import "KMMediaAsset.h"
 #import "KMMediaAssetExportSession.h"
 #import "NSRunLoop+waitUntil.h"
+#import "mp4boxes.h"
 
 
 /*
@@ -226,4 +227,1113 @@ static NSTimeInterval timeout = 60;
 }
 
 
+- (void)testSplitSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/highRes.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset, tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.splitInterval = 1;
+    XCTAssertFalse([tsToMP4ExportSession isAValidExportSession], @"Only a single input asset can be split");
+    
+    /*
+     The whole file converted at once gives the keyframes: a chunk starts on the first one,
+     then on the first one at least splitInterval after the start of the previous chunk
+     */
+    NSURL *referenceFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Reference.mp4",NSStringFromSelector(_cmd)]]];
+    [[NSFileManager defaultManager] removeItemAtURL:referenceFileURL error:nil];
+    KMMediaAssetExportSession *referenceExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    referenceExportSession.outputAssets = @[[KMMediaAsset assetWithURL:referenceFileURL withFormat:KMMediaFormatMP4]];
+    [referenceExportSession exportAsynchronouslyWithCompletionHandler:^{}];
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return referenceExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(referenceExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The reference export session must have succeed");
+    
+    NSTimeInterval splitInterval = 1;
+    NSUInteger expectedChunks = 0;
+    unsigned int videoSamples = 0;
+    mp4box_file file;
+    XCTAssertEqual(mp4box_load([referenceFileURL fileSystemRepresentation], &file), 0, @"The reference file must be a readable MP4 file");
+    for (unsigned int i = 0; i < file.track_count; i++)
+    {
+        mp4box_track *track = &file.tracks[i];
+        if(track->handler != MP4BOX_TYPE('v','i','d','e')) continue;
+        videoSamples = track->sample_count;
+        unsigned long long nextChunk = 0;
+        for (unsigned int j = 0; j < track->sample_count; j++)
+        {
+            if(track->sync && !track->sync[j]) continue;
+            if(expectedChunks && track->dts[j] < nextChunk) continue;
+            expectedChunks++;
+            nextChunk = track->dts[j] + (unsigned long long)(splitInterval * track->timescale);
+        }
+        break;
+    }
+    mp4box_free(&file);
+    XCTAssertTrue(expectedChunks > 0, @"The input file must hold keyframes");
+    
+    tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.splitInterval = splitInterval;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while splitting the file.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    XCTAssertEqual([tsToMP4ExportSession.splitOutputAssets count], expectedChunks, @"A chunk must start on the first keyframe after every interval");
+    
+    /* every chunk starts on a keyframe and together they hold every video sample */
+    unsigned int chunkVideoSamples = 0;
+    for (KMMediaAsset *chunkAsset in tsToMP4ExportSession.splitOutputAssets)
+    {
+        XCTAssertEqual(mp4box_load([chunkAsset.url fileSystemRepresentation], &file), 0, @"Every chunk must be a readable MP4 file");
+        for (unsigned int i = 0; i < file.track_count; i++)
+        {
+            mp4box_track *track = &file.tracks[i];
+            if(track->handler != MP4BOX_TYPE('v','i','d','e')) continue;
+            XCTAssertTrue(track->sample_count > 0, @"Every chunk must hold video samples");
+            XCTAssertTrue(track->sample_count == 0 || !track->sync || track->sync[0], @"Every chunk must start on a sync sample");
+            chunkVideoSamples += track->sample_count;
+            break;
+        }
+        mp4box_free(&file);
+    }
+    XCTAssertEqual(chunkVideoSamples, videoSamples, @"The chunks must hold every video sample");
+}
+
+
+- (void)testAllProgramsSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.allPrograms = YES;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the file.");
+        XCTAssertEqual([tsToMP4ExportSession.programOutputAssets count], (NSUInteger)1, @"A single program transport stream must produce a single file");
+        KMMediaAsset *programAsset = [tsToMP4ExportSession.programOutputAssets firstObject];
+        XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:programAsset.url.path], @"The program file must exist after export session");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+}
+
+
+- (void)testTraceSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    NSURL *traceFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.json",NSStringFromSelector(_cmd)]]];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.traceURL = traceFileURL;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the file.");
+        
+        NSData *traceData = [NSData dataWithContentsOfURL:traceFileURL];
+        XCTAssertNotNil(traceData, @"The trace file must exist after export session");
+        NSDictionary *trace = [NSJSONSerialization JSONObjectWithData:traceData options:0 error:nil];
+        NSArray *names = [trace[@"traceEvents"] valueForKey:@"name"];
+        for (NSString *stage in @[@"export", @"demux_file", @"import_file", @"make_interleave", @"isom_close"])
+        {
+            XCTAssertTrue([names containsObject:stage], @"Every stage must be traced");
+        }
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+}
+
+
+- (void)testProgressSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    XCTAssertEqual(tsToMP4ExportSession.progress, 0.f, @"The progress must be 0 before the export begins");
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the file.");
+        XCTAssertEqual(tsToMP4ExportSession.progress, 1.f, @"The progress must be 1 once the export is complete");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+}
+
+
+- (void)testCancelSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/highRes.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"A cancelled export session has no error");
+        XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:mp4FileURL.path], @"The output file must not exist after a cancelled export session");
+    }];
+    [tsToMP4ExportSession cancelExport];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCanceled; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCanceled, @"The export session must have been cancelled");
+}
+
+
+- (void)testAudioOnlySingleTStoM4A
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *m4aFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.m4a",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *m4aAsset = [KMMediaAsset assetWithURL:m4aFileURL withFormat:KMMediaFormatM4A];
+    
+    KMMediaAssetExportSession *tsToM4AExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToM4AExportSession.outputAssets = @[m4aAsset];
+    tsToM4AExportSession.streams = KMMediaAssetExportSessionStreamsFirstVideo;
+    XCTAssertFalse([tsToM4AExportSession isAValidExportSession], @"A M4A file cannot hold video");
+    
+    tsToM4AExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToM4AExportSession.outputAssets = @[m4aAsset];
+    
+    [tsToM4AExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToM4AExportSession.error, @"An error occured while extracting the audio.");
+        XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:m4aFileURL.path], @"The output file must exist after export session");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToM4AExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToM4AExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+}
+
+
+- (void)testCachedMultipleTStoMP4
+{
+    NSURL* ts1FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *ts1Asset = [KMMediaAsset assetWithURL:ts1FileURL withFormat:KMMediaFormatTS];
+    NSURL* ts2FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous2.ts"]];
+    KMMediaAsset *ts2Asset = [KMMediaAsset assetWithURL:ts2FileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:ts1FileURL.path], @"The input file must exist");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:ts2FileURL.path], @"The input file must exist");
+    
+    NSURL *cacheURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:NSStringFromSelector(_cmd)]];
+    KMMediaConversionCache *cache = [[KMMediaConversionCache alloc] initWithDirectoryURL:cacheURL maximumSize:100 * 1024 * 1024];
+    [cache removeAllEntries];
+    
+    /* the second export finds the first input asset in the cache */
+    NSArray *inputs = @[@[ts1Asset], @[ts1Asset, ts2Asset]];
+    for (NSUInteger i = 0; i < [inputs count]; i++)
+    {
+        NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result%lu.mp4",NSStringFromSelector(_cmd),(unsigned long)i]]];
+        KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+        
+        KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:inputs[i]];
+        tsToMP4ExportSession.outputAssets = @[mp4Asset];
+        tsToMP4ExportSession.cache = cache;
+        
+        [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+            XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+            XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:mp4FileURL.path], @"The output file must exist after export session");
+        }];
+        
+        [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+        XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    }
+    
+    NSArray *entries = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:cacheURL.path error:nil];
+    XCTAssertEqual([entries count], (NSUInteger)2, @"Every input asset must be cached once");
+    
+    [cache removeAllEntries];
+}
+
+
+- (void)testAppendMultipleTStoMP4
+{
+    NSURL* ts1FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *ts1Asset = [KMMediaAsset assetWithURL:ts1FileURL withFormat:KMMediaFormatTS];
+    NSURL* ts2FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous2.ts"]];
+    KMMediaAsset *ts2Asset = [KMMediaAsset assetWithURL:ts2FileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:ts1FileURL.path], @"The input file must exist");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:ts2FileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    /* the second segment alone, for the number of samples the append adds to each track */
+    NSURL *referenceFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Reference.mp4",NSStringFromSelector(_cmd)]]];
+    [[NSFileManager defaultManager] removeItemAtURL:referenceFileURL error:nil];
+    KMMediaAssetExportSession *referenceExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[ts2Asset]];
+    referenceExportSession.outputAssets = @[[KMMediaAsset assetWithURL:referenceFileURL withFormat:KMMediaFormatMP4]];
+    [referenceExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(referenceExportSession.error, @"An error occured while converting the files.");
+    }];
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return referenceExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(referenceExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    /* the first export creates the output asset, the second one appends the second segment to it */
+    mp4box_file files[2];
+    NSArray *inputs = @[ts1Asset, ts2Asset];
+    for (NSUInteger i = 0; i < [inputs count]; i++)
+    {
+        KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[inputs[i]]];
+        tsToMP4ExportSession.outputAssets = @[mp4Asset];
+        tsToMP4ExportSession.appendToOutput = YES;
+        
+        [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+            XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+            XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:mp4FileURL.path], @"The output file must exist after export session");
+        }];
+        
+        [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+        XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+        XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &files[i]), 0, @"The output file must be a readable MP4 file");
+    }
+    
+    mp4box_file reference;
+    XCTAssertEqual(mp4box_load([referenceFileURL fileSystemRepresentation], &reference), 0, @"The reference file must be a readable MP4 file");
+    XCTAssertEqual(files[1].track_count, files[0].track_count, @"The append must extend the tracks of the output file");
+    XCTAssertEqual(reference.track_count, files[0].track_count, @"Each segment must have the same tracks");
+    
+    for (unsigned int t = 0; t < files[1].track_count && t < files[0].track_count && t < reference.track_count; t++)
+    {
+        mp4box_track *before = &files[0].tracks[t];
+        mp4box_track *after = &files[1].tracks[t];
+        
+        XCTAssertEqual(after->sample_count, before->sample_count + reference.tracks[t].sample_count, @"Track %u must hold the samples of both segments", after->id);
+        XCTAssertTrue(after->sample_count > before->sample_count, @"Track %u must be extended", after->id);
+        
+        /* the samples of the first export are neither moved nor retimed, the appended ones follow them */
+        for (unsigned int s = 0; s < before->sample_count && s < after->sample_count; s++)
+        {
+            XCTAssertEqual(after->offsets[s], before->offsets[s], @"Sample %u of track %u must stay in place", s, after->id);
+            XCTAssertEqual(after->dts[s], before->dts[s], @"Sample %u of track %u must keep its time", s, after->id);
+            if (after->offsets[s] != before->offsets[s] || after->dts[s] != before->dts[s]) break;
+        }
+        for (unsigned int s = 1; s < after->sample_count; s++)
+        {
+            XCTAssertTrue(after->dts[s] > after->dts[s - 1], @"The decoding times of track %u must increase across the join, sample %u", after->id, s);
+            if (after->dts[s] <= after->dts[s - 1]) break;
+        }
+        if (before->sample_count < after->sample_count) XCTAssertEqual(after->dts[before->sample_count], before->duration, @"The appended samples of track %u must start at the end of the first segment", after->id);
+        
+        /* the edit list keeps its initial delay and spans the whole media */
+        XCTAssertEqual(after->delay, before->delay, @"Track %u must keep its delay", after->id);
+        if (after->edit_duration)
+        {
+            double media = (double) after->duration * files[1].timescale / after->timescale;
+            XCTAssertEqualWithAccuracy((double) after->edit_duration, media, 1, @"The edits of track %u must span its media", after->id);
+        }
+    }
+    
+    mp4box_free(&reference);
+    mp4box_free(&files[0]);
+    mp4box_free(&files[1]);
+}
+
+
+- (void)testCachedMultipleDiscontinuousTStoMP4
+{
+    NSURL* ts1FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Discontinuous1.ts"]];
+    KMMediaAsset *ts1Asset = [KMMediaAsset assetWithURL:ts1FileURL withFormat:KMMediaFormatTS];
+    NSURL* ts2FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Discontinuous2.ts"]];
+    KMMediaAsset *ts2Asset = [KMMediaAsset assetWithURL:ts2FileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:ts1FileURL.path], @"The input file must exist");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:ts2FileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    /* each input asset is demuxed on its own, the clock of the second one is rebased when they are concatenated */
+    NSURL *cacheURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:NSStringFromSelector(_cmd)]];
+    KMMediaConversionCache *cache = [[KMMediaConversionCache alloc] initWithDirectoryURL:cacheURL maximumSize:100 * 1024 * 1024];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[ts1Asset, ts2Asset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.cache = cache;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+        XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:mp4FileURL.path], @"The output file must exist after export session");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    [cache removeAllEntries];
+}
+
+
+- (void)testStorageLayoutsSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    /* the moov box is written after the media data only by the flat layout */
+    NSArray *layouts = @[@(KMMediaAssetExportSessionStorageDefault), @(KMMediaAssetExportSessionStorageFlat), @(KMMediaAssetExportSessionStorageTight)];
+    for (NSNumber *layout in layouts)
+    {
+        NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@%@Result.mp4",NSStringFromSelector(_cmd),layout]]];
+        KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+        [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+        
+        KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+        tsToMP4ExportSession.outputAssets = @[mp4Asset];
+        tsToMP4ExportSession.storage = (KMMediaAssetExportSessionStorage)[layout integerValue];
+        tsToMP4ExportSession.interleaveDuration = 0.5;
+        tsToMP4ExportSession.maximumChunkSize = 256 * 1024;
+        
+        [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+            XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+        }];
+        
+        [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+        XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+        
+        mp4box_file file;
+        XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &file), 0, @"The output file must be a readable MP4 file");
+        XCTAssertEqual(file.track_count, 2u, @"The output file must hold the audio and the video tracks");
+        XCTAssertEqual(file.moov.offset > file.mdat.offset, [layout integerValue] == KMMediaAssetExportSessionStorageFlat, @"The moov box must be written where the layout puts it");
+        mp4box_free(&file);
+    }
+}
+
+
+- (void)testMovieBoxSizeSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    mp4box_file file;
+    XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &file), 0, @"The output file must be a readable MP4 file");
+    XCTAssertEqual([tsToMP4ExportSession.movieBoxSizes[mp4FileURL] unsignedLongLongValue], file.moov.size, @"The size of the moov box must be reported");
+    for (unsigned int i = 0; i < file.track_count; i++)
+    {
+        if(file.tracks[i].handler == MP4BOX_TYPE('s','o','u','n')) XCTAssertTrue(file.tracks[i].sync == NULL, @"An audio track must not have a sync sample table");
+    }
+    mp4box_free(&file);
+}
+
+
+- (void)testSegmentIndexSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.segmentIndex = YES;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    /* the index sits before the media data and its ranges cover it */
+    mp4box_file file;
+    mp4box_sidx sidx;
+    XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &file), 0, @"The output file must be a readable MP4 file");
+    XCTAssertTrue(file.sidx.size > 0 && file.sidx.offset + file.sidx.size == file.mdat.offset, @"The segment index must be written before the media data");
+    
+    FILE *fp = fopen([mp4FileURL fileSystemRepresentation], "rb");
+    XCTAssertEqual(mp4box_read_sidx(fp, &file.sidx, &sidx), 0, @"The segment index must be readable");
+    fclose(fp);
+    unsigned long long indexed = 0;
+    for (unsigned int i = 0; i < sidx.reference_count; i++) indexed += sidx.sizes[i];
+    XCTAssertTrue(sidx.reference_count > 0 && indexed >= file.mdat.size, @"The ranges must cover the media data");
+    XCTAssertEqual(file.tracks[0].offsets[0] >= file.mdat.offset, YES, @"The chunk offsets must be moved after the index");
+    mp4box_free_sidx(&sidx);
+    mp4box_free(&file);
+}
+
+
+- (void)testSegmentSingleTStoCMAF
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.segmentDuration = 2;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    XCTAssertTrue([tsToMP4ExportSession.segmentOutputAssets count] > 0, @"At least one segment must be written");
+    
+    /* the init segment holds the moov box, every media segment a moof box, the playlist lists them in order */
+    mp4box box;
+    FILE *fp = fopen([tsToMP4ExportSession.segmentInitializationAsset.url fileSystemRepresentation], "rb");
+    XCTAssertTrue(fp && !mp4box_find_top(fp, MP4BOX_TYPE('m','o','o','v'), &box), @"The init segment must hold a moov box");
+    if(fp) fclose(fp);
+    
+    NSString *playlist = [NSString stringWithContentsOfURL:tsToMP4ExportSession.playlistURL encoding:NSUTF8StringEncoding error:nil];
+    XCTAssertTrue([playlist rangeOfString:@"#EXT-X-MAP:URI=\"testSegmentSingleTStoCMAFResult-init.mp4\""].location != NSNotFound, @"The playlist must reference the init segment");
+    
+    NSUInteger previous = 0;
+    for (KMMediaAsset *segmentAsset in tsToMP4ExportSession.segmentOutputAssets)
+    {
+        fp = fopen([segmentAsset.url fileSystemRepresentation], "rb");
+        XCTAssertTrue(fp && !mp4box_find_top(fp, MP4BOX_TYPE('m','o','o','f'), &box), @"A media segment must hold a moof box");
+        if(fp) fclose(fp);
+        
+        NSUInteger location = [playlist rangeOfString:[segmentAsset.url lastPathComponent]].location;
+        XCTAssertTrue(location != NSNotFound && location >= previous, @"The playlist must list the segments in order");
+        previous = location;
+    }
+}
+
+
+- (void)testProbeSingleTS
+{
+    NSString *resourcePath = [[NSBundle bundleForClass:[self class]] resourcePath];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:[NSURL fileURLWithPath:[resourcePath stringByAppendingString:@"/Continuous1.ts"]] withFormat:KMMediaFormatTS];
+    
+    NSError *error = nil;
+    NSDictionary *description = [KMMediaAssetExportSession probeAsset:tsAsset error:&error];
+    XCTAssertNotNil(description, @"The TS file must be probed: %@", error);
+    XCTAssertEqualWithAccuracy([description[KMMediaAssetProbeDurationKey] doubleValue], 5.1, 0.2, @"The probed duration must be the duration of the file");
+    XCTAssertFalse([description[KMMediaAssetProbeEstimatedKey] boolValue], @"The duration of a continuous file must be read from its timestamps");
+    XCTAssertEqual([description[KMMediaAssetProbePacketLengthKey] intValue], 188, @"The file is made of 188 bytes packets");
+    XCTAssertTrue([description[KMMediaAssetProbeBitrateKey] unsignedLongLongValue] > 0, @"The bitrate must be estimated");
+    
+    NSArray *streams = description[KMMediaAssetProbeStreamsKey];
+    XCTAssertEqual(streams.count, (NSUInteger)2, @"The file has one video and one audio stream");
+    XCTAssertEqual([[streams filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"%K == YES", KMMediaAssetProbeStreamVideoKey]] count], (NSUInteger)1, @"The file has one video stream");
+    
+    for (NSString *name in @[@"/txtFileRenamedAsTS.ts", @"/emptyfile.ts"])
+    {
+        error = nil;
+        KMMediaAsset *invalidAsset = [KMMediaAsset assetWithURL:[NSURL fileURLWithPath:[resourcePath stringByAppendingString:name]] withFormat:KMMediaFormatTS];
+        XCTAssertNil([KMMediaAssetExportSession probeAsset:invalidAsset error:&error], @"%@ is not a TS file", name);
+        XCTAssertEqual(error.code, (NSInteger)KMMediaAssetExportSessionErrorCodeInvalidInput, @"The error must tell the input is invalid");
+    }
+}
+
+
+- (void)testDemuxRangesSingleTStoMP4
+{
+    /* the continuous files make a single input asset large enough to be cut into several ranges */
+    NSString *resourcePath = [[NSBundle bundleForClass:[self class]] resourcePath];
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[resourcePath stringByAppendingString:[NSString stringWithFormat:@"/%@Input.ts",NSStringFromSelector(_cmd)]]];
+    NSMutableData *tsData = [NSMutableData data];
+    for (NSString *name in @[@"/Continuous1.ts", @"/Continuous2.ts", @"/Continuous3.ts"])
+    {
+        [tsData appendData:[NSData dataWithContentsOfFile:[resourcePath stringByAppendingString:name]]];
+    }
+    XCTAssertTrue([tsData writeToURL:tsFileURL atomically:NO], @"The input file must be written");
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSMutableArray *files = [NSMutableArray array];
+    for (NSNumber *ranges in @[@1, @4])
+    {
+        NSURL *mp4FileURL = [NSURL fileURLWithPath:[resourcePath stringByAppendingString:[NSString stringWithFormat:@"/%@Result%@.mp4",NSStringFromSelector(_cmd),ranges]]];
+        KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+        [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+        
+        KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+        tsToMP4ExportSession.outputAssets = @[mp4Asset];
+        tsToMP4ExportSession.demuxRanges = [ranges unsignedIntegerValue];
+        
+        [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+            XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+        }];
+        
+        [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+        XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+        [files addObject:mp4FileURL];
+    }
+    
+    /* the ranges demuxed concurrently give the same samples as a single demuxer */
+    mp4box_file single, ranges;
+    XCTAssertEqual(mp4box_load([files[0] fileSystemRepresentation], &single), 0, @"The output file must be a readable MP4 file");
+    XCTAssertEqual(mp4box_load([files[1] fileSystemRepresentation], &ranges), 0, @"The output file must be a readable MP4 file");
+    XCTAssertEqual(single.track_count, ranges.track_count, @"The outputs must have the same tracks");
+    XCTAssertEqual(single.mdat.size, ranges.mdat.size, @"The outputs must have the same media data");
+    for (unsigned int i = 0; i < MIN(single.track_count, ranges.track_count); i++)
+    {
+        XCTAssertEqual(single.tracks[i].sample_count, ranges.tracks[i].sample_count, @"The tracks must have the same samples");
+        if(single.tracks[i].sample_count && single.tracks[i].sample_count == ranges.tracks[i].sample_count)
+        {
+            XCTAssertEqual(single.tracks[i].dts[single.tracks[i].sample_count - 1], ranges.tracks[i].dts[ranges.tracks[i].sample_count - 1], @"The tracks must have the same sample times");
+        }
+    }
+    mp4box_free(&single);
+    mp4box_free(&ranges);
+    [[NSFileManager defaultManager] removeItemAtURL:tsFileURL error:nil];
+}
+
+
+- (void)testLogLevelsSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    /* the demuxer logs its informations, GPAC stays at the error level */
+    NSMutableArray *messages = [NSMutableArray array];
+    [KMMediaAssetExportSession setLogHandler:^(NSString *component, KMMediaAssetExportSessionLogLevel level, NSString *message) {
+        @synchronized(messages)
+        {
+            [messages addObject:@{@"component":component, @"level":@(level), @"message":message}];
+        }
+    }];
+    [KMMediaAssetExportSession setLogLevel:KMMediaAssetExportSessionLogLevelInfo forComponent:KMMediaAssetExportSessionLogDemux];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    [KMMediaAssetExportSession setLogLevel:KMMediaAssetExportSessionLogLevelError];
+    [KMMediaAssetExportSession setLogHandler:nil];
+    
+    @synchronized(messages)
+    {
+        XCTAssertTrue([[messages filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"component == %@ AND level == %d", KMMediaAssetExportSessionLogDemux, KMMediaAssetExportSessionLogLevelInfo]] count] > 0, @"The demuxer must log the format of the input");
+        XCTAssertEqual([[messages filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"level > %d", KMMediaAssetExportSessionLogLevelInfo]] count], (NSUInteger)0, @"No debug message must be logged");
+        XCTAssertEqual([[messages filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"component == %@", KMMediaAssetExportSessionLogGPAC]] count], (NSUInteger)0, @"GPAC must only log errors");
+    }
+}
+
+
+- (void)testMemoryUsageSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.measuresMemory = YES;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    NSDictionary *usage = tsToMP4ExportSession.memoryUsage;
+    XCTAssertEqual([usage count], (NSUInteger)5, @"Every conversion stage must be reported");
+    
+    /* the demuxer buffers are released with the demuxer */
+    XCTAssertTrue([usage[KMMediaAssetExportSessionMemoryStreamBuffers][KMMediaAssetExportSessionMemoryPeakKey] longLongValue] > 0, @"The streams of the demuxer must be counted");
+    XCTAssertTrue([usage[KMMediaAssetExportSessionMemoryDemuxBuffers][KMMediaAssetExportSessionMemoryPeakKey] longLongValue] > 0, @"The input buffer of the demuxer must be counted");
+    XCTAssertEqual([usage[KMMediaAssetExportSessionMemoryStreamBuffers][KMMediaAssetExportSessionMemoryCurrentKey] longLongValue], 0LL, @"The streams must be released");
+    XCTAssertEqual([usage[KMMediaAssetExportSessionMemoryDemuxBuffers][KMMediaAssetExportSessionMemoryCurrentKey] longLongValue], 0LL, @"The demuxer buffers must be released");
+    
+    /* GPAC holds the sample tables while it imports the streams */
+    XCTAssertTrue([usage[KMMediaAssetExportSessionMemoryGPACImport][KMMediaAssetExportSessionMemoryPeakKey] longLongValue] > 0, @"The import must grow the heap");
+    
+    /* the export measuring nothing reports nothing */
+    KMMediaAssetExportSession *unmeasuredExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    unmeasuredExportSession.outputAssets = @[mp4Asset];
+    [unmeasuredExportSession exportAsynchronouslyWithCompletionHandler:^{}];
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return unmeasuredExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertNil(unmeasuredExportSession.memoryUsage, @"Memory must only be measured when asked");
+}
+
+
+- (void)testConcurrentTrackImportSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    NSURL *traceFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.json",NSStringFromSelector(_cmd)]]];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    [[NSFileManager defaultManager] removeItemAtURL:traceFileURL error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.traceURL = traceFileURL;
+    
+    /* the trace file is written once the export is done, before the completion handler is called */
+    __block NSDictionary *trace = nil;
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the file.");
+        trace = [NSJSONSerialization JSONObjectWithData:[NSData dataWithContentsOfURL:traceFileURL] options:0 error:nil];
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return trace != nil; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    /* the import spans of the two streams run on their own threads and overlap in time */
+    NSArray *imports = [trace[@"traceEvents"] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"name == 'import_file'"]];
+    XCTAssertEqual([imports count], (NSUInteger)2, @"Each stream must be imported once");
+    if([imports count] == 2)
+    {
+        XCTAssertNotEqualObjects(imports[0][@"tid"], imports[1][@"tid"], @"The streams must be imported on their own threads");
+        unsigned long long latestStart = MAX([imports[0][@"ts"] unsignedLongLongValue], [imports[1][@"ts"] unsignedLongLongValue]);
+        unsigned long long earliestEnd = MIN([imports[0][@"ts"] unsignedLongLongValue] + [imports[0][@"dur"] unsignedLongLongValue],
+                                             [imports[1][@"ts"] unsignedLongLongValue] + [imports[1][@"dur"] unsignedLongLongValue]);
+        XCTAssertTrue(latestStart < earliestEnd, @"The imports of the streams must overlap in time");
+    }
+    
+    /* the streams are imported concurrently but their tracks keep the order of the streams, video first */
+    mp4box_file file;
+    XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &file), 0, @"The output file must be a readable MP4 file");
+    XCTAssertEqual(file.track_count, 2u, @"The output file must hold the audio and the video tracks");
+    if(file.track_count == 2)
+    {
+        XCTAssertEqual(file.tracks[0].handler, (unsigned int)MP4BOX_TYPE('v','i','d','e'), @"The video track must come first");
+        XCTAssertEqual(file.tracks[1].handler, (unsigned int)MP4BOX_TYPE('s','o','u','n'), @"The audio track must come second");
+        for(unsigned int t = 0; t < file.track_count; t++)
+        {
+            XCTAssertTrue(file.tracks[t].sample_count > 0, @"Every track must hold the samples of its stream");
+            for(unsigned int s = 1; s < file.tracks[t].sample_count; s++)
+            {
+                XCTAssertTrue(file.tracks[t].dts[s] > file.tracks[t].dts[s - 1], @"The samples must keep their decoding order");
+            }
+        }
+    }
+    mp4box_free(&file);
+    
+    NSArray *scratchFiles = [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:[[mp4FileURL path] stringByDeletingLastPathComponent] error:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"SELF ENDSWITH '~'"]];
+    XCTAssertEqual([scratchFiles count], (NSUInteger)0, @"The scratch files of the imports must be removed");
+}
+
+
+- (void)testPacketTraceSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    NSURL *traceFileURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"%@.tstrace",NSStringFromSelector(_cmd)]]];
+    [[NSFileManager defaultManager] removeItemAtURL:traceFileURL error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.packetTraceURL = traceFileURL;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    /* header: magic, version, record length, capacity, count, files */
+    NSData *trace = [NSData dataWithContentsOfURL:traceFileURL];
+    XCTAssertTrue([trace length] >= 40, @"The trace must have a header");
+    XCTAssertTrue(!memcmp([trace bytes], "TSTRACE", 8), @"The trace must start with its magic");
+    
+    uint32_t recordLength = 0;
+    uint64_t count = 0;
+    [trace getBytes:&recordLength range:NSMakeRange(12, 4)];
+    [trace getBytes:&count range:NSMakeRange(24, 8)];
+    
+    unsigned long long tsSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:[tsFileURL path] error:nil] fileSize];
+    XCTAssertEqual(recordLength, (uint32_t)48, @"The records must have a fixed size");
+    XCTAssertEqual(count, (uint64_t)(tsSize / 188), @"Every packet must be recorded");
+    XCTAssertEqual((uint64_t)[trace length], 40 + count * recordLength, @"The trace must hold every record");
+}
+
+
+- (void)testCheckpointSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    NSURL *checkpointURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"%@.checkpoint",NSStringFromSelector(_cmd)]]];
+    NSString *streamsPath = [[checkpointURL path] stringByAppendingPathExtension:@"streams"];
+    
+    /* a checkpoint of other input files is ignored */
+    [@"tsdemux-checkpoint 2\ninput 0 0 0 25 /other.ts\n" writeToURL:checkpointURL atomically:NO encoding:NSUTF8StringEncoding error:nil];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.checkpointURL = checkpointURL;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[mp4FileURL path]], @"The MP4 file must be written");
+    
+    /* nothing is left to resume once the export ended */
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[checkpointURL path]], @"The checkpoint must be removed");
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:streamsPath], @"The elementary streams must be removed");
+}
+
+
+- (void)testResumeCancelledCheckpointSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    
+    NSURL *checkpointURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"%@.checkpoint",NSStringFromSelector(_cmd)]]];
+    [[NSFileManager defaultManager] removeItemAtURL:checkpointURL error:nil];
+    
+    /* an uninterrupted export, then an export cancelled after its first checkpoint and resumed */
+    NSURL *referenceFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@ReferenceResult.mp4",NSStringFromSelector(_cmd)]]];
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    [[NSFileManager defaultManager] removeItemAtURL:referenceFileURL error:nil];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    KMMediaAssetExportSession *referenceExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    referenceExportSession.outputAssets = @[[KMMediaAsset assetWithURL:referenceFileURL withFormat:KMMediaFormatMP4]];
+    [referenceExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(referenceExportSession.error, @"An error occured while converting the file.");
+    }];
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return referenceExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(referenceExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    /* the progress is reported every 1024 packets, after the checkpoints of every 64 KB of input */
+    __block float cancelledProgress = -1;
+    KMMediaAssetExportSession *cancelledExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    cancelledExportSession.outputAssets = @[[KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4]];
+    cancelledExportSession.checkpointURL = checkpointURL;
+    cancelledExportSession.checkpointInterval = 64 * 1024;
+    [self keyValueObservingExpectationForObject:cancelledExportSession keyPath:@"progress" handler:^BOOL(id observedObject, NSDictionary *change) {
+        if(cancelledProgress >= 0 || ![[NSFileManager defaultManager] fileExistsAtPath:[checkpointURL path]]) return NO;
+        cancelledProgress = [observedObject progress];
+        [cancelledExportSession cancelExport];
+        return YES;
+    }];
+    [cancelledExportSession exportAsynchronouslyWithCompletionHandler:^{}];
+    [self waitForExpectationsWithTimeout:timeout handler:nil];
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return cancelledExportSession.status == KMMediaAssetExportSessionStatusCanceled; } orTimeout:timeout];
+    XCTAssertTrue(cancelledExportSession.status == KMMediaAssetExportSessionStatusCanceled, @"The export session must be cancelled");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[checkpointURL path]], @"The checkpoint of a cancelled export must be kept");
+    
+    /* the resumed demux counts the bytes demuxed before the checkpoint in its first progress */
+    __block float resumedProgress = -1;
+    KMMediaAssetExportSession *resumedExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    resumedExportSession.outputAssets = @[[KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4]];
+    resumedExportSession.checkpointURL = checkpointURL;
+    resumedExportSession.checkpointInterval = 64 * 1024;
+    [self keyValueObservingExpectationForObject:resumedExportSession keyPath:@"progress" handler:^BOOL(id observedObject, NSDictionary *change) {
+        if(resumedProgress >= 0) return NO;
+        resumedProgress = [observedObject progress];
+        return YES;
+    }];
+    [resumedExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(resumedExportSession.error, @"An error occured while converting the file.");
+    }];
+    [self waitForExpectationsWithTimeout:timeout handler:nil];
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return resumedExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(resumedExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The resumed export session must have succeed");
+    XCTAssertTrue(resumedProgress > cancelledProgress, @"The demux must resume from the checkpoint instead of the start");
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[checkpointURL path]], @"The checkpoint must be removed once the export is complete");
+    
+    /* the resumed export muxes the same samples as the uninterrupted one */
+    mp4box_file reference, resumed;
+    XCTAssertEqual(mp4box_load([referenceFileURL fileSystemRepresentation], &reference), 0, @"The reference file must be a readable MP4 file");
+    XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &resumed), 0, @"The resumed file must be a readable MP4 file");
+    XCTAssertEqual(reference.track_count, resumed.track_count, @"Both files must have the same tracks");
+    for (unsigned int i = 0; i < reference.track_count && i < resumed.track_count; i++)
+    {
+        XCTAssertEqual(reference.tracks[i].sample_count, resumed.tracks[i].sample_count, @"Both files must have the same samples");
+        for (unsigned int s = 0; s < reference.tracks[i].sample_count && s < resumed.tracks[i].sample_count; s++)
+        {
+            XCTAssertEqual(reference.tracks[i].sizes[s], resumed.tracks[i].sizes[s], @"The sample sizes must be the same");
+            XCTAssertEqual(reference.tracks[i].dts[s], resumed.tracks[i].dts[s], @"The sample times must be the same");
+        }
+    }
+    mp4box_free(&reference);
+    mp4box_free(&resumed);
+}
+
+
+- (void)testCompactSampleSizesSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    /* the same export with standard then compact sample sizes */
+    mp4box_file files[2];
+    for (int compact = 0; compact < 2; compact++)
+    {
+        NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@%dResult.mp4",NSStringFromSelector(_cmd),compact]]];
+        KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+        [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+        
+        KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+        tsToMP4ExportSession.outputAssets = @[mp4Asset];
+        tsToMP4ExportSession.compactSampleSizes = compact;
+        
+        [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+            XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+        }];
+        
+        [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+        XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+        XCTAssertEqual(mp4box_load([mp4FileURL fileSystemRepresentation], &files[compact]), 0, @"The output file must be a readable MP4 file");
+    }
+    
+    XCTAssertTrue(files[1].moov.size <= files[0].moov.size, @"Compact sample sizes must not make the moov box larger");
+    XCTAssertEqual(files[0].track_count, files[1].track_count, @"Both files must have the same tracks");
+    for (unsigned int i = 0; i < files[0].track_count && i < files[1].track_count; i++)
+    {
+        XCTAssertEqual(files[0].tracks[i].sample_count, files[1].tracks[i].sample_count, @"Both files must have the same samples");
+        for (unsigned int s = 0; s < files[0].tracks[i].sample_count && s < files[1].tracks[i].sample_count; s++)
+        {
+            XCTAssertEqual(files[0].tracks[i].sizes[s], files[1].tracks[i].sizes[s], @"The sample sizes must be the same");
+        }
+    }
+    mp4box_free(&files[0]);
+    mp4box_free(&files[1]);
+}
+
+
+- (void)testPacketHandlerSingleTStoMP4
+{
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/Continuous1.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    /* the payloads of the PES packets of each PID, concatenated */
+    NSMutableDictionary *payloads = [NSMutableDictionary dictionary];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.packetHandler = ^(NSUInteger pid, NSData *payload, NSTimeInterval pts) {
+        NSMutableData *data = payloads[@(pid)];
+        if(!data) payloads[@(pid)] = data = [NSMutableData data];
+        [data appendData:payload];
+    };
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    XCTAssertTrue([payloads count] > 0, @"The PES packets must be handled");
+    
+    /* the elementary stream files demuxed into a cache entry hold the same bytes */
+    NSURL *cacheURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:NSStringFromSelector(_cmd)]];
+    KMMediaConversionCache *cache = [[KMMediaConversionCache alloc] initWithDirectoryURL:cacheURL maximumSize:100 * 1024 * 1024];
+    [cache removeAllEntries];
+    [[NSFileManager defaultManager] removeItemAtURL:mp4FileURL error:nil];
+    
+    KMMediaAssetExportSession *cachedExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    cachedExportSession.outputAssets = @[mp4Asset];
+    cachedExportSession.cache = cache;
+    
+    [cachedExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(cachedExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return cachedExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(cachedExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    
+    NSArray *entries = [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:[cacheURL path] error:nil] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"NOT SELF BEGINSWITH '.'"]];
+    XCTAssertEqual([entries count], 1, @"The input asset must be in the cache");
+    NSString *entryPath = [[cacheURL path] stringByAppendingPathComponent:[entries firstObject]];
+    NSDictionary *info = [NSDictionary dictionaryWithContentsOfFile:[entryPath stringByAppendingPathComponent:@"info.plist"]];
+    
+    NSUInteger videoTracks = 0;
+    for (NSDictionary *track in info[@"tracks"])
+    {
+        if([track[@"fps"] doubleValue] <= 0) continue;
+        videoTracks++;
+        NSData *es = [NSData dataWithContentsOfFile:[entryPath stringByAppendingPathComponent:track[@"path"]]];
+        XCTAssertTrue([es length] > 0, @"The H.264 elementary stream must be demuxed");
+        XCTAssertEqualObjects(payloads[track[@"pid"]], es, @"The reassembled H.264 payloads must be the demuxed elementary stream");
+    }
+    XCTAssertEqual(videoTracks, 1, @"The input asset must hold an H.264 stream");
+}
+
+
+
+- (void)testSplitOnUnsignaledKeyframes
+{
+    /*
+     tsgen -d 4 --pes-min 500 --pes-max 2000 --sei 1500 --no-random-access: a keyframe every second
+     without random_access_indicator, its IDR and parameter sets behind a SEI running past the first packet
+     */
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/seiKeyframes.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.splitInterval = 1;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while splitting the file.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    XCTAssertEqual([tsToMP4ExportSession.splitOutputAssets count], (NSUInteger)4, @"A chunk must start on every keyframe, found from its NAL units");
+    
+    mp4box_file file;
+    for (KMMediaAsset *chunkAsset in tsToMP4ExportSession.splitOutputAssets)
+    {
+        XCTAssertEqual(mp4box_load([chunkAsset.url fileSystemRepresentation], &file), 0, @"Every chunk must be a readable MP4 file");
+        for (unsigned int i = 0; i < file.track_count; i++)
+        {
+            mp4box_track *track = &file.tracks[i];
+            if(track->handler != MP4BOX_TYPE('v','i','d','e')) continue;
+            XCTAssertTrue(track->sample_count > 0, @"Every chunk must hold video samples");
+            XCTAssertTrue(track->sample_count == 0 || !track->sync || track->sync[0], @"Every chunk must start on a sync sample");
+            break;
+        }
+        mp4box_free(&file);
+    }
+}
+
+
+
+- (void)testSegmentAcrossPTSWrap
+{
+    /* tsgen -d 4 --pes-min 500 --pes-max 2000 -t 8589754592: the 33-bit PTS wraps 2 seconds in */
+    NSURL* tsFileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:@"/wrapSegments.ts"]];
+    KMMediaAsset *tsAsset = [KMMediaAsset assetWithURL:tsFileURL withFormat:KMMediaFormatTS];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:tsFileURL.path], @"The input file must exist");
+    
+    NSURL *mp4FileURL = [NSURL fileURLWithPath:[[[NSBundle bundleForClass:[self class] ] resourcePath] stringByAppendingString:[NSString stringWithFormat:@"/%@Result.mp4",NSStringFromSelector(_cmd)]]];
+    KMMediaAsset *mp4Asset = [KMMediaAsset assetWithURL:mp4FileURL withFormat:KMMediaFormatMP4];
+    
+    KMMediaAssetExportSession *tsToMP4ExportSession = [[KMMediaAssetExportSession alloc] initWithInputAssets:@[tsAsset]];
+    tsToMP4ExportSession.outputAssets = @[mp4Asset];
+    tsToMP4ExportSession.segmentDuration = 1;
+    
+    [tsToMP4ExportSession exportAsynchronouslyWithCompletionHandler:^{
+        XCTAssertNil(tsToMP4ExportSession.error, @"An error occured while converting the files.");
+    }];
+    
+    [[NSRunLoop currentRunLoop] waitUntil:^BOOL{ return tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted; } orTimeout:timeout];
+    XCTAssertTrue(tsToMP4ExportSession.status == KMMediaAssetExportSessionStatusCompleted, @"The export session must have succeed");
+    XCTAssertEqual([tsToMP4ExportSession.segmentOutputAssets count], (NSUInteger)4, @"A segment must start on every keyframe");
+    
+    mp4box_file init;
+    XCTAssertEqual(mp4box_load([tsToMP4ExportSession.segmentInitializationAsset.url fileSystemRepresentation], &init), 0, @"The init segment must be a readable MP4 file");
+    
+    /* every segment decodes from the end of the previous one, the ones after the wrap included */
+    NSUInteger index = 0;
+    for (KMMediaAsset *segmentAsset in tsToMP4ExportSession.segmentOutputAssets)
+    {
+        mp4box moof, traf, tfhd, tfdt;
+        unsigned char header[12];
+        FILE *fp = fopen([segmentAsset.url fileSystemRepresentation], "rb");
+        XCTAssertTrue(fp && !mp4box_find_top(fp, MP4BOX_TYPE('m','o','o','f'), &moof) && !mp4box_find(fp, &moof, MP4BOX_TYPE('t','r','a','f'), &traf)
+                      && !mp4box_find(fp, &traf, MP4BOX_TYPE('t','f','h','d'), &tfhd) && !mp4box_find(fp, &traf, MP4BOX_TYPE('t','f','d','t'), &tfdt), @"A media segment must hold a decode time");
+        if(!fp) continue;
+        
+        unsigned int trackID = 0;
+        unsigned long long decodeTime = 0;
+        if(!fseeko(fp, (off_t) (tfhd.offset + tfhd.header), SEEK_SET) && fread(header, 1, 8, fp) == 8)
+            trackID = ((unsigned int) header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+        if(!fseeko(fp, (off_t) (tfdt.offset + tfdt.header), SEEK_SET) && fread(header, 1, 12, fp) == 12)
+        {
+            for (int i = 4; i < (header[0] ? 12 : 8); i++) decodeTime = (decodeTime << 8) | header[i];
+        }
+        fclose(fp);
+        
+        unsigned int timescale = 0;
+        for (unsigned int i = 0; i < init.track_count; i++) if(init.tracks[i].id == trackID) timescale = init.tracks[i].timescale;
+        XCTAssertTrue(timescale > 0, @"The track of the segment must be in the init segment");
+        if(timescale) XCTAssertEqualWithAccuracy((double) decodeTime / timescale, (double) index, 0.5, @"The segment %lu must start a second after the previous one", (unsigned long)index + 1);
+        index++;
+    }
+    mp4box_free(&init);
+    
+    NSString *playlist = [NSString stringWithContentsOfURL:tsToMP4ExportSession.playlistURL encoding:NSUTF8StringEncoding error:nil];
+    NSArray *entries = [playlist componentsSeparatedByString:@"#EXTINF:"];
+    XCTAssertEqual([entries count], (NSUInteger)5, @"The playlist must list every segment");
+    for (NSUInteger i = 1; i < [entries count]; i++)
+    {
+        XCTAssertEqualWithAccuracy([entries[i] doubleValue], 1., 0.5, @"Every segment lasts a second");
+    }
+    XCTAssertTrue([playlist rangeOfString:@"#EXT-X-TARGETDURATION:1\n"].location != NSNotFound || [playlist rangeOfString:@"#EXT-X-TARGETDURATION:2\n"].location != NSNotFound, @"The target duration must be the longest segment");
+}
+
+
 @end
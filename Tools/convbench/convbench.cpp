@@ -0,0 +1,551 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+/*
+ convbench runs the whole conversion of TS files, demux into elementary stream files then mux into a MP4 file,
+ as the export session does, and records for each input:
+ - wall_ms, cpu_ms: the conversion time, user and system CPU time included
+ - demux_ms, mux_ms: the wall time of each stage
+ - bytes_read, bytes_written: I/O of the stages, from the file sizes: the TS and the elementary streams are read,
+   the elementary streams and the MP4 file are written
+ - peak_rss_kb: peak resident memory
+ - memory_peak: peak bytes of each conversion stage, see Classes/Utils/kmmem.h
+ - es_bytes, output_bytes: size of the elementary streams and of the MP4 file
+ Every conversion runs in its own child process so its CPU time and peak memory are its own. With several runs,
+ the median times and the largest peak memory are kept.
+
+ The results are written as JSON, one case per line. Given a baseline written by a previous run, every case
+ whose time, memory or output grew more than the tolerance is reported and convbench exits with 1.
+
+ Build: cc -O2 -c -IClasses/MP4Mux -IClasses/Utils Classes/MP4Mux/mp4mux.c Classes/MP4Mux/mp4boxes.c Classes/Utils/kmtrace.c Classes/Utils/kmlog.c Classes/Utils/kmmem.c
+        c++ -O2 -IClasses/TSDemux -IClasses/MP4Mux -IClasses/Utils -o convbench Tools/convbench/convbench.cpp Classes/TSDemux/ts.cpp mp4mux.o mp4boxes.o kmtrace.o kmlog.o kmmem.o -lgpac -lpthread
+ */
+
+#include "ts.h"
+#include "mp4mux.h"
+
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+namespace convbench
+{
+    // what the child process measures, the parent adds the CPU time and the peak memory
+    struct result
+    {
+        int rc;                                 // 0 ok, 1 demux failed, 2 no stream to mux, 3 mux failed
+        double demux_ms;
+        double mux_ms;
+        u_int64_t input_bytes;
+        u_int64_t es_bytes;
+        u_int64_t output_bytes;
+        long long memory_peak[KMMEM_STAGE_COUNT];
+    };
+    
+    class measure
+    {
+    public:
+        std::string name;
+        int rc;
+        u_int64_t input_bytes;
+        double wall_ms;
+        double cpu_ms;
+        double demux_ms;
+        double mux_ms;
+        u_int64_t bytes_read;
+        u_int64_t bytes_written;
+        u_int64_t peak_rss_kb;
+        u_int64_t es_bytes;
+        u_int64_t output_bytes;
+        long long memory_peak[KMMEM_STAGE_COUNT];
+        
+        measure(void):rc(0),input_bytes(0),wall_ms(0),cpu_ms(0),demux_ms(0),mux_ms(0),bytes_read(0),bytes_written(0),peak_rss_kb(0),es_bytes(0),output_bytes(0) { memset(memory_peak,0,sizeof(memory_peak)); }
+    };
+    
+    double now_ms(void)
+    {
+        struct timeval tv;
+        gettimeofday(&tv,0);
+        return tv.tv_sec*1000.+tv.tv_usec/1000.;
+    }
+    
+    u_int64_t file_size(const std::string& path)
+    {
+        struct stat st;
+        return stat(path.c_str(),&st) ? 0 : st.st_size;
+    }
+    
+    void remove_directory(const std::string& path)
+    {
+        DIR* dir=opendir(path.c_str());
+        if(dir)
+        {
+            for(dirent* e=readdir(dir);e;e=readdir(dir))
+                if(strcmp(e->d_name,".") && strcmp(e->d_name,".."))
+                    unlink((path+os_slash+e->d_name).c_str());
+            closedir(dir);
+        }
+        rmdir(path.c_str());
+    }
+    
+    // demux and mux one input into work_dir, like the export session without options
+    result convert(const char* input, const std::string& work_dir)
+    {
+        result r;
+        memset(&r,0,sizeof(r));
+        r.input_bytes=file_size(input);
+        
+        kmmem_stats memory;
+        memset(&memory,0,sizeof(memory));
+        
+        struct track { std::string path, timing; char lang[4]; double fps; u_int64_t first_pts; bool video; };
+        std::vector<track> tracks;
+        double video_fps=0;
+        
+        double start=now_ms();
+        {
+            ts::demuxer demuxer;
+            demuxer.av_only=false;
+            demuxer.rebase=true;
+            demuxer.timing=true;
+            demuxer.dst=work_dir;
+            demuxer.prefix="es";
+            demuxer.memory=&memory;
+            
+            if(demuxer.demux_file(input,&video_fps))
+            {
+                r.rc=1;
+                for(int i=0;i<KMMEM_STAGE_COUNT;i++)
+                    r.memory_peak[i]=memory.stages[i].peak;
+                return r;
+            }
+            
+            for(std::map<u_int16_t,ts::stream>::const_iterator i=demuxer.streams.begin();i!=demuxer.streams.end();++i)
+            {
+                const ts::stream& s=i->second;
+                
+                if(s.type==0xff || !s.file.filename.length())
+                    continue;
+                
+                r.es_bytes+=s.file.written;
+                
+                const char* ext=strrchr(s.file.filename.c_str(),'.');
+                if(!ext || (strcmp(ext,".264") && strcmp(ext,".aac") && strcmp(ext,".mp3")))
+                    continue;
+                
+                track t;
+                t.path=s.file.filename;
+                t.timing=s.timing.filename;
+                memcpy(t.lang,s.lang,sizeof(t.lang));
+                t.video=!strcmp(ext,".264");
+                t.fps=t.video && s.frame_length ? 90000./s.frame_length : 0;
+                t.first_pts=s.first_pts;
+                tracks.push_back(t);
+            }
+        }
+        r.demux_ms=now_ms()-start;
+        
+        if(tracks.empty())
+        {
+            r.rc=2;
+            return r;
+        }
+        
+        // video tracks first, each one delayed from the start of the earliest track
+        std::vector<mp4mux_track> mux_tracks;
+        u_int64_t start_pts=tracks[0].first_pts;
+        for(size_t i=0;i<tracks.size();i++)
+            start_pts=std::min(start_pts,tracks[i].first_pts);
+        
+        for(int video=1;video>=0;video--)
+            for(size_t i=0;i<tracks.size();i++)
+            {
+                if(tracks[i].video!=(bool)video)
+                    continue;
+                
+                mp4mux_track t;
+                memset(&t,0,sizeof(t));
+                t.path=tracks[i].path.c_str();
+                memcpy(t.language,tracks[i].lang,sizeof(t.language));
+                t.fps=tracks[i].fps>0 ? video_fps : 0;
+                t.delay=(tracks[i].first_pts-start_pts)/90000.;
+                t.timing=tracks[i].timing.length() ? tracks[i].timing.c_str() : 0;
+                mux_tracks.push_back(t);
+            }
+        
+        std::string output=work_dir+os_slash+"output.mp4";
+        
+        mp4mux_options options;
+        memset(&options,0,sizeof(options));
+        options.memory=&memory;
+        
+        start=now_ms();
+        if(assemble_tracks(&mux_tracks[0],mux_tracks.size(),output.c_str(),&options))
+            r.rc=3;
+        r.mux_ms=now_ms()-start;
+        
+        for(int i=0;i<KMMEM_STAGE_COUNT;i++)
+            r.memory_peak[i]=memory.stages[i].peak;
+        
+        r.output_bytes=file_size(output);
+        
+        return r;
+    }
+    
+    // run one conversion in a child process, -1 if it cannot be started
+    int run(const char* input, measure& m)
+    {
+        char work_dir[]="/tmp/convbench.XXXXXX";
+        if(!mkdtemp(work_dir))
+            return -1;
+        
+        int fds[2];
+        if(pipe(fds))
+            return -1;
+        
+        double start=now_ms();
+        
+        pid_t pid=fork();
+        if(pid<0)
+            return -1;
+        
+        if(!pid)
+        {
+            close(fds[0]);
+            result r=convert(input,work_dir);
+            _exit(write(fds[1],&r,sizeof(r))==sizeof(r) ? 0 : 1);
+        }
+        
+        close(fds[1]);
+        
+        result r;
+        bool received=read(fds[0],&r,sizeof(r))==sizeof(r);
+        close(fds[0]);
+        
+        int status;
+        struct rusage usage;
+        while(wait4(pid,&status,0,&usage)<0 && errno==EINTR);
+        
+        m.wall_ms=now_ms()-start;
+        remove_directory(work_dir);
+        
+        if(!received || !WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            m.rc=-1;
+            return 0;
+        }
+        
+        m.rc=r.rc;
+        m.input_bytes=r.input_bytes;
+        m.demux_ms=r.demux_ms;
+        m.mux_ms=r.mux_ms;
+        m.es_bytes=r.es_bytes;
+        m.output_bytes=r.output_bytes;
+        memcpy(m.memory_peak,r.memory_peak,sizeof(m.memory_peak));
+        m.bytes_read=r.input_bytes+r.es_bytes;
+        m.bytes_written=r.es_bytes+r.output_bytes;
+        m.cpu_ms=usage.ru_utime.tv_sec*1000.+usage.ru_utime.tv_usec/1000.+usage.ru_stime.tv_sec*1000.+usage.ru_stime.tv_usec/1000.;
+#ifdef __APPLE__
+        m.peak_rss_kb=usage.ru_maxrss/1024;     // bytes on Darwin
+#else
+        m.peak_rss_kb=usage.ru_maxrss;
+#endif
+        
+        return 0;
+    }
+    
+    double median(std::vector<double> v)
+    {
+        std::sort(v.begin(),v.end());
+        return v.size()%2 ? v[v.size()/2] : (v[v.size()/2-1]+v[v.size()/2])/2;
+    }
+    
+    std::string memory_json(const measure& m)
+    {
+        std::string json;
+        char member[64];
+        for(int i=0;i<KMMEM_STAGE_COUNT;i++)
+        {
+            snprintf(member,sizeof(member),"%s\"%s\": %lld",i?", ":"",kmmem_stage_name((kmmem_stage)i),m.memory_peak[i]);
+            json+=member;
+        }
+        return json;
+    }
+    
+    void write_json(FILE* fp, const std::vector<measure>& measures)
+    {
+        fprintf(fp,"{\n  \"cases\": [\n");
+        for(size_t i=0;i<measures.size();i++)
+        {
+            const measure& m=measures[i];
+            fprintf(fp,"    {\"name\": \"%s\", \"rc\": %d, \"input_bytes\": %llu, \"wall_ms\": %.1f, \"cpu_ms\": %.1f, \"demux_ms\": %.1f, \"mux_ms\": %.1f, "
+                    "\"bytes_read\": %llu, \"bytes_written\": %llu, \"peak_rss_kb\": %llu, \"es_bytes\": %llu, \"output_bytes\": %llu, \"memory_peak\": {%s}}%s\n",
+                    m.name.c_str(),m.rc,(unsigned long long)m.input_bytes,m.wall_ms,m.cpu_ms,m.demux_ms,m.mux_ms,
+                    (unsigned long long)m.bytes_read,(unsigned long long)m.bytes_written,(unsigned long long)m.peak_rss_kb,
+                    (unsigned long long)m.es_bytes,(unsigned long long)m.output_bytes,memory_json(m).c_str(),i+1<measures.size()?",":"");
+        }
+        fprintf(fp,"  ]\n}\n");
+    }
+    
+    // value of "key": in a line written by write_json
+    bool get_number(const char* line, const char* key, double& value)
+    {
+        std::string k=std::string("\"")+key+"\": ";
+        const char* p=strstr(line,k.c_str());
+        return p && sscanf(p+k.length(),"%lf",&value)==1;
+    }
+    
+    bool get_name(const char* line, std::string& name)
+    {
+        const char* p=strstr(line,"\"name\": \"");
+        if(!p)
+            return false;
+        p+=9;
+        const char* e=strchr(p,'"');
+        if(!e)
+            return false;
+        name.assign(p,e-p);
+        return true;
+    }
+    
+    // metrics compared with the baseline, and the smallest growth worth reporting whatever the tolerance
+    struct metric { const char* key; double floor; };
+    
+    const metric compared[]=
+    {
+        { "wall_ms",        5 },
+        { "cpu_ms",         5 },
+        { "peak_rss_kb",    1024 },
+        { "bytes_written",  0 },
+        { "output_bytes",   0 }
+    };
+    
+    // number of regressions, -1 if the baseline cannot be read
+    int compare(const char* baseline, const std::vector<measure>& measures, double tolerance)
+    {
+        FILE* fp=fopen(baseline,"r");
+        if(!fp)
+        {
+            perror(baseline);
+            return -1;
+        }
+        
+        std::map<std::string,std::string> lines;
+        char line[4096];
+        while(fgets(line,sizeof(line),fp))
+        {
+            std::string name;
+            if(get_name(line,name))
+                lines[name]=line;
+        }
+        fclose(fp);
+        
+        int regressions=0;
+        
+        for(size_t i=0;i<measures.size();i++)
+        {
+            const measure& m=measures[i];
+            std::map<std::string,std::string>::const_iterator l=lines.find(m.name);
+            
+            if(l==lines.end())
+            {
+                fprintf(stderr,"%s: not in the baseline\n",m.name.c_str());
+                continue;
+            }
+            
+            double base_rc;
+            if(get_number(l->second.c_str(),"rc",base_rc) && (int)base_rc!=m.rc)
+            {
+                fprintf(stderr,"%s: REGRESSION rc %d, was %d\n",m.name.c_str(),m.rc,(int)base_rc);
+                regressions++;
+                continue;
+            }
+            
+            const double current[]={ m.wall_ms, m.cpu_ms, (double)m.peak_rss_kb, (double)m.bytes_written, (double)m.output_bytes };
+            
+            for(size_t j=0;j<sizeof(compared)/sizeof(compared[0]);j++)
+            {
+                double base;
+                if(!get_number(l->second.c_str(),compared[j].key,base))
+                    continue;
+                
+                double growth=base>0 ? (current[j]-base)/base*100 : 0;
+                
+                if(current[j]-base>compared[j].floor && growth>tolerance)
+                {
+                    fprintf(stderr,"%s: REGRESSION %s %.0f, was %.0f (+%.1f%%)\n",m.name.c_str(),compared[j].key,current[j],base,growth);
+                    regressions++;
+                }else if(base-current[j]>compared[j].floor && -growth>tolerance)
+                    fprintf(stderr,"%s: improved %s %.0f, was %.0f (%.1f%%)\n",m.name.c_str(),compared[j].key,current[j],base,growth);
+            }
+        }
+        
+        return regressions;
+    }
+    
+    // the TS files of a directory, sorted, or the file itself
+    void add_inputs(const char* path, std::vector<std::string>& inputs)
+    {
+        DIR* dir=opendir(path);
+        
+        if(!dir)
+        {
+            inputs.push_back(path);
+            return;
+        }
+        
+        std::vector<std::string> files;
+        for(dirent* e=readdir(dir);e;e=readdir(dir))
+        {
+            const char* ext=strrchr(e->d_name,'.');
+            if(ext && (!strcmp(ext,".ts") || !strcmp(ext,".m2ts")))
+                files.push_back(std::string(path)+os_slash+e->d_name);
+        }
+        closedir(dir);
+        
+        std::sort(files.begin(),files.end());
+        inputs.insert(inputs.end(),files.begin(),files.end());
+    }
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options] input.ts|directory ...\n"
+            "  -r, --runs=N                conversions of each input, the median times are kept (3)\n"
+            "  -o, --output=FILE           write the results there (stdout)\n"
+            "  -b, --baseline=FILE         compare the results with a previous output, exit with 1 on regression\n"
+            "  -t, --tolerance=PERCENT     growth of a time, the memory or the output tolerated by the comparison (10)\n"
+            "directories are searched for .ts and .m2ts files, tsgen writes larger inputs\n",
+            name);
+}
+
+int main(int argc,char** argv)
+{
+    int runs=3;
+    const char* output=0;
+    const char* baseline=0;
+    double tolerance=10;
+    
+    static struct option long_options[]=
+    {
+        { "runs",            required_argument, 0, 'r' },
+        { "output",          required_argument, 0, 'o' },
+        { "baseline",        required_argument, 0, 'b' },
+        { "tolerance",       required_argument, 0, 't' },
+        { 0, 0, 0, 0 }
+    };
+    
+    int c;
+    while((c=getopt_long(argc,argv,"r:o:b:t:",long_options,0))!=-1)
+    {
+        switch(c)
+        {
+            case 'r': runs=atoi(optarg); break;
+            case 'o': output=optarg; break;
+            case 'b': baseline=optarg; break;
+            case 't': tolerance=atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    
+    std::vector<std::string> inputs;
+    for(int i=optind;i<argc;i++)
+        convbench::add_inputs(argv[i],inputs);
+    
+    if(inputs.empty() || runs<1 || tolerance<0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    std::vector<convbench::measure> measures;
+    
+    for(size_t i=0;i<inputs.size();i++)
+    {
+        convbench::measure m;
+        std::vector<double> wall,cpu,demux,mux;
+        
+        for(int n=0;n<runs;n++)
+        {
+            if(convbench::run(inputs[i].c_str(),m))
+            {
+                perror(inputs[i].c_str());
+                return 1;
+            }
+            wall.push_back(m.wall_ms);
+            cpu.push_back(m.cpu_ms);
+            demux.push_back(m.demux_ms);
+            mux.push_back(m.mux_ms);
+            
+            if(!measures.empty() && measures.back().name==inputs[i])
+                m.peak_rss_kb=std::max(m.peak_rss_kb,measures.back().peak_rss_kb);
+        }
+        
+        const char* name=strrchr(inputs[i].c_str(),os_slash);
+        m.name=name ? name+1 : inputs[i];
+        m.wall_ms=convbench::median(wall);
+        m.cpu_ms=convbench::median(cpu);
+        m.demux_ms=convbench::median(demux);
+        m.mux_ms=convbench::median(mux);
+        measures.push_back(m);
+        
+        fprintf(stderr,"%s: rc=%d wall=%.1fms cpu=%.1fms rss=%lluKB output=%llu bytes\n",m.name.c_str(),m.rc,m.wall_ms,m.cpu_ms,
+                (unsigned long long)m.peak_rss_kb,(unsigned long long)m.output_bytes);
+    }
+    
+    FILE* fp=output ? fopen(output,"w") : stdout;
+    if(!fp)
+    {
+        perror(output);
+        return 1;
+    }
+    convbench::write_json(fp,measures);
+    if(output && fclose(fp))
+    {
+        perror(output);
+        return 1;
+    }
+    
+    if(baseline)
+    {
+        int regressions=convbench::compare(baseline,measures,tolerance);
+        if(regressions)
+        {
+            if(regressions>0)
+                fprintf(stderr,"%d regression(s) beyond %.1f%%\n",regressions,tolerance);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+/*
+ mp4bench measures how a player reads an MP4 file produced by the muxer, to compare the storage layouts
+ (interleave duration, chunk size, storage mode) for local playback, progressive download and archival.
+
+ The player reads the file by blocks of a fixed size and keeps the last few blocks in memory.
+ - playback: every sample of every track is read in decoding time order, from the beginning to the end.
+ - seeks: the player jumps to random times, restarts each track on its previous sync sample and reads
+   a window of samples of every track, with an empty cache.
+ The read amplification is the number of bytes read divided by the number of bytes of the samples.
+ The latency of a seek is the time spent in the reads, it depends on the page cache: drop it to measure a cold disk.
+
+ Build: cc -O2 -IClasses/MP4Mux -o mp4bench Tools/mp4bench/mp4bench.c Classes/MP4Mux/mp4boxes.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mp4boxes.h"
+
+typedef struct
+{
+    unsigned long long offset;
+    unsigned int size;
+    double time;
+} sample_ref;
+
+typedef struct
+{
+    int fd;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned long long *blocks;     /* offsets of the cached blocks, most recently used first */
+    unsigned int cached;
+    unsigned char *buffer;
+    unsigned long long bytes_read;
+    unsigned long long bytes_needed;
+    unsigned long long reads;
+    unsigned long long discontiguous_reads;
+    unsigned long long next_offset;
+    double read_time;
+} reader;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reader_reset(reader *r)
+{
+    r->cached = 0;
+    r->bytes_read = r->bytes_needed = r->reads = r->discontiguous_reads = 0;
+    r->next_offset = 0;
+    r->read_time = 0;
+}
+
+/*
+ Read the block at offset unless it is cached, then move it to the front of the cache
+ */
+static int read_block(reader *r, unsigned long long offset)
+{
+    unsigned int i;
+    double start;
+    ssize_t len;
+
+    for (i = 0; i < r->cached && r->blocks[i] != offset; i++) ;
+
+    if (i == r->cached) {
+        start = now();
+        len = pread(r->fd, r->buffer, r->block_size, (off_t) offset);
+        r->read_time += now() - start;
+        if (len < 0) return -1;
+
+        r->bytes_read += (unsigned long long) len;
+        r->reads++;
+        if (offset != r->next_offset) r->discontiguous_reads++;
+        r->next_offset = offset + (unsigned long long) len;
+
+        if (r->cached < r->block_count) r->cached++;
+        i = r->cached - 1;
+    }
+    memmove(r->blocks + 1, r->blocks, sizeof(unsigned long long) * i);
+    r->blocks[0] = offset;
+    return 0;
+}
+
+static int read_sample(reader *r, const sample_ref *sample)
+{
+    unsigned long long block;
+
+    r->bytes_needed += sample->size;
+    for (block = sample->offset / r->block_size * r->block_size; block < sample->offset + sample->size; block += r->block_size) {
+        if (read_block(r, block)) return -1;
+    }
+    return 0;
+}
+
+static int compare_time(const void *a, const void *b)
+{
+    const sample_ref *x = (const sample_ref *) a, *y = (const sample_ref *) b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double sample_time(const mp4box_track *track, unsigned int i)
+{
+    return track->timescale ? (double) track->dts[i] / track->timescale : 0;
+}
+
+/* xorshift64* */
+static unsigned long long next_random(unsigned long long *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] file.mp4\n"
+            "  -b, --block-size=BYTES      size of the reads of the player (65536)\n"
+            "  -c, --cache=N               blocks kept in memory by the player (4)\n"
+            "  -n, --seeks=N               random seeks (100)\n"
+            "  -w, --window=SEC            duration read after each seek (1)\n"
+            "  -S, --seed=N                random seed (1)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int block_size = 65536, cache = 4, seeks = 100;
+    double window = 1, duration = 0;
+    unsigned long long seed = 1;
+    mp4box_file file;
+    sample_ref *samples, *window_samples;
+    unsigned int i, j, n, sample_count = 0;
+    double *latencies;
+    double amplification = 0, reads = 0, start;
+    reader r;
+    int c;
+
+    static struct option long_options[] = {
+        { "block-size", required_argument, 0, 'b' },
+        { "cache",      required_argument, 0, 'c' },
+        { "seeks",      required_argument, 0, 'n' },
+        { "window",     required_argument, 0, 'w' },
+        { "seed",       required_argument, 0, 'S' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "b:c:n:w:S:", long_options, 0)) != -1) {
+        switch (c) {
+            case 'b': block_size = (unsigned int) strtoul(optarg, 0, 10); break;
+            case 'c': cache = (unsigned int) strtoul(optarg, 0, 10); break;
+            case 'n': seeks = (unsigned int) strtoul(optarg, 0, 10); break;
+            case 'w': window = atof(optarg); break;
+            case 'S': seed = strtoull(optarg, 0, 10); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || !block_size || !cache || window <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (mp4box_load(argv[optind], &file)) {
+        fprintf(stderr, "%s: not a readable MP4 file\n", argv[optind]);
+        return 1;
+    }
+
+    for (i = 0; i < file.track_count; i++) sample_count += file.tracks[i].sample_count;
+
+    samples = (sample_ref *) malloc(sizeof(sample_ref) * (sample_count + 1));
+    window_samples = (sample_ref *) malloc(sizeof(sample_ref) * (sample_count + 1));
+    latencies = (double *) malloc(sizeof(double) * (seeks + 1));
+    r.blocks = (unsigned long long *) malloc(sizeof(unsigned long long) * cache);
+    r.buffer = (unsigned char *) malloc(block_size);
+    r.fd = open(argv[optind], O_RDONLY);
+    r.block_size = block_size;
+    r.block_count = cache;
+    if (!samples || !window_samples || !latencies || !r.blocks || !r.buffer || r.fd < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    for (i = 0, n = 0; i < file.track_count; i++) {
+        const mp4box_track *track = &file.tracks[i];
+        for (j = 0; j < track->sample_count; j++, n++) {
+            samples[n].offset = track->offsets[j];
+            samples[n].size = track->sizes[j];
+            samples[n].time = sample_time(track, j);
+            if (samples[n].time > duration) duration = samples[n].time;
+        }
+    }
+    qsort(samples, sample_count, sizeof(sample_ref), compare_time);
+
+    printf("file: %s, %llu bytes, %u tracks, %u samples, %.3f s\n", argv[optind], file.file_size, file.track_count, sample_count, duration);
+    printf("moov: %llu bytes at %llu, %s\n", file.moov.size, file.moov.offset,
+           file.moov.offset < file.mdat.offset ? "before the media data, playback starts after the first bytes"
+                                               : "after the media data, progressive playback needs the end of the file first");
+
+    /* playback */
+    reader_reset(&r);
+    for (i = 0; i < sample_count; i++) {
+        if (read_sample(&r, &samples[i])) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    printf("playback: %llu reads, %llu discontiguous, %llu bytes read for %llu bytes of samples, amplification %.3f, %.3f ms\n",
+           r.reads, r.discontiguous_reads, r.bytes_read, r.bytes_needed,
+           r.bytes_needed ? (double) r.bytes_read / r.bytes_needed : 0, r.read_time * 1000);
+
+    /* seeks */
+    for (n = 0; n < seeks && sample_count; n++) {
+        double target = duration * (double) (next_random(&seed) >> 11) / 9007199254740992.0;
+        unsigned int count = 0;
+
+        reader_reset(&r);
+        start = now();
+
+        for (i = 0; i < file.track_count; i++) {
+            const mp4box_track *track = &file.tracks[i];
+            unsigned int first = 0;
+            double end;
+
+            /* previous sync sample of the track */
+            for (j = 0; j < track->sample_count && sample_time(track, j) <= target; j++) {
+                if (!track->sync || track->sync[j]) first = j;
+            }
+            end = target + window;
+            for (j = first; j < track->sample_count && sample_time(track, j) < end; j++, count++) {
+                window_samples[count].offset = track->offsets[j];
+                window_samples[count].size = track->sizes[j];
+                window_samples[count].time = sample_time(track, j);
+            }
+        }
+        qsort(window_samples, count, sizeof(sample_ref), compare_time);
+
+        for (i = 0; i < count; i++) {
+            if (read_sample(&r, &window_samples[i])) {
+                perror(argv[optind]);
+                return 1;
+            }
+        }
+
+        latencies[n] = (now() - start) * 1000;
+        amplification += r.bytes_needed ? (double) r.bytes_read / r.bytes_needed : 0;
+        reads += r.reads;
+    }
+
+    if (n) {
+        qsort(latencies, n, sizeof(double), compare_double);
+        for (i = 0, start = 0; i < n; i++) start += latencies[i];
+        printf("seeks: %u, %.1f reads per seek, amplification %.3f, latency mean %.3f ms, p50 %.3f ms, p95 %.3f ms, max %.3f ms\n",
+               n, reads / n, amplification / n, start / n, latencies[n / 2], latencies[(n * 95) / 100 < n ? (n * 95) / 100 : n - 1], latencies[n - 1]);
+    }
+
+    close(r.fd);
+    free(samples);
+    free(window_samples);
+    free(latencies);
+    free(r.blocks);
+    free(r.buffer);
+    mp4box_free(&file);
+    return 0;
+}
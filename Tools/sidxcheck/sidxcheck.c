@@ -0,0 +1,164 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+/*
+ sidxcheck verifies the segment index (sidx) of an MP4 file against the layout of its samples:
+ - the ranges are consecutive, start where the index says and end inside the file;
+ - each range starts with the sample of the reference track presented at its start time,
+   a sync sample when the index says so;
+ - every sample of the reference track lies in the range of its time, so one range request is enough to seek;
+ - the durations cover the whole reference track.
+ The samples of the other tracks are only required to lie in the indexed bytes.
+
+ Build: cc -O2 -IClasses/MP4Mux -o sidxcheck Tools/sidxcheck/sidxcheck.c Classes/MP4Mux/mp4boxes.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mp4boxes.h"
+
+static unsigned int errors = 0;
+
+static void report(const char *format, unsigned long long a, unsigned long long b)
+{
+    /* only the first errors are printed */
+    if (errors++ < 20) {
+        fprintf(stderr, "error: ");
+        fprintf(stderr, format, a, b);
+        fprintf(stderr, "\n");
+    }
+}
+
+static long long presentation_time(const mp4box_track *track, unsigned int i)
+{
+    return (long long) track->dts[i] + (track->cts_offsets ? track->cts_offsets[i] : 0);
+}
+
+int main(int argc, char **argv)
+{
+    mp4box_file file;
+    mp4box_sidx sidx;
+    const mp4box_track *track = NULL;
+    unsigned long long *starts, begin, end, max_size = 0;
+    unsigned int *first_samples;
+    long long time, end_time = 0;
+    unsigned int i, k, t;
+    FILE *fp;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s file.mp4\n", argv[0]);
+        return 2;
+    }
+
+    if (mp4box_load(argv[1], &file)) {
+        fprintf(stderr, "%s: not a readable MP4 file\n", argv[1]);
+        return 2;
+    }
+    if (!file.sidx.size) {
+        fprintf(stderr, "%s: no segment index\n", argv[1]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp || mp4box_read_sidx(fp, &file.sidx, &sidx)) {
+        fprintf(stderr, "%s: unreadable segment index\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    for (t = 0; t < file.track_count; t++) {
+        if (file.tracks[t].id == sidx.reference_id) track = &file.tracks[t];
+    }
+    if (!track || !track->sample_count || !sidx.reference_count) {
+        fprintf(stderr, "%s: the segment index does not reference a track with samples\n", argv[1]);
+        return 1;
+    }
+    if (sidx.timescale != track->timescale) report("timescale %llu instead of %llu", sidx.timescale, track->timescale);
+
+    starts = (unsigned long long *) malloc(sizeof(unsigned long long) * (sidx.reference_count + 1));
+    first_samples = (unsigned int *) malloc(sizeof(unsigned int) * (sidx.reference_count + 1));
+    if (!starts || !first_samples) return 2;
+
+    /* byte ranges */
+    starts[0] = file.sidx.offset + file.sidx.size + sidx.first_offset;
+    for (k = 0; k < sidx.reference_count; k++) {
+        starts[k + 1] = starts[k] + sidx.sizes[k];
+        if (sidx.sizes[k] > max_size) max_size = sidx.sizes[k];
+    }
+    if (starts[sidx.reference_count] > file.file_size) report("the ranges end at %llu, after the end of the file at %llu", starts[sidx.reference_count], file.file_size);
+
+    /* first sample of each range, presented at its start time */
+    for (k = 0, time = (long long) sidx.earliest_time; k < sidx.reference_count; time += sidx.durations[k], k++) {
+        first_samples[k] = track->sample_count;
+        for (i = 0; i < track->sample_count; i++) {
+            if (presentation_time(track, i) == time) {
+                first_samples[k] = i;
+                break;
+            }
+        }
+        if (first_samples[k] == track->sample_count) {
+            if (k) report("range %llu starts at time %llu, when no sample is presented", k, time);
+            first_samples[k] = 0;
+            continue;
+        }
+        if (k && track->offsets[first_samples[k]] != starts[k]) report("range %llu does not start with the sample presented at its start time, at offset %llu", k, track->offsets[first_samples[k]]);
+        if (sidx.starts_with_sap[k] && track->sync && !track->sync[first_samples[k]]) report("range %llu starts with sample %llu, which is not a sync sample", k, first_samples[k] + 1);
+    }
+    end_time = time;
+
+    /* samples of the reference track, in decoding order */
+    for (k = 0; k < sidx.reference_count; k++) {
+        unsigned int last = (k + 1 < sidx.reference_count) ? first_samples[k + 1] : track->sample_count;
+        for (i = first_samples[k]; i < last; i++) {
+            if (track->offsets[i] < starts[k] || track->offsets[i] + track->sizes[i] > starts[k + 1]) report("sample %llu of the reference track is out of its range %llu", i + 1, k);
+        }
+    }
+    for (i = 0; i < track->sample_count; i++) {
+        if (presentation_time(track, i) >= end_time) report("sample %llu of the reference track is presented after the indexed duration %llu", i + 1, end_time);
+    }
+
+    /* samples of every track */
+    begin = starts[0];
+    end = starts[sidx.reference_count];
+    for (t = 0; t < file.track_count; t++) {
+        for (i = 0; i < file.tracks[t].sample_count; i++) {
+            if (file.tracks[t].offsets[i] < begin || file.tracks[t].offsets[i] + file.tracks[t].sizes[i] > end) {
+                report("sample %llu of track %llu is out of the indexed bytes", i + 1, file.tracks[t].id);
+            }
+        }
+    }
+
+    printf("%s: %u ranges of track %u, %.3f s, largest range %llu bytes, %u errors\n",
+           argv[1], sidx.reference_count, sidx.reference_id, (double) (end_time - (long long) sidx.earliest_time) / sidx.timescale, max_size, errors);
+
+    free(starts);
+    free(first_samples);
+    mp4box_free_sidx(&sidx);
+    mp4box_free(&file);
+    return errors ? 1 : 0;
+}
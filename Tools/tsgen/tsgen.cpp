@@ -0,0 +1,658 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ tsgen writes a synthetic but valid MPEG2-TS (or M2TS) stream used to benchmark the demuxer
+ on inputs far larger or stranger than the test resources.
+
+ Every program carries one H.264 video stream, one AAC (ADTS) audio stream and an optional
+ number of private data streams. The elementary stream payloads are random bytes framed by
+ real NAL/ADTS headers, so the demuxer and the muxer parse them like real content.
+ The output only depends on the options: the same seed always gives the same bytes.
+
+ Build: c++ -O2 -o tsgen Tools/tsgen/tsgen.cpp
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+namespace tsgen
+{
+    class random
+    {
+    private:
+        u_int64_t state;
+    public:
+        random(u_int64_t seed):state(seed?seed:0x9e3779b97f4a7c15ULL) {}
+
+        // xorshift64*
+        u_int64_t next(void)
+        {
+            state^=state>>12;
+            state^=state<<25;
+            state^=state>>27;
+            return state*0x2545f4914f6cdd1dULL;
+        }
+
+        u_int32_t range(u_int32_t min,u_int32_t max)
+        { return max>min?min+(u_int32_t)(next()%(max-min+1)):min; }
+
+        bool chance(double p)
+        { return p>0 && (next()>>11)*(1.0/9007199254740992.0)<p; }
+    };
+
+    class options
+    {
+    public:
+        double duration;                // seconds
+        u_int64_t bitrate;              // bits per second, padded with null packets, 0 - no padding
+        int programs;
+        int data_streams;               // private data streams per program
+        u_int32_t pes_min;              // video access unit size range
+        u_int32_t pes_max;
+        int gop;                        // frames between keyframes
+        double fps;
+        double stuffing;                // probability of adaptation field stuffing in a packet
+        double psi_interval;            // seconds between PAT/PMT repetitions
+        int discontinuities;            // timeline jumps evenly spread in the stream
+        double corruption;              // probability of corrupting a packet
+        bool m2ts;
+        u_int64_t seed;
+        u_int64_t start_pts;            // 90kHz timeline origin, timestamps wrap at 2^33 like real ones
+        u_int32_t sei;                  // size of a SEI NAL leading each keyframe, 0 - none
+        bool random_access;             // signal keyframes with the random_access_indicator
+
+        options(void):duration(10),bitrate(0),programs(1),data_streams(0),pes_min(2000),pes_max(40000),gop(25),fps(25),
+        stuffing(0),psi_interval(0.1),discontinuities(0),corruption(0),m2ts(false),seed(1),start_pts(0),sei(0),random_access(true) {}
+    };
+
+    class stream
+    {
+    public:
+        u_int16_t pid;
+        u_int8_t type;                  // PMT stream type
+        u_int8_t stream_id;             // PES stream id
+        u_int8_t cc;                    // continuity counter
+        double next;                    // time of the next access unit
+        double period;
+        u_int64_t frame_num;
+
+        stream(u_int16_t p,u_int8_t t,u_int8_t id,double per):pid(p),type(t),stream_id(id),cc(0),next(0),period(per),frame_num(0) {}
+    };
+
+    class program
+    {
+    public:
+        u_int16_t number;
+        u_int16_t pmt_pid;
+        u_int8_t pmt_cc;
+        std::vector<stream> streams;    // streams[0] is the video stream carrying the PCR
+
+        program(void):number(0),pmt_pid(0),pmt_cc(0) {}
+    };
+
+    class generator
+    {
+    private:
+        const options& opt;
+        random rnd;
+        FILE* fp;
+
+        std::vector<program> programs;
+        u_int8_t pat_cc;
+        u_int8_t null_cc;
+
+        u_int64_t packets;              // packets written
+        u_int64_t timeline;             // 90kHz offset added to every timestamp, moved at discontinuities
+        bool discontinuity;             // signal the next PCR as discontinuous
+
+        static u_int32_t crc32(const unsigned char* p,int l);
+
+        void write_packet(unsigned char* pkt,double t);
+        void write_section(u_int16_t pid,u_int8_t& cc,const std::string& section,double t);
+        void write_psi(double t);
+        void write_pes(program& prg,stream& s,double t);
+        void pad_to(double t);
+
+        void make_video_au(std::string& au,bool keyframe);
+        void make_audio_au(std::string& au);
+        void make_data_au(std::string& au);
+    public:
+        u_int64_t bytes;
+
+        generator(const options& o,FILE* f);
+
+        void run(void);
+    };
+}
+
+u_int32_t tsgen::generator::crc32(const unsigned char* p,int l)
+{
+    u_int32_t crc=0xffffffff;
+
+    for(int i=0;i<l;i++)
+    {
+        crc^=((u_int32_t)p[i])<<24;
+        for(int j=0;j<8;j++)
+            crc=(crc&0x80000000)?(crc<<1)^0x04c11db7:crc<<1;
+    }
+
+    return crc;
+}
+
+tsgen::generator::generator(const options& o,FILE* f):opt(o),rnd(o.seed),fp(f),pat_cc(0),null_cc(0),packets(0),timeline(o.start_pts),discontinuity(false),bytes(0)
+{
+    for(int i=0;i<opt.programs;i++)
+    {
+        program prg;
+        prg.number=i+1;
+        prg.pmt_pid=0x1000+i;
+
+        u_int16_t base=0x100+i*(2+opt.data_streams);
+
+        prg.streams.push_back(stream(base,0x1b,0xe0,1.0/opt.fps));
+        prg.streams.push_back(stream(base+1,0x0f,0xc0,1024.0/48000.0));
+        for(int j=0;j<opt.data_streams;j++)
+            prg.streams.push_back(stream(base+2+j,0x15,0xbd,0.1));
+
+        programs.push_back(prg);
+    }
+}
+
+void tsgen::generator::write_packet(unsigned char* pkt,double t)
+{
+    if(opt.corruption>0 && rnd.chance(opt.corruption))
+    {
+        switch(rnd.range(0,3))
+        {
+            case 0: pkt[rnd.range(4,187)]^=1<<rnd.range(0,7); break;    // bit error in the payload
+            case 1: pkt[0]=0x00; break;                                 // lost sync byte
+            case 2: pkt[1]|=0x80; break;                                // transport_error_indicator
+            case 3: return;                                             // dropped packet
+        }
+    }
+
+    if(opt.m2ts)
+    {
+        // arrival time stamp, lower 30 bits of the 27MHz clock
+        u_int32_t ats=(u_int32_t)((u_int64_t)(t*27000000.0)&0x3fffffff);
+        unsigned char hdr[4]={ (unsigned char)(ats>>24), (unsigned char)(ats>>16), (unsigned char)(ats>>8), (unsigned char)ats };
+        fwrite(hdr,1,4,fp);
+        bytes+=4;
+    }
+
+    fwrite(pkt,1,188,fp);
+    bytes+=188;
+    packets++;
+}
+
+void tsgen::generator::write_section(u_int16_t pid,u_int8_t& cc,const std::string& section,double t)
+{
+    unsigned char pkt[188];
+
+    size_t offset=0;
+
+    while(offset<section.length())
+    {
+        memset(pkt,0xff,sizeof(pkt));
+        pkt[0]=0x47;
+        pkt[1]=(offset?0x00:0x40)|(pid>>8);
+        pkt[2]=pid&0xff;
+        pkt[3]=0x10|(cc++&0x0f);
+
+        int hdr=4;
+        if(!offset)
+            pkt[hdr++]=0x00;                    // pointer_field
+
+        size_t n=section.length()-offset;
+        if(n>(size_t)(188-hdr))
+            n=188-hdr;
+
+        memcpy(pkt+hdr,section.data()+offset,n);
+        offset+=n;
+
+        write_packet(pkt,t);
+    }
+}
+
+void tsgen::generator::write_psi(double t)
+{
+    std::string s;
+
+    // PAT
+    int len=5+4*programs.size()+4;
+    s+=(char)0x00;
+    s+=(char)(0xb0|(len>>8));
+    s+=(char)(len&0xff);
+    s.append("\x00\x01\xc1\x00\x00",5);
+    for(size_t i=0;i<programs.size();i++)
+    {
+        s+=(char)(programs[i].number>>8);
+        s+=(char)(programs[i].number&0xff);
+        s+=(char)(0xe0|(programs[i].pmt_pid>>8));
+        s+=(char)(programs[i].pmt_pid&0xff);
+    }
+    u_int32_t crc=crc32((const unsigned char*)s.data(),s.length());
+    for(int i=3;i>=0;i--)
+        s+=(char)((crc>>(i*8))&0xff);
+
+    write_section(0,pat_cc,s,t);
+
+    // PMT
+    for(size_t i=0;i<programs.size();i++)
+    {
+        program& prg=programs[i];
+
+        std::string es;
+        for(size_t j=0;j<prg.streams.size();j++)
+        {
+            const stream& st=prg.streams[j];
+            es+=(char)st.type;
+            es+=(char)(0xe0|(st.pid>>8));
+            es+=(char)(st.pid&0xff);
+            if(st.type==0x0f)
+            {
+                // ISO 639 language descriptor
+                es.append("\xf0\x06\x0a\x04",4);
+                es.append(j==1?"eng":"fre",3);
+                es+=(char)0x00;
+            }else
+                es.append("\xf0\x00",2);
+        }
+
+        len=9+es.length()+4;
+
+        s.clear();
+        s+=(char)0x02;
+        s+=(char)(0xb0|(len>>8));
+        s+=(char)(len&0xff);
+        s+=(char)(prg.number>>8);
+        s+=(char)(prg.number&0xff);
+        s.append("\xc1\x00\x00",3);
+        s+=(char)(0xe0|(prg.streams[0].pid>>8));   // PCR PID
+        s+=(char)(prg.streams[0].pid&0xff);
+        s.append("\xf0\x00",2);
+        s+=es;
+        crc=crc32((const unsigned char*)s.data(),s.length());
+        for(int k=3;k>=0;k--)
+            s+=(char)((crc>>(k*8))&0xff);
+
+        write_section(prg.pmt_pid,prg.pmt_cc,s,t);
+    }
+}
+
+void tsgen::generator::make_video_au(std::string& au,bool keyframe)
+{
+    u_int32_t size=rnd.range(opt.pes_min,opt.pes_max);
+    if(keyframe)
+        size*=2;
+
+    au.assign("\x00\x00\x00\x01\x09\xf0",6);                                                // AUD
+    if(keyframe && opt.sei)
+    {
+        au.append("\x00\x00\x01\x06",4);                                                    // SEI, user data unregistered
+        for(u_int32_t i=0;i<opt.sei;i++)
+            au+=(char)rnd.range(1,255);
+    }
+    if(keyframe)
+    {
+        au.append("\x00\x00\x00\x01\x67\x42\xc0\x1e\xd9\x00\xa0\x47\xfe\xc8",14);              // SPS, baseline 160x120
+        au.append("\x00\x00\x00\x01\x68\xce\x3c\x80",8);                                    // PPS
+        au.append("\x00\x00\x01\x65",4);                                                    // IDR slice
+    }else
+        au.append("\x00\x00\x01\x41",4);                                                    // non-IDR slice
+
+    // no zero byte in the slice data so no start code can be emulated
+    while(au.length()<size)
+        au+=(char)rnd.range(1,255);
+}
+
+void tsgen::generator::make_audio_au(std::string& au)
+{
+    u_int32_t size=7+rnd.range(100,400);
+
+    // ADTS header, AAC LC, 48kHz, stereo
+    au.resize(7);
+    au[0]=(char)0xff;
+    au[1]=(char)0xf1;
+    au[2]=(char)0x4c;
+    au[3]=(char)(0x80|((size>>11)&0x03));
+    au[4]=(char)((size>>3)&0xff);
+    au[5]=(char)(((size&0x07)<<5)|0x1f);
+    au[6]=(char)0xfc;
+
+    while(au.length()<size)
+        au+=(char)rnd.range(1,255);
+}
+
+void tsgen::generator::make_data_au(std::string& au)
+{
+    au.clear();
+    u_int32_t size=rnd.range(16,512);
+    while(au.length()<size)
+        au+=(char)rnd.range(0,255);
+}
+
+void tsgen::generator::write_pes(program& prg,stream& s,double t)
+{
+    std::string au;
+
+    if(s.type==0x1b)
+        make_video_au(au,!(s.frame_num%opt.gop));
+    else if(s.type==0x0f)
+        make_audio_au(au);
+    else
+        make_data_au(au);
+
+    u_int64_t pts=(timeline+(u_int64_t)(t*90000.0)+90000)&0x1ffffffffULL;
+    bool has_dts=s.type==0x1b;
+    u_int64_t dts=(pts-3600)&0x1ffffffffULL;
+
+    // PES header
+    std::string pes("\x00\x00\x01",3);
+    pes+=(char)s.stream_id;
+    size_t pes_len=3+(has_dts?10:5)+au.length();
+    if(pes_len>0xffff || s.type==0x1b)
+        pes_len=0;                                                  // unbounded, allowed for video
+    pes+=(char)(pes_len>>8);
+    pes+=(char)(pes_len&0xff);
+    pes+=(char)0x80;
+    pes+=(char)(has_dts?0xc0:0x80);
+    pes+=(char)(has_dts?10:5);
+
+    for(int k=0;k<(has_dts?2:1);k++)
+    {
+        u_int64_t ts=k?dts:pts;
+        u_int8_t marker=has_dts?(k?0x11:0x31):0x21;
+        pes+=(char)(marker|((ts>>29)&0x0e));
+        pes+=(char)((ts>>22)&0xff);
+        pes+=(char)(((ts>>14)&0xfe)|1);
+        pes+=(char)((ts>>7)&0xff);
+        pes+=(char)(((ts<<1)&0xfe)|1);
+    }
+    pes+=au;
+
+    bool pcr=&s==&prg.streams[0];
+
+    unsigned char pkt[188];
+    size_t offset=0;
+
+    while(offset<pes.length())
+    {
+        pkt[0]=0x47;
+        pkt[1]=(offset?0x00:0x40)|(s.pid>>8);
+        pkt[2]=s.pid&0xff;
+
+        // adaptation field: PCR on the first packet of the video PES, random stuffing, or padding of the last packet
+        int af=0;
+        unsigned char af_buf[184];
+
+        if(!offset && pcr)
+        {
+            u_int64_t base=(timeline+(u_int64_t)(t*90000.0))&0x1ffffffffULL;
+            af_buf[0]=(discontinuity?0x80:0x00)|((opt.random_access && !(s.frame_num%opt.gop))?0x40:0x00)|0x10;
+            af_buf[1]=(unsigned char)(base>>25);
+            af_buf[2]=(unsigned char)(base>>17);
+            af_buf[3]=(unsigned char)(base>>9);
+            af_buf[4]=(unsigned char)(base>>1);
+            af_buf[5]=(unsigned char)(((base&1)<<7)|0x7e);
+            af_buf[6]=0x00;
+            af=7;
+            discontinuity=false;
+        }
+
+        if(opt.stuffing>0 && rnd.chance(opt.stuffing))
+        {
+            int n=rnd.range(1,64);
+            if(!af)
+                af_buf[af++]=0x00;
+            memset(af_buf+af,0xff,n);
+            af+=n;
+        }
+
+        bool has_af=af>0;
+        size_t room=184-(has_af?af+1:0);
+        size_t n=pes.length()-offset;
+
+        if(n<room)
+        {
+            // pad the last packet with adaptation field stuffing
+            size_t pad=room-n;
+            if(!has_af)
+            {
+                has_af=true;
+                pad--;                      // adaptation_field_length byte
+                if(pad)
+                {
+                    af_buf[af++]=0x00;      // flags
+                    pad--;
+                }
+            }
+            memset(af_buf+af,0xff,pad);
+            af+=pad;
+        }else
+            n=room;
+
+        pkt[3]=(has_af?0x30:0x10)|(s.cc++&0x0f);
+
+        int hdr=4;
+        if(has_af)
+        {
+            pkt[hdr++]=af;
+            memcpy(pkt+hdr,af_buf,af);
+            hdr+=af;
+        }
+
+        memcpy(pkt+hdr,pes.data()+offset,n);
+        offset+=n;
+
+        write_packet(pkt,t);
+    }
+
+    s.frame_num++;
+}
+
+void tsgen::generator::pad_to(double t)
+{
+    if(!opt.bitrate)
+        return;
+
+    u_int64_t target=(u_int64_t)(t*opt.bitrate/(8.0*(opt.m2ts?192:188)));
+
+    unsigned char pkt[188];
+    memset(pkt,0xff,sizeof(pkt));
+    pkt[0]=0x47;
+    pkt[1]=0x1f;
+    pkt[2]=0xff;
+
+    while(packets<target)
+    {
+        pkt[3]=0x10|(null_cc++&0x0f);
+        write_packet(pkt,t);
+    }
+}
+
+void tsgen::generator::run(void)
+{
+    double next_psi=0;
+    double next_discontinuity=opt.discontinuities>0?opt.duration/(opt.discontinuities+1):opt.duration+1;
+
+    for(;;)
+    {
+        // earliest access unit among every stream
+        program* prg=0;
+        stream* s=0;
+
+        for(size_t i=0;i<programs.size();i++)
+            for(size_t j=0;j<programs[i].streams.size();j++)
+                if(!s || programs[i].streams[j].next<s->next)
+                {
+                    prg=&programs[i];
+                    s=&programs[i].streams[j];
+                }
+
+        double t=s->next;
+
+        if(t>=opt.duration)
+            break;
+
+        if(t>=next_discontinuity)
+        {
+            timeline+=rnd.range(90000,90000*3600);
+            discontinuity=true;
+            next_discontinuity+=opt.duration/(opt.discontinuities+1);
+        }
+
+        if(t>=next_psi)
+        {
+            write_psi(t);
+            next_psi+=opt.psi_interval;
+        }
+
+        pad_to(t);
+
+        write_pes(*prg,*s,t);
+
+        s->next+=s->period;
+    }
+
+    pad_to(opt.duration);
+}
+
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options] output.ts\n"
+            "  -d, --duration=SEC          stream duration (10)\n"
+            "  -b, --bitrate=BPS           pad with null packets up to this bitrate (no padding)\n"
+            "  -p, --programs=N            number of programs (1)\n"
+            "  -n, --data-streams=N        private data streams per program, to stress many PIDs (0)\n"
+            "      --pes-min=BYTES         smallest video access unit (2000)\n"
+            "      --pes-max=BYTES         largest video access unit (40000)\n"
+            "  -g, --gop=N                 frames between keyframes (25)\n"
+            "  -f, --fps=N                 video frame rate (25)\n"
+            "  -s, --stuffing=P            probability of adaptation field stuffing per packet (0)\n"
+            "  -r, --psi-interval=SEC      PAT/PMT repetition interval (0.1)\n"
+            "  -D, --discontinuities=N     timeline discontinuities (0)\n"
+            "  -c, --corruption=P          probability of corrupting a packet (0)\n"
+            "  -m, --m2ts                  write 192 bytes M2TS packets\n"
+            "  -S, --seed=N                random seed (1)\n"
+            "  -t, --start-pts=TICKS       90kHz timeline origin, set it close to 8589934592 to cross the 33 bits wrap (0)\n"
+            "      --sei=BYTES             SEI NAL leading the parameter sets of each keyframe, spanning packets when large (0)\n"
+            "      --no-random-access      do not signal keyframes with the random_access_indicator\n",
+            name);
+}
+
+int main(int argc,char** argv)
+{
+    tsgen::options opt;
+
+    static struct option long_options[]=
+    {
+        { "duration",        required_argument, 0, 'd' },
+        { "bitrate",         required_argument, 0, 'b' },
+        { "programs",        required_argument, 0, 'p' },
+        { "data-streams",    required_argument, 0, 'n' },
+        { "pes-min",         required_argument, 0, 1   },
+        { "pes-max",         required_argument, 0, 2   },
+        { "gop",             required_argument, 0, 'g' },
+        { "fps",             required_argument, 0, 'f' },
+        { "stuffing",        required_argument, 0, 's' },
+        { "psi-interval",    required_argument, 0, 'r' },
+        { "discontinuities", required_argument, 0, 'D' },
+        { "corruption",      required_argument, 0, 'c' },
+        { "m2ts",            no_argument,       0, 'm' },
+        { "seed",            required_argument, 0, 'S' },
+        { "start-pts",       required_argument, 0, 't' },
+        { "sei",             required_argument, 0, 3   },
+        { "no-random-access", no_argument,      0, 4   },
+        { 0, 0, 0, 0 }
+    };
+
+    int c;
+    while((c=getopt_long(argc,argv,"d:b:p:n:g:f:s:r:D:c:mS:t:",long_options,0))!=-1)
+    {
+        switch(c)
+        {
+            case 'd': opt.duration=atof(optarg); break;
+            case 'b': opt.bitrate=strtoull(optarg,0,10); break;
+            case 'p': opt.programs=atoi(optarg); break;
+            case 'n': opt.data_streams=atoi(optarg); break;
+            case 1:   opt.pes_min=strtoul(optarg,0,10); break;
+            case 2:   opt.pes_max=strtoul(optarg,0,10); break;
+            case 3:   opt.sei=strtoul(optarg,0,10); break;
+            case 4:   opt.random_access=false; break;
+            case 'g': opt.gop=atoi(optarg); break;
+            case 'f': opt.fps=atof(optarg); break;
+            case 's': opt.stuffing=atof(optarg); break;
+            case 'r': opt.psi_interval=atof(optarg); break;
+            case 'D': opt.discontinuities=atoi(optarg); break;
+            case 'c': opt.corruption=atof(optarg); break;
+            case 'm': opt.m2ts=true; break;
+            case 'S': opt.seed=strtoull(optarg,0,10); break;
+            case 't': opt.start_pts=strtoull(optarg,0,10); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind!=argc-1 || opt.programs<1 || opt.data_streams<0 || opt.gop<1 || opt.fps<=0 || opt.pes_min<64 || opt.pes_max<opt.pes_min || opt.psi_interval<=0 ||
+       opt.programs*(2+opt.data_streams)>0x1000-0x100)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* fp=fopen(argv[optind],"wb");
+    if(!fp)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    static char buf[1<<20];
+    setvbuf(fp,buf,_IOFBF,sizeof(buf));
+
+    tsgen::generator gen(opt,fp);
+    gen.run();
+
+    if(fclose(fp))
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    fprintf(stderr,"%s: %llu bytes\n",argv[optind],(unsigned long long)gen.bytes);
+
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ *			         TS2MP4 Pod
+ *
+ *			Authors: Gailliez Jonathan
+ *                   Damien Leroy
+ *			Copyright (c) Keemotion 2014
+ *					All rights reserved
+ *
+ *  This file is part of TS2MP4 Pod.
+ *
+ *  TS2MP4 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  TS2MP4 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; see the file LICENCE.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+
+
+/*
+ tstrace prints or summarizes the packet trace recorded by the demuxer (ts::demuxer::trace, or
+ the packetTraceURL of KMMediaAssetExportSession), see Classes/TSDemux/tstrace.h for the format.
+
+ Without options every record is printed, oldest first, one line per packet:
+   file offset pid flags cc payload_len [pcr=27MHz] [pts=90kHz] [dts=90kHz] [stream=id]
+ where flags are s (payload unit start), a (adaptation field), p (payload), e (transport error),
+ d (discontinuity indicator), r (random access), C (continuity counter error) and x (PID not demuxed).
+ The summary gives per PID the packet and PES counts, the continuity errors, the largest PCR interval
+ and the PTS range.
+
+ Build: c++ -O2 -IClasses/TSDemux -o tstrace Tools/tstrace/tstrace.cpp
+ */
+
+#include "tstrace.h"
+#include <map>
+
+namespace tstrace
+{
+    class pid_summary
+    {
+    public:
+        u_int64_t packets;
+        u_int64_t payload_bytes;
+        u_int64_t pes;
+        u_int64_t cc_errors;
+        u_int64_t discontinuities;
+        u_int64_t random_access;
+        u_int64_t pcrs;
+        u_int64_t max_pcr_interval;     // 27MHz, between two PCRs of the same file
+        u_int64_t first_pts;
+        u_int64_t last_pts;
+        bool selected;
+
+        u_int32_t pcr_file;
+        u_int64_t pcr;
+
+        pid_summary(void):packets(0),payload_bytes(0),pes(0),cc_errors(0),discontinuities(0),random_access(0),pcrs(0),max_pcr_interval(0),
+        first_pts(0),last_pts(0),selected(false),pcr_file(0),pcr(0) {}
+
+        void add(const record& r)
+        {
+            packets++;
+            payload_bytes+=r.payload_len;
+            if(r.flags&flag_pusi) pes++;
+            if(r.flags&flag_cc_error) cc_errors++;
+            if(r.flags&flag_discontinuity) discontinuities++;
+            if(r.flags&flag_random_access) random_access++;
+            if(r.flags&flag_selected) selected=true;
+            if(r.flags&flag_pcr)
+            {
+                if(pcrs && pcr_file==r.file && !(r.flags&flag_discontinuity) && r.pcr>pcr && r.pcr-pcr>max_pcr_interval)
+                    max_pcr_interval=r.pcr-pcr;
+                pcrs++;
+                pcr_file=r.file;
+                pcr=r.pcr;
+            }
+            if(r.flags&flag_pts)
+            {
+                if(!first_pts) first_pts=r.pts;
+                last_pts=r.pts;
+            }
+        }
+    };
+}
+
+static void print_record(const tstrace::record& r)
+{
+    if(r.flags&tstrace::flag_sync_error)
+    {
+        printf("%u %llu sync error\n",r.file,(unsigned long long)r.offset);
+        return;
+    }
+
+    static const struct { u_int16_t flag; char c; } chars[]=
+    {
+        { tstrace::flag_pusi, 's' }, { tstrace::flag_adaptation, 'a' }, { tstrace::flag_payload, 'p' }, { tstrace::flag_error, 'e' },
+        { tstrace::flag_discontinuity, 'd' }, { tstrace::flag_random_access, 'r' }, { tstrace::flag_cc_error, 'C' }
+    };
+
+    char flags[sizeof(chars)/sizeof(*chars)+2];
+    size_t n=0;
+    for(;n<sizeof(chars)/sizeof(*chars);n++)
+        flags[n]=r.flags&chars[n].flag?chars[n].c:'-';
+    flags[n++]=r.flags&tstrace::flag_selected?'-':'x';
+    flags[n]=0;
+
+    printf("%u %llu %.4x %s %u %u",r.file,(unsigned long long)r.offset,r.pid,flags,r.cc,r.payload_len);
+    if(r.timecode)
+        printf(" timecode=%u",r.timecode);
+    if(r.flags&tstrace::flag_pcr)
+        printf(" pcr=%llu",(unsigned long long)r.pcr);
+    if(r.flags&tstrace::flag_pts)
+        printf(" pts=%llu",(unsigned long long)r.pts);
+    if(r.flags&tstrace::flag_dts)
+        printf(" dts=%llu",(unsigned long long)r.dts);
+    if(r.flags&tstrace::flag_pts)
+        printf(" stream=%.2x",r.stream_id);
+    printf("\n");
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options] trace\n"
+            "  -p, --pid=PID               only the packets of this PID (decimal or 0x hexadecimal)\n"
+            "  -f, --file=N                only the packets of the Nth input file demuxed, from 0\n"
+            "  -e, --errors                only the packets with a sync, transport or continuity error or a discontinuity\n"
+            "  -s, --summary               print a summary per PID instead of the packets\n",
+            name);
+}
+
+int main(int argc,char** argv)
+{
+    int pid=-1;
+    long long file=-1;
+    bool errors=false;
+    bool summary=false;
+
+    static struct option long_options[]=
+    {
+        { "pid",     required_argument, 0, 'p' },
+        { "file",    required_argument, 0, 'f' },
+        { "errors",  no_argument,       0, 'e' },
+        { "summary", no_argument,       0, 's' },
+        { 0, 0, 0, 0 }
+    };
+
+    int c;
+    while((c=getopt_long(argc,argv,"p:f:es",long_options,0))!=-1)
+    {
+        switch(c)
+        {
+            case 'p': pid=strtol(optarg,0,0); break;
+            case 'f': file=atoll(optarg); break;
+            case 'e': errors=true; break;
+            case 's': summary=true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind!=argc-1 || pid<-1 || pid>0x1fff)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* fp=fopen(argv[optind],"rb");
+    if(!fp)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    tstrace::header hdr;
+    if(fread(&hdr,sizeof(hdr),1,fp)!=1 || memcmp(hdr.magic,"TSTRACE",8) || hdr.version!=tstrace::version ||
+       hdr.record_len!=sizeof(tstrace::record) || !hdr.capacity)
+    {
+        fprintf(stderr,"%s: not a packet trace\n",argv[optind]);
+        fclose(fp);
+        return 1;
+    }
+
+    // once the ring wrapped the oldest record follows the newest one
+    u_int64_t count=hdr.count<hdr.capacity?hdr.count:hdr.capacity;
+    u_int64_t first=hdr.count<hdr.capacity?0:hdr.count%hdr.capacity;
+
+    std::map<u_int16_t,tstrace::pid_summary> pids;
+    u_int64_t sync_errors=0,transport_errors=0,records=0;
+
+    static tstrace::record buf[4096];
+
+    for(u_int64_t done=0;done<count;)
+    {
+        u_int64_t i=(first+done)%hdr.capacity;
+        size_t n=hdr.capacity-i<sizeof(buf)/sizeof(*buf)?(size_t)(hdr.capacity-i):sizeof(buf)/sizeof(*buf);
+        if(n>count-done)
+            n=(size_t)(count-done);
+
+        if(fseeko(fp,sizeof(hdr)+i*sizeof(tstrace::record),SEEK_SET) || fread(buf,sizeof(tstrace::record),n,fp)!=n)
+        {
+            fprintf(stderr,"%s: truncated at record %llu\n",argv[optind],(unsigned long long)done);
+            break;
+        }
+
+        for(size_t j=0;j<n;j++)
+        {
+            const tstrace::record& r=buf[j];
+
+            if(file!=-1 && r.file!=file)
+                continue;
+            if(pid!=-1 && (r.pid!=pid || (r.flags&tstrace::flag_sync_error)))
+                continue;
+            if(errors && !(r.flags&(tstrace::flag_sync_error|tstrace::flag_error|tstrace::flag_cc_error|tstrace::flag_discontinuity)))
+                continue;
+
+            records++;
+
+            if(!summary)
+                print_record(r);
+            else if(r.flags&tstrace::flag_sync_error)
+                sync_errors++;
+            else
+            {
+                if(r.flags&tstrace::flag_error)
+                    transport_errors++;
+                pids[r.pid].add(r);
+            }
+        }
+
+        done+=n;
+    }
+
+    fclose(fp);
+
+    if(summary)
+    {
+        printf("%llu packets of %u files",(unsigned long long)records,hdr.files);
+        if(hdr.count>hdr.capacity)
+            printf(", the oldest %llu overwritten",(unsigned long long)(hdr.count-hdr.capacity));
+        printf(", %llu sync errors, %llu transport errors\n",(unsigned long long)sync_errors,(unsigned long long)transport_errors);
+
+        printf("pid    packets    payload      pes  cc_err  discont  rand_acc  pcr_max_ms  first_pts     last_pts\n");
+        for(std::map<u_int16_t,tstrace::pid_summary>::iterator i=pids.begin();i!=pids.end();++i)
+        {
+            const tstrace::pid_summary& s=i->second;
+            printf("%.4x%c %10llu %10llu %8llu %7llu %8llu %9llu %11.1f  %-12llu  %llu\n",
+                   i->first,s.selected?' ':'x',
+                   (unsigned long long)s.packets,(unsigned long long)s.payload_bytes,(unsigned long long)s.pes,
+                   (unsigned long long)s.cc_errors,(unsigned long long)s.discontinuities,(unsigned long long)s.random_access,
+                   s.max_pcr_interval/27000.,(unsigned long long)s.first_pts,(unsigned long long)s.last_pts);
+        }
+    }
+
+    return 0;
+}